@@ -0,0 +1,1054 @@
+/*
+ * B+-tree for large ordered sets of string keys
+ * Copyright (C) 2014  Seong-Kook Shin <cinsky@gmail.com>
+ * DO WHAT THE FUCK YOU WANT TO PUBLIC LICENSE
+ * Version 2, December 2004
+ */
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <errno.h>
+
+#include "bptree.h"
+
+#define NODE_SIZE       BPTREE_NODE_SIZE
+#define KEY_MAX         BPTREE_KEY_MAX
+#define MAX_DEPTH       32
+
+/* How much of a node bptree_load() fills */
+#define LOAD_FILL       (NODE_SIZE * 15 / 16)
+
+/*
+ * A node is a slotted page.  The slots grow up from the header, and
+ * the key bytes grow down from the end of the node:
+ *
+ *   | header | slot 0 | slot 1 | ...  free ...  | keys | prefix |
+ *
+ * Every key in the node starts with the prefix, which is the common
+ * prefix of the bounds of the node, and the slot points to the rest.
+ *
+ * In an inner node, slot[i].ptr is the child with the keys less than
+ * the separator i (and not less than the separator i - 1), and UPPER
+ * is the child with the keys not less than the last separator.  In a
+ * leaf, slot[i].ptr is the value of the key i.
+ */
+struct slot {
+  uint16_t off;                 /* offset of the key (without prefix) */
+  uint16_t len;
+  uint32_t head;                /* the first 4 bytes of the key, big-endian */
+  void *ptr;
+};
+
+struct bptree_node {
+  uint16_t level;               /* 0 for leaves */
+  uint16_t count;
+  uint16_t heap;                /* the keys and prefix are in [heap, NODE_SIZE) */
+  uint16_t dead;                /* bytes of the removed keys in the heap */
+  uint16_t plen;                /* prefix length */
+  struct bptree_node *next;     /* the next leaf */
+  struct bptree_node *upper;
+  struct slot slot[];
+};
+
+struct bptree {
+  struct bptree_node *root;
+  struct bptree_node *scratch;  /* a spare node for compaction and split */
+  size_t size;
+  size_t nnodes;
+};
+
+struct bound {
+  const unsigned char *key;
+  size_t len;                   /* 0 if unbounded */
+};
+
+#define BYTES(n)        ((unsigned char *)(n))
+#define PREFIX(n)       (BYTES(n) + NODE_SIZE - (n)->plen)
+#define SUFFIX(n, i)    (BYTES(n) + (n)->slot[i].off)
+#define SLOT_END(n)     (offsetof(struct bptree_node, slot) + \
+                         (n)->count * sizeof(struct slot))
+#define FREE_SPACE(n)   ((size_t)((n)->heap - SLOT_END(n)))
+#define CHILD(n, i)     (((i) < (n)->count) ? \
+                         (struct bptree_node *)(n)->slot[i].ptr : (n)->upper)
+
+
+static __inline__ uint32_t
+key_head(const unsigned char *key, size_t len)
+{
+  uint32_t head = 0;
+  size_t i;
+
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+  if (len >= 4) {
+    memcpy(&head, key, 4);
+    return __builtin_bswap32(head);
+  }
+#endif
+  for (i = 0; i < 4; i++)
+    head = (head << 8) | ((i < len) ? key[i] : 0);
+  return head;
+}
+
+
+static __inline__ size_t
+common_prefix(const unsigned char *a, size_t alen,
+              const unsigned char *b, size_t blen)
+{
+  size_t i, n = (alen < blen) ? alen : blen;
+
+  for (i = 0; i < n && a[i] == b[i]; i++)
+    ;
+  return i;
+}
+
+
+/*
+ * Compare KEY (without the prefix of N) with the key I of N.
+ */
+static __inline__ int
+slot_cmp(struct bptree_node *n, unsigned i,
+         const unsigned char *key, size_t len, uint32_t head)
+{
+  struct slot *s = n->slot + i;
+  size_t l, from;
+  int ret;
+
+  if (head != s->head)
+    return (head < s->head) ? -1 : 1;
+
+  /* The heads are equal, so are the first 4 bytes if both have them. */
+  l = (len < s->len) ? len : s->len;
+  from = (l < 4) ? 0 : 4;
+  ret = memcmp(key + from, BYTES(n) + s->off + from, l - from);
+  if (ret)
+    return ret;
+  return (len > s->len) - (len < s->len);
+}
+
+
+/*
+ * Return the first slot of N whose key is not less than KEY (or
+ * greater than KEY, if UPPER is nonzero).
+ */
+static __inline__ unsigned
+node_search(struct bptree_node *n, const unsigned char *key, size_t len,
+            int upper)
+{
+  unsigned lo = 0, hi = n->count, mid;
+  uint32_t head = key_head(key, len);
+
+  while (lo < hi) {
+    mid = (lo + hi) / 2;
+    if (slot_cmp(n, mid, key, len, head) + upper > 0)
+      lo = mid + 1;
+    else
+      hi = mid;
+  }
+  return lo;
+}
+
+
+/*
+ * Copy the whole key I of N into BUF, and return its length.
+ */
+static __inline__ size_t
+node_key(struct bptree_node *n, unsigned i, unsigned char *buf)
+{
+  memcpy(buf, PREFIX(n), n->plen);
+  memcpy(buf + n->plen, SUFFIX(n, i), n->slot[i].len);
+  return n->plen + n->slot[i].len;
+}
+
+
+/*
+ * Initialize N as an empty node for the keys in [LOWER, UPPER).
+ */
+static void
+node_init(struct bptree_node *n, unsigned level,
+          const struct bound *lower, const struct bound *upper)
+{
+  n->level = level;
+  n->count = 0;
+  n->dead = 0;
+  n->next = n->upper = NULL;
+  n->plen = 0;
+  if (lower->len && upper->len)
+    n->plen = common_prefix(lower->key, lower->len, upper->key, upper->len);
+  n->heap = NODE_SIZE - n->plen;
+  if (n->plen)
+    memcpy(PREFIX(n), upper->key, n->plen);
+}
+
+
+/*
+ * Insert KEY (without the prefix) at the slot I of N.  N must have
+ * enough free space.
+ */
+static void
+node_insert(struct bptree_node *n, unsigned i,
+            const unsigned char *key, size_t len, void *ptr)
+{
+  struct slot *s = n->slot + i;
+
+  memmove(s + 1, s, (n->count - i) * sizeof(*s));
+  n->heap -= len;
+  memcpy(BYTES(n) + n->heap, key, len);
+  s->off = n->heap;
+  s->len = len;
+  s->head = key_head(key, len);
+  s->ptr = ptr;
+  n->count++;
+}
+
+
+/*
+ * Append the whole key KEY to N.
+ */
+static __inline__ void
+node_append(struct bptree_node *n, const unsigned char *key, size_t len,
+            void *ptr)
+{
+  node_insert(n, n->count, key + n->plen, len - n->plen, ptr);
+}
+
+
+/*
+ * Reclaim the space of the removed keys of N, using SCRATCH.
+ */
+static void
+node_compact(struct bptree_node *n, struct bptree_node *scratch)
+{
+  unsigned i;
+
+  memcpy(scratch, n, SLOT_END(n));
+  scratch->heap = NODE_SIZE - n->plen;
+  memcpy(PREFIX(scratch), PREFIX(n), n->plen);
+  for (i = 0; i < n->count; i++) {
+    scratch->heap -= n->slot[i].len;
+    memcpy(BYTES(scratch) + scratch->heap, SUFFIX(n, i), n->slot[i].len);
+    scratch->slot[i].off = scratch->heap;
+  }
+  scratch->dead = 0;
+  memcpy(n, scratch, NODE_SIZE);
+}
+
+
+static struct bptree_node *
+node_new(bptree_t *t)
+{
+  void *p;
+
+  if (posix_memalign(&p, 64, NODE_SIZE) != 0) {
+    errno = ENOMEM;
+    return NULL;
+  }
+  t->nnodes++;
+  return p;
+}
+
+
+static void
+node_free(bptree_t *t, struct bptree_node *n)
+{
+  unsigned i;
+
+  if (n->level) {
+    for (i = 0; i <= n->count; i++)
+      node_free(t, CHILD(n, i));
+  }
+  free(n);
+  t->nnodes--;
+}
+
+
+bptree_t *
+bptree_new(void)
+{
+  return calloc(1, sizeof(struct bptree));
+}
+
+
+void
+bptree_delete(bptree_t *t)
+{
+  if (t->root)
+    node_free(t, t->root);
+  free(t->scratch);
+  free(t);
+}
+
+
+size_t
+bptree_size(bptree_t *t)
+{
+  return t->size;
+}
+
+
+/*
+ * Descend to the leaf for KEY, recording the path if PATH is not NULL.
+ */
+static __inline__ struct bptree_node *
+find_leaf(bptree_t *t, const unsigned char *key, size_t len,
+          struct bptree_node **path, unsigned *pos, unsigned *depth)
+{
+  struct bptree_node *n = t->root;
+  unsigned i, d = 0;
+
+  while (n->level) {
+    i = node_search(n, key + n->plen, len - n->plen, 1);
+    if (path) {
+      path[d] = n;
+      pos[d] = i;
+    }
+    d++;
+    n = CHILD(n, i);
+  }
+  if (depth)
+    *depth = d;
+  return n;
+}
+
+
+/*
+ * Split the node PATH[DEPTH] into two, and insert the separator into
+ * its parent.  If the parent may not have room for it, split the
+ * parent instead; the caller retries the insertion from the root
+ * anyway.
+ */
+static int
+split(bptree_t *t, struct bptree_node **path, unsigned *pos, unsigned depth)
+{
+  unsigned char lbuf[KEY_MAX], ubuf[KEY_MAX], sep[KEY_MAX], key[KEY_MAX];
+  struct bound lower = { lbuf, 0 }, upper = { ubuf, 0 }, mid;
+  struct bptree_node *n = path[depth], *parent, *left, *right, *root = NULL;
+  size_t total, acc, len, klen;
+  unsigned i, m, d;
+
+  if (depth > 0) {
+    parent = path[depth - 1];
+    if (FREE_SPACE(parent) < sizeof(struct slot) + KEY_MAX) {
+      if (FREE_SPACE(parent) + parent->dead >= sizeof(struct slot) + KEY_MAX)
+        node_compact(parent, t->scratch);
+      else
+        return split(t, path, pos, depth - 1);
+    }
+  }
+
+  /* The bounds of N from the separators along the path. */
+  for (d = 0; d < depth; d++) {
+    if (pos[d] > 0)
+      lower.len = node_key(path[d], pos[d] - 1, lbuf);
+    if (pos[d] < path[d]->count)
+      upper.len = node_key(path[d], pos[d], ubuf);
+  }
+
+  /* Split in the middle of the bytes, not of the keys. */
+  total = 0;
+  for (i = 0; i < n->count; i++)
+    total += sizeof(struct slot) + n->slot[i].len;
+  acc = 0;
+  for (m = 0; m + 1 < n->count; m++) {
+    acc += sizeof(struct slot) + n->slot[m].len;
+    if (acc >= total / 2)
+      break;
+  }
+  m++;                          /* slot[0..m) goes to the left */
+  if (m >= n->count)
+    m = n->count - 1;
+
+  if (n->level == 0) {
+    /* The shortest key that is greater than the key m - 1 and not
+     * greater than the key m. */
+    klen = node_key(n, m - 1, key);
+    len = node_key(n, m, sep);
+    len = common_prefix(key, klen, sep, len) + 1;
+  }
+  else
+    len = node_key(n, m, sep);
+  mid.key = sep;
+  mid.len = len;
+
+  right = node_new(t);
+  if (!right)
+    return -1;
+  if (depth == 0) {
+    root = node_new(t);
+    if (!root) {
+      free(right);
+      t->nnodes--;
+      return -1;
+    }
+  }
+  left = t->scratch;
+
+  node_init(left, n->level, &lower, &mid);
+  node_init(right, n->level, &mid, &upper);
+  for (i = 0; i < m; i++) {
+    klen = node_key(n, i, key);
+    node_append(left, key, klen, n->slot[i].ptr);
+  }
+  for (i = (n->level) ? m + 1 : m; i < n->count; i++) {
+    klen = node_key(n, i, key);
+    node_append(right, key, klen, n->slot[i].ptr);
+  }
+  if (n->level) {
+    left->upper = n->slot[m].ptr;
+    right->upper = n->upper;
+  }
+  else {
+    right->next = n->next;
+    left->next = right;
+  }
+
+  /* N becomes the left half, and keeps its place in the parent and
+   * in the leaf list. */
+  memcpy(n, left, NODE_SIZE);
+
+  if (depth == 0) {
+    lower.len = upper.len = 0;
+    node_init(root, n->level + 1, &lower, &upper);
+    node_append(root, sep, len, n);
+    root->upper = right;
+    t->root = root;
+    return 0;
+  }
+
+  parent = path[depth - 1];
+  i = pos[depth - 1];
+  if (i < parent->count)
+    parent->slot[i].ptr = right;
+  else
+    parent->upper = right;
+  node_insert(parent, i, sep + parent->plen, len - parent->plen, n);
+  return 0;
+}
+
+
+int
+bptree_insert(bptree_t *t, const void *key, size_t len, void *value)
+{
+  struct bptree_node *path[MAX_DEPTH], *n;
+  struct bound none = { NULL, 0 };
+  const unsigned char *k = key;
+  unsigned pos[MAX_DEPTH], depth, i;
+  size_t need;
+
+  if (len > KEY_MAX) {
+    errno = EINVAL;
+    return -1;
+  }
+  if (!t->scratch) {
+    t->scratch = node_new(t);
+    if (!t->scratch)
+      return -1;
+  }
+  if (!t->root) {
+    t->root = node_new(t);
+    if (!t->root)
+      return -1;
+    node_init(t->root, 0, &none, &none);
+  }
+
+  while (1) {
+    n = find_leaf(t, k, len, path, pos, &depth);
+    i = node_search(n, k + n->plen, len - n->plen, 0);
+    if (i < n->count &&
+        slot_cmp(n, i, k + n->plen, len - n->plen,
+                 key_head(k + n->plen, len - n->plen)) == 0)
+      return 1;
+
+    need = sizeof(struct slot) + len - n->plen;
+    if (FREE_SPACE(n) >= need)
+      break;
+    if (FREE_SPACE(n) + n->dead >= need) {
+      node_compact(n, t->scratch);
+      break;
+    }
+    path[depth] = n;
+    if (split(t, path, pos, depth) < 0)
+      return -1;
+  }
+
+  node_insert(n, i, k + n->plen, len - n->plen, value);
+  t->size++;
+  return 0;
+}
+
+
+int
+bptree_search(bptree_t *t, const void *key, size_t len, void **value)
+{
+  const unsigned char *k = key;
+  struct bptree_node *n;
+  unsigned i;
+
+  if (!t->root)
+    return 0;
+  n = find_leaf(t, k, len, NULL, NULL, NULL);
+  i = node_search(n, k + n->plen, len - n->plen, 0);
+  if (i >= n->count ||
+      slot_cmp(n, i, k + n->plen, len - n->plen,
+               key_head(k + n->plen, len - n->plen)) != 0)
+    return 0;
+  if (value)
+    *value = n->slot[i].ptr;
+  return 1;
+}
+
+
+int
+bptree_remove(bptree_t *t, const void *key, size_t len, void **value)
+{
+  const unsigned char *k = key;
+  struct bptree_node *n;
+  unsigned i;
+
+  if (!t->root)
+    return 0;
+  n = find_leaf(t, k, len, NULL, NULL, NULL);
+  i = node_search(n, k + n->plen, len - n->plen, 0);
+  if (i >= n->count ||
+      slot_cmp(n, i, k + n->plen, len - n->plen,
+               key_head(k + n->plen, len - n->plen)) != 0)
+    return 0;
+
+  if (value)
+    *value = n->slot[i].ptr;
+  n->dead += n->slot[i].len;
+  memmove(n->slot + i, n->slot + i + 1, (n->count - i - 1) * sizeof(struct slot));
+  n->count--;
+  t->size--;
+  return 1;
+}
+
+
+/*
+ * Build one level of bptree_load(): group N children (the leaves are
+ * the keys) into nodes of LEVEL.  SEPS[i] separates the entry i and
+ * i + 1.  On return, CHILD[] and SEPS[] hold the new level, and the
+ * number of nodes is returned, or 0 on failure.
+ */
+static size_t
+load_level(bptree_t *t, unsigned level, size_t n, void **child,
+           struct bound *seps, const void *const *keys, const size_t *lens,
+           struct bptree_node **prev)
+{
+  struct bound none = { NULL, 0 }, lower, upper;
+  struct bptree_node *node;
+  size_t a, b, i, cnt, sum, plen, nout = 0;
+
+  for (a = 0; a < n; a = b) {
+    /* Leaves take keys [a, b); inner nodes take children [a, b), and
+     * the separators between them.  Stop before the node gets fuller
+     * than LOAD_FILL, counting the prefix it will have. */
+    lower = (a > 0) ? seps[a - 1] : none;
+    cnt = sum = 0;
+    for (b = a; b < n; b++) {
+      if (level == 0 || b > a) {
+        cnt++;
+        sum += (level == 0) ? lens[b] : seps[b - 1].len;
+      }
+      upper = (b + 1 < n) ? seps[b] : none;
+      plen = 0;
+      if (lower.len && upper.len)
+        plen = common_prefix(lower.key, lower.len, upper.key, upper.len);
+      if (offsetof(struct bptree_node, slot) + cnt * sizeof(struct slot) +
+          sum - (cnt - 1) * plen > LOAD_FILL && b > a + (level ? 2 : 1))
+        break;
+    }
+
+    node = node_new(t);
+    if (!node) {
+      /* Free this level so far, and the rest of the lower level. */
+      for (i = 0; i < nout; i++)
+        node_free(t, child[i]);
+      for (i = a; level > 0 && i < n; i++)
+        node_free(t, child[i]);
+      return 0;
+    }
+    upper = (b < n) ? seps[b - 1] : none;
+    node_init(node, level, &lower, &upper);
+
+    if (level == 0) {
+      for (i = a; i < b; i++)
+        node_append(node, keys[i], lens[i], child[i]);
+      if (*prev)
+        (*prev)->next = node;
+      *prev = node;
+    }
+    else {
+      for (i = a; i < b - 1; i++)
+        node_append(node, seps[i].key, seps[i].len, child[i]);
+      node->upper = child[b - 1];
+    }
+
+    /* Reuse the arrays for the next level; NOUT <= A. */
+    child[nout] = node;
+    if (nout > 0)
+      seps[nout - 1] = lower;
+    nout++;
+  }
+  return nout;
+}
+
+
+int
+bptree_load(bptree_t *t, size_t n, const void *const *keys,
+            const size_t *lens, void *const *values)
+{
+  struct bptree_node *prev = NULL;
+  struct bound *seps;
+  void **child;
+  size_t i, c, nkeys = n;
+  unsigned level;
+
+  if (t->root || t->size) {
+    errno = EINVAL;
+    return -1;
+  }
+  for (i = 0; i < n; i++) {
+    if (lens[i] > KEY_MAX)
+      break;
+    if (i > 0) {
+      c = common_prefix(keys[i - 1], lens[i - 1], keys[i], lens[i]);
+      if (c == lens[i] ||
+          (c < lens[i - 1] && ((const unsigned char *)keys[i - 1])[c] >
+           ((const unsigned char *)keys[i])[c]))
+        break;
+    }
+  }
+  if (i < n) {
+    errno = EINVAL;
+    return -1;
+  }
+  if (n == 0)
+    return 0;
+
+  if (!t->scratch) {
+    t->scratch = node_new(t);
+    if (!t->scratch)
+      return -1;
+  }
+
+  child = malloc(sizeof(*child) * n);
+  seps = malloc(sizeof(*seps) * n);
+  if (!child || !seps) {
+    free(child);
+    free(seps);
+    errno = ENOMEM;
+    return -1;
+  }
+
+  /* The separator between two keys is the shortest prefix of the
+   * second one that is greater than the first one. */
+  for (i = 0; i < n; i++) {
+    child[i] = values[i];
+    if (i + 1 < n) {
+      seps[i].key = keys[i + 1];
+      seps[i].len = common_prefix(keys[i], lens[i], keys[i + 1], lens[i + 1]) + 1;
+    }
+  }
+
+  for (level = 0; level == 0 || n > 1; level++) {
+    n = load_level(t, level, n, child, seps, keys, lens, &prev);
+    if (n == 0)
+      break;
+  }
+
+  if (n == 1) {
+    t->root = child[0];
+    t->size = nkeys;
+  }
+  free(child);
+  free(seps);
+  if (n == 0) {
+    errno = ENOMEM;
+    return -1;
+  }
+  return 0;
+}
+
+
+void
+bptree_seek(bptree_t *t, struct bptree_iter *it, const void *key, size_t len)
+{
+  const unsigned char *k = key;
+  struct bptree_node *n = t->root;
+
+  it->leaf = NULL;
+  it->pos = 0;
+  if (!n)
+    return;
+
+  if (!key) {
+    while (n->level)
+      n = CHILD(n, 0);
+  }
+  else {
+    n = find_leaf(t, k, len, NULL, NULL, NULL);
+    it->pos = node_search(n, k + n->plen, len - n->plen, 0);
+  }
+  it->leaf = n;
+}
+
+
+int
+bptree_next(struct bptree_iter *it)
+{
+  while (it->leaf && it->pos >= it->leaf->count) {
+    it->leaf = it->leaf->next;
+    it->pos = 0;
+  }
+  if (!it->leaf)
+    return 0;
+
+  it->keylen = node_key(it->leaf, it->pos, it->key);
+  it->value = it->leaf->slot[it->pos].ptr;
+  it->pos++;
+  return 1;
+}
+
+
+#ifdef TEST_BPTREE
+#include <stdio.h>
+#include <sys/time.h>
+#include "rbtree.h"
+
+/*
+ * Random operations checked against rbtree, then a benchmark of
+ * insert, lookup, full scan and range scan against RB_INSERT() and
+ * RB_SEARCH() with strcmp() over malloc()ed nodes, as in rbtree-test.c.
+ * The keys look like "/user/0012345/photos/00000042".
+ *
+ *   $ ./a.out [NKEYS]
+ */
+struct mytype {
+  struct rb_node node_;
+  char *name;
+  void *value;
+};
+
+static double
+now(void)
+{
+  struct timeval tv;
+
+  gettimeofday(&tv, 0);
+  return tv.tv_sec + tv.tv_usec / 1e6;
+}
+
+static int
+keycmp(const unsigned char *a, size_t alen,
+       const unsigned char *b, size_t blen)
+{
+  size_t l = (alen < blen) ? alen : blen;
+  int ret = memcmp(a, b, l);
+
+  return (ret) ? ret : (alen > blen) - (alen < blen);
+}
+
+/*
+ * Check that every key of N is in [LOWER, UPPER) and sorted, and that
+ * the nodes fit.  Returns the number of keys, or -1.
+ */
+static long
+check(struct bptree_node *n, const struct bound *lower,
+      const struct bound *upper)
+{
+  unsigned char key[KEY_MAX], prev[KEY_MAX];
+  struct bound lo = *lower, hi;
+  size_t len, plen = 0;
+  unsigned i;
+  long sum = 0, ret;
+
+  if (n->heap < SLOT_END(n))
+    return -1;
+  for (i = 0; i < n->count; i++) {
+    len = node_key(n, i, key);
+    if (n->slot[i].head != key_head(SUFFIX(n, i), n->slot[i].len))
+      return -1;
+    if (i > 0 && keycmp(prev, plen, key, len) >= 0)
+      return -1;
+    if ((lower->len && keycmp(key, len, lower->key, lower->len) < 0) ||
+        (upper->len && keycmp(key, len, upper->key, upper->len) >= 0))
+      return -1;
+    memcpy(prev, key, len);
+    plen = len;
+  }
+  if (n->level == 0)
+    return n->count;
+
+  for (i = 0; i <= n->count; i++) {
+    hi = *upper;
+    if (i < n->count) {
+      hi.len = node_key(n, i, prev);
+      hi.key = prev;
+    }
+    if (CHILD(n, i)->level != n->level - 1)
+      return -1;
+    ret = check(CHILD(n, i), &lo, &hi);
+    if (ret < 0)
+      return -1;
+    sum += ret;
+    if (i < n->count) {
+      lo.len = node_key(n, i, key);
+      lo.key = key;
+    }
+  }
+  return sum;
+}
+
+static int
+verify(bptree_t *t, struct rb_root *root)
+{
+  struct bound none = { NULL, 0 };
+  struct bptree_iter it;
+  struct rb_node *rb;
+  struct mytype *p;
+
+  if (t->root && check(t->root, &none, &none) != (long)t->size)
+    return -1;
+  if (t->size != root->size)
+    return -1;
+
+  bptree_seek(t, &it, NULL, 0);
+  for (rb = rb_first(root); rb; rb = rb_next(rb)) {
+    p = container_of(rb, struct mytype, node_);
+    if (!bptree_next(&it) || it.value != p ||
+        keycmp(it.key, it.keylen, (unsigned char *)p->name, strlen(p->name)))
+      return -1;
+  }
+  return bptree_next(&it) ? -1 : 0;
+}
+
+static void
+make_key(char *buf, unsigned long i)
+{
+  sprintf(buf, "/user/%07lu/photos/%08lu", i / 64, i % 64 * 7919);
+}
+
+static int
+test(unsigned nops)
+{
+  struct rb_root root = RB_ROOT;
+  struct mytype *p;
+  struct bptree_iter it;
+  bptree_t *t = bptree_new();
+  char key[KEY_MAX + 1];
+  unsigned i, j, len;
+  void *v;
+
+  for (i = 0; i < nops; i++) {
+    /* Random keys with long shared prefixes */
+    len = rand() % 4 == 0 ? rand() % KEY_MAX + 1 : rand() % 12 + 1;
+    for (j = 0; j < len; j++)
+      key[j] = 'a' + ((j + 3 < len) ? j % 3 : (unsigned)rand() % 4);
+    key[len] = '\0';
+
+    p = RB_SEARCH(&root, struct mytype, node_, name, strcmp, key);
+    if (bptree_search(t, key, len, &v) != (p != 0) || (p && v != p))
+      return -1;
+
+    if (!p && rand() % 3) {
+      p = malloc(sizeof(*p));
+      p->name = strdup(key);
+      p->value = p;
+      RB_INSERT((&root), struct mytype, name, node_, strcmp, p);
+      if (bptree_insert(t, key, len, p) != 0)
+        return -1;
+    }
+    else if (p) {
+      RB_DELETE((&root), struct mytype, node_, name, strcmp, key);
+      if (bptree_remove(t, key, len, &v) != 1 || v != p)
+        return -1;
+      free(p->name);
+      free(p);
+    }
+
+    /* range query from a random key */
+    bptree_seek(t, &it, key, len);
+    if (bptree_next(&it) &&
+        keycmp(it.key, it.keylen, (unsigned char *)key, len) < 0)
+      return -1;
+
+    if (i % 1000 == 0 && verify(t, &root) < 0)
+      return -1;
+  }
+  if (verify(t, &root) < 0)
+    return -1;
+
+  RB_ERASE_LOOP((&root)) {
+    p = RB_ERASE((&root), struct mytype, node_);
+    free(p->name);
+    free(p);
+  }
+  bptree_delete(t);
+
+  /* bulk load */
+  {
+    size_t n = 100000, k;
+    const void **keys = malloc(sizeof(*keys) * n);
+    size_t *lens = malloc(sizeof(*lens) * n);
+    void **values = malloc(sizeof(*values) * n);
+    char *buf = malloc(n * 32);
+
+    t = bptree_new();
+    for (k = 0; k < n; k++) {
+      make_key(buf + k * 32, k);
+      keys[k] = buf + k * 32;
+      lens[k] = strlen(buf + k * 32);
+    }
+    for (k = 1; k < n; k++)
+      if (keycmp(keys[k - 1], lens[k - 1], keys[k], lens[k]) >= 0)
+        return -1;
+    for (k = 0; k < n; k++)
+      values[k] = (void *)k;
+    if (bptree_load(t, n, keys, lens, values) < 0)
+      return -1;
+    bptree_seek(t, &it, NULL, 0);
+    for (k = 0; k < n; k++)
+      if (!bptree_next(&it) || it.value != (void *)k)
+        return -1;
+    for (k = 0; k < n; k += 3)
+      if (bptree_search(t, keys[k], lens[k], &v) != 1 || v != (void *)k)
+        return -1;
+    /* inserting after the bulk load */
+    for (k = 0; k < n; k++) {
+      sprintf(key, "%s/x", (char *)keys[k]);
+      if (bptree_insert(t, key, strlen(key), 0) != 0)
+        return -1;
+    }
+    if (check(t->root, &(struct bound){ NULL, 0 }, &(struct bound){ NULL, 0 })
+        != (long)n * 2)
+      return -1;
+    bptree_delete(t);
+    free(keys);
+    free(lens);
+    free(values);
+    free(buf);
+  }
+  return 0;
+}
+
+int
+main(int argc, char *argv[])
+{
+  size_t n = (argc > 1) ? atol(argv[1]) : 1000000;
+  struct rb_root root = RB_ROOT;
+  struct mytype *nodes, *p;
+  struct bptree_iter it;
+  struct rb_node *rb;
+  unsigned long *perm, sum;
+  const void **keys;
+  size_t *lens, i, j, k;
+  char *buf, *key;
+  bptree_t *t;
+  double beg;
+  void *v;
+
+  srand(1);
+  if (test(200000) < 0) {
+    fprintf(stderr, "bptree: test failed\n");
+    return 1;
+  }
+  printf("bptree: test passed\n");
+
+  buf = malloc(n * 32);
+  keys = malloc(sizeof(*keys) * n);
+  lens = malloc(sizeof(*lens) * n);
+  perm = malloc(sizeof(*perm) * n);
+  nodes = malloc(sizeof(*nodes) * n);
+  for (i = 0; i < n; i++) {
+    key = buf + i * 32;
+    make_key(key, i);
+    keys[i] = key;
+    lens[i] = strlen(key);
+    perm[i] = i;
+  }
+  for (i = n - 1; i > 0; i--) {
+    j = ((unsigned long)rand() * RAND_MAX + rand()) % (i + 1);
+    k = perm[i];
+    perm[i] = perm[j];
+    perm[j] = k;
+  }
+
+  /* rbtree, in the way of rbtree-test.c */
+  beg = now();
+  for (i = 0; i < n; i++) {
+    p = malloc(sizeof(*p));
+    p->name = strdup(keys[perm[i]]);
+    p->value = p;
+    RB_INSERT((&root), struct mytype, name, node_, strcmp, p);
+  }
+  printf("%-8s insert %7.3f", "rbtree", now() - beg);
+  beg = now();
+  for (i = 0, sum = 0; i < n; i++)
+    sum += (unsigned long)RB_SEARCH(&root, struct mytype, node_, name,
+                                    strcmp, (char *)keys[perm[i]]);
+  printf("  lookup %7.3f", now() - beg);
+  beg = now();
+  for (rb = rb_first(&root), sum = 0; rb; rb = rb_next(rb))
+    sum += container_of(rb, struct mytype, node_)->name[lens[0] - 1];
+  printf("  scan %7.3f", now() - beg);
+  beg = now();
+  for (i = 0, sum = 0; i < n / 100; i++) {
+    for (rb = &RB_SEARCH(&root, struct mytype, node_, name, strcmp,
+                         (char *)keys[perm[i]])->node_, j = 0;
+         rb && j < 100; rb = rb_next(rb), j++)
+      sum += container_of(rb, struct mytype, node_)->name[lens[0] - 1];
+  }
+  printf("  range100 %7.3f  (sec)\n", now() - beg);
+
+  RB_ERASE_LOOP((&root)) {
+    p = RB_ERASE((&root), struct mytype, node_);
+    free(p->name);
+    free(p);
+  }
+
+  /* bptree */
+  t = bptree_new();
+  beg = now();
+  for (i = 0; i < n; i++)
+    bptree_insert(t, keys[perm[i]], lens[perm[i]], nodes + perm[i]);
+  printf("%-8s insert %7.3f", "bptree", now() - beg);
+  beg = now();
+  for (i = 0, sum = 0; i < n; i++) {
+    bptree_search(t, keys[perm[i]], lens[perm[i]], &v);
+    sum += (unsigned long)v;
+  }
+  printf("  lookup %7.3f", now() - beg);
+  beg = now();
+  bptree_seek(t, &it, NULL, 0);
+  for (sum = 0; bptree_next(&it); )
+    sum += it.key[it.keylen - 1];
+  printf("  scan %7.3f", now() - beg);
+  beg = now();
+  for (i = 0, sum = 0; i < n / 100; i++) {
+    bptree_seek(t, &it, keys[perm[i]], lens[perm[i]]);
+    for (j = 0; j < 100 && bptree_next(&it); j++)
+      sum += it.key[it.keylen - 1];
+  }
+  printf("  range100 %7.3f  (sec)\n", now() - beg);
+  printf("%-8s %zu nodes, %.1f MB, %.1f bytes/key\n", "", t->nnodes,
+         t->nnodes * (double)NODE_SIZE / 1048576,
+         t->nnodes * (double)NODE_SIZE / n);
+  bptree_delete(t);
+
+  for (i = 0; i < n; i++)
+    perm[i] = (unsigned long)(nodes + i);
+  t = bptree_new();
+  beg = now();
+  bptree_load(t, n, keys, lens, (void *const *)perm);
+  printf("%-8s load   %7.3f  %zu nodes, %.1f bytes/key\n", "bptree",
+         now() - beg, t->nnodes, t->nnodes * (double)NODE_SIZE / n);
+  bptree_delete(t);
+
+  free(nodes);
+  free(perm);
+  free(lens);
+  free(keys);
+  free(buf);
+  return 0;
+}
+#endif  /* TEST_BPTREE */
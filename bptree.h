@@ -0,0 +1,145 @@
+#ifndef BPTREE_H__
+#define BPTREE_H__
+
+/*
+ * B+-tree for large ordered sets of string keys
+ * Copyright (C) 2014  Seong-Kook Shin <cinsky@gmail.com>
+ * DO WHAT THE FUCK YOU WANT TO PUBLIC LICENSE
+ * Version 2, December 2004
+ */
+
+/*
+ * 'bptree' maps byte-string keys to pointers, in the order of
+ * memcmp(3) (a key sorts before any longer key that starts with it,
+ * which is strcmp(3) order for C strings).  It is meant for sets that
+ * are too large for rbtree.h: an RB_INSERT() with strcmp() chases a
+ * pointer and misses the cache for every node and every key, while
+ * bptree keeps the keys inline in BPTREE_NODE_SIZE nodes.
+ *
+ * - Every node stores the common prefix of its key range once, and
+ *   the keys without it.  Keys like "/users/0001234/profile" usually
+ *   take a few bytes each.
+ *
+ * - A slot keeps the first 4 bytes of its key next to the offset, so
+ *   most comparisons in a binary search do not touch the key bytes.
+ *
+ * - Inner nodes store the shortest separators between the children,
+ *   not whole keys.
+ *
+ * - bptree_load() builds a tree from sorted input in O(n).
+ *
+ * - bptree_seek()/bptree_next() walk the linked leaves in order.
+ *
+ * bptree_remove() does not merge underfull nodes; the space is reused
+ * by the following insertions.  bptree is not thread-safe.
+ *
+ *   bptree_t *t = bptree_new();
+ *   struct bptree_iter it;
+ *
+ *   bptree_insert(t, "apple", 5, apple);
+ *   ...
+ *   bptree_seek(t, &it, "a", 1);
+ *   while (bptree_next(&it) && it.key[0] == 'a')
+ *     printf("%.*s\n", (int)it.keylen, it.key);
+ *
+ * The test/benchmark program can be built with:
+ *
+ *   $ cc -DTEST_BPTREE -O2 bptree.c rbtree.c
+ */
+
+/* This indirect using of extern "C" { ... } makes Emacs happy */
+#ifndef BEGIN_C_DECLS
+# ifdef __cplusplus
+#  define BEGIN_C_DECLS extern "C" {
+#  define END_C_DECLS   }
+# else
+#  define BEGIN_C_DECLS
+#  define END_C_DECLS
+# endif
+#endif /* BEGIN_C_DECLS */
+
+#include <stddef.h>
+
+BEGIN_C_DECLS
+
+/* The size of a node in bytes; a page by default.  Must be a multiple
+ * of 64, and 32768 at most. */
+#ifndef BPTREE_NODE_SIZE
+#define BPTREE_NODE_SIZE        4096
+#endif
+
+/* The maximum length of a key */
+#define BPTREE_KEY_MAX          (BPTREE_NODE_SIZE / 8)
+
+struct bptree;
+typedef struct bptree bptree_t;
+
+struct bptree_node;
+
+struct bptree_iter {
+  struct bptree_node *leaf;
+  unsigned pos;
+
+  /* Set by bptree_next() */
+  void *value;
+  size_t keylen;
+  unsigned char key[BPTREE_KEY_MAX];
+};
+
+/*
+ * Create an empty tree.  Returns NULL on failure.
+ */
+extern bptree_t *bptree_new(void);
+
+extern void bptree_delete(bptree_t *t);
+
+/*
+ * Insert KEY of LEN bytes with VALUE.  Returns 0 on success, 1 if KEY
+ * already exists (the tree is not changed), or -1 on failure with
+ * errno set (EINVAL if LEN > BPTREE_KEY_MAX).
+ */
+extern int bptree_insert(bptree_t *t, const void *key, size_t len,
+                         void *value);
+
+/*
+ * Look up KEY.  Returns 1 and stores its value in *VALUE (if VALUE is
+ * not NULL), or returns 0 if not found.
+ */
+extern int bptree_search(bptree_t *t, const void *key, size_t len,
+                         void **value);
+
+/*
+ * Remove KEY.  Returns 1 and stores its value in *VALUE (if VALUE is
+ * not NULL), or returns 0 if not found.
+ */
+extern int bptree_remove(bptree_t *t, const void *key, size_t len,
+                         void **value);
+
+/*
+ * Build T from N keys in strictly increasing order.  T must be empty.
+ * The leaves are filled up to 15/16, so that later insertions do not
+ * split every leaf at once.  Returns 0 on success, or -1 on failure
+ * with errno set (EINVAL if the keys are not sorted or too long).
+ */
+extern int bptree_load(bptree_t *t, size_t n, const void *const *keys,
+                       const size_t *lens, void *const *values);
+
+extern size_t bptree_size(bptree_t *t);
+
+/*
+ * Position IT before the first key that is not less than KEY, or
+ * before the first key if KEY is NULL.  Call bptree_next() to get the
+ * keys.  Modifying T invalidates IT.
+ */
+extern void bptree_seek(bptree_t *t, struct bptree_iter *it,
+                        const void *key, size_t len);
+
+/*
+ * Advance IT to the next key, and store the key and the value in IT.
+ * Returns 1 on success, 0 at the end of the tree.
+ */
+extern int bptree_next(struct bptree_iter *it);
+
+END_C_DECLS
+
+#endif  /* BPTREE_H__ */
@@ -0,0 +1,340 @@
+/*
+ * Test and benchmark of CONF
+ *
+ *   $ cc -O2 -D_GNU_SOURCE -o conf-test conf-test.c conf.c confcache.c
+ *   $ ./conf-test [NENTRIES]
+ *
+ * The test runs random adds, overwrites and removes on a CONF that
+ * starts with the smallest table, so that it grows several times
+ * while entries come and go, and compares every parameter with a
+ * plain array model after each step.  Then it checks that CF_PRUNE
+ * drops a section whose last entry is removed, and that the saved
+ * file loads back into the same parameters.
+ *
+ * The benchmark writes a file of NENTRIES (100k by default) entries
+ * in sections of 100, and measures conf_load() into the smallest
+ * table and into a table of the final size, the lookup of every
+ * parameter, the overwrite of every parameter, and conf_save().
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "conf.h"
+#include "difftime.h"
+
+#define NSECTS          8
+#define NKEYS           500
+#define NSTEPS          20000
+
+static char *model[NSECTS][NKEYS];
+static int nmodel;
+
+
+static int
+check_model(CONF *cf)
+{
+  char sect[32], key[32];
+  const char *v;
+  int s, k;
+
+  if (conf_entry_count(cf) != nmodel)
+    return -1;
+  for (s = 0; s < NSECTS; s++)
+    for (k = 0; k < NKEYS; k++) {
+      snprintf(sect, sizeof(sect), "sect%d", s);
+      snprintf(key, sizeof(key), "key%d", k);
+      v = conf_get(cf, sect, key);
+      if (model[s][k] ? (!v || strcmp(v, model[s][k]) != 0) : v != NULL)
+        return -1;
+    }
+  return 0;
+}
+
+
+static int
+test_random(void)
+{
+  CONF *cf = conf_new(0);
+  char sect[32], key[32], value[64];
+  int i, s, k;
+
+  if (cf == NULL)
+    return -1;
+  conf_set_flags(cf, CF_OVERWRITE);
+  srand(1);
+
+  for (i = 0; i < NSTEPS; i++) {
+    s = rand() % NSECTS;
+    k = rand() % NKEYS;
+    snprintf(sect, sizeof(sect), "sect%d", s);
+    snprintf(key, sizeof(key), "key%d", k);
+
+    /* Mostly adds while the first half grows the table */
+    if (rand() % 4 < ((i < NSTEPS / 2) ? 3 : 2)) {
+      snprintf(value, sizeof(value), "value %d of %d", i, k);
+      if (conf_add(cf, sect, key, value) != 0)
+        return -1;
+      if (!model[s][k])
+        nmodel++;
+      free(model[s][k]);
+      model[s][k] = strdup(value);
+    }
+    else if (model[s][k]) {
+      if (conf_remove(cf, sect, key) != 0)
+        return -1;
+      free(model[s][k]);
+      model[s][k] = NULL;
+      nmodel--;
+    }
+    else if (conf_remove(cf, sect, key) != -1)
+      return -1;
+
+    if (i % 1000 == 0 && check_model(cf) < 0)
+      return -1;
+  }
+  if (check_model(cf) < 0)
+    return -1;
+
+  /* Without CF_OVERWRITE, the first value stays. */
+  conf_set_flags(cf, 0);
+  if (conf_add(cf, "sect0", "extra", "first") != 0)
+    return -1;
+  if (conf_add(cf, "sect0", "extra", "second") != -1)
+    return -1;
+  if (strcmp(conf_get(cf, "sect0", "extra"), "first") != 0)
+    return -1;
+  if (strcmp(conf_get(cf, NULL, "extra"), "first") != 0)
+    return -1;
+  if (conf_remove(cf, "sect0", "extra") != 0)
+    return -1;
+
+  for (s = 0; s < NSECTS; s++)
+    for (k = 0; k < NKEYS; k++) {
+      free(model[s][k]);
+      model[s][k] = NULL;
+    }
+  nmodel = 0;
+  conf_close(cf);
+  return 0;
+}
+
+
+static int
+test_prune(void)
+{
+  CONF *cf = conf_new(0);
+  int i;
+
+  conf_set_flags(cf, CF_PRUNE);
+  if (conf_add(cf, "a", "x", "1") != 0)
+    return -1;
+  if (conf_add(cf, "b", "y", "2") != 0)
+    return -1;
+  if (conf_section_count(cf) != 2)
+    return -1;
+  if (conf_remove(cf, "a", "x") != 0)
+    return -1;
+  if (conf_section_count(cf) != 1)
+    return -1;
+  if (conf_get(cf, "a", "x") != NULL)
+    return -1;
+
+  /* The nodes that were freed are reused. */
+  for (i = 0; i < 100; i++) {
+    if (conf_add(cf, "a", "x", "3") != 0)
+      return -1;
+    if (conf_remove(cf, "a", "x") != 0)
+      return -1;
+  }
+  if (conf_add(cf, "a", "x", "4") != 0)
+    return -1;
+  if (conf_section_count(cf) != 2 || conf_entry_count(cf) != 2)
+    return -1;
+  if (strcmp(conf_get(cf, "a", "x"), "4") != 0)
+    return -1;
+  if (strcmp(conf_get(cf, "b", "y"), "2") != 0)
+    return -1;
+  conf_close(cf);
+  return 0;
+}
+
+
+struct compare {
+  CONF *cf;
+  int n;
+};
+
+
+static int
+compare_proc(const char *section, const char *key, const char *value,
+             int index, void *data)
+{
+  struct compare *c = data;
+  const char *v = conf_get(c->cf, section, key);
+
+  (void)index;
+  if (v && strcmp(v, value) == 0)
+    c->n++;                     /* test_save() checks that all are */
+  return 0;
+}
+
+
+static int
+test_save(const char *path)
+{
+  static const char *headers[] = { "generated by conf-test", 0 };
+  CONF *cf = conf_new(0), *loaded = conf_new(0);
+  struct compare c;
+  char key[32], value[64];
+  int i;
+
+  for (i = 0; i < 3000; i++) {
+    snprintf(key, sizeof(key), "key%d", i);
+    snprintf(value, sizeof(value), (i % 3) ? "v%d" : "with space %d", i);
+    if (conf_add(cf, (i % 7) ? "main" : "other", key, value) != 0)
+      return -1;
+  }
+  if (conf_save_as(cf, path, headers) != 0)
+    return -1;
+  if (conf_load(loaded, path, 0) != 0)
+    return -1;
+  if (conf_entry_count(loaded) != 3000)
+    return -1;
+  if (conf_section_count(loaded) != 2)
+    return -1;
+
+  c.cf = cf;
+  c.n = 0;
+  conf_enum(loaded, NULL, compare_proc, &c);
+  if (c.n != 3000)
+    return -1;
+
+  conf_close(loaded);
+  conf_close(cf);
+  return 0;
+}
+
+
+static int
+lookup_all(CONF *cf, int nentries)
+{
+  char sect[32], key[32];
+  int i, found = 0;
+
+  for (i = 0; i < nentries; i++) {
+    snprintf(sect, sizeof(sect), "section%d", i / 100);
+    snprintf(key, sizeof(key), "key%d", i);
+    if (conf_get(cf, sect, key))
+      found++;
+  }
+  return found;
+}
+
+
+static int
+bench(const char *path, int nentries)
+{
+  CONF *cf, *sized;
+  FILE *fp;
+  char sect[32], key[32];
+  uint64_t t_load, t_sized, t_get, t_get_sized, t_add, t_save;
+  int i, ok = 1, found = 0, found_sized = 0;
+  df_t df;
+
+  fp = fopen(path, "w");
+  if (fp == NULL) {
+    fprintf(stderr, "conf-test: cannot write %s\n", path);
+    return -1;
+  }
+  for (i = 0; i < nentries; i++) {
+    if (i % 100 == 0)
+      fprintf(fp, "[section%d]\n", i / 100);
+    fprintf(fp, "key%d = value-%d-abcdefghijklmnop\n", i, i);
+  }
+  fclose(fp);
+
+  DF(df) {
+    cf = conf_new(0);
+    ok &= (conf_load(cf, path, 0) == 0);
+  }
+  t_load = df.value;
+
+  DF(df) {
+    sized = conf_new(nentries);
+    ok &= (conf_load(sized, path, 0) == 0);
+  }
+  t_sized = df.value;
+  if (!ok || conf_entry_count(cf) != nentries) {
+    fprintf(stderr, "conf-test: cannot load %s\n", path);
+    return -1;
+  }
+
+  DF(df) {
+    found = lookup_all(cf, nentries);
+  }
+  t_get = df.value;
+
+  DF(df) {
+    found_sized = lookup_all(sized, nentries);
+  }
+  t_get_sized = df.value;
+
+  conf_set_flags(cf, CF_OVERWRITE);
+  DF(df) {
+    for (i = 0; i < nentries; i++) {
+      snprintf(sect, sizeof(sect), "section%d", i / 100);
+      snprintf(key, sizeof(key), "key%d", i);
+      ok &= (conf_add(cf, sect, key, "another value") == 0);
+    }
+  }
+  t_add = df.value;
+
+  DF(df) {
+    ok &= (conf_save(cf, NULL) == 0);
+  }
+  t_save = df.value;
+
+  conf_close(sized);
+  conf_close(cf);
+  if (!ok || found != nentries || found_sized != nentries) {
+    fprintf(stderr, "conf-test: bench: found %d and %d of %d%s\n",
+            found, found_sized, nentries, (ok) ? "" : ", and failed");
+    return -1;
+  }
+
+  printf("%d entries:\n", nentries);
+  printf("  conf_load, growing     %8.1f ms\n", t_load / 1e6);
+  printf("  conf_load, presized    %8.1f ms\n", t_sized / 1e6);
+  printf("  conf_get, growing      %8.1f ns/op\n", (double)t_get / nentries);
+  printf("  conf_get, presized     %8.1f ns/op\n",
+         (double)t_get_sized / nentries);
+  printf("  conf_add, overwrite    %8.1f ns/op\n", (double)t_add / nentries);
+  printf("  conf_save              %8.1f ms\n", t_save / 1e6);
+  return 0;
+}
+
+
+int
+main(int argc, char *argv[])
+{
+  const char *tmpdir = getenv("TMPDIR");
+  int nentries = (argc > 1) ? atoi(argv[1]) : 100000;
+  char path[256];
+  int ret;
+
+  snprintf(path, sizeof(path), "%s/conf-test.%d",
+           (tmpdir) ? tmpdir : "/tmp", (int)getpid());
+
+  if (test_random() < 0 || test_prune() < 0 || test_save(path) < 0) {
+    fprintf(stderr, "conf-test: test failed\n");
+    unlink(path);
+    return 1;
+  }
+  printf("conf-test: test passed\n");
+
+  ret = bench(path, nentries);
+  unlink(path);
+  return (ret < 0) ? 1 : 0;
+}
@@ -18,14 +18,22 @@
 #include <assert.h>
 
 #include <ctype.h>
-
+#include <errno.h>
+#include <limits.h>
 #include <stdarg.h>
+#include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+
 #include <obstack.h>
 
 #include "conf.h"
+#include "confcache.h"
 
 #ifndef obstack_chunk_alloc
 #define obstack_chunk_alloc     malloc
@@ -37,6 +45,7 @@
 
 struct confent {
   int type;
+  unsigned long hash;           /* of KEY, and of the section of an entry */
 
   char *key;
   char *value;
@@ -58,12 +67,36 @@ struct conf_ {
   size_t num_sections;
 
   char *cur_section;            /* reserved for parsing functions */
-  int errno;
-
+  int error;
+
+  /* All entries and their strings are in STACK, and freed at once by
+   * conf_close().  A removed entry goes to FREE_ENTS for reuse; the
+   * strings of removed entries and replaced values stay until then. */
+  struct obstack stack;
+  struct confent *free_ents;
+
+  /* The table grows as the entries do.  Then the buckets of the
+   * previous table, OLD_TABLE, are moved into TABLE a few at a time by
+   * the following changes, in the order of their indices; the ones
+   * below REHASH_POS are moved. */
   size_t table_size;
-  struct confent *table[1];
+  struct confent **table;
+  size_t old_size;
+  struct confent **old_table;   /* NULL if not moving */
+  size_t rehash_pos;
+
+  /* If conf_load() took the content from a confcache image, it stays
+   * there, and is read in place, until the first change moves it into
+   * the table. */
+  confcache_t *image;
 };
 
+/* Grow the table when it has this many entries per bucket. */
+#define CONF_LOAD_FACTOR        2
+
+/* The number of old buckets that each change moves */
+#define CONF_REHASH_STEP        2
+
 
 static size_t get_nearest_prime(size_t n, int op);
 static unsigned long string_hash(const char *s);
@@ -82,7 +115,11 @@ static char *get_quoted(char *line, char quote);
 static char *cur_section(CONF *cf);
 static int parse_section(CONF *cf, char *line);
 
-static int conf_save_stream(CONF *cf, FILE *fp, const char *headers[]);
+static int conf_save_fd(CONF *cf, int fd, const char *headers[]);
+
+static int materialize(CONF *cf);
+static void write_cache(CONF *cf, const char *pathname,
+                        const struct stat *st);
 
 static struct confent *find_sect(CONF *cf, const char *sect);
 static struct confent *find_sect_create(CONF *cf, const char *sect);
@@ -93,19 +130,23 @@ static void add_sectlist(CONF *cf, struct confent *ent);
 static struct confent *del_sectlist(CONF *cf, struct confent *ent);
 
 static struct confent *find_entry(CONF *cf, const char *sect, const char *key,
-                                  struct confent **prev);
+                                  struct confent ***link);
 static struct confent *add_entry(CONF *cf, struct confent *sect,
                                  const char *key, const char *val);
 static struct confent *del_entry(CONF *cf, const char *sect, const char *key);
 
-static struct confent *new_entry(int type, const char *key, const char *value);
+static struct confent *new_entry(CONF *cf, int type, const char *key,
+                                 const char *value);
 static void delete_entry(CONF *cf, struct confent *ent);
 
-static void add_hash(CONF *cf, int index, struct confent *ent);
+static struct confent **get_bucket(CONF *cf, unsigned long hash);
+static void rehash_step(CONF *cf, size_t nbuckets);
+static void add_hash(CONF *cf, struct confent *ent);
+static void del_hash(CONF *cf, struct confent *ent);
 
 static int blankline(const char *line);
 static int eol(FILE *fp, int ch);
-static char *getline(FILE *fp, int lookahead, int *lineno);
+static char *read_line(FILE *fp, int lookahead, unsigned *lineno);
 
 #define BOM_INVALID             (-1)
 #define BOM_NONE                0
@@ -123,8 +164,10 @@ static struct obstack gl_stack_;
 #define IS_VERBOSE(cf)          ((cf)->flags & CF_VERBOSE)
 #define IS_OVERWRITE(cf)        ((cf)->flags & CF_OVERWRITE)
 #define IS_PRUNE(cf)            ((cf)->flags & CF_PRUNE)
+#define IS_CACHE(cf)            ((cf)->flags & CF_CACHE)
 
-#define GET_HASH(cf, s) (string_hash(s) % (cf)->table_size)
+/* The hash of the entry KEY in the section SECT */
+#define ENTRY_HASH(sect, key)   (string_hash(key) + (sect)->hash * 31)
 
 
 CONF *
@@ -134,13 +177,24 @@ conf_new(int size_hint)
   int i;
 
   size_hint = get_nearest_prime(size_hint, 0);
-  cf = malloc(sizeof(*cf) + sizeof(struct confent *) * (size_hint - 1));
+  cf = malloc(sizeof(*cf));
   if (!cf)
     return NULL;
+  cf->table = malloc(sizeof(struct confent *) * size_hint);
+  if (!cf->table) {
+    free(cf);
+    return NULL;
+  }
+  obstack_init(&cf->stack);
+  cf->free_ents = NULL;
 
   cf->pathname = NULL;
   cf->sections = NULL;
   cf->table_size = size_hint;
+  cf->old_table = NULL;
+  cf->old_size = 0;
+  cf->rehash_pos = 0;
+  cf->image = NULL;
   cf->dirty = 0;
   cf->flags = 0;
 
@@ -148,7 +202,7 @@ conf_new(int size_hint)
   cf->num_sections = 0;
 
   cf->cur_section = 0;
-  cf->errno = 0;
+  cf->error = 0;
 
   for (i = 0; i < cf->table_size; i++)
     cf->table[i] = NULL;
@@ -162,7 +216,8 @@ conf_load(CONF *cf, const char *pathname, int size_hint)
 {
   FILE *fp;
   char *p;
-  int ret;
+  struct stat st;
+  int ret, cache = 0;
 
   assert(cf != NULL);
 
@@ -170,6 +225,23 @@ conf_load(CONF *cf, const char *pathname, int size_hint)
   if (!p)
     return -1;
 
+  /* The image is only for the whole content of CF. */
+  if (IS_CACHE(cf) && !cf->image &&
+      cf->num_entries == 0 && cf->num_sections == 0) {
+    cf->image = confcache_open(pathname, CONFCACHE_CONF);
+    if (cf->image) {
+      if (cf->pathname)
+        free(cf->pathname);
+      cf->pathname = p;
+      return 0;
+    }
+    cache = (stat(pathname, &st) == 0);
+  }
+  else if (materialize(cf) < 0) {
+    free(p);
+    return -1;
+  }
+
   fp = fopen(pathname, "r");
   if (!fp) {
     free(p);
@@ -179,13 +251,15 @@ conf_load(CONF *cf, const char *pathname, int size_hint)
   ret = parse(cf, fp);
 
   if (ret != 0) {
-    cf->errno = ret;
+    cf->error = ret;
     free(p);
   }
   else {
     if (cf->pathname)
       free(cf->pathname);
     cf->pathname = p;
+    if (cache)
+      write_cache(cf, pathname, &st);
   }
 
   fclose(fp);
@@ -196,35 +270,18 @@ conf_load(CONF *cf, const char *pathname, int size_hint)
 int
 conf_close(CONF *cf)
 {
-  /* TODO: release all resources refered by CF. */
-  struct confent *p;
-  int i;
-
   if (cf->dirty) {
     /* TODO: save */
   }
 
-  for (i = 0; i < cf->table_size; i++) {
-    if (!cf->table[i])
-      continue;
-
-    p = cf->table[i];
-    while (p) {
-      cf->table[i] = p->next;
-
-      /* free P */
-      free(p->key);
-      if (p->type == CF_ENTRY && p->value) {
-        free(p->value);
-      }
-      free(p);
-
-      p = cf->table[i];
-    }
-  }
+  confcache_close(cf->image);
+  obstack_free(&cf->stack, NULL);
+  free(cf->table);
+  free(cf->old_table);
 
   if (cf->pathname)
     free(cf->pathname);
+  free(cf->cur_section);
 
   free(cf);
   return 0;
@@ -236,7 +293,9 @@ conf_add(CONF *cf, const char *sect, const char *key, const char *value)
 {
   struct confent *s;
 
-  s = find_sect_create(cf, sect);
+  if (materialize(cf) < 0)
+    return -1;
+  s = find_sect_create(cf, (sect) ? sect : "");
   if (!s)
     return -1;
 
@@ -251,7 +310,13 @@ conf_add(CONF *cf, const char *sect, const char *key, const char *value)
 int
 conf_remove(CONF *cf, const char *sect, const char *key)
 {
-  struct confent *ent = del_entry(cf, sect, key);
+  struct confent *ent;
+
+  if (materialize(cf) < 0)
+    return -1;
+  ent = del_entry(cf, sect, key);
+  if (!ent)
+    return -1;
   sect_unref(cf, ent->sect);
   delete_entry(cf, ent);
 
@@ -264,8 +329,18 @@ int
 conf_enum_section(CONF *cf, conf_enum_proc proc, void *data)
 {
   struct confent *p;
+  const char *name;
   int index;
 
+  if (cf->image) {
+    for (index = 0; index < (int)confcache_nsections(cf->image); index++) {
+      confcache_section(cf->image, index, &name, NULL);
+      if (proc(name, 0, 0, index, data) < 0)
+        break;
+    }
+    return index;
+  }
+
   for (index = 0, p = cf->sections; p != 0; p = p->sibling, index++) {
     if (proc(p->key, 0, 0, index, data) < 0)
       break;
@@ -275,12 +350,38 @@ conf_enum_section(CONF *cf, conf_enum_proc proc, void *data)
 }
 
 
+static int
+enum_image(CONF *cf, const char *section, conf_enum_proc proc, void *data)
+{
+  size_t s, first, n, i, nsections = confcache_nsections(cf->image);
+  const char *name, *key, *value;
+  int index = 0;
+
+  for (s = 0; s < nsections; s++) {
+    n = confcache_section(cf->image, s, &name, &first);
+    if (section && strcmp(name, section) != 0)
+      continue;
+    for (i = first; i < first + n; i++) {
+      confcache_entry(cf->image, i, NULL, NULL, &key, NULL, &value, NULL);
+      if (proc(name, key, value, index++, data) < 0)
+        return index;
+    }
+    if (section)
+      return index;
+  }
+  return (section) ? -1 : index;
+}
+
+
 int
 conf_enum(CONF *cf, const char *section, conf_enum_proc proc, void *data)
 {
   struct confent *sect, *p;
   int index = 0;
 
+  if (cf->image)
+    return enum_image(cf, section, proc, data);
+
   if (section) {
     sect = find_sect(cf, section);
     if (!sect)
@@ -295,7 +396,7 @@ conf_enum(CONF *cf, const char *section, conf_enum_proc proc, void *data)
     for (sect = cf->sections; sect != NULL; sect = sect->sibling) {
       for (p = sect->sect; p != NULL; p = p->sibling)
         if (proc(sect->key, p->key, p->value, index++, data) < 0)
-          break;
+          return index;
     }
   }
   return index;
@@ -309,6 +410,16 @@ conf_set_dirty(CONF *cf, int dirty)
 }
 
 
+unsigned
+conf_set_flags(CONF *cf, unsigned flags)
+{
+  unsigned old = cf->flags;
+
+  cf->flags = flags;
+  return old;
+}
+
+
 int
 conf_save_as(CONF *cf, const char *pathname, const char *headers[])
 {
@@ -330,33 +441,30 @@ conf_save_as(CONF *cf, const char *pathname, const char *headers[])
 int
 conf_save(CONF *cf, const char *headers[])
 {
-  FILE *fp;
-  int ret;
+  int fd, ret;
 
   if (!cf->dirty)
     return 0;
 
-  if (!cf->pathname)
-    return -1;
-
-  fp = fopen(cf->pathname, "w");
-  if (!fp)
+  if (!cf->pathname || materialize(cf) < 0)
     return -1;
 
-  ret = conf_save_stream(cf, fp, headers);
-  if (ret < 0) {
-    fclose(fp);
+  fd = open(cf->pathname, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+  if (fd < 0)
     return -1;
-  }
 
-  fclose(fp);
-  return 0;
+  ret = conf_save_fd(cf, fd, headers);
+  if (close(fd) < 0)
+    ret = -1;
+  return ret;
 }
 
 
 int
 conf_section_count(CONF *cf)
 {
+  if (cf->image)
+    return confcache_nsections(cf->image);
   return cf->num_sections;
 }
 
@@ -364,44 +472,214 @@ conf_section_count(CONF *cf)
 int
 conf_entry_count(CONF *cf)
 {
+  if (cf->image)
+    return confcache_count(cf->image);
   return cf->num_entries;
 }
 
 
+static const char *
+get_image(CONF *cf, const char *sect, const char *key)
+{
+  size_t s, nsections = confcache_nsections(cf->image);
+  const char *value;
+  long i = -1;
+
+  if (sect)
+    i = confcache_find(cf->image, sect, strlen(sect), key, strlen(key));
+  else
+    for (s = 0; s < nsections && i < 0; s++) {
+      confcache_section(cf->image, s, &sect, NULL);
+      i = confcache_find(cf->image, sect, strlen(sect), key, strlen(key));
+    }
+  if (i < 0)
+    return NULL;
+  confcache_entry(cf->image, i, NULL, NULL, NULL, NULL, &value, NULL);
+  return value;
+}
+
+
+const char *
+conf_get(CONF *cf, const char *sect, const char *key)
+{
+  struct confent *ent;
+
+  if (cf->image)
+    return get_image(cf, sect, key);
+  ent = find_entry(cf, sect, key, NULL);
+  return (ent) ? ent->value : NULL;
+}
+
+
+/*
+ * Move the content of the image, if any, into the table.  Since an
+ * entry goes to the head of the sibling list of its section, the
+ * entries of each section are added backward to keep their order.
+ */
 static int
-conf_save_stream(CONF *cf, FILE *fp, const char *headers[])
+materialize(CONF *cf)
 {
+  confcache_t *cc = cf->image;
+  size_t s, first, n, i, nsections;
+  const char *name, *key, *value;
+  struct confent *sect;
+
+  if (!cc)
+    return 0;
+  cf->image = NULL;
+
+  nsections = confcache_nsections(cc);
+  for (s = 0; s < nsections; s++) {
+    n = confcache_section(cc, s, &name, &first);
+    sect = find_sect_create(cf, name);
+    if (!sect)
+      goto err;
+    for (i = first + n; i-- > first; ) {
+      confcache_entry(cc, i, NULL, NULL, &key, NULL, &value, NULL);
+      if (!add_entry(cf, sect, key, value))
+        goto err;
+    }
+  }
+  confcache_close(cc);
+  return 0;
+
+ err:
+  confcache_close(cc);
+  return -1;
+}
+
+
+static void
+write_cache(CONF *cf, const char *pathname, const struct stat *st)
+{
+  confcache_builder_t *b = confcache_builder_new(CONFCACHE_CONF);
   struct confent *p, *q;
-  int i;
 
-  if (headers)
-    for (i = 0; headers[i] != 0; i++)
-      fprintf(fp, "# %s\n", headers[i]);
+  if (!b)
+    return;
+  for (p = cf->sections; p != NULL; p = p->sibling)
+    for (q = p->sect; q != NULL; q = q->sibling)
+      confcache_add(b, p->key, strlen(p->key), q->key, strlen(q->key),
+                    q->value, strlen(q->value));
+  confcache_write(b, pathname, st);
+  confcache_builder_free(b);
+}
 
-  for (p = cf->sections; p != NULL; p = p->sibling) {
-    fprintf(fp, "[%s]\n", p->key);
 
-    for (q = p->sect; q != NULL; q = q->sibling) {
-      if (strpbrk(q->key, " \t\b\r\n\v"))
-        fprintf(fp, "\"%s\"", q->key);
-      else
-        fprintf(fp, "%s", q->key);
+/*
+ * conf_save_fd() gathers the output into iovecs that point to the
+ * strings of the entries, and writes them with writev(2) whenever
+ * SAVE_IOV of them are gathered, instead of a stdio call per token.
+ */
+#ifdef IOV_MAX
+# define SAVE_IOV       IOV_MAX
+#else
+# define SAVE_IOV       1024
+#endif
 
-      fprintf(fp, " = ");
+struct savebuf {
+  int fd;
+  int n;                        /* the number of IOV in use */
+  int failed;
+  struct iovec iov[SAVE_IOV];
+};
 
-      if (strpbrk(q->value, " \t\b\r\n\v"))
-        fprintf(fp, "\"%s\"", q->value);
-      else
-        fprintf(fp, "%s", q->value);
 
-      fprintf(fp, "\n");
+static void
+save_flush(struct savebuf *sb)
+{
+  struct iovec *iov = sb->iov;
+  int n = sb->n;
+  ssize_t written;
+
+  sb->n = 0;
+  while (n > 0 && !sb->failed) {
+    written = writev(sb->fd, iov, n);
+    if (written < 0) {
+      if (errno != EINTR)
+        sb->failed = 1;
+      continue;
+    }
+    /* A short write may end in the middle of an iovec. */
+    while (n > 0 && (size_t)written >= iov->iov_len) {
+      written -= iov->iov_len;
+      iov++;
+      n--;
+    }
+    if (n > 0) {
+      iov->iov_base = (char *)iov->iov_base + written;
+      iov->iov_len -= written;
     }
-    fprintf(fp, "\n");
   }
+}
 
-  cf->dirty = 0;
 
-  return 0;
+static __inline__ void
+save_add(struct savebuf *sb, const char *s, size_t len)
+{
+  if (sb->n == SAVE_IOV)
+    save_flush(sb);
+  sb->iov[sb->n].iov_base = (void *)s;
+  sb->iov[sb->n].iov_len = len;
+  sb->n++;
+}
+
+
+static void
+save_word(struct savebuf *sb, const char *s)
+{
+  if (strpbrk(s, " \t\b\r\n\v")) {
+    save_add(sb, "\"", 1);
+    save_add(sb, s, strlen(s));
+    save_add(sb, "\"", 1);
+  }
+  else
+    save_add(sb, s, strlen(s));
+}
+
+
+static int
+conf_save_fd(CONF *cf, int fd, const char *headers[])
+{
+  struct savebuf *sb;
+  struct confent *p, *q;
+  int i, ret;
+
+  sb = malloc(sizeof(*sb));
+  if (!sb)
+    return -1;
+  sb->fd = fd;
+  sb->n = 0;
+  sb->failed = 0;
+
+  if (headers)
+    for (i = 0; headers[i] != 0; i++) {
+      save_add(sb, "# ", 2);
+      save_add(sb, headers[i], strlen(headers[i]));
+      save_add(sb, "\n", 1);
+    }
+
+  for (p = cf->sections; p != NULL; p = p->sibling) {
+    save_add(sb, "[", 1);
+    save_add(sb, p->key, strlen(p->key));
+    save_add(sb, "]\n", 2);
+
+    for (q = p->sect; q != NULL; q = q->sibling) {
+      save_word(sb, q->key);
+      save_add(sb, " = ", 3);
+      save_word(sb, q->value);
+      save_add(sb, "\n", 1);
+    }
+    save_add(sb, "\n", 1);
+  }
+  save_flush(sb);
+
+  ret = (sb->failed) ? -1 : 0;
+  free(sb);
+  if (ret == 0)
+    cf->dirty = 0;
+
+  return ret;
 }
 
 
@@ -421,7 +699,7 @@ parse(CONF *cf, FILE *fp)
   if ((ret = eatup_bom(fp, ch)) == BOM_INVALID)
     goto err;
 
-  line = getline(fp, (ret == BOM_NONE) ? ch : EOF, &lineno);
+  line = read_line(fp, (ret == BOM_NONE) ? ch : EOF, &lineno);
   if (line) {
     do {
       /* TODO: parse */
@@ -429,29 +707,28 @@ parse(CONF *cf, FILE *fp)
 
       len = strlen(line);
       if (len == 0 || blankline(line)) /* ignore an empty or a blank line */
-        continue;
+        goto next;
 
       if (line[0] == '#' || line[0] == '!' || line[0] == ';')
         /* ignore a comment line */
-        continue;
+        goto next;
 
       if (parse_section(cf, line) == 0)
-        continue;
+        goto next;
 
       ret = get_pair(line, &key, &value);
       if (ret < 0) {
         if (IS_VERBOSE(cf))
           ;
-        goto err;
         free(line);
-        return ret;
+        goto err;
       }
 
-      printf("[%s] %s = %s\n", cur_section(cf), key, value);
       conf_add(cf, cur_section(cf), key, value);
 
+    next:
       free(line);
-    } while ((line = getline(fp, EOF, &lineno)) != NULL);
+    } while ((line = read_line(fp, EOF, &lineno)) != NULL);
   }
   return 0;
 
@@ -584,10 +861,10 @@ static struct confent *
 find_sect(CONF *cf, const char *sect)
 {
   struct confent *p;
-  unsigned index = GET_HASH(cf, sect);
+  unsigned long hash = string_hash(sect);
 
-  for (p = cf->table[index]; p != NULL; p = p->next)
-    if (p->type == CF_SECT && strcmp(p->key, sect) == 0)
+  for (p = *get_bucket(cf, hash); p != NULL; p = p->next)
+    if (p->hash == hash && p->type == CF_SECT && strcmp(p->key, sect) == 0)
       return p;
 
   return NULL;
@@ -598,17 +875,17 @@ static struct confent *
 find_sect_create(CONF *cf, const char *sect)
 {
   struct confent *ent;
-  unsigned index = GET_HASH(cf, sect);
 
   ent = find_sect(cf, sect);
   if (ent)
     return ent;
 
-  ent = new_entry(CF_SECT, sect, 0);
+  ent = new_entry(cf, CF_SECT, sect, 0);
   if (!ent)
     return NULL;
 
-  add_hash(cf, index, ent);
+  ent->hash = string_hash(sect);
+  add_hash(cf, ent);
   add_sectlist(cf, ent);
 
   return ent;
@@ -649,7 +926,7 @@ del_sectlist(CONF *cf, struct confent *ent)
   struct confent *p;
 
   assert(ent->type == CF_SECT);
-  assert((unsigned)ent->value == 0);
+  assert((size_t)ent->value == 0);
 
   if (cf->sections == ent) {
     cf->sections = ent->sibling;
@@ -667,23 +944,23 @@ del_sectlist(CONF *cf, struct confent *ent)
 
 
 static struct confent *
-new_entry(int type, const char *key, const char *value)
+new_entry(CONF *cf, int type, const char *key, const char *value)
 {
   struct confent *p;
 
-  p = malloc(sizeof(*p));
-  if (!p)
-    return NULL;
-
-  p->key = strdup(key);
-  if (!p->key)
-    goto err_key;
-
-  if (value) {
-    p->value = strdup(value);
-    if (!p->value)
-      goto err_val;
+  if (cf->free_ents) {
+    p = cf->free_ents;
+    cf->free_ents = p->next;
+  }
+  else {
+    p = obstack_alloc(&cf->stack, sizeof(*p));
+    if (!p)
+      return NULL;
   }
+
+  p->key = obstack_copy0(&cf->stack, key, strlen(key));
+  if (value)
+    p->value = obstack_copy0(&cf->stack, value, strlen(value));
   else
     p->value = NULL;
 
@@ -691,110 +968,188 @@ new_entry(int type, const char *key, const char *value)
   p->type = type;
 
   return p;
-
- err_val:
-  free(p->key);
- err_key:
-  free(p);
-  return NULL;
 }
 
 
+/*
+ * The strings of ENT stay in the obstack until conf_close(); only the
+ * node is reused.
+ */
 static void
 delete_entry(CONF *cf, struct confent *ent)
 {
   if (ent) {
-    if (ent->type == CF_ENTRY) {
-      if (ent->value)
-        free(ent->value);
+    if (ent->type == CF_ENTRY)
       cf->num_entries--;
-    }
     else
       cf->num_sections--;
 
-    if(ent->key)
-      free(ent->key);
+    ent->next = cf->free_ents;
+    cf->free_ents = ent;
+  }
+}
+
+
+/*
+ * Return the head of the chain of HASH, which is in the old table if
+ * its bucket is not moved yet.
+ */
+static struct confent **
+get_bucket(CONF *cf, unsigned long hash)
+{
+  size_t index;
+
+  if (cf->old_table) {
+    index = hash % cf->old_size;
+    if (index >= cf->rehash_pos)
+      return &cf->old_table[index];
+  }
+  return &cf->table[hash % cf->table_size];
+}
+
+
+/* Move NBUCKETS buckets of the old table, if any, into the table. */
+static void
+rehash_step(CONF *cf, size_t nbuckets)
+{
+  struct confent *p, **bucket;
+
+  if (!cf->old_table)
+    return;
 
-    free(ent);
+  for (; nbuckets > 0 && cf->rehash_pos < cf->old_size; nbuckets--) {
+    while ((p = cf->old_table[cf->rehash_pos]) != NULL) {
+      cf->old_table[cf->rehash_pos] = p->next;
+      bucket = &cf->table[p->hash % cf->table_size];
+      p->next = *bucket;
+      *bucket = p;
+    }
+    cf->rehash_pos++;
+  }
+
+  if (cf->rehash_pos == cf->old_size) {
+    free(cf->old_table);
+    cf->old_table = NULL;
+    cf->old_size = 0;
+    cf->rehash_pos = 0;
   }
 }
 
 
 static void
-add_hash(CONF *cf, int index, struct confent *ent)
+add_hash(CONF *cf, struct confent *ent)
 {
+  struct confent **table, **bucket;
+  size_t size, i;
+
   if (ent->type == CF_ENTRY)
     cf->num_entries++;
   else
     cf->num_sections++;
 
-  ent->next = cf->table[index];
-  cf->table[index] = ent;
+  bucket = get_bucket(cf, ent->hash);
+  ent->next = *bucket;
+  *bucket = ent;
+
+  rehash_step(cf, CONF_REHASH_STEP);
+
+  if (cf->old_table ||
+      cf->num_entries + cf->num_sections <= cf->table_size * CONF_LOAD_FACTOR)
+    return;
+
+  /* Start to move into a table of about twice the size.  If it cannot
+   * be allocated, the chains just get longer. */
+  size = get_nearest_prime(cf->table_size * 2, 0);
+  if (size <= cf->table_size)
+    return;
+  table = malloc(sizeof(*table) * size);
+  if (!table)
+    return;
+  for (i = 0; i < size; i++)
+    table[i] = NULL;
+
+  cf->old_table = cf->table;
+  cf->old_size = cf->table_size;
+  cf->rehash_pos = 0;
+  cf->table = table;
+  cf->table_size = size;
+}
+
+
+/* Remove ENT from its hash chain. */
+static void
+del_hash(CONF *cf, struct confent *ent)
+{
+  struct confent **link;
+
+  for (link = get_bucket(cf, ent->hash); *link != NULL; link = &(*link)->next)
+    if (*link == ent) {
+      *link = ent->next;
+      ent->next = NULL;
+      break;
+    }
 }
 
 
 /*
- * Return the entry (sect:key) if found.
- * If PREV is not NULL, *PREV is set to the pointer to the previous entry.
- * If PREV is not NULL and there is no previous entry, *PREV is set to NULL.
+ * Return the entry (sect:key) if found.  SECT may be NULL for any
+ * section.  If LINK is not NULL, *LINK is set to the pointer that
+ * points the entry in its hash chain.
  */
 static struct confent *
-find_entry(CONF *cf, const char *sect, const char *key, struct confent **prev)
+find_entry(CONF *cf, const char *sect, const char *key,
+           struct confent ***link)
 {
-  struct confent *p, *q;
-  int index = GET_HASH(cf, key);
+  struct confent *s, *p, **pp;
+  unsigned long hash;
 
-  if (prev)
-    *prev = 0;
+  if (!sect) {
+    for (s = cf->sections; s != NULL; s = s->sibling)
+      if ((p = find_entry(cf, s->key, key, link)) != NULL)
+        return p;
+    return NULL;
+  }
 
-  for (q = p = cf->table[index]; p != NULL; p = p->next) {
-    if (p->type == CF_SECT)
-      continue;
+  s = find_sect(cf, sect);
+  if (!s)
+    return NULL;
 
-    if (sect) {
-      if (strcmp(p->sect->key, sect) == 0 && strcmp(p->key, key) == 0) {
-        if (prev && p != q)
-          *prev = q;
-        return p;
-      }
-      return NULL;
-    }
-    else if (strcmp(p->key, key) == 0) {
-      if (prev)
-        *prev = q;
+  hash = ENTRY_HASH(s, key);
+  for (pp = get_bucket(cf, hash); (p = *pp) != NULL; pp = &p->next) {
+    if (p->hash == hash && p->type == CF_ENTRY && p->sect == s &&
+        strcmp(p->key, key) == 0) {
+      if (link)
+        *link = pp;
       return p;
     }
-    q = p;
   }
   return NULL;
 }
 
 
+/*
+ * The value that is replaced stays in the obstack until conf_close().
+ */
 static struct confent *
 add_entry(CONF *cf, struct confent *sect, const char *key, const char *val)
 {
   struct confent *ent;
-  char *p;
-  int index = GET_HASH(cf, key);
 
   ent = find_entry(cf, sect->key, key, 0);
 
   if (ent) {
     if (!IS_OVERWRITE(cf))
       return NULL;
-    p = strdup(val);
-    if (!p)
-      return NULL;
-    free(ent->value);
-    ent->value = p;
+    ent->value = obstack_copy0(&cf->stack, val, strlen(val));
   }
   else {
-    ent = new_entry(CF_ENTRY, key, val);
+    ent = new_entry(cf, CF_ENTRY, key, val);
     if (!ent)
       return NULL;
     ent->sect = sect;
+    ent->hash = ENTRY_HASH(sect, key);
     sect_ref(cf, sect);
-    add_hash(cf, index, ent);
+    add_hash(cf, ent);
 
     /* Add to the sibling list */
     ent->sibling = sect->sect;
@@ -811,30 +1166,23 @@ add_entry(CONF *cf, struct confent *sect, const char *key, const char *val)
 static struct confent *
 del_entry(CONF *cf, const char *sect, const char *key)
 {
-  struct confent *prev, *ent, *p;
-  int index = GET_HASH(cf, key);
+  struct confent *ent, *p, **link;
 
   /* Remove from the hash chain list */
-  ent = find_entry(cf, sect, key, &prev);
+  ent = find_entry(cf, sect, key, &link);
   if (!ent)
     return NULL;
 
-  if (!prev)
-    cf->table[index] = ent->next;
-  else
-    prev->next = ent->next;
+  *link = ent->next;
   ent->next = 0;
 
   /* Remove from the sect sibling list */
-  for (p = prev = ent->sect->sect; p != NULL && p != ent; p = p->sibling) {
-    prev = p;
-  }
-  /* TODO: Can P be NULL?  */
-  if (p == ent->sect->sect)
-    ent->sect = p->sibling;
-  else
-    prev->sibling = p->sibling;
-  p->sibling = 0;
+  for (link = &ent->sect->sect; (p = *link) != ent; link = &p->sibling)
+    ;
+  *link = ent->sibling;
+  ent->sibling = 0;
+
+  rehash_step(cf, CONF_REHASH_STEP);
 
   return ent;
 }
@@ -844,7 +1192,7 @@ static __inline__ void
 sect_ref(CONF *cf, struct confent *ent)
 {
   assert(ent->type == CF_SECT);
-  ent->value = (char *)((unsigned)ent->value + 1);
+  ent->value = (char *)((size_t)ent->value + 1);
 
   /* TODO: overflow check?? */
 }
@@ -856,11 +1204,14 @@ sect_unref(CONF *cf, struct confent *ent)
   struct confent *p;
   assert(ent->type == CF_SECT);
 
-  ent->value = (char *)((unsigned)ent->value - 1);
+  ent->value = (char *)((size_t)ent->value - 1);
 
-  if ((unsigned)ent->value == 0 && IS_PRUNE(cf)) {
+  if ((size_t)ent->value == 0 && IS_PRUNE(cf)) {
     p = del_sectlist(cf, ent);
-    delete_entry(cf, p);
+    if (p) {
+      del_hash(cf, p);
+      delete_entry(cf, p);
+    }
   }
 }
 
@@ -993,7 +1344,7 @@ getline_finalizer(void)
  * already read one character, pass it as LOOKAHEAD. Otherwise use
  * EOF.  */
 static char *
-getline(FILE *fp, int lookahead, int *lineno)
+read_line(FILE *fp, int lookahead, unsigned *lineno)
 {
   int ch, look;
   char *line, *dup;
@@ -1129,6 +1480,7 @@ conf_dump(CONF *cf, FILE *fp)
 {
   struct confent *p, *q;
 
+  materialize(cf);
   fprintf(fp, "conf[%p]-----------------------------\n", cf);
   fprintf(fp, "  pathname: %s\n", cf->pathname);
   fprintf(fp, "  dirty: %d\n", cf->dirty);
@@ -1140,7 +1492,7 @@ conf_dump(CONF *cf, FILE *fp)
   fprintf(fp, "  sections: %p\n", cf->sections);
   if (cf->sections)
     for (p = cf->sections; p != NULL; p = p->sibling) {
-      printf("\t%s [%u]\n", p->key, (unsigned)p->value);
+      printf("\t%s [%u]\n", p->key, (unsigned)(size_t)p->value);
 
       for (q = p->sect; q != NULL; q = q->sibling)
         printf("\t\t%s = %s\n", q->key, q->value);
@@ -1150,6 +1502,9 @@ conf_dump(CONF *cf, FILE *fp)
 
 
 #ifdef TEST_CONF
+/*
+ *   $ cc -D_GNU_SOURCE -DTEST_CONF -o conf conf.c confcache.c
+ */
 int
 enum_proc(const char *sect, const char *key, const char *val,
           int index, void *data)
@@ -1187,7 +1542,8 @@ main(int argc, char *argv[])
 #endif
 
   puts("\n\n-- save begin ----------------");
-  conf_save_stream(cf, stdout, headers);
+  fflush(stdout);
+  conf_save_fd(cf, STDOUT_FILENO, headers);
   puts("-- save end ----------------");
 #if 0
   conf_dump(cf, stdout);
@@ -40,6 +40,19 @@ BEGIN_C_DECLS
 #define CF_PRUNE        0x0002
 #define CF_VERBOSE      0x0004
 
+/*
+ * With CF_CACHE, conf_load() into an empty CONF maps the image that
+ * was saved next to the file, if the file has not changed since, and
+ * saves a new one otherwise (see confcache.h).  The CONF is read from
+ * the image until the first change.
+ *
+ * conf.c links with confcache.c for this, whether CF_CACHE is used or
+ * not:
+ *
+ *   $ cc -D_GNU_SOURCE ... conf.c confcache.c
+ */
+#define CF_CACHE        0x0008
+
 struct conf_;
 typedef struct conf_ CONF;
 
@@ -59,8 +72,14 @@ extern int conf_add(CONF *cf, const char *sect,
 
 extern int conf_remove(CONF *cf, const char *sect, const char *key);
 
+/* Return the value of KEY in SECT (NULL for any), or NULL. */
+extern const char *conf_get(CONF *cf, const char *sect, const char *key);
+
 extern void conf_set_dirty(CONF *cf, int dirty);
 
+/* Set the CF_* flags of CF, and return the previous ones. */
+extern unsigned conf_set_flags(CONF *cf, unsigned flags);
+
 typedef int (*conf_enum_proc)(const char *section,
                               const char *key, const char *value,
                               int index, void *data);
@@ -0,0 +1,614 @@
+/*
+ * Test and benchmark of confcache
+ *
+ *   $ cc -O2 -D_GNU_SOURCE -o confcache-test confcache-test.c confcache.c \
+ *       conf.c properties.c xerror.c
+ *   $ ./confcache-test [NENTRIES]
+ *
+ * The test loads a CONF file and a properties file twice with their
+ * images, and checks that the second load, which maps the image,
+ * gives the same parameters in the same order as parsing, and that
+ * changes after it work.  Then it checks that an image is not taken
+ * for a changed file or when it is damaged, and that it is written
+ * again then.  Last, that an image keeps what parsing gives for empty
+ * sections, that it is no more readable than its file, and that an
+ * image that others could have written is not taken.
+ *
+ * The benchmark writes a CONF file of NENTRIES (100k by default)
+ * entries, and a properties file of ten times as many, and measures
+ * parsing them against loading them from their images.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+
+#include "conf.h"
+#include "properties.h"
+#include "confcache.h"
+#include "difftime.h"
+
+
+static char *
+image_path(const char *path)
+{
+  static char buf[512];
+
+  snprintf(buf, sizeof(buf), "%s.cache", path);
+  return buf;
+}
+
+
+/* Set the mtime of PATH to SEC, so that each version differs. */
+static int
+touch(const char *path, long sec)
+{
+  struct timeval tv[2];
+
+  tv[0].tv_sec = tv[1].tv_sec = sec;
+  tv[0].tv_usec = tv[1].tv_usec = 0;
+  return utimes(path, tv);
+}
+
+
+static int
+write_conf(const char *path, int nentries, const char *value)
+{
+  FILE *fp = fopen(path, "w");
+  int i;
+
+  if (fp == NULL) {
+    fprintf(stderr, "confcache-test: cannot write %s\n", path);
+    return -1;
+  }
+  for (i = 0; i < nentries; i++) {
+    if (i % 100 == 0)
+      fprintf(fp, "[section%d]\n", i / 100);
+    fprintf(fp, "key%d = %s-%d-abcdefghijklmnop\n", i, value, i);
+  }
+  fclose(fp);
+  return 0;
+}
+
+
+struct record {
+  char *lines[4096];
+  int n;
+  int bad;                      /* an index out of order, or too many */
+};
+
+
+static int
+record_proc(const char *section, const char *key, const char *value,
+            int index, void *data)
+{
+  struct record *r = data;
+  char buf[256];
+
+  if (index != r->n || r->n >= 4096) {
+    r->bad = 1;
+    return -1;
+  }
+  snprintf(buf, sizeof(buf), "%s/%s=%s", section, key, value);
+  r->lines[r->n++] = strdup(buf);
+  return 0;
+}
+
+
+/* Return -1 unless A and B recorded the same lines, and forget them. */
+static int
+compare_records(struct record *a, struct record *b)
+{
+  int i, ret = (a->bad || b->bad || a->n != b->n) ? -1 : 0;
+
+  for (i = 0; i < a->n || i < b->n; i++) {
+    if (i < a->n && i < b->n && strcmp(a->lines[i], b->lines[i]) != 0)
+      ret = -1;
+    if (i < a->n)
+      free(a->lines[i]);
+    if (i < b->n)
+      free(b->lines[i]);
+  }
+  a->n = b->n = 0;
+  a->bad = b->bad = 0;
+  return ret;
+}
+
+
+static CONF *
+load_conf(const char *path, int cache)
+{
+  CONF *cf = conf_new(0);
+
+  if (cf == NULL)
+    return NULL;
+  if (cache)
+    conf_set_flags(cf, CF_CACHE);
+  if (conf_load(cf, path, 0) < 0) {
+    fprintf(stderr, "confcache-test: cannot load %s\n", path);
+    conf_close(cf);
+    return NULL;
+  }
+  return cf;
+}
+
+
+/* Return -1 unless an image of PATH is there to map, and map it. */
+static int
+image_ok(const char *path, int kind)
+{
+  confcache_t *cc = confcache_open(path, kind);
+
+  if (cc == NULL)
+    return -1;
+  confcache_close(cc);
+  return 0;
+}
+
+
+static int
+test_conf(const char *path)
+{
+  static struct record parsed, cached;
+  confcache_t *cc;
+  CONF *cf, *ref;
+  FILE *fp;
+  int n;
+
+  unlink(image_path(path));
+  if (write_conf(path, 1000, "first") < 0 || touch(path, 1000000000) < 0)
+    return -1;
+
+  if ((ref = load_conf(path, 0)) == NULL)
+    return -1;
+  conf_enum(ref, NULL, record_proc, &parsed);
+
+  /* The first load parses, and writes the image. */
+  if ((cf = load_conf(path, 1)) == NULL)
+    return -1;
+  if (access(image_path(path), F_OK) != 0)
+    return -1;
+  conf_enum(cf, NULL, record_proc, &cached);
+  if (compare_records(&parsed, &cached) < 0)
+    return -1;
+  conf_close(cf);
+
+  /* The second one maps it. */
+  cc = confcache_open(path, CONFCACHE_CONF);
+  if (cc == NULL || confcache_count(cc) != 1000)
+    return -1;
+  if (confcache_nsections(cc) != 10)
+    return -1;
+  if (confcache_find(cc, "section3", 8, "key345", 6) < 0)
+    return -1;
+  if (confcache_find(cc, "section4", 8, "key345", 6) != -1)
+    return -1;
+  confcache_close(cc);
+
+  if ((cf = load_conf(path, 1)) == NULL)
+    return -1;
+  if (conf_entry_count(cf) != 1000 || conf_section_count(cf) != 10)
+    return -1;
+  if (strcmp(conf_get(cf, "section9", "key999"),
+             "first-999-abcdefghijklmnop") != 0)
+    return -1;
+  if (strcmp(conf_get(cf, NULL, "key0"), "first-0-abcdefghijklmnop") != 0)
+    return -1;
+  if (conf_get(cf, "section0", "key999") != NULL)
+    return -1;
+  if (conf_enum(cf, "section1", record_proc, &cached) != 100)
+    return -1;
+  if (conf_enum(cf, "nothing", record_proc, &cached) != -1)
+    return -1;
+  conf_enum(ref, "section1", record_proc, &parsed);
+  if (compare_records(&parsed, &cached) < 0)
+    return -1;
+  conf_enum(cf, NULL, record_proc, &cached);
+  conf_enum(ref, NULL, record_proc, &parsed);
+  if (compare_records(&parsed, &cached) < 0)
+    return -1;
+
+  /* A change moves the image into the table, in the same order. */
+  if (conf_add(cf, "section0", "new", "value") != 0 ||
+      conf_add(ref, "section0", "new", "value") != 0)
+    return -1;
+  if (conf_remove(cf, "section5", "key550") != 0 ||
+      conf_remove(ref, "section5", "key550") != 0)
+    return -1;
+  conf_enum(cf, NULL, record_proc, &cached);
+  conf_enum(ref, NULL, record_proc, &parsed);
+  if (compare_records(&parsed, &cached) < 0)
+    return -1;
+  if (strcmp(conf_get(cf, "section0", "new"), "value") != 0)
+    return -1;
+  conf_close(cf);
+  conf_close(ref);
+
+  /* The image of the file that changed is not taken. */
+  if (write_conf(path, 500, "second") < 0 || touch(path, 1000000001) < 0)
+    return -1;
+  if (image_ok(path, CONFCACHE_CONF) == 0)
+    return -1;
+  if ((cf = load_conf(path, 1)) == NULL)
+    return -1;
+  n = conf_entry_count(cf);
+  if (n != 500 || strcmp(conf_get(cf, "section2", "key250"),
+                         "second-250-abcdefghijklmnop") != 0)
+    return -1;
+  conf_close(cf);
+
+  /* Nor the damaged one, nor the one of another kind */
+  if (image_ok(path, CONFCACHE_CONF) < 0)
+    return -1;
+  if (image_ok(path, CONFCACHE_PROPERTIES) == 0)
+    return -1;
+
+  fp = fopen(image_path(path), "r+");
+  if (fp == NULL)
+    return -1;
+  fseek(fp, -10, SEEK_END);
+  fputc('X', fp);
+  fclose(fp);
+  if (image_ok(path, CONFCACHE_CONF) == 0)
+    return -1;
+
+  if ((cf = load_conf(path, 1)) == NULL)
+    return -1;
+  n = conf_entry_count(cf);
+  if (n != 500 || strcmp(conf_get(cf, "section4", "key499"),
+                         "second-499-abcdefghijklmnop") != 0)
+    return -1;
+  conf_close(cf);
+  if (image_ok(path, CONFCACHE_CONF) < 0)
+    return -1;
+
+  unlink(image_path(path));
+  unlink(path);
+  return 0;
+}
+
+
+static int
+test_empty(const char *path)
+{
+  static struct record none;
+  struct stat st;
+  CONF *cf, *ref;
+  FILE *fp;
+  int i;
+
+  unlink(image_path(path));
+  fp = fopen(path, "w");
+  if (fp == NULL)
+    return -1;
+  fputs("[empty]\n[full]\na = 1\n", fp);
+  fclose(fp);
+  if (chmod(path, 0600) != 0)
+    return -1;
+
+  /* The first load writes the image, the second one reads it; both
+   * see the sections that parsing sees. */
+  if ((ref = load_conf(path, 0)) == NULL)
+    return -1;
+  for (i = 0; i < 2; i++) {
+    if ((cf = load_conf(path, 1)) == NULL)
+      return -1;
+    if (conf_section_count(cf) != conf_section_count(ref))
+      return -1;
+    if (conf_enum(cf, "empty", record_proc, &none) !=
+        conf_enum(ref, "empty", record_proc, &none))
+      return -1;
+    if (strcmp(conf_get(cf, "full", "a"), "1") != 0)
+      return -1;
+    conf_close(cf);
+  }
+  conf_close(ref);
+  if (stat(image_path(path), &st) != 0)
+    return -1;
+  if ((st.st_mode & 0777) != 0600)
+    return -1;
+
+  unlink(image_path(path));
+  unlink(path);
+  return 0;
+}
+
+
+/* An image that the group or others may write, or that someone else
+ * owns, could have been put there for us; it is not taken, and the
+ * next load writes our own. */
+static int
+test_foreign(const char *path)
+{
+  struct stat st;
+  CONF *cf;
+  int i;
+
+  unlink(image_path(path));
+  if (write_conf(path, 100, "mine") < 0 || chmod(path, 0644) != 0)
+    return -1;
+  if ((cf = load_conf(path, 1)) == NULL)
+    return -1;
+  conf_close(cf);
+  if (image_ok(path, CONFCACHE_CONF) < 0)
+    return -1;
+
+  for (i = 0; i < 2; i++) {
+    if (chmod(image_path(path), (i == 0) ? 0664 : 0646) != 0)
+      return -1;
+    if (image_ok(path, CONFCACHE_CONF) == 0)
+      return -1;
+    if ((cf = load_conf(path, 1)) == NULL)
+      return -1;
+    conf_close(cf);
+    if (image_ok(path, CONFCACHE_CONF) < 0)
+      return -1;
+  }
+
+  /* Unless its file is as open */
+  if (chmod(path, 0666) != 0 || chmod(image_path(path), 0666) != 0)
+    return -1;
+  if (image_ok(path, CONFCACHE_CONF) < 0)
+    return -1;
+
+  /* Only root can give the image away; the file stays ours. */
+  if (geteuid() == 0 && stat(path, &st) == 0 && st.st_uid == 0) {
+    if (chmod(image_path(path), 0644) != 0 ||
+        chown(image_path(path), 1, (gid_t)-1) != 0)
+      return -1;
+    if (image_ok(path, CONFCACHE_CONF) == 0)
+      return -1;
+  }
+
+  unlink(image_path(path));
+  unlink(path);
+  return 0;
+}
+
+
+struct props_record {
+  char *lines[64];
+  int n;
+};
+
+
+static int
+props_proc(const char *key, const char *value, void *data)
+{
+  struct props_record *r = data;
+  char buf[256];
+
+  if (r->n >= 64)
+    return -1;
+  snprintf(buf, sizeof(buf), "%s=%s", key, value);
+  r->lines[r->n++] = strdup(buf);
+  return 0;
+}
+
+
+static int
+test_properties(const char *path)
+{
+  static const char text[] =
+    "# comment\n"
+    "a = 1\n"
+    "b.c : two words\n"
+    "long = first \\\n"
+    "    second\n"
+    "unicode = \\u00e9t\\u00e9\n"
+    "empty\n"
+    "a = overridden\n";
+  struct props_record parsed = { { 0 }, 0 }, cached = { { 0 }, 0 };
+  PROPERTIES *ref, *props;
+  confcache_t *cc;
+  FILE *fp;
+  int i;
+
+  unlink(image_path(path));
+  fp = fopen(path, "w");
+  if (fp == NULL)
+    return -1;
+  fputs(text, fp);
+  fclose(fp);
+
+  ref = properties_load(path, NULL);
+  if (ref == NULL)
+    return -1;
+  properties_enum(ref, props_proc, NULL, &parsed);
+
+  for (i = 0; i < 2; i++) {
+    props = properties_load_cached(path);
+    if (props == NULL)
+      return -1;
+    if (access(image_path(path), F_OK) != 0)
+      return -1;
+    if (strcmp(properties_get(props, "a"), "overridden") != 0)
+      return -1;
+    if (strcmp(properties_get(props, "long"), "first second") != 0)
+      return -1;
+    if (strcmp(properties_get(props, "unicode"), "\xc3\xa9t\xc3\xa9") != 0)
+      return -1;
+    if (strcmp(properties_get(props, "empty"), "") != 0)
+      return -1;
+    if (properties_get(props, "missing") != NULL)
+      return -1;
+    if (properties_enum(props, props_proc, "b.*", &cached) != 1)
+      return -1;
+    if (strcmp(cached.lines[--cached.n], "b.c=two words") != 0)
+      return -1;
+    free(cached.lines[cached.n]);
+
+    properties_enum(props, props_proc, NULL, &cached);
+    if (cached.n != parsed.n)
+      return -1;
+    while (cached.n > 0) {
+      cached.n--;
+      if (strcmp(cached.lines[cached.n], parsed.lines[cached.n]) != 0)
+        return -1;
+      free(cached.lines[cached.n]);
+    }
+
+    properties_put(props, "a", "put");
+    properties_put(props, "z", "last");
+    if (strcmp(properties_get(props, "a"), "put") != 0)
+      return -1;
+    if (strcmp(properties_get(props, "z"), "last") != 0)
+      return -1;
+    if (strcmp(properties_get(props, "b.c"), "two words") != 0)
+      return -1;
+    if (properties_enum(props, props_proc, NULL, &cached) != parsed.n + 1)
+      return -1;
+    while (cached.n > 0)
+      free(cached.lines[--cached.n]);
+    properties_close(props);
+  }
+
+  cc = confcache_open(path, CONFCACHE_PROPERTIES);
+  if (cc == NULL || confcache_count(cc) != 5)
+    return -1;
+  confcache_close(cc);
+  while (parsed.n > 0)
+    free(parsed.lines[--parsed.n]);
+  properties_close(ref);
+  unlink(image_path(path));
+  unlink(path);
+  return 0;
+}
+
+
+static int
+bench_conf(const char *path, int nentries)
+{
+  CONF *cf = NULL;
+  uint64_t t_parse, t_write, t_cached;
+  int ok = 1;
+  df_t df;
+
+  unlink(image_path(path));
+  if (write_conf(path, nentries, "value") < 0)
+    return -1;
+
+  DF(df) {
+    cf = load_conf(path, 0);
+  }
+  t_parse = df.value;
+  if (cf == NULL)
+    return -1;
+  conf_close(cf);
+
+  DF(df) {
+    cf = load_conf(path, 1);
+  }
+  t_write = df.value;
+  if (cf == NULL)
+    return -1;
+  conf_close(cf);
+
+  DF(df) {
+    cf = load_conf(path, 1);
+    ok = (cf != NULL && conf_get(cf, "section0", "key0") != NULL);
+  }
+  t_cached = df.value;
+  if (!ok || conf_entry_count(cf) != nentries) {
+    fprintf(stderr, "confcache-test: cannot load %s from its image\n", path);
+    return -1;
+  }
+  conf_close(cf);
+
+  printf("conf, %d entries:\n", nentries);
+  printf("  conf_load               %8.1f ms\n", t_parse / 1e6);
+  printf("  conf_load, image written %7.1f ms\n", t_write / 1e6);
+  printf("  conf_load, image mapped %8.1f ms\n", t_cached / 1e6);
+
+  unlink(image_path(path));
+  unlink(path);
+  return 0;
+}
+
+
+static int
+bench_properties(const char *path, int nentries)
+{
+  PROPERTIES *props = NULL;
+  FILE *fp;
+  uint64_t t_parse, t_write, t_cached;
+  int i, ok = 1;
+  df_t df;
+
+  unlink(image_path(path));
+  fp = fopen(path, "w");
+  if (fp == NULL) {
+    fprintf(stderr, "confcache-test: cannot write %s\n", path);
+    return -1;
+  }
+  for (i = 0; i < nentries; i++)
+    fprintf(fp, "app.module%d.key%d = value-%d-abcdefghijklmnop\n",
+            i % 97, i, i);
+  fclose(fp);
+
+  DF(df) {
+    props = properties_load(path, NULL);
+  }
+  t_parse = df.value;
+  if (props == NULL)
+    return -1;
+  properties_close(props);
+
+  DF(df) {
+    props = properties_load_cached(path);
+  }
+  t_write = df.value;
+  if (props == NULL)
+    return -1;
+  properties_close(props);
+
+  DF(df) {
+    props = properties_load_cached(path);
+    ok = (props && properties_get(props, "app.module0.key0") != NULL);
+  }
+  t_cached = df.value;
+  if (!ok) {
+    fprintf(stderr, "confcache-test: cannot load %s from its image\n", path);
+    return -1;
+  }
+  properties_close(props);
+
+  printf("properties, %d entries:\n", nentries);
+  printf("  properties_load         %8.1f ms\n", t_parse / 1e6);
+  printf("  load_cached, written    %8.1f ms\n", t_write / 1e6);
+  printf("  load_cached, mapped     %8.1f ms\n", t_cached / 1e6);
+
+  unlink(image_path(path));
+  unlink(path);
+  return 0;
+}
+
+
+int
+main(int argc, char *argv[])
+{
+  const char *tmpdir = getenv("TMPDIR");
+  int nentries = (argc > 1) ? atoi(argv[1]) : 100000;
+  char path[256];
+  int ret;
+
+  snprintf(path, sizeof(path), "%s/confcache-test.%d",
+           (tmpdir) ? tmpdir : "/tmp", (int)getpid());
+
+  if (test_conf(path) < 0 || test_properties(path) < 0 ||
+      test_empty(path) < 0 || test_foreign(path) < 0) {
+    fprintf(stderr, "confcache-test: test failed\n");
+    unlink(image_path(path));
+    unlink(path);
+    return 1;
+  }
+  printf("confcache-test: test passed\n");
+
+  ret = (bench_conf(path, nentries) < 0 ||
+         bench_properties(path, nentries * 10) < 0) ? -1 : 0;
+  unlink(image_path(path));
+  unlink(path);
+  return (ret < 0) ? 1 : 0;
+}
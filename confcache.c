@@ -0,0 +1,662 @@
+/* confcache: precompiled binary images of configuration files
+ * Copyright (C) 2014  Seong-Kook Shin <cinsky@gmail.com>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Library General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Library General Public License for more details.
+ *
+ * You should have received a copy of the GNU Library General Public
+ * License along with this library; if not, write to the Free
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+
+#include "confcache.h"
+
+#define CACHE_SUFFIX    ".cache"
+#define CACHE_MAGIC     "CFCACHE"
+#define CACHE_BYTEORDER 0x01020304
+
+/*
+ * The image is the header, the sections, the entries, the index
+ * (padded to 8 bytes), and the strings.  All offsets of the strings
+ * are from the beginning of the strings.
+ */
+struct cache_header {
+  char magic[8];                /* CACHE_MAGIC */
+  uint32_t version;             /* CONFCACHE_VERSION */
+  uint32_t kind;                /* CONFCACHE_CONF, ... */
+  uint32_t byteorder;           /* CACHE_BYTEORDER */
+  uint32_t nsections;
+  uint32_t nentries;
+  uint32_t index_size;          /* a power of two */
+
+  uint64_t source_size;         /* of the stat(2) of the source */
+  uint64_t source_mtime;        /* in nanoseconds */
+  uint64_t source_ino;
+  uint64_t source_dev;
+
+  uint64_t strings_size;
+  uint64_t checksum;            /* of everything after the header */
+};
+
+struct cache_section {
+  uint32_t name;
+  uint32_t name_len;
+  uint32_t first;               /* of its entries */
+  uint32_t count;
+};
+
+struct cache_entry {
+  uint32_t section;
+  uint32_t hash;                /* of the section and the key */
+  uint32_t key;
+  uint32_t key_len;
+  uint32_t value;
+  uint32_t value_len;
+};
+
+struct confcache_ {
+  void *addr;
+  size_t size;
+
+  const struct cache_header *head;
+  const struct cache_section *sections;
+  const struct cache_entry *entries;
+  const uint32_t *index;        /* entry + 1, or 0 */
+  const char *strings;
+};
+
+struct confcache_builder_ {
+  int kind;
+  int failed;
+
+  struct cache_section *sections;
+  size_t nsections;
+  size_t sections_cap;
+
+  struct cache_entry *entries;
+  size_t nentries;
+  size_t entries_cap;
+
+  char *strings;
+  size_t strings_size;
+  size_t strings_cap;
+};
+
+
+static uint32_t
+cache_hash(const char *section, size_t section_len,
+           const char *key, size_t key_len)
+{
+  /* FNV-1a, with 0xff, which is not in UTF-8, between the two */
+  uint32_t h = 2166136261U;
+  size_t i;
+
+  for (i = 0; i < section_len; i++)
+    h = (h ^ (unsigned char)section[i]) * 16777619U;
+  h = (h ^ 0xff) * 16777619U;
+  for (i = 0; i < key_len; i++)
+    h = (h ^ (unsigned char)key[i]) * 16777619U;
+  return h;
+}
+
+
+/*
+ * The checksum of IOV, a word at a time.  All but the last part must
+ * be a multiple of 8 bytes, so that it does not matter how the bytes
+ * are split into the parts.
+ */
+static uint64_t
+checksum(const struct iovec *iov, int n)
+{
+  const unsigned char *p;
+  uint64_t h = 0x9e3779b97f4a7c15ULL, w, total = 0;
+  size_t len;
+  int i;
+
+  for (i = 0; i < n; i++) {
+    p = (const unsigned char *)iov[i].iov_base;
+    len = iov[i].iov_len;
+    total += len;
+    for (; len >= 8; p += 8, len -= 8) {
+      memcpy(&w, p, 8);
+      h = (h ^ w) * 0xff51afd7ed558ccdULL;
+      h ^= h >> 32;
+    }
+    if (len > 0) {
+      w = 0;
+      memcpy(&w, p, len);
+      h = (h ^ w) * 0xc4ceb9fe1a85ec53ULL;
+      h ^= h >> 29;
+    }
+  }
+  return (h ^ total) * 0xff51afd7ed558ccdULL;
+}
+
+
+static __inline__ size_t
+pad8(size_t n)
+{
+  return (n + 7) & ~(size_t)7;
+}
+
+
+static char *
+cache_path(const char *pathname)
+{
+  size_t len = strlen(pathname);
+  char *path = (char *)malloc(len + sizeof(CACHE_SUFFIX));
+
+  if (path) {
+    memcpy(path, pathname, len);
+    memcpy(path + len, CACHE_SUFFIX, sizeof(CACHE_SUFFIX));
+  }
+  return path;
+}
+
+
+static __inline__ uint64_t
+mtime_ns(const struct stat *st)
+{
+  return (uint64_t)st->st_mtim.tv_sec * 1000000000ULL + st->st_mtim.tv_nsec;
+}
+
+
+static int
+string_ok(const struct cache_header *h, const char *strings,
+          uint32_t off, uint32_t len)
+{
+  return (uint64_t)off + len < h->strings_size && strings[off + len] == '\0';
+}
+
+
+/* Check the image in CC of KIND against ST, the stat of its source. */
+static int
+validate(confcache_t *cc, int kind, const struct stat *st)
+{
+  const struct cache_header *h = cc->head;
+  const struct cache_section *s;
+  const struct cache_entry *e;
+  struct iovec iov[2];
+  uint64_t body;
+  size_t i, nempty;
+
+  if (memcmp(h->magic, CACHE_MAGIC, sizeof(h->magic)) != 0 ||
+      h->version != CONFCACHE_VERSION || h->kind != (uint32_t)kind ||
+      h->byteorder != CACHE_BYTEORDER)
+    return -1;
+  if (h->source_size != (uint64_t)st->st_size ||
+      h->source_mtime != mtime_ns(st) ||
+      h->source_ino != (uint64_t)st->st_ino ||
+      h->source_dev != (uint64_t)st->st_dev)
+    return -1;
+
+  if (h->index_size == 0 || (h->index_size & (h->index_size - 1)) != 0 ||
+      h->index_size <= h->nentries)
+    return -1;
+  body = (uint64_t)h->nsections * sizeof(struct cache_section) +
+    (uint64_t)h->nentries * sizeof(struct cache_entry) +
+    pad8((size_t)h->index_size * sizeof(uint32_t)) + h->strings_size;
+  if (body != cc->size - sizeof(*h))
+    return -1;
+
+  iov[0].iov_base = (char *)cc->addr + sizeof(*h);
+  iov[0].iov_len = body - h->strings_size;
+  iov[1].iov_base = (char *)cc->strings;
+  iov[1].iov_len = h->strings_size;
+  if (checksum(iov, 2) != h->checksum)
+    return -1;
+
+  /* The checksum catches a damaged image; this, a wrong writer. */
+  for (i = 0; i < h->nsections; i++) {
+    s = cc->sections + i;
+    if (!string_ok(h, cc->strings, s->name, s->name_len) ||
+        (uint64_t)s->first + s->count > h->nentries)
+      return -1;
+  }
+  for (i = 0; i < h->nentries; i++) {
+    e = cc->entries + i;
+    if (e->section >= h->nsections ||
+        !string_ok(h, cc->strings, e->key, e->key_len) ||
+        !string_ok(h, cc->strings, e->value, e->value_len))
+      return -1;
+  }
+  /* confcache_find() stops at an empty slot, so there must be one. */
+  for (i = 0, nempty = 0; i < h->index_size; i++) {
+    if (cc->index[i] > h->nentries)
+      return -1;
+    nempty += (cc->index[i] == 0);
+  }
+  return (nempty > 0) ? 0 : -1;
+}
+
+
+confcache_t *
+confcache_open(const char *pathname, int kind)
+{
+  struct stat st, cst;
+  confcache_t *cc;
+  char *path;
+  void *addr;
+  int fd;
+
+  if (stat(pathname, &st) < 0)
+    return NULL;
+  path = cache_path(pathname);
+  if (!path)
+    return NULL;
+  fd = open(path, O_RDONLY | O_CLOEXEC);
+  free(path);
+  if (fd < 0)
+    return NULL;
+  /* Not one that another user planted, nor one others may change */
+  if (fstat(fd, &cst) < 0 || !S_ISREG(cst.st_mode) ||
+      (cst.st_uid != geteuid() && cst.st_uid != st.st_uid) ||
+      (cst.st_mode & ~st.st_mode & (S_IWGRP | S_IWOTH)) != 0 ||
+      cst.st_size < (off_t)sizeof(struct cache_header)) {
+    close(fd);
+    return NULL;
+  }
+  addr = mmap(NULL, cst.st_size, PROT_READ, MAP_SHARED, fd, 0);
+  close(fd);
+  if (addr == MAP_FAILED)
+    return NULL;
+
+  cc = (confcache_t *)malloc(sizeof(*cc));
+  if (!cc) {
+    munmap(addr, cst.st_size);
+    return NULL;
+  }
+  cc->addr = addr;
+  cc->size = cst.st_size;
+  cc->head = (const struct cache_header *)addr;
+  cc->sections = (const struct cache_section *)(cc->head + 1);
+  cc->entries = (const struct cache_entry *)
+    (cc->sections + cc->head->nsections);
+  cc->index = (const uint32_t *)(cc->entries + cc->head->nentries);
+  cc->strings = (const char *)cc->index +
+    pad8((size_t)cc->head->index_size * sizeof(uint32_t));
+
+  /* The pointers above are only used if it is valid. */
+  if (validate(cc, kind, &st) < 0) {
+    confcache_close(cc);
+    return NULL;
+  }
+  return cc;
+}
+
+
+void
+confcache_close(confcache_t *cc)
+{
+  if (!cc)
+    return;
+  munmap(cc->addr, cc->size);
+  free(cc);
+}
+
+
+size_t
+confcache_count(const confcache_t *cc)
+{
+  return cc->head->nentries;
+}
+
+
+size_t
+confcache_nsections(const confcache_t *cc)
+{
+  return cc->head->nsections;
+}
+
+
+size_t
+confcache_section(const confcache_t *cc, size_t s,
+                  const char **name, size_t *first)
+{
+  const struct cache_section *p = cc->sections + s;
+
+  if (name)
+    *name = cc->strings + p->name;
+  if (first)
+    *first = p->first;
+  return p->count;
+}
+
+
+void
+confcache_entry(const confcache_t *cc, size_t i,
+                const char **section, size_t *section_len,
+                const char **key, size_t *key_len,
+                const char **value, size_t *value_len)
+{
+  const struct cache_entry *e = cc->entries + i;
+  const struct cache_section *s = cc->sections + e->section;
+
+  if (section)
+    *section = cc->strings + s->name;
+  if (section_len)
+    *section_len = s->name_len;
+  if (key)
+    *key = cc->strings + e->key;
+  if (key_len)
+    *key_len = e->key_len;
+  if (value)
+    *value = cc->strings + e->value;
+  if (value_len)
+    *value_len = e->value_len;
+}
+
+
+long
+confcache_find(const confcache_t *cc, const char *section, size_t section_len,
+               const char *key, size_t key_len)
+{
+  const struct cache_entry *e;
+  const struct cache_section *s;
+  uint32_t h, mask = cc->head->index_size - 1, i, v;
+
+  if (!section) {
+    section = "";
+    section_len = 0;
+  }
+  h = cache_hash(section, section_len, key, key_len);
+  for (i = h & mask; (v = cc->index[i]) != 0; i = (i + 1) & mask) {
+    e = cc->entries + v - 1;
+    if (e->hash != h || e->key_len != key_len ||
+        memcmp(cc->strings + e->key, key, key_len) != 0)
+      continue;
+    s = cc->sections + e->section;
+    if (s->name_len == section_len &&
+        memcmp(cc->strings + s->name, section, section_len) == 0)
+      return v - 1;
+  }
+  return -1;
+}
+
+
+confcache_builder_t *
+confcache_builder_new(int kind)
+{
+  confcache_builder_t *b = (confcache_builder_t *)calloc(1, sizeof(*b));
+
+  if (b)
+    b->kind = kind;
+  return b;
+}
+
+
+void
+confcache_builder_free(confcache_builder_t *b)
+{
+  if (!b)
+    return;
+  free(b->sections);
+  free(b->entries);
+  free(b->strings);
+  free(b);
+}
+
+
+/* Make room for one more of SIZE bytes in *ARRAY of *N with *CAP. */
+static int
+grow(void *array, size_t n, size_t *cap, size_t size, size_t more)
+{
+  void *p;
+  size_t newcap;
+
+  if (n + more <= *cap)
+    return 0;
+  newcap = (*cap) ? *cap : 64;
+  while (newcap < n + more)
+    newcap *= 2;
+  p = realloc(*(void **)array, newcap * size);
+  if (!p)
+    return -1;
+  *(void **)array = p;
+  *cap = newcap;
+  return 0;
+}
+
+
+/* Add S of LEN bytes, and a NUL, to the strings, and set *OFF. */
+static int
+add_string(confcache_builder_t *b, const char *s, size_t len, uint32_t *off)
+{
+  if (b->strings_size + len + 1 > UINT32_MAX ||
+      grow(&b->strings, b->strings_size, &b->strings_cap, 1, len + 1) < 0)
+    return -1;
+  memcpy(b->strings + b->strings_size, s, len);
+  b->strings[b->strings_size + len] = '\0';
+  *off = b->strings_size;
+  b->strings_size += len + 1;
+  return 0;
+}
+
+
+/* Make SECTION the current section of B, unless it already is. */
+static struct cache_section *
+set_section(confcache_builder_t *b, const char *section, size_t section_len)
+{
+  struct cache_section *s;
+
+  if (!section) {
+    section = "";
+    section_len = 0;
+  }
+
+  s = (b->nsections > 0) ? b->sections + b->nsections - 1 : NULL;
+  if (s && s->name_len == section_len &&
+      memcmp(b->strings + s->name, section, section_len) == 0)
+    return s;
+
+  if (grow(&b->sections, b->nsections, &b->sections_cap,
+           sizeof(*s), 1) < 0)
+    return NULL;
+  s = b->sections + b->nsections;
+  if (add_string(b, section, section_len, &s->name) < 0)
+    return NULL;
+  s->name_len = section_len;
+  s->first = b->nentries;
+  s->count = 0;
+  b->nsections++;
+  return s;
+}
+
+
+int
+confcache_add_section(confcache_builder_t *b, const char *section,
+                      size_t section_len)
+{
+  if (b->failed)
+    return -1;
+  if (!set_section(b, section, section_len)) {
+    b->failed = 1;
+    return -1;
+  }
+  return 0;
+}
+
+
+int
+confcache_add(confcache_builder_t *b, const char *section, size_t section_len,
+              const char *key, size_t key_len,
+              const char *value, size_t value_len)
+{
+  struct cache_section *s;
+  struct cache_entry *e;
+
+  if (b->failed)
+    return -1;
+  if (!section) {
+    section = "";
+    section_len = 0;
+  }
+
+  s = set_section(b, section, section_len);
+  if (!s)
+    goto err;
+
+  if (b->nentries >= UINT32_MAX - 1 ||
+      grow(&b->entries, b->nentries, &b->entries_cap, sizeof(*e), 1) < 0)
+    goto err;
+  e = b->entries + b->nentries;
+  e->section = b->nsections - 1;
+  e->hash = cache_hash(section, section_len, key, key_len);
+  if (add_string(b, key, key_len, &e->key) < 0 ||
+      add_string(b, value, value_len, &e->value) < 0)
+    goto err;
+  e->key_len = key_len;
+  e->value_len = value_len;
+  b->nentries++;
+  s->count++;
+  return 0;
+
+ err:
+  b->failed = 1;
+  return -1;
+}
+
+
+/* Write all of IOV to FD, which may take more than one writev(2). */
+static int
+write_all(int fd, struct iovec *iov, int n)
+{
+  ssize_t written;
+
+  while (n > 0) {
+    written = writev(fd, iov, n);
+    if (written < 0) {
+      if (errno == EINTR)
+        continue;
+      return -1;
+    }
+    while (n > 0 && (size_t)written >= iov->iov_len) {
+      written -= iov->iov_len;
+      iov++;
+      n--;
+    }
+    if (n > 0) {
+      iov->iov_base = (char *)iov->iov_base + written;
+      iov->iov_len -= written;
+    }
+  }
+  return 0;
+}
+
+
+int
+confcache_write(confcache_builder_t *b, const char *pathname,
+                const struct stat *st)
+{
+  static const char zeros[8] = { 0 };
+  struct cache_header h;
+  struct iovec iov[6];
+  uint32_t *index, mask, i, j;
+  size_t index_size = 8;
+  char *path = NULL, *tmp = NULL;
+  int fd = -1, saved_errno;
+
+  if (b->failed) {
+    errno = ENOMEM;
+    return -1;
+  }
+
+  while (index_size < b->nentries * 2)
+    index_size *= 2;
+  index = (uint32_t *)calloc(index_size, sizeof(*index));
+  if (!index)
+    return -1;
+  mask = index_size - 1;
+  for (i = 0; i < b->nentries; i++) {
+    for (j = b->entries[i].hash & mask; index[j] != 0; j = (j + 1) & mask)
+      ;
+    index[j] = i + 1;
+  }
+
+  memset(&h, 0, sizeof(h));
+  memcpy(h.magic, CACHE_MAGIC, sizeof(h.magic));
+  h.version = CONFCACHE_VERSION;
+  h.kind = b->kind;
+  h.byteorder = CACHE_BYTEORDER;
+  h.nsections = b->nsections;
+  h.nentries = b->nentries;
+  h.index_size = index_size;
+  h.source_size = st->st_size;
+  h.source_mtime = mtime_ns(st);
+  h.source_ino = st->st_ino;
+  h.source_dev = st->st_dev;
+  h.strings_size = b->strings_size;
+
+  iov[0].iov_base = &h;
+  iov[0].iov_len = sizeof(h);
+  iov[1].iov_base = b->sections;
+  iov[1].iov_len = b->nsections * sizeof(*b->sections);
+  iov[2].iov_base = b->entries;
+  iov[2].iov_len = b->nentries * sizeof(*b->entries);
+  iov[3].iov_base = index;
+  iov[3].iov_len = index_size * sizeof(*index);
+  iov[4].iov_base = (void *)zeros;
+  iov[4].iov_len = pad8(iov[3].iov_len) - iov[3].iov_len;
+  iov[5].iov_base = b->strings;
+  iov[5].iov_len = b->strings_size;
+  h.checksum = checksum(iov + 1, 5);
+
+  path = cache_path(pathname);
+  if (!path)
+    goto err;
+  tmp = (char *)malloc(strlen(path) + sizeof(".XXXXXX"));
+  if (!tmp)
+    goto err;
+  sprintf(tmp, "%s.XXXXXX", path);
+
+  /* A new file, renamed over the old one: see confcache.h. */
+  fd = mkstemp(tmp);
+  if (fd < 0)
+    goto err;
+  /* Never more readable than the source: the values are in it. */
+  if (fchmod(fd, st->st_mode & 0666) < 0 || write_all(fd, iov, 6) < 0)
+    goto err_unlink;
+  if (close(fd) < 0) {
+    fd = -1;
+    goto err_unlink;
+  }
+  fd = -1;
+  if (rename(tmp, path) < 0)
+    goto err_unlink;
+
+  free(tmp);
+  free(path);
+  free(index);
+  return 0;
+
+ err_unlink:
+  saved_errno = errno;
+  if (fd >= 0)
+    close(fd);
+  unlink(tmp);
+  errno = saved_errno;
+ err:
+  saved_errno = errno;
+  free(tmp);
+  free(path);
+  free(index);
+  errno = saved_errno;
+  return -1;
+}
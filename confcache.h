@@ -0,0 +1,161 @@
+/* confcache: precompiled binary images of configuration files
+ * Copyright (C) 2014  Seong-Kook Shin <cinsky@gmail.com>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Library General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Library General Public License for more details.
+ *
+ * You should have received a copy of the GNU Library General Public
+ * License along with this library; if not, write to the Free
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+#ifndef CONFCACHE_H__
+#define CONFCACHE_H__
+
+#include <stddef.h>
+#include <sys/stat.h>
+
+/* This indirect using of extern "C" { ... } makes Emacs happy */
+#ifndef BEGIN_C_DECLS
+# ifdef __cplusplus
+#  define BEGIN_C_DECLS extern "C" {
+#  define END_C_DECLS   }
+# else
+#  define BEGIN_C_DECLS
+#  define END_C_DECLS
+# endif
+#endif /* BEGIN_C_DECLS */
+
+BEGIN_C_DECLS
+
+/*
+ * A program that parses the same large configuration file at every
+ * start can keep the parsed result in an image next to the file,
+ * PATHNAME.cache, and map the image at the next start instead, as
+ * long as the file did not change.  conf_load() with CF_CACHE,
+ * properties_load_cached() and inifile::load(pathname, true) do so:
+ *
+ *   struct stat st;
+ *
+ *   cc = confcache_open(pathname, CONFCACHE_CONF);
+ *   if (!cc) {
+ *     stat(pathname, &st);           // before parsing it
+ *     ... parse PATHNAME ...
+ *     b = confcache_builder_new(CONFCACHE_CONF);
+ *     for each section:
+ *       confcache_add_section(b, section, slen);   // if it may be empty
+ *       for each parameter in it:
+ *         confcache_add(b, section, slen, key, klen, value, vlen);
+ *     confcache_write(b, pathname, &st);
+ *     confcache_builder_free(b);
+ *   }
+ *
+ * The image has a header, the sections, the parameters, an open
+ * addressing index over (section, key), and the strings, each
+ * null-terminated.  It is mapped read-only and shared, so the
+ * processes that load the same file share its pages, and it is read
+ * in place; nothing is parsed or copied.
+ *
+ * confcache_open() takes the image only if its version, kind and
+ * byte order are ours, its checksum is right, and the size, mtime,
+ * inode and device of PATHNAME are the ones it was written for.  As
+ * anyone who can stat(2) PATHNAME can make such an image, it must
+ * also be a regular file owned by us or by the owner of PATHNAME, and
+ * not writable by the group or others unless PATHNAME is as well.
+ * Otherwise it returns NULL, and the caller parses PATHNAME, and
+ * writes a new image.  The image is written to a temporary file that
+ * is renamed over the old one, so a reader never sees half of it.  It
+ * gets the permission bits of PATHNAME, so it is never more readable
+ * than the file whose values it holds.  A directory that cannot be
+ * written is not an error, just no cache.
+ *
+ * conf.c, properties.c and inifile.cc use it, so they need it too,
+ * even without the cache; it also builds as C++:
+ *
+ *   $ cc ... conf.c confcache.c
+ *   $ c++ ... inifile.cc iniview.cc confcache.c
+ */
+
+#define CONFCACHE_VERSION       1
+
+enum {
+  CONFCACHE_CONF = 1,
+  CONFCACHE_PROPERTIES,
+  CONFCACHE_INIFILE,
+};
+
+struct confcache_;
+typedef struct confcache_ confcache_t;
+
+struct confcache_builder_;
+typedef struct confcache_builder_ confcache_builder_t;
+
+/* Map the image of PATHNAME of KIND, or return NULL. */
+extern confcache_t *confcache_open(const char *pathname, int kind);
+extern void confcache_close(confcache_t *cc);
+
+/* The number of parameters, and of sections */
+extern size_t confcache_count(const confcache_t *cc);
+extern size_t confcache_nsections(const confcache_t *cc);
+
+/*
+ * The name of the section S, and the range [*FIRST, *FIRST + count)
+ * of its parameters, where count is the return value.
+ */
+extern size_t confcache_section(const confcache_t *cc, size_t s,
+                                const char **name, size_t *first);
+
+/*
+ * The parameter I.  Each of SECTION, KEY and VALUE may be NULL, and
+ * each length pointer too.
+ */
+extern void confcache_entry(const confcache_t *cc, size_t i,
+                            const char **section, size_t *section_len,
+                            const char **key, size_t *key_len,
+                            const char **value, size_t *value_len);
+
+/*
+ * Return the index of KEY in SECTION (NULL or "" for none), or -1.
+ * KEY_LEN and SECTION_LEN are the lengths of the strings.
+ */
+extern long confcache_find(const confcache_t *cc,
+                           const char *section, size_t section_len,
+                           const char *key, size_t key_len);
+
+extern confcache_builder_t *confcache_builder_new(int kind);
+extern void confcache_builder_free(confcache_builder_t *b);
+
+/*
+ * Start SECTION (NULL for none) in B, so that it is in the image even
+ * if no parameter is added to it.  Returns 0, or -1 as below.
+ */
+extern int confcache_add_section(confcache_builder_t *b,
+                                 const char *section, size_t section_len);
+
+/*
+ * Add the parameter KEY = VALUE in SECTION (NULL for none) to B.  The
+ * parameters of a section must be added one after another; a key
+ * must not be added twice to a section.  Returns 0, or -1 if out of
+ * memory, or if the strings exceed 4 GiB.
+ */
+extern int confcache_add(confcache_builder_t *b,
+                         const char *section, size_t section_len,
+                         const char *key, size_t key_len,
+                         const char *value, size_t value_len);
+
+/*
+ * Write the image of B for PATHNAME, whose stat(2) before it was
+ * parsed is ST.  Returns 0 or -1 with errno.
+ */
+extern int confcache_write(confcache_builder_t *b, const char *pathname,
+                           const struct stat *st);
+
+END_C_DECLS
+
+#endif  /* CONFCACHE_H__ */
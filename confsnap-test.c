@@ -0,0 +1,553 @@
+/*
+ * Test and benchmark of confsnap
+ *
+ *   $ cc -O2 -D_GNU_SOURCE -o confsnap-test confsnap-test.c confsnap.c \
+ *       rbsync.c -lpthread
+ *   $ ./confsnap-test [NPARAMS]
+ *
+ * The test checks the conversions, the defaults, overriding, the
+ * errors, and the lookup of every parameter of a snapshot of NPARAMS
+ * (100k by default) parameters, and of as many that are not there,
+ * and the changes that confsnap_diff() reports between snapshots.
+ *
+ * The snapshot test runs reader threads that check that two
+ * parameters of a snapshot always add up to the same sum while a
+ * writer builds and publishes new snapshots.
+ *
+ * The benchmark reads 8 integer parameters per "request", with the
+ * typed accessors of a pinned snapshot, and by name with
+ * confsnap_find() and strtoll(), as a program does with a string map.
+ */
+#include <errno.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "conf.h"
+#include "properties.h"
+#include "confsnap.h"
+#include "difftime.h"
+
+/* The adaptors must fit conf_enum() and properties_enum(). */
+static conf_enum_proc conf_adaptor = confsnap_conf_proc;
+static int (*properties_adaptor)(const char *, const char *, void *) =
+  confsnap_properties_proc;
+
+static int
+test_types(void)
+{
+  static const struct {
+    int type;
+    const char *text;
+    int ok;
+    long long i;                /* or the size, or the bool */
+    double d;
+  } cases[] = {
+    { CONFSNAP_INT, "42", 1, 42 },
+    { CONFSNAP_INT, " -12 ", 1, -12 },
+    { CONFSNAP_INT, "0x7f", 1, 127 },
+    { CONFSNAP_INT, "017", 1, 15 },
+    { CONFSNAP_INT, "12abc", 0 },
+    { CONFSNAP_INT, "", 0 },
+    { CONFSNAP_INT, "99999999999999999999", 0 },
+    { CONFSNAP_DOUBLE, "2.5", 1, 0, 2.5 },
+    { CONFSNAP_DOUBLE, "-1e3", 1, 0, -1000 },
+    { CONFSNAP_DOUBLE, "1.2.3", 0 },
+    { CONFSNAP_BOOL, "Yes", 1, 1 },
+    { CONFSNAP_BOOL, "on", 1, 1 },
+    { CONFSNAP_BOOL, "TRUE", 1, 1 },
+    { CONFSNAP_BOOL, "0", 1, 0 },
+    { CONFSNAP_BOOL, "off ", 1, 0 },
+    { CONFSNAP_BOOL, "nope", 0 },
+    { CONFSNAP_BOOL, "yes no", 0 },
+    { CONFSNAP_DURATION, "30", 1, 30000000000LL },
+    { CONFSNAP_DURATION, "250ms", 1, 250000000LL },
+    { CONFSNAP_DURATION, "1h30m", 1, 5400000000000LL },
+    { CONFSNAP_DURATION, "2.5s", 1, 2500000000LL },
+    { CONFSNAP_DURATION, "1d 2us", 1, 86400000002000LL },
+    { CONFSNAP_DURATION, "10 20s", 0 },
+    { CONFSNAP_DURATION, "5 minutes", 0 },
+    { CONFSNAP_DURATION, "-5s", 0 },
+    { CONFSNAP_SIZE, "512", 1, 512 },
+    { CONFSNAP_SIZE, "64k", 1, 65536 },
+    { CONFSNAP_SIZE, "10MB", 1, 10485760 },
+    { CONFSNAP_SIZE, "1.5GiB", 1, 1610612736 },
+    { CONFSNAP_SIZE, "3t", 1, 3298534883328LL },
+    { CONFSNAP_SIZE, "8 kb", 1, 8192 },
+    { CONFSNAP_SIZE, "1x", 0 },
+    { CONFSNAP_SIZE, "1ki", 0 },
+    { CONFSNAP_SIZE, "-1", 0 },
+    { CONFSNAP_SIZE, "99999999999999T", 0 },
+  };
+  size_t i;
+
+  for (i = 0; i < sizeof(cases) / sizeof(cases[0]); i++) {
+    confsnap_schema_t *schema = confsnap_schema_new();
+    confsnap_builder_t *b;
+    confsnap_t *sp;
+    char errbuf[128];
+    int slot;
+
+    /* As a default */
+    slot = confsnap_declare(schema, "s", "k", cases[i].type, cases[i].text);
+    if (!cases[i].ok) {
+      if (slot >= 0 || errno != EINVAL)
+        return -1;
+      slot = confsnap_declare(schema, "s", "k", cases[i].type, NULL);
+    }
+    if (slot != 0)
+      return -1;
+
+    /* As a value */
+    b = confsnap_builder_new(schema);
+    if (confsnap_add(b, "s", "k", cases[i].text) != 0)
+      return -1;
+    sp = confsnap_build(b, errbuf, sizeof(errbuf));
+    if (!cases[i].ok) {
+      if (sp != NULL)
+        return -1;
+      if (strncmp(errbuf, "[s] k: invalid ", 15) != 0)
+        return -1;
+      confsnap_schema_free(schema);
+      continue;
+    }
+    if (sp == NULL)
+      return -1;
+    if (strcmp(confsnap_string(sp, slot), cases[i].text) != 0)
+      return -1;
+    switch (cases[i].type) {
+    case CONFSNAP_INT:
+      if (confsnap_int(sp, slot) != cases[i].i)
+        return -1;
+      break;
+    case CONFSNAP_DOUBLE:
+      if (confsnap_double(sp, slot) != cases[i].d)
+        return -1;
+      break;
+    case CONFSNAP_BOOL:
+      if (confsnap_bool(sp, slot) != cases[i].i)
+        return -1;
+      break;
+    case CONFSNAP_DURATION:
+      if (confsnap_duration(sp, slot) != cases[i].i)
+        return -1;
+      break;
+    case CONFSNAP_SIZE:
+      if (confsnap_size(sp, slot) != (unsigned long long)cases[i].i)
+        return -1;
+      break;
+    }
+    confsnap_unpin(sp);
+    confsnap_schema_free(schema);
+  }
+  return 0;
+}
+
+
+static int
+test_build(size_t nparams)
+{
+  confsnap_schema_t *schema = confsnap_schema_new();
+  confsnap_builder_t *b;
+  confsnap_t *sp;
+  const struct confsnap_value *v;
+  char errbuf[128], key[64], value[64];
+  int port, host, timeout, debug, max, prop;
+  size_t i;
+
+  port = confsnap_declare(schema, "db", "port", CONFSNAP_INT, "5432");
+  host = confsnap_declare(schema, "db", "host", CONFSNAP_STRING, "localhost");
+  timeout = confsnap_declare(schema, "db", "timeout",
+                             CONFSNAP_DURATION, "30s");
+  debug = confsnap_declare(schema, NULL, "debug", CONFSNAP_BOOL, NULL);
+  max = confsnap_declare(schema, "", "max.size", CONFSNAP_SIZE, "1m");
+  prop = confsnap_declare(schema, NULL, "app.name", CONFSNAP_STRING, NULL);
+  if (port != 0 || host != 1 || timeout != 2 || debug != 3 || max != 4)
+    return -1;
+  if (confsnap_declare(schema, "db", "port", CONFSNAP_INT, NULL) != port)
+    return -1;
+  if (confsnap_declare(schema, "db", "port", CONFSNAP_BOOL, NULL) >= 0)
+    return -1;
+
+  /* Nothing loaded: the defaults */
+  sp = confsnap_build(confsnap_builder_new(schema), errbuf, sizeof(errbuf));
+  if (sp == NULL)
+    return -1;
+  if (confsnap_count(sp) != 6)
+    return -1;
+  if (confsnap_int(sp, port) != 5432)
+    return -1;
+  if (strcmp(confsnap_string(sp, host), "localhost") != 0)
+    return -1;
+  if (confsnap_duration(sp, timeout) != 30000000000LL)
+    return -1;
+  if (confsnap_string(sp, debug) != NULL || confsnap_bool(sp, debug) != 0)
+    return -1;
+  if (confsnap_size(sp, max) != 1048576)
+    return -1;
+  if (confsnap_string(sp, prop) != NULL)
+    return -1;
+  if (confsnap_find(sp, "db", "port") != confsnap_value(sp, port))
+    return -1;
+  if (confsnap_find(sp, "", "debug") != confsnap_value(sp, debug))
+    return -1;
+  if (confsnap_find(sp, "db", "user") != NULL)
+    return -1;
+  confsnap_unpin(sp);
+
+  if (confsnap_declare(schema, "db", "user", CONFSNAP_STRING, NULL) >= 0)
+    return -1;
+  if (errno != EBUSY)
+    return -1;
+
+  b = confsnap_builder_new(schema);
+  if (conf_adaptor("db", "port", "6543", 0, b) != 0)
+    return -1;
+  if (conf_adaptor("db", "user", "admin", 1, b) != 0)
+    return -1;
+  if (properties_adaptor("app.name", "demo", b) != 0)
+    return -1;
+  if (confsnap_add(b, NULL, "debug", "yes") != 0)
+    return -1;
+  if (confsnap_addn(b, "dbx", 2, "hostname", 4, "db.example.com", 14) != 0)
+    return -1;
+  for (i = 0; i < nparams; i++) {
+    snprintf(key, sizeof(key), "key.%zu", i);
+    snprintf(value, sizeof(value), "value %zu", i);
+    if (confsnap_add(b, "many", key, value) != 0)
+      return -1;
+  }
+  /* Later ones win. */
+  if (confsnap_add(b, "db", "user", "root") != 0)
+    return -1;
+  if (confsnap_add(b, "many", "key.0", "zero") != 0)
+    return -1;
+  sp = confsnap_build(b, errbuf, sizeof(errbuf));
+  if (sp == NULL)
+    return -1;
+
+  if (confsnap_count(sp) != 7 + nparams)
+    return -1;
+  if (confsnap_int(sp, port) != 6543)
+    return -1;
+  if (strcmp(confsnap_string(sp, host), "db.example.com") != 0)
+    return -1;
+  if (confsnap_value(sp, host)->len != 14)
+    return -1;
+  if (confsnap_bool(sp, debug) != 1)
+    return -1;
+  if (strcmp(confsnap_string(sp, prop), "demo") != 0)
+    return -1;
+  v = confsnap_find(sp, "db", "user");
+  if (!v || strcmp(v->str, "root") != 0)
+    return -1;
+  v = confsnap_find(sp, "many", "key.0");
+  if (!v || strcmp(v->str, "zero") != 0)
+    return -1;
+  for (i = 1; i < nparams; i++) {
+    snprintf(key, sizeof(key), "key.%zu", i);
+    snprintf(value, sizeof(value), "value %zu", i);
+    v = confsnap_find(sp, "many", key);
+    if (!v || strcmp(v->str, value) != 0)
+      return -1;
+    if (confsnap_find(sp, "many.", key) != NULL)
+      return -1;
+    snprintf(key, sizeof(key), "key.%zu", i + nparams);
+    if (confsnap_find(sp, "many", key) != NULL)
+      return -1;
+  }
+  confsnap_unpin(sp);
+
+  /* A value that does not convert fails the build. */
+  b = confsnap_builder_new(schema);
+  confsnap_add(b, "db", "port", "http");
+  if (confsnap_build(b, errbuf, sizeof(errbuf)) != NULL)
+    return -1;
+  if (strcmp(errbuf, "[db] port: invalid integer 'http'") != 0)
+    return -1;
+  b = confsnap_builder_new(schema);
+  confsnap_add(b, NULL, "debug", "maybe");
+  if (confsnap_build(b, errbuf, sizeof(errbuf)) != NULL)
+    return -1;
+  if (strcmp(errbuf, "debug: invalid boolean 'maybe'") != 0)
+    return -1;
+
+  confsnap_schema_free(schema);
+  return 0;
+}
+
+
+/* The changes that confsnap_diff() reports, as "[s] k: old -> new" */
+struct changes {
+  char text[512];
+  size_t len;
+};
+
+static int
+record_change(const char *section, const char *key,
+              const struct confsnap_value *old_value,
+              const struct confsnap_value *new_value, void *data)
+{
+  struct changes *c = data;
+
+  c->len += snprintf(c->text + c->len, sizeof(c->text) - c->len,
+                     "[%s] %s: %s -> %s\n", section, key,
+                     (old_value) ? old_value->str : "NULL",
+                     (new_value) ? new_value->str : "NULL");
+  return (c->len < sizeof(c->text)) ? 0 : -1;
+}
+
+
+static int
+test_diff(void)
+{
+  confsnap_schema_t *schema = confsnap_schema_new();
+  confsnap_builder_t *b;
+  confsnap_t *s1, *s2, *s3;
+  struct changes c;
+  char errbuf[128];
+
+  confsnap_declare(schema, "db", "port", CONFSNAP_INT, "5432");
+  confsnap_declare(schema, "db", "user", CONFSNAP_STRING, NULL);
+
+  b = confsnap_builder_new(schema);
+  confsnap_add(b, "db", "x", "1");
+  s1 = confsnap_build(b, errbuf, sizeof(errbuf));
+
+  b = confsnap_builder_new(schema);
+  confsnap_add(b, "db", "port", "6543");
+  confsnap_add(b, "db", "user", "admin");
+  confsnap_add(b, "db", "y", "2");
+  s2 = confsnap_build(b, errbuf, sizeof(errbuf));
+
+  /* "user" is dropped: declared, but without a default. */
+  b = confsnap_builder_new(schema);
+  confsnap_add(b, "db", "port", "6543");
+  confsnap_add(b, "db", "y", "2");
+  s3 = confsnap_build(b, errbuf, sizeof(errbuf));
+  if (!s1 || !s2 || !s3)
+    return -1;
+
+  c.len = 0;
+  c.text[0] = '\0';
+  if (confsnap_diff(NULL, s1, record_change, &c) != 2 ||
+      strcmp(c.text, "[db] port: NULL -> 5432\n[db] x: NULL -> 1\n") != 0)
+    return -1;
+
+  c.len = 0;
+  if (confsnap_diff(s1, s2, record_change, &c) != 4 ||
+      strcmp(c.text, "[db] port: 5432 -> 6543\n[db] user: NULL -> admin\n"
+             "[db] y: NULL -> 2\n[db] x: 1 -> NULL\n") != 0)
+    return -1;
+
+  c.len = 0;
+  if (confsnap_diff(s2, s3, record_change, &c) != 1 ||
+      strcmp(c.text, "[db] user: admin -> NULL\n") != 0)
+    return -1;
+
+  if (confsnap_diff(s3, s3, NULL, NULL) != 0 ||
+      confsnap_diff(s3, s1, NULL, NULL) != 3)
+    return -1;
+
+  confsnap_unpin(s1);
+  confsnap_unpin(s2);
+  confsnap_unpin(s3);
+  confsnap_schema_free(schema);
+  return 0;
+}
+
+
+/*
+ * The readers check that "a" + "b" is always 1000 in a snapshot, and
+ * that the versions never go back.
+ */
+#define NREADERS        3
+
+static confsnap_schema_t *shared;
+static int slot_a, slot_b;
+static volatile int done;
+static volatile int failed;
+
+static void *
+reader(void *arg)
+{
+  confsnap_t *sp = NULL;
+  unsigned long last = 0, reads = 0;
+
+  (void)arg;
+  while (!done) {
+    sp = confsnap_refresh(shared, sp);
+    if (!sp ||
+        confsnap_int(sp, slot_a) + confsnap_int(sp, slot_b) != 1000 ||
+        confsnap_version(sp) < last) {
+      failed = 1;
+      break;
+    }
+    last = confsnap_version(sp);
+    reads++;
+  }
+  confsnap_unpin(sp);
+  return (void *)reads;
+}
+
+
+static int
+test_threads(void)
+{
+  pthread_t tid[NREADERS];
+  char errbuf[128], a[32], b[32];
+  confsnap_builder_t *bld;
+  confsnap_t *sp;
+  unsigned long reads = 0;
+  void *ret;
+  int i, n;
+
+  shared = confsnap_schema_new();
+  slot_a = confsnap_declare(shared, "acct", "a", CONFSNAP_INT, "1000");
+  slot_b = confsnap_declare(shared, "acct", "b", CONFSNAP_INT, "0");
+  sp = confsnap_build(confsnap_builder_new(shared), errbuf, sizeof(errbuf));
+  confsnap_publish(shared, sp);
+
+  for (n = 0; n < NREADERS; n++)
+    if (pthread_create(tid + n, NULL, reader, NULL) != 0) {
+      failed = 1;
+      break;
+    }
+
+  for (i = 1; i <= 2000 && !failed; i++) {
+    bld = confsnap_builder_new(shared);
+    snprintf(a, sizeof(a), "%d", 1000 - i % 1000);
+    snprintf(b, sizeof(b), "%d", i % 1000);
+    confsnap_add(bld, "acct", "a", a);
+    confsnap_add(bld, "acct", "b", b);
+    confsnap_add(bld, "noise", "n", a);
+    sp = confsnap_build(bld, errbuf, sizeof(errbuf));
+    if (!sp) {
+      failed = 1;
+      break;
+    }
+    confsnap_publish(shared, sp);
+  }
+  done = 1;
+  for (i = 0; i < n; i++) {
+    pthread_join(tid[i], &ret);
+    reads += (unsigned long)ret;
+  }
+
+  sp = confsnap_pin(shared);
+  if (confsnap_version(sp) != 2001)
+    failed = 1;
+  confsnap_unpin(sp);
+  confsnap_schema_free(shared);
+  if (failed)
+    return -1;
+  printf("threads: %d readers, %lu reads, 2000 publishes\n",
+         NREADERS, reads);
+  return 0;
+}
+
+
+static int
+bench(long nrequests)
+{
+  static const char *names[8] = {
+    "workers", "backlog", "timeout", "retries",
+    "buffer", "keepalive", "max_body", "log_level",
+  };
+  confsnap_schema_t *schema = confsnap_schema_new();
+  confsnap_builder_t *b = confsnap_builder_new(schema);
+  confsnap_t *sp;
+  char errbuf[128], key[32];
+  int slots[8];
+  long long typed = 0, named = 0, expect = 0;
+  uint64_t t_typed;
+  df_t df;
+  long r;
+  int i;
+
+  for (i = 0; i < 8; i++) {
+    slots[i] = confsnap_declare(schema, "server", names[i],
+                                CONFSNAP_INT, "0");
+    snprintf(key, sizeof(key), "%d", 1000 + i * 37);
+    confsnap_add(b, "server", names[i], key);
+    expect += 1000 + i * 37;
+  }
+  for (i = 0; i < 1000; i++) {
+    snprintf(key, sizeof(key), "other.%d", i);
+    confsnap_add(b, "server", key, "x");
+  }
+  sp = confsnap_build(b, errbuf, sizeof(errbuf));
+  if (!sp) {
+    fprintf(stderr, "confsnap-test: %s\n", errbuf);
+    return -1;
+  }
+  confsnap_publish(schema, sp);
+  sp = NULL;
+
+  DF(df) {
+    for (r = 0; r < nrequests; r++) {
+      sp = confsnap_refresh(schema, sp);
+      for (i = 0; i < 8; i++)
+        typed += confsnap_int(sp, slots[i]);
+    }
+  }
+  t_typed = df.value;
+
+  DF(df) {
+    for (r = 0; r < nrequests; r++) {
+      sp = confsnap_refresh(schema, sp);
+      for (i = 0; i < 8; i++)
+        named += strtoll(confsnap_find(sp, "server", names[i])->str, NULL, 0);
+    }
+  }
+  confsnap_unpin(sp);
+  confsnap_schema_free(schema);
+
+  if (typed != expect * nrequests || named != expect * nrequests) {
+    fprintf(stderr, "confsnap-test: bench: wrong sums\n");
+    return -1;
+  }
+  printf("8 parameters/request: typed %6.1f ns, by name %6.1f ns\n",
+         (double)t_typed / nrequests, (double)df.value / nrequests);
+  return 0;
+}
+
+
+int
+main(int argc, char *argv[])
+{
+  size_t nparams = (argc > 1) ? strtoul(argv[1], NULL, 0) : 100000;
+  confsnap_schema_t *schema;
+  confsnap_builder_t *b;
+  confsnap_t *sp = NULL;
+  char errbuf[128], key[32];
+  df_t df;
+  size_t i;
+
+  if (test_types() < 0 || test_build(nparams) < 0 || test_diff() < 0 ||
+      test_threads() < 0) {
+    fprintf(stderr, "confsnap-test: test failed\n");
+    return 1;
+  }
+  printf("confsnap-test: test passed\n");
+
+  schema = confsnap_schema_new();
+  b = confsnap_builder_new(schema);
+  for (i = 0; i < nparams; i++) {
+    snprintf(key, sizeof(key), "key.%zu", i);
+    confsnap_add(b, "section", key, key);
+  }
+  DF(df) {
+    sp = confsnap_build(b, errbuf, sizeof(errbuf));
+  }
+  if (!sp) {
+    fprintf(stderr, "confsnap-test: %s\n", errbuf);
+    return 1;
+  }
+  printf("build: %zu parameters in %.1f ms\n", nparams, df.value / 1e6);
+  confsnap_unpin(sp);
+  confsnap_schema_free(schema);
+
+  return (bench(10000000) < 0) ? 1 : 0;
+}
@@ -0,0 +1,1006 @@
+/* confsnap: compiled, immutable configuration snapshots
+ * Copyright (C) 2014  Seong-Kook Shin <cinsky@gmail.com>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Library General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Library General Public License for more details.
+ *
+ * You should have received a copy of the GNU Library General Public
+ * License along with this library; if not, write to the Free
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+#include <ctype.h>
+#include <errno.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+
+#include "rbsync.h"
+#include "confsnap.h"
+
+/*
+ * A snapshot is one malloc()ed block:
+ *
+ *   struct confsnap_
+ *   values[N]          struct confsnap_value, by slot
+ *   keys[N]            struct snapkey, by slot
+ *   disp[NBUCKETS]     the displacements of the perfect hash
+ *   table[NPOS]        slot + 1 at each position, or 0
+ *   the strings
+ *
+ * where the declared parameters come first, in the order of their
+ * declarations, then the others, in the order they were added.
+ *
+ * The perfect hash is "hash and displace": the keys are put in
+ * NBUCKETS (about N / 4) buckets by their hash, and for each bucket,
+ * largest first, the build looks for a displacement D that sends all
+ * of its keys to free positions, which are
+ *
+ *   mix64(hash + D * GOLDEN) & (NPOS - 1)
+ *
+ * A lookup is one hash of the name, two loads, and one comparison.
+ */
+
+#define GOLDEN          0x9e3779b97f4a7c15ULL
+
+/* Give up a table size after this many displacements for a bucket. */
+#define MAX_DISP        (1U << 16)
+
+struct snapkey {
+  uint64_t hash;
+  const char *section;
+  const char *key;
+  size_t section_len;
+  size_t key_len;
+};
+
+struct confsnap_ {
+  struct confsnap_head_ head;
+  unsigned long refs;
+  size_t n;                     /* number of the parameters */
+  size_t bmask;                 /* number of the buckets - 1 */
+  size_t pmask;                 /* number of the positions - 1 */
+  const uint32_t *disp;
+  const uint32_t *table;
+  const struct snapkey *keys;
+};
+
+struct decl {
+  uint64_t hash;
+  char *section;
+  char *key;
+  size_t section_len;
+  size_t key_len;
+  int type;
+  struct confsnap_value def;    /* DEF.STR is malloc()ed */
+};
+
+struct confsnap_schema_ {
+  struct decl *decl;
+  size_t ndecl;
+  size_t decl_size;
+  int frozen;                   /* nonzero after the first build */
+
+  struct confsnap_ *snap;       /* the last published snapshot */
+  unsigned long version;
+};
+
+struct bent {
+  uint64_t hash;
+  size_t section;               /* offsets into the pool */
+  size_t key;
+  size_t value;
+  size_t section_len;
+  size_t key_len;
+  size_t value_len;
+};
+
+struct confsnap_builder_ {
+  confsnap_schema_t *schema;
+
+  char *pool;                   /* the strings, null-terminated */
+  size_t pool_len;
+  size_t pool_size;
+
+  struct bent *ent;
+  size_t nent;
+  size_t ent_size;
+
+  uint32_t *index;              /* entry + 1, or 0; open addressing */
+  size_t index_size;            /* a power of two */
+
+  int nomem;
+};
+
+
+static __inline__ uint64_t
+mix64(uint64_t h)
+{
+  h ^= h >> 33;
+  h *= 0xff51afd7ed558ccdULL;
+  h ^= h >> 33;
+  h *= 0xc4ceb9fe1a85ec53ULL;
+  h ^= h >> 33;
+  return h;
+}
+
+
+/* FNV-1a of SECTION, a separator, and KEY */
+static uint64_t
+key_hash(const char *section, size_t section_len,
+         const char *key, size_t key_len)
+{
+  uint64_t h = 0xcbf29ce484222325ULL;
+  size_t i;
+
+  for (i = 0; i < section_len; i++)
+    h = (h ^ (unsigned char)section[i]) * 0x100000001b3ULL;
+  h = (h ^ 0xff) * 0x100000001b3ULL;
+  for (i = 0; i < key_len; i++)
+    h = (h ^ (unsigned char)key[i]) * 0x100000001b3ULL;
+  return mix64(h);
+}
+
+
+static __inline__ size_t
+position(uint64_t hash, uint32_t disp, size_t pmask)
+{
+  return mix64(hash + disp * GOLDEN) & pmask;
+}
+
+
+static size_t
+pow2_at_least(size_t n)
+{
+  size_t p = 1;
+
+  while (p < n)
+    p <<= 1;
+  return p;
+}
+
+
+static __inline__ const char *
+skip_space(const char *p)
+{
+  while (isspace((unsigned char)*p))
+    p++;
+  return p;
+}
+
+
+/*
+ * Convert the null-terminated S of TYPE into V.  Returns 0, or -1
+ * with *WHAT set to the name of the type.
+ */
+static int
+parse_value(int type, const char *s, struct confsnap_value *v,
+            const char **what)
+{
+  static const char *const yes[] = { "true", "yes", "on", "1" };
+  static const char *const no[] = { "false", "no", "off", "0" };
+  static const struct {
+    const char *unit;
+    double ns;
+  } units[] = {
+    { "ns", 1 }, { "us", 1e3 }, { "ms", 1e6 }, { "s", 1e9 },
+    { "m", 60e9 }, { "h", 3600e9 }, { "d", 86400e9 },
+  };
+  const char *p;
+  char *end;
+  double d, total;
+  unsigned long long n;
+  size_t i, len;
+  int shift;
+
+  memset(&v->u, 0, sizeof(v->u));
+  errno = 0;
+
+  switch (type) {
+  case CONFSNAP_STRING:
+    return 0;
+
+  case CONFSNAP_INT:
+    *what = "integer";
+    v->u.i = strtoll(s, &end, 0);
+    if (end == s || *skip_space(end) != '\0' || errno == ERANGE)
+      return -1;
+    return 0;
+
+  case CONFSNAP_DOUBLE:
+    *what = "number";
+    v->u.d = strtod(s, &end);
+    if (end == s || *skip_space(end) != '\0' || errno == ERANGE)
+      return -1;
+    return 0;
+
+  case CONFSNAP_BOOL:
+    *what = "boolean";
+    p = skip_space(s);
+    for (len = 0; p[len] && !isspace((unsigned char)p[len]); len++)
+      ;
+    if (*skip_space(p + len) != '\0')
+      return -1;
+    for (i = 0; i < sizeof(yes) / sizeof(yes[0]); i++) {
+      if (strlen(yes[i]) == len && strncasecmp(p, yes[i], len) == 0) {
+        v->u.b = 1;
+        return 0;
+      }
+      if (strlen(no[i]) == len && strncasecmp(p, no[i], len) == 0) {
+        v->u.b = 0;
+        return 0;
+      }
+    }
+    return -1;
+
+  case CONFSNAP_DURATION:
+    *what = "duration";
+    p = skip_space(s);
+    total = 0;
+    do {
+      p = skip_space(p);
+      if (!isdigit((unsigned char)*p) && *p != '.')
+        return -1;
+      d = strtod(p, &end);
+      if (end == p)
+        return -1;
+      for (len = 0; isalpha((unsigned char)end[len]); len++)
+        ;
+      if (len == 0) {
+        /* Only a lone number may go without a unit. */
+        if (p != skip_space(s) || *skip_space(end) != '\0')
+          return -1;
+        total = d * 1e9;
+      }
+      else {
+        for (i = 0; i < sizeof(units) / sizeof(units[0]); i++)
+          if (strlen(units[i].unit) == len &&
+              strncmp(end, units[i].unit, len) == 0)
+            break;
+        if (i == sizeof(units) / sizeof(units[0]))
+          return -1;
+        total += d * units[i].ns;
+      }
+      p = end + len;
+    } while (*skip_space(p) != '\0');
+    if (total >= 9.2e18)
+      return -1;
+    v->u.i = (long long)(total + 0.5);
+    return 0;
+
+  case CONFSNAP_SIZE:
+    *what = "size";
+    p = skip_space(s);
+    if (!isdigit((unsigned char)*p) && *p != '.')
+      return -1;
+    /* Whole numbers are exact; the others go through a double. */
+    n = strtoull(p, &end, 10);
+    if (*end == '.' || *end == 'e' || *end == 'E') {
+      d = strtod(p, &end);
+      n = 0;
+    }
+    else {
+      if (errno == ERANGE)
+        return -1;
+      d = -1;
+    }
+    end = (char *)skip_space(end);
+    switch (tolower((unsigned char)*end)) {
+    case 'k': shift = 10; end++; break;
+    case 'm': shift = 20; end++; break;
+    case 'g': shift = 30; end++; break;
+    case 't': shift = 40; end++; break;
+    default:  shift = 0;         break;
+    }
+    if (shift && tolower((unsigned char)*end) == 'i') {
+      end++;
+      if (tolower((unsigned char)*end) != 'b')
+        return -1;
+    }
+    if (tolower((unsigned char)*end) == 'b')
+      end++;
+    if (*skip_space(end) != '\0')
+      return -1;
+
+    if (d >= 0) {
+      d *= (double)(1ULL << shift);
+      if (d >= 1.8e19)
+        return -1;
+      v->u.size = (unsigned long long)(d + 0.5);
+    }
+    else {
+      if (shift && n > (~0ULL >> shift))
+        return -1;
+      v->u.size = n << shift;
+    }
+    return 0;
+
+  default:
+    *what = "type";
+    return -1;
+  }
+}
+
+
+confsnap_schema_t *
+confsnap_schema_new(void)
+{
+  return calloc(1, sizeof(confsnap_schema_t));
+}
+
+
+static void
+snapshot_unref(struct confsnap_ *sp)
+{
+  if (__atomic_sub_fetch(&sp->refs, 1, __ATOMIC_ACQ_REL) == 0)
+    free(sp);
+}
+
+
+void
+confsnap_schema_free(confsnap_schema_t *schema)
+{
+  size_t i;
+
+  for (i = 0; i < schema->ndecl; i++) {
+    free(schema->decl[i].section);
+    free(schema->decl[i].key);
+    free((char *)schema->decl[i].def.str);
+  }
+  free(schema->decl);
+  if (schema->snap)
+    snapshot_unref(schema->snap);
+  free(schema);
+}
+
+
+static char *
+memdup(const char *s, size_t len)
+{
+  char *p = malloc(len + 1);
+
+  if (p) {
+    memcpy(p, s, len);
+    p[len] = '\0';
+  }
+  return p;
+}
+
+
+int
+confsnap_declare(confsnap_schema_t *schema, const char *section,
+                 const char *key, int type, const char *def)
+{
+  struct decl *d;
+  size_t section_len, key_len, i;
+  const char *what;
+  uint64_t hash;
+
+  if (schema->frozen) {
+    errno = EBUSY;
+    return -1;
+  }
+  if (type < CONFSNAP_STRING || type > CONFSNAP_SIZE) {
+    errno = EINVAL;
+    return -1;
+  }
+  if (!section)
+    section = "";
+  section_len = strlen(section);
+  key_len = strlen(key);
+  hash = key_hash(section, section_len, key, key_len);
+
+  for (i = 0; i < schema->ndecl; i++) {
+    d = schema->decl + i;
+    if (d->hash == hash && strcmp(d->section, section) == 0 &&
+        strcmp(d->key, key) == 0) {
+      if (d->type != type) {
+        errno = EINVAL;
+        return -1;
+      }
+      return i;
+    }
+  }
+
+  if (schema->ndecl == schema->decl_size) {
+    size_t size = (schema->decl_size) ? schema->decl_size * 2 : 16;
+    d = realloc(schema->decl, sizeof(*d) * size);
+    if (!d)
+      return -1;
+    schema->decl = d;
+    schema->decl_size = size;
+  }
+
+  d = schema->decl + schema->ndecl;
+  memset(d, 0, sizeof(*d));
+  if (def && parse_value(type, def, &d->def, &what) < 0) {
+    errno = EINVAL;
+    return -1;
+  }
+  d->hash = hash;
+  d->section = memdup(section, section_len);
+  d->key = memdup(key, key_len);
+  if (def) {
+    d->def.len = strlen(def);
+    d->def.str = memdup(def, d->def.len);
+  }
+  if (!d->section || !d->key || (def && !d->def.str)) {
+    free(d->section);
+    free(d->key);
+    free((char *)d->def.str);
+    errno = ENOMEM;
+    return -1;
+  }
+  d->section_len = section_len;
+  d->key_len = key_len;
+  d->type = type;
+  return schema->ndecl++;
+}
+
+
+confsnap_builder_t *
+confsnap_builder_new(confsnap_schema_t *schema)
+{
+  confsnap_builder_t *b = calloc(1, sizeof(*b));
+
+  if (b)
+    b->schema = schema;
+  return b;
+}
+
+
+void
+confsnap_builder_free(confsnap_builder_t *b)
+{
+  if (!b)
+    return;
+  free(b->pool);
+  free(b->ent);
+  free(b->index);
+  free(b);
+}
+
+
+static int
+pool_add(confsnap_builder_t *b, const char *s, size_t len, size_t *offset)
+{
+  if (b->pool_len + len + 1 > b->pool_size) {
+    size_t size = (b->pool_size) ? b->pool_size : 4096;
+    char *p;
+
+    while (size < b->pool_len + len + 1)
+      size *= 2;
+    p = realloc(b->pool, size);
+    if (!p)
+      return -1;
+    b->pool = p;
+    b->pool_size = size;
+  }
+  memcpy(b->pool + b->pool_len, s, len);
+  b->pool[b->pool_len + len] = '\0';
+  *offset = b->pool_len;
+  b->pool_len += len + 1;
+  return 0;
+}
+
+
+/* Return the index slot of (SECTION, KEY) in B: free, or its entry. */
+static size_t
+builder_slot(const confsnap_builder_t *b, uint64_t hash,
+             const char *section, size_t section_len,
+             const char *key, size_t key_len)
+{
+  size_t mask = b->index_size - 1, i = hash & mask;
+  const struct bent *e;
+
+  while (b->index[i]) {
+    e = b->ent + b->index[i] - 1;
+    if (e->hash == hash &&
+        e->section_len == section_len && e->key_len == key_len &&
+        memcmp(b->pool + e->section, section, section_len) == 0 &&
+        memcmp(b->pool + e->key, key, key_len) == 0)
+      break;
+    i = (i + 1) & mask;
+  }
+  return i;
+}
+
+
+static int
+builder_grow(confsnap_builder_t *b)
+{
+  size_t size = (b->index_size) ? b->index_size * 2 : 64, i, j;
+  uint32_t *index;
+  struct bent *ent;
+
+  ent = realloc(b->ent, sizeof(*ent) * size / 2);
+  if (!ent)
+    return -1;
+  b->ent = ent;
+  b->ent_size = size / 2;
+
+  index = calloc(size, sizeof(*index));
+  if (!index)
+    return -1;
+  for (i = 0; i < b->nent; i++) {
+    for (j = b->ent[i].hash & (size - 1); index[j]; j = (j + 1) & (size - 1))
+      ;
+    index[j] = i + 1;
+  }
+  free(b->index);
+  b->index = index;
+  b->index_size = size;
+  return 0;
+}
+
+
+int
+confsnap_addn(confsnap_builder_t *b,
+              const char *section, size_t section_len,
+              const char *key, size_t key_len,
+              const char *value, size_t value_len)
+{
+  uint64_t hash;
+  struct bent *e;
+  size_t i;
+
+  if (!section)
+    section = "";
+  if (b->nent == b->ent_size && builder_grow(b) < 0)
+    goto nomem;
+
+  hash = key_hash(section, section_len, key, key_len);
+  i = builder_slot(b, hash, section, section_len, key, key_len);
+  if (b->index[i]) {
+    /* Override; the old value stays in the pool. */
+    e = b->ent + b->index[i] - 1;
+    if (pool_add(b, value, value_len, &e->value) < 0)
+      goto nomem;
+    e->value_len = value_len;
+    return 0;
+  }
+
+  e = b->ent + b->nent;
+  e->hash = hash;
+  e->section_len = section_len;
+  e->key_len = key_len;
+  e->value_len = value_len;
+  if (pool_add(b, section, section_len, &e->section) < 0 ||
+      pool_add(b, key, key_len, &e->key) < 0 ||
+      pool_add(b, value, value_len, &e->value) < 0)
+    goto nomem;
+  b->index[i] = ++b->nent;
+  return 0;
+
+ nomem:
+  b->nomem = 1;
+  return -1;
+}
+
+
+int
+confsnap_add(confsnap_builder_t *b, const char *section,
+             const char *key, const char *value)
+{
+  return confsnap_addn(b, section, (section) ? strlen(section) : 0,
+                       key, strlen(key), value, strlen(value));
+}
+
+
+int
+confsnap_conf_proc(const char *section, const char *key, const char *value,
+                   int index, void *builder)
+{
+  (void)index;
+  return confsnap_add(builder, section, key, (value) ? value : "");
+}
+
+
+int
+confsnap_properties_proc(const char *key, const char *value, void *builder)
+{
+  return confsnap_add(builder, NULL, key, (value) ? value : "");
+}
+
+
+static char *
+copy_str(char **p, const char *s, size_t len)
+{
+  char *dst = *p;
+
+  memcpy(dst, s, len);
+  dst[len] = '\0';
+  *p += len + 1;
+  return dst;
+}
+
+
+static int
+bucket_cmp(const void *a, const void *b)
+{
+  const uint32_t *x = a, *y = b;
+
+  /* Largest first; by index for the same size, to be deterministic. */
+  if (x[1] != y[1])
+    return (x[1] < y[1]) ? 1 : -1;
+  return (x[0] > y[0]) - (x[0] < y[0]);
+}
+
+
+/*
+ * Fill DISP and TABLE of SP for its keys.  Returns 0, or -1 if some
+ * bucket did not fit, or out of memory.
+ */
+static int
+perfect_hash(struct confsnap_ *sp, uint32_t *disp, uint32_t *table)
+{
+  size_t nbuckets = sp->bmask + 1, i, j, k, pos[64];
+  uint32_t *order, *start, *members, d;
+  int ret = -1;
+
+  /* ORDER is (bucket, size) pairs; MEMBERS the slots by bucket. */
+  order = calloc(nbuckets * 2, sizeof(uint32_t));
+  start = calloc(nbuckets + 1, sizeof(uint32_t));
+  members = malloc(sizeof(uint32_t) * (sp->n + 1));
+  if (!order || !start || !members)
+    goto out;
+
+  for (i = 0; i < sp->n; i++)
+    start[(sp->keys[i].hash & sp->bmask) + 1]++;
+  for (i = 0; i < nbuckets; i++) {
+    order[i * 2] = i;
+    order[i * 2 + 1] = start[i + 1];
+    start[i + 1] += start[i];
+  }
+  for (i = 0; i < sp->n; i++) {
+    size_t bk = sp->keys[i].hash & sp->bmask;
+    members[start[bk] + --order[bk * 2 + 1]] = i;
+  }
+  for (i = 0; i < nbuckets; i++)
+    order[i * 2 + 1] = start[i + 1] - start[i];
+  qsort(order, nbuckets, sizeof(uint32_t) * 2, bucket_cmp);
+
+  memset(table, 0, sizeof(uint32_t) * (sp->pmask + 1));
+  memset(disp, 0, sizeof(uint32_t) * nbuckets);
+
+  for (i = 0; i < nbuckets && order[i * 2 + 1] > 0; i++) {
+    uint32_t bk = order[i * 2], size = order[i * 2 + 1];
+    const uint32_t *m = members + start[bk];
+
+    if (size > sizeof(pos) / sizeof(pos[0]))
+      goto out;
+    for (d = 0; d < MAX_DISP; d++) {
+      for (j = 0; j < size; j++) {
+        pos[j] = position(sp->keys[m[j]].hash, d, sp->pmask);
+        if (table[pos[j]])
+          break;
+        for (k = 0; k < j; k++)
+          if (pos[k] == pos[j])
+            break;
+        if (k < j)
+          break;
+      }
+      if (j == size)
+        break;
+    }
+    if (d == MAX_DISP)
+      goto out;
+    disp[bk] = d;
+    for (j = 0; j < size; j++)
+      table[pos[j]] = m[j] + 1;
+  }
+  ret = 0;
+
+ out:
+  free(order);
+  free(start);
+  free(members);
+  return ret;
+}
+
+
+confsnap_t *
+confsnap_build(confsnap_builder_t *b, char *errbuf, size_t errsize)
+{
+  confsnap_schema_t *schema = b->schema;
+  struct confsnap_ *sp = NULL;
+  struct confsnap_value *values;
+  struct snapkey *keys;
+  uint32_t *disp, *table;
+  const struct decl *d;
+  const struct bent *e;
+  long *decl_ent = NULL;
+  char *used = NULL, *strings;
+  const char *what;
+  size_t n, i, j, nbuckets, npos, strsize, size;
+
+  schema->frozen = 1;
+  if (errbuf && errsize)
+    errbuf[0] = '\0';
+  if (b->nomem)
+    goto nomem;
+
+  decl_ent = malloc(sizeof(long) * (schema->ndecl + 1));
+  used = calloc(b->nent + 1, 1);
+  if (!decl_ent || !used)
+    goto nomem;
+
+  n = schema->ndecl;
+  strsize = 0;
+  for (i = 0; i < schema->ndecl; i++) {
+    d = schema->decl + i;
+    decl_ent[i] = -1;
+    if (b->nent) {
+      j = builder_slot(b, d->hash, d->section, d->section_len,
+                       d->key, d->key_len);
+      if (b->index[j]) {
+        decl_ent[i] = b->index[j] - 1;
+        used[decl_ent[i]] = 1;
+      }
+    }
+    strsize += d->section_len + d->key_len + 2;
+    if (decl_ent[i] >= 0)
+      strsize += b->ent[decl_ent[i]].value_len + 1;
+    else if (d->def.str)
+      strsize += d->def.len + 1;
+  }
+  for (i = 0; i < b->nent; i++) {
+    if (used[i])
+      continue;
+    e = b->ent + i;
+    strsize += e->section_len + e->key_len + e->value_len + 3;
+    n++;
+  }
+
+  nbuckets = pow2_at_least(n / 4 + 1);
+  npos = pow2_at_least(n + n / 4 + 1);
+
+  for (;;) {
+    size = sizeof(*sp) + sizeof(*values) * n + sizeof(*keys) * n +
+      sizeof(uint32_t) * (nbuckets + npos) + strsize;
+    sp = malloc(size);
+    if (!sp)
+      goto nomem;
+    values = (struct confsnap_value *)(sp + 1);
+    keys = (struct snapkey *)(values + n);
+    disp = (uint32_t *)(keys + n);
+    table = disp + nbuckets;
+    strings = (char *)(table + npos);
+
+    sp->head.values = values;
+    sp->head.version = 0;
+    sp->refs = 1;
+    sp->n = n;
+    sp->bmask = nbuckets - 1;
+    sp->pmask = npos - 1;
+    sp->disp = disp;
+    sp->table = table;
+    sp->keys = keys;
+
+    for (i = 0, j = schema->ndecl; i < schema->ndecl + b->nent; i++) {
+      struct snapkey *k;
+      struct confsnap_value *v;
+
+      if (i < schema->ndecl) {
+        d = schema->decl + i;
+        k = keys + i;
+        v = values + i;
+        k->section = copy_str(&strings, d->section, d->section_len);
+        k->key = copy_str(&strings, d->key, d->key_len);
+        k->section_len = d->section_len;
+        k->key_len = d->key_len;
+        k->hash = d->hash;
+
+        if (decl_ent[i] < 0) {
+          *v = d->def;
+          if (d->def.str)
+            v->str = copy_str(&strings, d->def.str, d->def.len);
+          continue;
+        }
+        e = b->ent + decl_ent[i];
+        v->str = copy_str(&strings, b->pool + e->value, e->value_len);
+        v->len = e->value_len;
+        if (parse_value(d->type, v->str, v, &what) < 0) {
+          if (errbuf && errsize) {
+            if (d->section_len)
+              snprintf(errbuf, errsize, "[%s] %s: invalid %s '%s'",
+                       d->section, d->key, what, v->str);
+            else
+              snprintf(errbuf, errsize, "%s: invalid %s '%s'",
+                       d->key, what, v->str);
+          }
+          goto fail;
+        }
+        continue;
+      }
+
+      if (used[i - schema->ndecl])
+        continue;
+      e = b->ent + (i - schema->ndecl);
+      k = keys + j;
+      v = values + j++;
+      k->section = copy_str(&strings, b->pool + e->section, e->section_len);
+      k->key = copy_str(&strings, b->pool + e->key, e->key_len);
+      k->section_len = e->section_len;
+      k->key_len = e->key_len;
+      k->hash = e->hash;
+      v->str = copy_str(&strings, b->pool + e->value, e->value_len);
+      v->len = e->value_len;
+      memset(&v->u, 0, sizeof(v->u));
+    }
+
+    if (perfect_hash(sp, disp, table) == 0)
+      break;
+    /* Rare: retry with more room. */
+    free(sp);
+    sp = NULL;
+    if (npos > n * 16 + 1024)
+      goto nomem;
+    npos *= 2;
+  }
+
+  free(decl_ent);
+  free(used);
+  confsnap_builder_free(b);
+  return sp;
+
+ nomem:
+  if (errbuf && errsize)
+    snprintf(errbuf, errsize, "out of memory");
+ fail:
+  free(sp);
+  free(decl_ent);
+  free(used);
+  confsnap_builder_free(b);
+  return NULL;
+}
+
+
+static const struct confsnap_value *
+snap_find(const struct confsnap_ *sp, uint64_t hash,
+          const char *section, size_t section_len,
+          const char *key, size_t key_len)
+{
+  const struct snapkey *k;
+  uint32_t slot;
+
+  slot = sp->table[position(hash, sp->disp[hash & sp->bmask], sp->pmask)];
+  if (!slot)
+    return NULL;
+  k = sp->keys + slot - 1;
+  if (k->hash != hash || k->section_len != section_len ||
+      k->key_len != key_len || memcmp(k->key, key, key_len) != 0 ||
+      memcmp(k->section, section, section_len) != 0)
+    return NULL;
+  return sp->head.values + slot - 1;
+}
+
+
+const struct confsnap_value *
+confsnap_find(const confsnap_t *sp, const char *section, const char *key)
+{
+  size_t section_len, key_len;
+
+  if (!section)
+    section = "";
+  section_len = strlen(section);
+  key_len = strlen(key);
+  return snap_find(sp, key_hash(section, section_len, key, key_len),
+                   section, section_len, key, key_len);
+}
+
+
+static int
+value_equal(const struct confsnap_value *a, const struct confsnap_value *b)
+{
+  if (!a->str || !b->str)
+    return a->str == b->str;
+  return a->len == b->len && memcmp(a->str, b->str, a->len) == 0;
+}
+
+
+int
+confsnap_diff(const confsnap_t *old, const confsnap_t *sp,
+              confsnap_diff_proc proc, void *data)
+{
+  const struct confsnap_value *v, *ov;
+  const struct snapkey *k;
+  int n = 0;
+  size_t i;
+
+  /* A declared parameter without a value counts as not there. */
+  for (i = 0; i < sp->n; i++) {
+    k = sp->keys + i;
+    v = sp->head.values + i;
+    ov = (old) ? snap_find(old, k->hash, k->section, k->section_len,
+                           k->key, k->key_len) : NULL;
+    if (ov && !ov->str)
+      ov = NULL;
+    if (!v->str)
+      v = NULL;
+    if (!ov && !v)
+      continue;
+    if (ov && v && value_equal(ov, v))
+      continue;
+    n++;
+    if (proc && proc(k->section, k->key, ov, v, data) < 0)
+      return n;
+  }
+
+  for (i = 0; old && i < old->n; i++) {
+    k = old->keys + i;
+    if (!old->head.values[i].str ||
+        snap_find(sp, k->hash, k->section, k->section_len,
+                  k->key, k->key_len))
+      continue;
+    n++;
+    if (proc && proc(k->section, k->key, old->head.values + i, NULL,
+                     data) < 0)
+      return n;
+  }
+  return n;
+}
+
+
+size_t
+confsnap_count(const confsnap_t *sp)
+{
+  return sp->n;
+}
+
+
+void
+confsnap_publish(confsnap_schema_t *schema, confsnap_t *sp)
+{
+  struct confsnap_ *old = schema->snap;
+
+  sp->head.version = ++schema->version;
+  __atomic_store_n(&schema->snap, sp, __ATOMIC_RELEASE);
+
+  if (old) {
+    /* Wait for the threads that may be pinning OLD through SCHEMA. */
+    rbs_synchronize();
+    snapshot_unref(old);
+  }
+}
+
+
+confsnap_t *
+confsnap_pin(confsnap_schema_t *schema)
+{
+  struct confsnap_ *sp;
+
+  rbs_read_lock();
+  sp = __atomic_load_n(&schema->snap, __ATOMIC_ACQUIRE);
+  if (sp)
+    __atomic_add_fetch(&sp->refs, 1, __ATOMIC_RELAXED);
+  rbs_read_unlock();
+  return sp;
+}
+
+
+void
+confsnap_unpin(confsnap_t *sp)
+{
+  if (sp)
+    snapshot_unref(sp);
+}
+
+
+confsnap_t *
+confsnap_refresh(confsnap_schema_t *schema, confsnap_t *sp)
+{
+  /* SP is pinned, so its address is not reused by another one. */
+  if (sp && sp == __atomic_load_n(&schema->snap, __ATOMIC_ACQUIRE))
+    return sp;
+  confsnap_unpin(sp);
+  return confsnap_pin(schema);
+}
@@ -0,0 +1,273 @@
+/* confsnap: compiled, immutable configuration snapshots
+ * Copyright (C) 2014  Seong-Kook Shin <cinsky@gmail.com>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Library General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Library General Public License for more details.
+ *
+ * You should have received a copy of the GNU Library General Public
+ * License along with this library; if not, write to the Free
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+#ifndef CONFSNAP_H__
+#define CONFSNAP_H__
+
+#include <stddef.h>
+
+/* This indirect using of extern "C" { ... } makes Emacs happy */
+#ifndef BEGIN_C_DECLS
+# ifdef __cplusplus
+#  define BEGIN_C_DECLS extern "C" {
+#  define END_C_DECLS   }
+# else
+#  define BEGIN_C_DECLS
+#  define END_C_DECLS
+# endif
+#endif /* BEGIN_C_DECLS */
+
+BEGIN_C_DECLS
+
+/*
+ * A configuration that is loaded with inifile, iniview, CONF or
+ * PROPERTIES is a set of strings, and every read of a parameter is a
+ * lookup by name and a conversion.  confsnap compiles a loaded
+ * configuration once into an immutable snapshot, where each parameter
+ * that the program declared in a schema is already converted to its
+ * type, and read by a slot number in O(1):
+ *
+ *   // at startup
+ *   schema = confsnap_schema_new();
+ *   port = confsnap_declare(schema, "db", "port", CONFSNAP_INT, "5432");
+ *   timeout = confsnap_declare(schema, "db", "timeout",
+ *                              CONFSNAP_DURATION, "30s");
+ *
+ *   // at startup, and at every reload
+ *   b = confsnap_builder_new(schema);
+ *   conf_enum(cf, NULL, confsnap_conf_proc, b);
+ *   sp = confsnap_build(b, errbuf, sizeof(errbuf));
+ *   if (!sp)
+ *     complain(errbuf);            // the last snapshot stays
+ *   else
+ *     confsnap_publish(schema, sp);
+ *
+ *   // per request, in any thread
+ *   snap = confsnap_refresh(schema, snap);
+ *   connect_to(confsnap_int(snap, port), confsnap_duration(snap, timeout));
+ *
+ * A parameter that the configuration does not have gets the default
+ * of its declaration; one that cannot be converted fails the build.
+ * The parameters that were not declared are kept as strings, and can
+ * be found by name with confsnap_find(), through a perfect hash table.
+ *
+ * The types and what they accept:
+ *
+ *   CONFSNAP_STRING    anything; only STR and LEN are set
+ *   CONFSNAP_INT       a C integer constant, e.g. "-12", "0x7f", "017"
+ *   CONFSNAP_DOUBLE    what strtod(3) accepts
+ *   CONFSNAP_BOOL      "true", "yes", "on", "1", "false", "no", "off",
+ *                      "0", in any case
+ *   CONFSNAP_DURATION  numbers with the units "ns", "us", "ms", "s",
+ *                      "m", "h", "d", e.g. "1h30m", "2.5s"; a number
+ *                      without a unit is in seconds; in nanoseconds
+ *   CONFSNAP_SIZE      a number with an optional unit "k", "m", "g",
+ *                      "t" (1024-based, in any case, optionally with
+ *                      "b" or "ib"), e.g. "64k", "1.5GiB"; in bytes
+ *
+ * Sharing works like symtable snapshots (see symtable.h):
+ * confsnap_publish() makes SP the last snapshot of SCHEMA, which any
+ * number of threads pin with confsnap_pin() or confsnap_refresh(),
+ * read without locks, and unpin.  The previous snapshot is freed when
+ * the last thread unpins it.  A snapshot that was never published is
+ * freed with confsnap_unpin().  Only one thread may publish at a time.
+ *
+ * All parameters must be declared before the first confsnap_build();
+ * then confsnap_declare() fails with EBUSY.
+ *
+ *   $ cc -D_GNU_SOURCE ... confsnap.c rbsync.c -lpthread
+ */
+
+enum confsnap_type {
+  CONFSNAP_STRING,
+  CONFSNAP_INT,
+  CONFSNAP_DOUBLE,
+  CONFSNAP_BOOL,
+  CONFSNAP_DURATION,
+  CONFSNAP_SIZE,
+};
+
+struct confsnap_value {
+  const char *str;              /* the text, or NULL if there is none */
+  size_t len;                   /* of STR */
+  union {
+    long long i;                /* INT, and DURATION in nanoseconds */
+    double d;                   /* DOUBLE */
+    int b;                      /* BOOL, 0 or 1 */
+    unsigned long long size;    /* SIZE in bytes */
+  } u;
+};
+
+struct confsnap_schema_;
+typedef struct confsnap_schema_ confsnap_schema_t;
+
+struct confsnap_builder_;
+typedef struct confsnap_builder_ confsnap_builder_t;
+
+struct confsnap_;
+typedef struct confsnap_ confsnap_t;
+
+/* The beginning of every snapshot, for the inline accessors */
+struct confsnap_head_ {
+  const struct confsnap_value *values;  /* indexed by slot */
+  unsigned long version;
+};
+
+extern confsnap_schema_t *confsnap_schema_new(void);
+
+/*
+ * Free SCHEMA and its last snapshot.  The snapshots that are still
+ * pinned stay valid until they are unpinned.
+ */
+extern void confsnap_schema_free(confsnap_schema_t *schema);
+
+/*
+ * Declare the parameter KEY in SECTION (NULL or "" for none, as in a
+ * properties file) of TYPE, with DEF (may be NULL) as its default.
+ *
+ * Returns the slot of the parameter, which is the same in all the
+ * snapshots of SCHEMA.  Declaring it again with the same TYPE returns
+ * the same slot.  Returns -1 with errno set to EINVAL if DEF is not a
+ * TYPE, or if it was declared with another type, EBUSY after the
+ * first build, or ENOMEM.
+ */
+extern int confsnap_declare(confsnap_schema_t *schema,
+                            const char *section, const char *key,
+                            int type, const char *def);
+
+extern confsnap_builder_t *confsnap_builder_new(confsnap_schema_t *schema);
+extern void confsnap_builder_free(confsnap_builder_t *b);
+
+/*
+ * Add the parameter KEY = VALUE in SECTION (NULL or "" for none) to
+ * B.  A later one overrides the same parameter that was added before.
+ * confsnap_addn() takes strings that need not be null-terminated, such
+ * as the std::string_view of iniview.
+ *
+ * Return 0, or -1 if out of memory; then confsnap_build() fails too.
+ */
+extern int confsnap_add(confsnap_builder_t *b, const char *section,
+                        const char *key, const char *value);
+extern int confsnap_addn(confsnap_builder_t *b,
+                         const char *section, size_t section_len,
+                         const char *key, size_t key_len,
+                         const char *value, size_t value_len);
+
+/* confsnap_add() for conf_enum(), and for properties_enum() */
+extern int confsnap_conf_proc(const char *section,
+                              const char *key, const char *value,
+                              int index, void *builder);
+extern int confsnap_properties_proc(const char *key, const char *value,
+                                    void *builder);
+
+/*
+ * Compile the parameters of B into a new snapshot, and free B.
+ *
+ * Returns the snapshot, pinned once, or NULL with the reason written
+ * to ERRBUF (if not NULL) of ERRSIZE bytes, e.g.
+ *
+ *   [db] port: invalid integer 'http'
+ */
+extern confsnap_t *confsnap_build(confsnap_builder_t *b,
+                                  char *errbuf, size_t errsize);
+
+/* Find KEY in SECTION (NULL or "" for none), or return NULL. */
+extern const struct confsnap_value *confsnap_find(const confsnap_t *sp,
+                                                  const char *section,
+                                                  const char *key);
+
+/* The number of parameters in SP, the declared ones included */
+extern size_t confsnap_count(const confsnap_t *sp);
+
+/*
+ * Call PROC for each parameter whose value differs between OLD (may
+ * be NULL) and SP, with OLD_VALUE NULL if it has no value in OLD, and
+ * NEW_VALUE NULL if it has none in SP: it is not there, or it is
+ * declared without a default and was not set.  A declared parameter
+ * that has no value in either is not a change.  Stops if PROC
+ * returns -1.  Returns the number of the changes that PROC was called
+ * with (PROC may be NULL to count them).
+ */
+typedef int (*confsnap_diff_proc)(const char *section, const char *key,
+                                  const struct confsnap_value *old_value,
+                                  const struct confsnap_value *new_value,
+                                  void *data);
+
+extern int confsnap_diff(const confsnap_t *old, const confsnap_t *sp,
+                         confsnap_diff_proc proc, void *data);
+
+/* Make SP, as returned by confsnap_build(), the last one of SCHEMA. */
+extern void confsnap_publish(confsnap_schema_t *schema, confsnap_t *sp);
+
+extern confsnap_t *confsnap_pin(confsnap_schema_t *schema);
+extern void confsnap_unpin(confsnap_t *sp);
+extern confsnap_t *confsnap_refresh(confsnap_schema_t *schema,
+                                    confsnap_t *sp);
+
+
+static __inline__ const struct confsnap_value *
+confsnap_value(const confsnap_t *sp, int slot)
+{
+  return &((const struct confsnap_head_ *)sp)->values[slot];
+}
+
+/* The version increases by one with each confsnap_publish(). */
+static __inline__ unsigned long
+confsnap_version(const confsnap_t *sp)
+{
+  return ((const struct confsnap_head_ *)sp)->version;
+}
+
+static __inline__ const char *
+confsnap_string(const confsnap_t *sp, int slot)
+{
+  return confsnap_value(sp, slot)->str;
+}
+
+static __inline__ long long
+confsnap_int(const confsnap_t *sp, int slot)
+{
+  return confsnap_value(sp, slot)->u.i;
+}
+
+static __inline__ double
+confsnap_double(const confsnap_t *sp, int slot)
+{
+  return confsnap_value(sp, slot)->u.d;
+}
+
+static __inline__ int
+confsnap_bool(const confsnap_t *sp, int slot)
+{
+  return confsnap_value(sp, slot)->u.b;
+}
+
+static __inline__ long long
+confsnap_duration(const confsnap_t *sp, int slot)
+{
+  return confsnap_value(sp, slot)->u.i;
+}
+
+static __inline__ unsigned long long
+confsnap_size(const confsnap_t *sp, int slot)
+{
+  return confsnap_value(sp, slot)->u.size;
+}
+
+END_C_DECLS
+
+#endif  /* CONFSNAP_H__ */
@@ -0,0 +1,436 @@
+/*
+ * Test of confwatch
+ *
+ *   $ cc -O2 -D_GNU_SOURCE -o confwatch-test confwatch-test.c confwatch.c \
+ *       confsnap.c rbsync.c -lpthread
+ *   $ ./confwatch-test
+ *
+ * The test watches two INI-like files in a directory under $TMPDIR,
+ * changes them the way an editor (write and rename) and a shell
+ * (truncate and write) do, and checks the callbacks and the published
+ * snapshots.  A reader thread refreshes its snapshot all along, and
+ * checks that it never sees a port that was not valid.  A file that
+ * changes all the time next to a watched one must not hold back its
+ * reload.
+ *
+ * Then it overflows the inotify queue while the watcher is stopped,
+ * so that the event of a change is lost, and checks that the change
+ * is loaded anyway, and that removing the directory is reported.
+ */
+#include <errno.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include "confwatch.h"
+#include "difftime.h"
+
+static char dir[256], path_a[300], path_b[300];
+
+static confsnap_schema_t *schema;
+static int slot_port, slot_debug;
+
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static char changes[4096];      /* "[section] key: old -> new\n" ... */
+static int nchanges, nsection_changes, nerrors;
+static char last_error[256];
+
+static int done, bad_port;
+
+
+/* "[section]" and "key = value" lines */
+static int
+load_file(confsnap_builder_t *b, const char *path)
+{
+  char line[256], section[256] = "", *eq, *end;
+  FILE *fp = fopen(path, "r");
+
+  if (!fp)
+    return (errno == ENOENT) ? 0 : -1;
+  while (fgets(line, sizeof(line), fp)) {
+    line[strcspn(line, "\n")] = '\0';
+    if (line[0] == '[') {
+      end = strchr(line, ']');
+      if (end)
+        *end = '\0';
+      snprintf(section, sizeof(section), "%s", line + 1);
+      continue;
+    }
+    eq = strstr(line, " = ");
+    if (!eq)
+      continue;
+    *eq = '\0';
+    confsnap_add(b, section, line, eq + 3);
+  }
+  fclose(fp);
+  return 0;
+}
+
+
+static int
+load(confsnap_builder_t *b, void *data)
+{
+  (void)data;
+  if (load_file(b, path_a) < 0 || load_file(b, path_b) < 0)
+    return -1;
+  return 0;
+}
+
+
+static int
+record(const char *section, const char *key,
+       const struct confsnap_value *old_value,
+       const struct confsnap_value *new_value, void *data)
+{
+  size_t len;
+
+  (void)data;
+  pthread_mutex_lock(&lock);
+  len = strlen(changes);
+  snprintf(changes + len, sizeof(changes) - len, "[%s] %s: %s -> %s\n",
+           section, key,
+           (old_value && old_value->str) ? old_value->str : "(none)",
+           (new_value && new_value->str) ? new_value->str : "(none)");
+  nchanges++;
+  pthread_mutex_unlock(&lock);
+  return 0;
+}
+
+
+static int
+record_section(const char *section, const char *key,
+               const struct confsnap_value *old_value,
+               const struct confsnap_value *new_value, void *data)
+{
+  (void)section; (void)key; (void)old_value; (void)new_value; (void)data;
+  pthread_mutex_lock(&lock);
+  nsection_changes++;
+  pthread_mutex_unlock(&lock);
+  return 0;
+}
+
+
+static void
+record_error(const char *msg, void *data)
+{
+  (void)data;
+  pthread_mutex_lock(&lock);
+  snprintf(last_error, sizeof(last_error), "%s", msg);
+  nerrors++;
+  pthread_mutex_unlock(&lock);
+}
+
+
+/* Write CONTENTS to PATH as an editor does: a new file, renamed. */
+static int
+replace_file(const char *path, const char *contents)
+{
+  char tmp[320];
+  FILE *fp;
+
+  snprintf(tmp, sizeof(tmp), "%s.tmp", path);
+  fp = fopen(tmp, "w");
+  if (fp == NULL)
+    return -1;
+  fputs(contents, fp);
+  fclose(fp);
+  return rename(tmp, path);
+}
+
+
+/* Write CONTENTS to PATH as "echo ... > PATH" does. */
+static int
+rewrite_file(const char *path, const char *contents)
+{
+  FILE *fp = fopen(path, "w");
+
+  if (fp == NULL)
+    return -1;
+  fputs(contents, fp);
+  fclose(fp);
+  return 0;
+}
+
+
+/* Queue more inotify events than the kernel keeps. */
+static int
+flood(void)
+{
+  char path[320];
+  long i, max = 16384;
+  FILE *fp = fopen("/proc/sys/fs/inotify/max_queued_events", "r");
+
+  if (fp) {
+    if (fscanf(fp, "%ld", &max) != 1)
+      max = 16384;
+    fclose(fp);
+  }
+  snprintf(path, sizeof(path), "%s/flood", dir);
+  /* IN_CREATE, IN_CLOSE_WRITE and IN_DELETE each time */
+  for (i = 0; i < max / 3 + 100; i++) {
+    if (rewrite_file(path, "") < 0)
+      return -1;
+    unlink(path);
+  }
+  return 0;
+}
+
+
+/*
+ * Wait up to 5 seconds for *COUNTER to reach N.  Returns the time it
+ * took in milliseconds, or -1.
+ */
+static long
+wait_for(int *counter, int n)
+{
+  struct timeval t0, t1;
+  long ms;
+  int v;
+
+  gettimeofday(&t0, 0);
+  for (;;) {
+    pthread_mutex_lock(&lock);
+    v = *counter;
+    pthread_mutex_unlock(&lock);
+    gettimeofday(&t1, 0);
+    ms = diff_timeval(&t1, &t0);
+    if (v >= n)
+      return ms;
+    if (ms >= 5000)
+      return -1;
+    usleep(1000);
+  }
+}
+
+
+static void
+reset(void)
+{
+  pthread_mutex_lock(&lock);
+  changes[0] = '\0';
+  nchanges = nsection_changes = nerrors = 0;
+  pthread_mutex_unlock(&lock);
+}
+
+
+static unsigned long
+version(void)
+{
+  confsnap_t *sp = confsnap_pin(schema);
+  unsigned long v = confsnap_version(sp);
+
+  confsnap_unpin(sp);
+  return v;
+}
+
+
+static void *
+reader(void *arg)
+{
+  confsnap_t *sp = NULL;
+  long long port;
+
+  (void)arg;
+  while (!__atomic_load_n(&done, __ATOMIC_RELAXED)) {
+    sp = confsnap_refresh(schema, sp);
+    port = confsnap_int(sp, slot_port);
+    if (port != 80 && port != 8080 && port != 9090) {
+      bad_port = 1;
+      break;
+    }
+  }
+  confsnap_unpin(sp);
+  return NULL;
+}
+
+
+static int
+test(void)
+{
+  const char *tmpdir = getenv("TMPDIR");
+  char other[320];
+  confwatch_t *cw;
+  pthread_t tid;
+  long latency;
+  int i, ok;
+
+  snprintf(dir, sizeof(dir), "%s/confwatch-test.%d",
+           (tmpdir) ? tmpdir : "/tmp", (int)getpid());
+  snprintf(path_a, sizeof(path_a), "%s/a.conf", dir);
+  snprintf(path_b, sizeof(path_b), "%s/b.conf", dir);
+  snprintf(other, sizeof(other), "%s/other.conf", dir);
+  if (mkdir(dir, 0700) != 0)
+    return -1;
+
+  /* B does not exist yet. */
+  if (rewrite_file(path_a, "[server]\nport = 8080\nname = alpha\n") < 0)
+    return -1;
+
+  schema = confsnap_schema_new();
+  slot_port = confsnap_declare(schema, "server", "port", CONFSNAP_INT, "80");
+  slot_debug = confsnap_declare(schema, "log", "debug", CONFSNAP_BOOL, "no");
+
+  cw = confwatch_new(schema, load, NULL);
+  if (cw == NULL ||
+      confwatch_add_file(cw, path_a) < 0 ||
+      confwatch_add_file(cw, path_b) < 0 ||
+      confwatch_subscribe(cw, NULL, NULL, record, NULL) < 0 ||
+      confwatch_subscribe(cw, "log", NULL, record_section, NULL) < 0)
+    return -1;
+  confwatch_error_handler(cw, record_error, NULL);
+
+  /* The first snapshot has no callbacks. */
+  if (confwatch_reload(cw) <= 0 || nchanges != 0 || version() != 1)
+    return -1;
+  if (confwatch_reload(cw) != 0 || version() != 1)
+    return -1;
+
+  if (pthread_create(&tid, NULL, reader, NULL) != 0)
+    return -1;
+  if (confwatch_start(cw) < 0)
+    return -1;
+
+  /* One parameter changes. */
+  reset();
+  if (replace_file(path_a, "[server]\nport = 9090\nname = alpha\n") < 0 ||
+      (latency = wait_for(&nchanges, 1)) < 0)
+    return -1;
+  usleep(200000);
+  if (nchanges != 1 || nsection_changes != 0 ||
+      strcmp(changes, "[server] port: 8080 -> 9090\n") != 0 ||
+      version() != 2)
+    return -1;
+  printf("change to callback: %ld ms\n", latency);
+
+  /* The same contents again: no new snapshot */
+  reset();
+  if (rewrite_file(path_a, "[server]\nport = 9090\nname = alpha\n") < 0)
+    return -1;
+  usleep(300000);
+  if (nchanges != 0 || version() != 2)
+    return -1;
+
+  /* A new file, and a burst of writes that makes one reload */
+  reset();
+  if (rewrite_file(path_b, "[log]\ndebug = yes\n") < 0 ||
+      rewrite_file(path_b, "[log]\ndebug = yes\nlevel = 3\n") < 0 ||
+      rewrite_file(path_b, "[log]\ndebug = yes\nlevel = 4\n") < 0 ||
+      wait_for(&nchanges, 2) < 0)
+    return -1;
+  usleep(200000);
+  if (nchanges != 2 || nsection_changes != 2 ||
+      !strstr(changes, "[log] debug: no -> yes\n") ||
+      !strstr(changes, "[log] level: (none) -> 4\n") ||
+      version() != 3)
+    return -1;
+
+  /* A bad value keeps the last snapshot. */
+  reset();
+  if (replace_file(path_a, "[server]\nport = http\nname = alpha\n") < 0 ||
+      wait_for(&nerrors, 1) < 0)
+    return -1;
+  if (strcmp(last_error, "[server] port: invalid integer 'http'") != 0 ||
+      nchanges != 0 || version() != 3)
+    return -1;
+
+  /* Removed parameters, and a declared one back to its default */
+  reset();
+  if (replace_file(path_a, "[server]\nname = alpha\n") < 0)
+    return -1;
+  unlink(path_b);
+  if (wait_for(&nchanges, 3) < 0)
+    return -1;
+  usleep(200000);
+  if (nchanges != 3 ||
+      !strstr(changes, "[server] port: 9090 -> 80\n") ||
+      !strstr(changes, "[log] debug: yes -> no\n") ||
+      !strstr(changes, "[log] level: 4 -> (none)\n") ||
+      strstr(changes, "[server] name:"))
+    return -1;
+
+  /* Files that we do not watch */
+  reset();
+  if (rewrite_file(path_a, "[server]\nname = alpha\n") < 0)
+    return -1;
+  unlink(path_a);
+  if (rewrite_file(path_a, "[server]\nname = alpha\n") < 0 ||
+      rewrite_file(other, "[server]\nport = 1\n") < 0)
+    return -1;
+  unlink(other);
+  usleep(300000);
+  if (nchanges != 0)
+    return -1;
+
+  /* Writes to another file every 20 ms do not hold the reload back. */
+  reset();
+  if (replace_file(path_a, "[server]\nport = 9090\nname = alpha\n") < 0)
+    return -1;
+  for (i = 0; i < 50; i++) {
+    if (rewrite_file(other, "noise\n") < 0)
+      return -1;
+    usleep(20000);
+  }
+  pthread_mutex_lock(&lock);
+  ok = (nchanges == 1 &&
+        strcmp(changes, "[server] port: 80 -> 9090\n") == 0);
+  pthread_mutex_unlock(&lock);
+  if (!ok)
+    return -1;
+  unlink(other);
+
+  if (confwatch_stop(cw) < 0)
+    return -1;
+  __atomic_store_n(&done, 1, __ATOMIC_RELAXED);
+  pthread_join(tid, NULL);
+  if (bad_port)
+    return -1;
+
+  reset();
+  if (replace_file(path_a, "[server]\nport = 8080\nname = alpha\n") < 0)
+    return -1;
+  usleep(200000);
+  if (nchanges != 0 || confwatch_reload(cw) != 1 || nchanges != 1)
+    return -1;
+
+  /* The event of this change is lost, but the overflow reloads. */
+  if (confwatch_start(cw) < 0)          /* eat the events queued above */
+    return -1;
+  usleep(200000);
+  confwatch_stop(cw);
+  reset();
+  if (flood() < 0 ||
+      replace_file(path_a, "[server]\nport = 9090\nname = alpha\n") < 0 ||
+      confwatch_start(cw) < 0 ||
+      wait_for(&nchanges, 1) < 0)
+    return -1;
+  if (nerrors < 1 || !strstr(last_error, "overflow") ||
+      strcmp(changes, "[server] port: 8080 -> 9090\n") != 0)
+    return -1;
+
+  /* The watch of a removed directory ends, and that is reported. */
+  reset();
+  unlink(path_a);
+  if (rmdir(dir) != 0 || wait_for(&nerrors, 1) < 0 ||
+      !strstr(last_error, "a.conf was removed"))
+    return -1;
+  confwatch_stop(cw);
+
+  confwatch_free(cw);
+  confsnap_schema_free(schema);
+  return 0;
+}
+
+
+int
+main(void)
+{
+  if (test() < 0) {
+    fprintf(stderr, "confwatch-test: test failed\n");
+    return 1;
+  }
+  printf("confwatch-test: test passed\n");
+  return 0;
+}
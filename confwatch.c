@@ -0,0 +1,449 @@
+/* confwatch: reload configuration files when they change
+ * Copyright (C) 2014  Seong-Kook Shin <cinsky@gmail.com>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Library General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Library General Public License for more details.
+ *
+ * You should have received a copy of the GNU Library General Public
+ * License along with this library; if not, write to the Free
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/inotify.h>
+
+#include "confwatch.h"
+
+#define WATCH_MASK      (IN_CLOSE_WRITE | IN_MOVED_TO | IN_MOVED_FROM | \
+                         IN_CREATE | IN_DELETE | IN_DELETE_SELF | \
+                         IN_MOVE_SELF)
+
+struct watched {
+  int wd;                       /* of the directory, -1 if not watched */
+  char *name;                   /* the file name in the directory */
+};
+
+struct subscriber {
+  char *section;                /* NULL for any */
+  char *key;                    /* NULL for any */
+  confsnap_diff_proc proc;
+  void *data;
+};
+
+struct confwatch_ {
+  confsnap_schema_t *schema;
+  confwatch_load_proc load;
+  void *data;
+
+  confwatch_error_proc error;
+  void *error_data;
+
+  struct watched *files;
+  size_t nfiles;
+
+  struct subscriber *subs;      /* under LOCK */
+  size_t nsubs;
+
+  pthread_mutex_t lock;         /* one reload at a time */
+  int loaded;                   /* nonzero after the first reload */
+
+  int ifd;                      /* inotify(7) */
+  int pipe[2];                  /* to wake the thread up */
+  int quit;
+  int running;
+  pthread_t thread;
+};
+
+
+static void
+default_error(const char *msg, void *data)
+{
+  (void)data;
+  fprintf(stderr, "confwatch: %s\n", msg);
+}
+
+
+confwatch_t *
+confwatch_new(confsnap_schema_t *schema, confwatch_load_proc load, void *data)
+{
+  confwatch_t *cw = calloc(1, sizeof(*cw));
+
+  if (!cw)
+    return NULL;
+  cw->ifd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+  if (cw->ifd < 0) {
+    free(cw);
+    return NULL;
+  }
+  cw->schema = schema;
+  cw->load = load;
+  cw->data = data;
+  cw->error = default_error;
+  cw->pipe[0] = cw->pipe[1] = -1;
+  pthread_mutex_init(&cw->lock, NULL);
+  return cw;
+}
+
+
+void
+confwatch_free(confwatch_t *cw)
+{
+  size_t i;
+
+  if (!cw)
+    return;
+  confwatch_stop(cw);
+  close(cw->ifd);
+  for (i = 0; i < cw->nfiles; i++)
+    free(cw->files[i].name);
+  free(cw->files);
+  for (i = 0; i < cw->nsubs; i++) {
+    free(cw->subs[i].section);
+    free(cw->subs[i].key);
+  }
+  free(cw->subs);
+  pthread_mutex_destroy(&cw->lock);
+  free(cw);
+}
+
+
+int
+confwatch_add_file(confwatch_t *cw, const char *pathname)
+{
+  const char *slash = strrchr(pathname, '/');
+  struct watched *w;
+  char dir[PATH_MAX];
+  int wd;
+
+  if (!slash)
+    strcpy(dir, ".");
+  else if (slash == pathname)
+    strcpy(dir, "/");
+  else if ((size_t)(slash - pathname) >= sizeof(dir)) {
+    errno = ENAMETOOLONG;
+    return -1;
+  }
+  else {
+    memcpy(dir, pathname, slash - pathname);
+    dir[slash - pathname] = '\0';
+  }
+
+  /* The same directory gets the same WD. */
+  wd = inotify_add_watch(cw->ifd, dir, WATCH_MASK);
+  if (wd < 0)
+    return -1;
+
+  w = realloc(cw->files, sizeof(*w) * (cw->nfiles + 1));
+  if (!w)
+    return -1;
+  cw->files = w;
+  w += cw->nfiles;
+  w->wd = wd;
+  w->name = strdup((slash) ? slash + 1 : pathname);
+  if (!w->name)
+    return -1;
+  cw->nfiles++;
+  return 0;
+}
+
+
+int
+confwatch_subscribe(confwatch_t *cw, const char *section, const char *key,
+                    confsnap_diff_proc proc, void *data)
+{
+  struct subscriber *s;
+  int ret = -1;
+
+  /* The watcher thread reads CW->subs in notify(). */
+  pthread_mutex_lock(&cw->lock);
+  s = realloc(cw->subs, sizeof(*s) * (cw->nsubs + 1));
+  if (!s)
+    goto out;
+  cw->subs = s;
+  s += cw->nsubs;
+  s->section = (section) ? strdup(section) : NULL;
+  s->key = (key) ? strdup(key) : NULL;
+  if ((section && !s->section) || (key && !s->key)) {
+    free(s->section);
+    free(s->key);
+    goto out;
+  }
+  s->proc = proc;
+  s->data = data;
+  cw->nsubs++;
+  ret = 0;
+
+ out:
+  pthread_mutex_unlock(&cw->lock);
+  return ret;
+}
+
+
+void
+confwatch_error_handler(confwatch_t *cw, confwatch_error_proc proc,
+                        void *data)
+{
+  cw->error = (proc) ? proc : default_error;
+  cw->error_data = data;
+}
+
+
+static int
+notify(const char *section, const char *key,
+       const struct confsnap_value *old_value,
+       const struct confsnap_value *new_value, void *data)
+{
+  confwatch_t *cw = data;
+  const struct subscriber *s;
+  size_t i;
+
+  for (i = 0; i < cw->nsubs; i++) {
+    s = cw->subs + i;
+    if ((s->section && strcmp(s->section, section) != 0) ||
+        (s->key && strcmp(s->key, key) != 0))
+      continue;
+    s->proc(section, key, old_value, new_value, s->data);
+  }
+  return 0;
+}
+
+
+int
+confwatch_reload(confwatch_t *cw)
+{
+  confsnap_builder_t *b;
+  confsnap_t *old, *sp;
+  char errbuf[256];
+  int n = -1;
+
+  pthread_mutex_lock(&cw->lock);
+
+  b = confsnap_builder_new(cw->schema);
+  if (!b) {
+    cw->error("out of memory", cw->error_data);
+    goto out;
+  }
+  if (cw->load(b, cw->data) < 0) {
+    confsnap_builder_free(b);
+    cw->error("cannot load the configuration", cw->error_data);
+    goto out;
+  }
+  sp = confsnap_build(b, errbuf, sizeof(errbuf));
+  if (!sp) {
+    cw->error(errbuf, cw->error_data);
+    goto out;
+  }
+
+  /* We are the only publisher, so OLD stays the last one. */
+  old = confsnap_pin(cw->schema);
+  n = confsnap_diff(old, sp, NULL, NULL);
+  if (n == 0 && cw->loaded) {
+    confsnap_unpin(sp);
+    confsnap_unpin(old);
+    goto out;
+  }
+
+  /* The schema takes our reference to SP, so pin it for the diff. */
+  confsnap_publish(cw->schema, sp);
+  sp = confsnap_pin(cw->schema);
+  if (cw->loaded && cw->nsubs > 0)
+    confsnap_diff(old, sp, notify, cw);
+  cw->loaded = 1;
+  confsnap_unpin(sp);
+  confsnap_unpin(old);
+
+ out:
+  pthread_mutex_unlock(&cw->lock);
+  return n;
+}
+
+
+/*
+ * Stop watching the directory WD, and tell the error handler why.
+ * The files in it are not watched any more, until they are added
+ * again.
+ */
+static void
+unwatch(confwatch_t *cw, int wd, const char *why)
+{
+  char msg[PATH_MAX + 64];
+  size_t i;
+  int reported = 0;
+
+  for (i = 0; i < cw->nfiles; i++) {
+    if (cw->files[i].wd != wd)
+      continue;
+    cw->files[i].wd = -1;
+    if (!reported) {
+      snprintf(msg, sizeof(msg), "the directory of %s was %s; "
+               "it is not watched any more", cw->files[i].name, why);
+      cw->error(msg, cw->error_data);
+      reported = 1;
+    }
+  }
+}
+
+
+/*
+ * Return nonzero if the events in BUF of LEN bytes touch our files,
+ * or if some events were lost, so that a reload is due.
+ */
+static int
+relevant(confwatch_t *cw, const char *buf, ssize_t len)
+{
+  const struct inotify_event *ev;
+  const char *p;
+  size_t i;
+  int ret = 0;
+
+  for (p = buf; p < buf + len; p += sizeof(*ev) + ev->len) {
+    ev = (const struct inotify_event *)p;
+    if (ev->mask & IN_Q_OVERFLOW) {
+      cw->error("inotify queue overflow; reloading", cw->error_data);
+      ret = 1;
+      continue;
+    }
+    if (ev->mask & (IN_DELETE_SELF | IN_MOVE_SELF | IN_IGNORED)) {
+      /* IN_IGNORED follows IN_DELETE_SELF, or an unmount. */
+      for (i = 0; i < cw->nfiles; i++)
+        if (cw->files[i].wd == ev->wd)
+          break;
+      if (i == cw->nfiles)
+        continue;
+      ret = 1;
+      if (ev->mask & IN_MOVE_SELF) {
+        inotify_rm_watch(cw->ifd, ev->wd);
+        unwatch(cw, ev->wd, "moved");
+      }
+      else if (ev->mask & IN_IGNORED)
+        unwatch(cw, ev->wd, "removed or unmounted");
+      continue;
+    }
+    if (ev->len == 0)
+      continue;
+    for (i = 0; i < cw->nfiles; i++)
+      if (cw->files[i].wd == ev->wd &&
+          strcmp(cw->files[i].name, ev->name) == 0)
+        ret = 1;
+  }
+  return ret;
+}
+
+
+/* The milliseconds from now until DEADLINE, rounded up, or 0 if past */
+static int
+ms_until(const struct timespec *deadline)
+{
+  struct timespec now;
+  long long ns;
+
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  ns = (deadline->tv_sec - now.tv_sec) * 1000000000LL +
+    (deadline->tv_nsec - now.tv_nsec);
+  return (ns > 0) ? (int)((ns + 999999) / 1000000) : 0;
+}
+
+
+static void *
+watch_main(void *arg)
+{
+  confwatch_t *cw = arg;
+  char buf[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+  struct pollfd pfd[2];
+  struct timespec deadline;
+  int pending = 0, n;
+  ssize_t len;
+
+  pfd[0].fd = cw->ifd;
+  pfd[0].events = POLLIN;
+  pfd[1].fd = cw->pipe[0];
+  pfd[1].events = POLLIN;
+
+  /*
+   * Only the events of our files move the deadline, so that the other
+   * files in the directories cannot put a reload off.
+   */
+  for (;;) {
+    n = poll(pfd, 2, (pending) ? ms_until(&deadline) : -1);
+    if (__atomic_load_n(&cw->quit, __ATOMIC_ACQUIRE))
+      break;
+    if (n > 0 && (pfd[0].revents & POLLIN)) {
+      while ((len = read(cw->ifd, buf, sizeof(buf))) > 0)
+        if (relevant(cw, buf, len)) {
+          clock_gettime(CLOCK_MONOTONIC, &deadline);
+          deadline.tv_nsec += CONFWATCH_DELAY_MS * 1000000L;
+          if (deadline.tv_nsec >= 1000000000L) {
+            deadline.tv_sec++;
+            deadline.tv_nsec -= 1000000000L;
+          }
+          pending = 1;
+        }
+    }
+    if (pending && ms_until(&deadline) == 0) {
+      /* Our files were quiet for CONFWATCH_DELAY_MS. */
+      pending = 0;
+      confwatch_reload(cw);
+    }
+  }
+  return NULL;
+}
+
+
+int
+confwatch_start(confwatch_t *cw)
+{
+  int ret;
+
+  if (cw->running)
+    return 0;
+  if (pipe(cw->pipe) < 0)
+    return -1;
+  fcntl(cw->pipe[0], F_SETFD, FD_CLOEXEC);
+  fcntl(cw->pipe[1], F_SETFD, FD_CLOEXEC);
+
+  cw->quit = 0;
+  ret = pthread_create(&cw->thread, NULL, watch_main, cw);
+  if (ret != 0) {
+    close(cw->pipe[0]);
+    close(cw->pipe[1]);
+    cw->pipe[0] = cw->pipe[1] = -1;
+    errno = ret;
+    return -1;
+  }
+  cw->running = 1;
+  return 0;
+}
+
+
+int
+confwatch_stop(confwatch_t *cw)
+{
+  if (!cw->running)
+    return 0;
+
+  __atomic_store_n(&cw->quit, 1, __ATOMIC_RELEASE);
+  if (write(cw->pipe[1], "q", 1) < 0) {
+    /* the pipe is full, so the thread is awake anyway */
+  }
+  pthread_join(cw->thread, NULL);
+  close(cw->pipe[0]);
+  close(cw->pipe[1]);
+  cw->pipe[0] = cw->pipe[1] = -1;
+  cw->running = 0;
+  return 0;
+}
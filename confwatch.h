@@ -0,0 +1,126 @@
+/* confwatch: reload configuration files when they change
+ * Copyright (C) 2014  Seong-Kook Shin <cinsky@gmail.com>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Library General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Library General Public License for more details.
+ *
+ * You should have received a copy of the GNU Library General Public
+ * License along with this library; if not, write to the Free
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+#ifndef CONFWATCH_H__
+#define CONFWATCH_H__
+
+#include "confsnap.h"
+
+/* This indirect using of extern "C" { ... } makes Emacs happy */
+#ifndef BEGIN_C_DECLS
+# ifdef __cplusplus
+#  define BEGIN_C_DECLS extern "C" {
+#  define END_C_DECLS   }
+# else
+#  define BEGIN_C_DECLS
+#  define END_C_DECLS
+# endif
+#endif /* BEGIN_C_DECLS */
+
+BEGIN_C_DECLS
+
+/*
+ * confwatch watches configuration files with inotify(7), and when one
+ * of them changes, loads them again into a confsnap snapshot (see
+ * confsnap.h) in a thread of its own, and publishes the snapshot if
+ * any parameter changed.  The readers go on with the last snapshot
+ * meanwhile, and pick up the new one with confsnap_refresh():
+ *
+ *   static int
+ *   load(confsnap_builder_t *b, void *data)
+ *   {
+ *     CONF *cf = conf_new(0);
+ *     if (conf_load(cf, "/etc/foo.conf", 0) < 0)
+ *       ...;
+ *     conf_enum(cf, NULL, confsnap_conf_proc, b);
+ *     conf_close(cf);
+ *     return 0;
+ *   }
+ *
+ *   cw = confwatch_new(schema, load, NULL);
+ *   confwatch_add_file(cw, "/etc/foo.conf");
+ *   confwatch_subscribe(cw, "db", NULL, db_changed, pool);
+ *   if (confwatch_reload(cw) < 0)          // the first snapshot
+ *     ...;
+ *   confwatch_start(cw);
+ *
+ * The directory of each file is watched, not the file, so that a file
+ * that is replaced by rename(2), as editors and deployment tools do,
+ * is still seen.  The events are coalesced until the files are quiet
+ * for CONFWATCH_DELAY_MS; the other files in the directories do not
+ * count.
+ *
+ * If the inotify queue overflows, events were lost, so the watcher
+ * reloads, and tells the error handler.  If a watched directory is
+ * removed, moved, or unmounted, the error handler is told, and the
+ * files in it are not watched any more.
+ *
+ * A reload calls LOAD with a new builder, builds the snapshot, and
+ * compares it with the last one with confsnap_diff().  If nothing
+ * changed, the new snapshot is thrown away.  Otherwise it is published,
+ * and then each change is passed to the subscribers whose SECTION and
+ * KEY match it (NULL matches any), in the watcher thread, with the old
+ * and new value (see confsnap_diff_proc).  There are no callbacks for
+ * the first snapshot.
+ *
+ * If LOAD returns -1 or the build fails, the last snapshot stays, and
+ * the error goes to the error handler, or to stderr by default.
+ *
+ *   $ cc -D_GNU_SOURCE ... confwatch.c confsnap.c rbsync.c -lpthread
+ */
+
+#define CONFWATCH_DELAY_MS      50
+
+struct confwatch_;
+typedef struct confwatch_ confwatch_t;
+
+typedef int (*confwatch_load_proc)(confsnap_builder_t *b, void *data);
+typedef void (*confwatch_error_proc)(const char *msg, void *data);
+
+extern confwatch_t *confwatch_new(confsnap_schema_t *schema,
+                                  confwatch_load_proc load, void *data);
+
+/* Stop the watcher if it runs, and free CW, but not its schema. */
+extern void confwatch_free(confwatch_t *cw);
+
+/* Watch PATHNAME, which need not exist yet.  Returns 0 or -1. */
+extern int confwatch_add_file(confwatch_t *cw, const char *pathname);
+
+/*
+ * Call PROC for the changes of KEY in SECTION (NULL for any) from now
+ * on.  It may be called while the watcher runs, but not from PROC.
+ */
+extern int confwatch_subscribe(confwatch_t *cw,
+                               const char *section, const char *key,
+                               confsnap_diff_proc proc, void *data);
+
+extern void confwatch_error_handler(confwatch_t *cw,
+                                    confwatch_error_proc proc, void *data);
+
+/*
+ * Reload now, e.g. on SIGHUP.  Returns the number of the parameters
+ * that changed, or -1 on error.
+ */
+extern int confwatch_reload(confwatch_t *cw);
+
+/* Start and stop the watcher thread.  Return 0, or -1 with errno. */
+extern int confwatch_start(confwatch_t *cw);
+extern int confwatch_stop(confwatch_t *cw);
+
+END_C_DECLS
+
+#endif  /* CONFWATCH_H__ */
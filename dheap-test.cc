@@ -0,0 +1,247 @@
+/*
+ * Test and benchmark of dheap (dheap.hh) and DHEAP_DEFINE() (heap.h)
+ * against HEAP_INSERT/HEAP_POP.
+ *
+ *   $ g++ -O2 -o dheap-test dheap-test.cc
+ *   $ ./dheap-test [NELEM]
+ *
+ * The benchmark simulates a timer queue: it loads NELEM random
+ * deadlines, runs NELEM expire-and-rearm steps (pop the earliest
+ * deadline, push a later one), then drains the queue.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/time.h>
+#include <algorithm>
+#include <set>
+#include <vector>
+#include "heap.h"
+#include "dheap.hh"
+
+struct timer {
+  long deadline;
+  char payload[24];
+};
+
+// HEAP_* macros build a max-heap; invert it to get the earliest deadline.
+#define timerheap_t_cmp(x, y)   (((x)->deadline < (y)->deadline) - \
+                                 ((x)->deadline > (y)->deadline))
+HEAP_DECL_TYPE(struct timer, timerheap_t);
+
+#define KEY_LESS(a, b)  ((a) < (b))
+DHEAP_DEFINE(ctimerq, long, struct timer *, KEY_LESS);
+
+static double
+now()
+{
+  struct timeval tv;
+  gettimeofday(&tv, 0);
+  return tv.tv_sec + tv.tv_usec / 1e6;
+}
+
+static void
+report(const char *name, double sec, long checksum)
+{
+  printf("%-24s %8.3f sec  (checksum %ld)\n", name, sec, checksum);
+}
+
+
+static void
+bench_heap(std::vector<timer> &timers, const std::vector<long> &delta)
+{
+  timerheap_t heap = HEAP_INITIALIZER(timers.size());
+  size_t n = timers.size();
+  long sum = 0;
+  timer *t;
+  double beg = now();
+
+  for (size_t i = 0; i < n; i++)
+    HEAP_INSERT(timerheap_t, &heap, &timers[i]);
+  for (size_t i = 0; i < n; i++) {
+    t = HEAP_POP(timerheap_t, &heap);
+    sum += t->deadline;
+    t->deadline += delta[i];
+    HEAP_INSERT(timerheap_t, &heap, t);
+  }
+  while ((t = HEAP_POP(timerheap_t, &heap)) != 0)
+    sum += t->deadline;
+
+  report("HEAP_INSERT/HEAP_POP", now() - beg, sum);
+  HEAP_FREE(&heap);
+}
+
+
+static void
+bench_cdheap(std::vector<timer> &timers, const std::vector<long> &delta)
+{
+  ctimerq q;
+  size_t n = timers.size();
+  long key = 0, sum = 0;
+  timer *t = 0;
+  double beg = now();
+
+  ctimerq_init(&q);
+  for (size_t i = 0; i < n; i++)
+    ctimerq_push(&q, timers[i].deadline, &timers[i]);
+  for (size_t i = 0; i < n; i++) {
+    ctimerq_pop(&q, &key, &t);
+    sum += key;
+    t->deadline = key + delta[i];
+    ctimerq_push(&q, t->deadline, t);
+  }
+  while (ctimerq_pop(&q, &key, 0))
+    sum += key;
+
+  report("DHEAP_DEFINE", now() - beg, sum);
+  ctimerq_free(&q);
+}
+
+
+static void
+bench_dheap(std::vector<timer> &timers, const std::vector<long> &delta)
+{
+  dheap<long, timer *> q;
+  size_t n = timers.size();
+  long sum = 0;
+  double beg = now();
+
+  for (size_t i = 0; i < n; i++)
+    q.push(timers[i].deadline, &timers[i]);
+  for (size_t i = 0; i < n; i++) {
+    timer *t = q.top_value();
+    sum += q.top_key();
+    t->deadline = q.top_key() + delta[i];
+    q.pop();
+    q.push(t->deadline, t);
+  }
+  for (; !q.empty(); q.pop())
+    sum += q.top_key();
+
+  report("dheap<4>", now() - beg, sum);
+}
+
+
+// Rearming in place through the handle, which HEAP_* cannot do.
+static void
+bench_dheap_update(std::vector<timer> &timers, const std::vector<long> &delta)
+{
+  dheap<long, timer *> q;
+  std::vector<dheap<long, timer *>::handle_type> handles;
+  size_t n = timers.size();
+  long sum = 0;
+  double beg = now();
+
+  q.reserve(n);
+  handles.reserve(n);
+  for (size_t i = 0; i < n; i++)
+    handles.push_back(q.append(timers[i].deadline, &timers[i]));
+  q.heapify();
+  for (size_t i = 0; i < n; i++) {
+    dheap<long, timer *>::handle_type h = q.top();
+    sum += q.top_key();
+    q.update(h, q.top_key() + delta[i]);
+  }
+  for (size_t i = 0; i < n; i += 2)
+    q.erase(handles[(i * 7919) % n]);
+  for (; !q.empty(); q.pop())
+    sum += q.top_key();
+
+  report("dheap<4> heapify/update", now() - beg, sum);
+}
+
+
+// Random operations checked against std::multiset.
+static int
+test_dheap(unsigned nops)
+{
+  typedef dheap<int, int> heap_type;
+  heap_type q;
+  std::multiset<std::pair<int, int> > ref;
+  std::vector<heap_type::handle_type> handles;
+  std::vector<int> live;        // values that are in Q
+
+  for (unsigned i = 0; i < nops; i++) {
+    int op = rand() % 5;
+    if (op <= 1 || live.empty()) {
+      int key = rand() % 1000;
+      int val = handles.size();
+      handles.push_back(q.push(key, val));
+      ref.insert(std::make_pair(key, val));
+      live.push_back(val);
+    }
+    else if (op == 2) {
+      if (q.top_key() != ref.begin()->first)
+        return -1;
+      int val = q.top_value();
+      ref.erase(ref.find(std::make_pair(q.top_key(), val)));
+      q.pop();
+      live.erase(std::find(live.begin(), live.end(), val));
+    }
+    else {
+      size_t idx = rand() % live.size();
+      int val = live[idx];
+      heap_type::handle_type h = handles[val];
+      ref.erase(ref.find(std::make_pair(q.key(h), val)));
+      if (op == 3) {
+        int key = rand() % 1000;
+        q.update(h, key);
+        ref.insert(std::make_pair(key, val));
+      }
+      else {
+        q.erase(h);
+        live.erase(live.begin() + idx);
+      }
+    }
+    if (q.size() != ref.size())
+      return -1;
+  }
+  while (!q.empty()) {
+    if (q.top_key() != ref.begin()->first)
+      return -1;
+    ref.erase(ref.begin());
+    q.pop();
+  }
+  return 0;
+}
+
+
+int
+main(int argc, char *argv[])
+{
+  size_t n = (argc > 1) ? atol(argv[1]) : 1000000;
+  std::vector<timer> timers(n);
+  std::vector<long> delta(n);
+
+  if (test_dheap(200000) < 0) {
+    fprintf(stderr, "dheap: test failed\n");
+    return 1;
+  }
+  printf("dheap: test passed\n");
+
+  srand(1);
+  for (size_t i = 0; i < n; i++)
+    delta[i] = 1 + rand() % 30000;
+
+  for (int pass = 0; pass < 3; pass++) {
+    srand(2);
+    for (size_t i = 0; i < n; i++)
+      timers[i].deadline = rand() % 60000;
+    switch (pass) {
+    case 0:
+      bench_heap(timers, delta);
+      break;
+    case 1:
+      bench_cdheap(timers, delta);
+      break;
+    default:
+      bench_dheap(timers, delta);
+      break;
+    }
+  }
+  srand(2);
+  for (size_t i = 0; i < n; i++)
+    timers[i].deadline = rand() % 60000;
+  bench_dheap_update(timers, delta);
+
+  return 0;
+}
@@ -0,0 +1,261 @@
+/* -*-c++-*- */
+#ifndef DHEAP_HH__
+#define DHEAP_HH__
+
+/*
+ * Copyright (C) 2014  Seong-Kook Shin <cinsky@gmail.com>
+ * DO WHAT THE FUCK YOU WANT TO PUBLIC LICENSE
+ * Version 2, December 2004
+ */
+
+#include <vector>
+#include <functional>
+#include <utility>
+#include <cassert>
+#include <cstddef>
+
+//
+// dheap is a D-ary (4-ary by default) implicit heap.  Unlike the
+// HEAP_* macros in heap.h, the keys are stored inline in one array,
+// so that comparing the children of a node does not chase pointers.
+// D children of a node are adjacent, so a sift-down step reads one or
+// two cache lines for small keys.
+//
+// Every element gets a handle on push(), which stays valid until the
+// element is popped or erased.  The handle can be used to change the
+// key (decrease_key(), update()) or to remove the element (erase()).
+// Handles are recycled.
+//
+// The top of the heap is the element with the smallest key according
+// to LESS, which is what a timer queue wants:
+//
+//   dheap<time_t, conn *> timers;
+//
+//   dheap<time_t, conn *>::handle_type h = timers.push(deadline, c);
+//   ...
+//   timers.update(h, new_deadline);   // on activity
+//   ...
+//   while (!timers.empty() && timers.top_key() <= now) {
+//     expire(timers.top_value());
+//     timers.pop();
+//   }
+//
+// For bulk loading, append() elements without ordering them, then
+// call heapify() once; it runs in O(n).
+//
+// The C version of this heap is DHEAP_DEFINE() in heap.h.
+
+template <class K, class V, unsigned D = 4, class LESS = std::less<K> >
+class dheap {
+public:
+  typedef K key_type;
+  typedef V value_type;
+  typedef unsigned handle_type;
+
+  static const handle_type nohandle = ~0u;
+
+private:
+  struct entry {
+    K key_;
+    handle_type handle_;
+  };
+
+  std::vector<entry> body_;
+  std::vector<unsigned> pos_;   // handle -> index in body_, or next free
+  std::vector<V> values_;       // handle -> value
+  handle_type free_;            // head of the free handle list
+  bool heap_;                   // false after append() until heapify()
+  LESS less_;
+
+  void place(unsigned i, const entry &e) {
+    body_[i] = e;
+    pos_[e.handle_] = i;
+  }
+
+  void sift_up(unsigned i) {
+    entry e = body_[i];
+
+    while (i > 0) {
+      unsigned parent = (i - 1) / D;
+      if (!less_(e.key_, body_[parent].key_))
+        break;
+      place(i, body_[parent]);
+      i = parent;
+    }
+    place(i, e);
+  }
+
+  void sift_down(unsigned i) {
+    unsigned n = body_.size();
+    entry e = body_[i];
+
+    while (true) {
+      unsigned first = i * D + 1;
+      if (first >= n)
+        break;
+      unsigned last = (first + D < n) ? first + D : n;
+      unsigned best = first;
+      for (unsigned c = first + 1; c < last; c++)
+        if (less_(body_[c].key_, body_[best].key_))
+          best = c;
+
+      if (!less_(body_[best].key_, e.key_))
+        break;
+      place(i, body_[best]);
+      i = best;
+    }
+    place(i, e);
+  }
+
+  handle_type new_handle(const V &value) {
+    handle_type h;
+
+    if (free_ != nohandle) {
+      h = free_;
+      free_ = pos_[h];
+      values_[h] = value;
+    }
+    else {
+      h = pos_.size();
+      pos_.push_back(0);
+      values_.push_back(value);
+    }
+    return h;
+  }
+
+  void release_handle(handle_type h) {
+    values_[h] = V();
+    pos_[h] = free_;
+    free_ = h;
+  }
+
+  // Remove the element at the index I, and restore the heap property.
+  void remove_at(unsigned i) {
+    handle_type h = body_[i].handle_;
+    unsigned last = body_.size() - 1;
+
+    if (i != last) {
+      entry moved = body_[last];
+      body_.pop_back();
+      place(i, moved);
+      if (i > 0 && less_(moved.key_, body_[(i - 1) / D].key_))
+        sift_up(i);
+      else
+        sift_down(i);
+    }
+    else
+      body_.pop_back();
+
+    release_handle(h);
+  }
+
+public:
+  explicit dheap(const LESS &less = LESS())
+    : free_(nohandle), heap_(true), less_(less) {}
+
+  size_t size() const { return body_.size(); }
+  bool empty() const { return body_.empty(); }
+
+  void reserve(size_t n) {
+    body_.reserve(n);
+    pos_.reserve(n);
+    values_.reserve(n);
+  }
+
+  void clear() {
+    body_.clear();
+    pos_.clear();
+    values_.clear();
+    free_ = nohandle;
+    heap_ = true;
+  }
+
+  handle_type push(const K &key, const V &value) {
+    assert(heap_);
+    entry e;
+    e.key_ = key;
+    e.handle_ = new_handle(value);
+    body_.push_back(e);
+    sift_up(body_.size() - 1);
+    return e.handle_;
+  }
+
+  // Add an element without keeping the heap property.  Call heapify()
+  // before using any other operation.
+  handle_type append(const K &key, const V &value) {
+    entry e;
+    e.key_ = key;
+    e.handle_ = new_handle(value);
+    pos_[e.handle_] = body_.size();
+    body_.push_back(e);
+    heap_ = false;
+    return e.handle_;
+  }
+
+  // Floyd's bottom-up construction; O(n).
+  void heapify() {
+    unsigned n = body_.size();
+
+    if (n > 1)
+      for (unsigned i = (n - 2) / D + 1; i-- > 0;)
+        sift_down(i);
+    heap_ = true;
+  }
+
+  template <class InputIterator>
+  void heapify(InputIterator first, InputIterator last) {
+    for (; first != last; ++first)
+      append(first->first, first->second);
+    heapify();
+  }
+
+  handle_type top() const {
+    assert(heap_ && !body_.empty());
+    return body_[0].handle_;
+  }
+  const K &top_key() const {
+    assert(heap_ && !body_.empty());
+    return body_[0].key_;
+  }
+  V &top_value() {
+    assert(heap_ && !body_.empty());
+    return values_[body_[0].handle_];
+  }
+
+  void pop() {
+    assert(heap_ && !body_.empty());
+    remove_at(0);
+  }
+
+  const K &key(handle_type h) const { return body_[pos_[h]].key_; }
+  V &value(handle_type h) { return values_[h]; }
+  const V &value(handle_type h) const { return values_[h]; }
+
+  // KEY must not be greater than the current key of H.
+  void decrease_key(handle_type h, const K &key) {
+    assert(heap_);
+    unsigned i = pos_[h];
+    assert(!less_(body_[i].key_, key));
+    body_[i].key_ = key;
+    sift_up(i);
+  }
+
+  // Change the key of H to KEY in either direction.
+  void update(handle_type h, const K &key) {
+    assert(heap_);
+    unsigned i = pos_[h];
+    bool up = less_(key, body_[i].key_);
+    body_[i].key_ = key;
+    if (up)
+      sift_up(i);
+    else
+      sift_down(i);
+  }
+
+  void erase(handle_type h) {
+    assert(heap_);
+    remove_at(pos_[h]);
+  }
+};
+
+#endif  /* DHEAP_HH__ */
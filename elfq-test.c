@@ -0,0 +1,236 @@
+/*
+ * Test and benchmark of elfq.h against a mutex with edque_*()
+ *
+ *   $ cc -O2 -mcx16 -o elfq-test elfq-test.c -lpthread
+ *   $ ./elfq-test [NITEMS] [NPRODUCERS]
+ *
+ * - stack: NPRODUCERS threads pop an element from a shared pool and
+ *   push it back, NITEMS times each.
+ * - mpsc: NPRODUCERS threads push NITEMS elements each to one consumer.
+ * - spsc: one thread pushes NITEMS elements to another.
+ *
+ * The tests check that no element is lost or duplicated, and that the
+ * queues keep the order of each producer.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <pthread.h>
+#include <sched.h>
+#include <sys/time.h>
+#include "elfq.h"
+
+struct item {
+  struct elist link;
+  int producer;
+  long seq;
+};
+
+enum { M_MUTEX, M_LOCKFREE };
+
+static int method;
+static long nitems;
+static int nproducers;
+
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static struct elist dque;       /* for M_MUTEX */
+static struct estack stack;
+static struct empscq mpscq;
+static struct espscq spscq;
+
+static struct item *items;
+
+static double
+now(void)
+{
+  struct timeval tv;
+  gettimeofday(&tv, 0);
+  return tv.tv_sec + tv.tv_usec / 1e6;
+}
+
+
+/* stack */
+static void *
+stack_worker(void *arg)
+{
+  struct elist *lp;
+  long i;
+
+  (void)arg;
+  for (i = 0; i < nitems; i++) {
+    if (method == M_MUTEX) {
+      pthread_mutex_lock(&lock);
+      lp = edque_pop_back(&dque);
+      pthread_mutex_unlock(&lock);
+    }
+    else
+      lp = estack_pop(&stack);
+    if (!lp) {
+      sched_yield();
+      continue;
+    }
+    ELIST_ENTRY(lp, struct item, link)->seq++;
+    if (method == M_MUTEX) {
+      pthread_mutex_lock(&lock);
+      edque_push_back(&dque, lp);
+      pthread_mutex_unlock(&lock);
+    }
+    else
+      estack_push(&stack, lp);
+  }
+  return 0;
+}
+
+static int
+run_stack(double *sec)
+{
+  pthread_t tid[64];
+  struct elist *lp;
+  long npool = nproducers * 4, i, n = 0;
+  int t;
+
+  edque_init(&dque);
+  estack_init(&stack);
+  for (i = 0; i < npool; i++) {
+    items[i].seq = 0;
+    if (method == M_MUTEX)
+      edque_push_back(&dque, &items[i].link);
+    else
+      estack_push(&stack, &items[i].link);
+  }
+
+  *sec = now();
+  for (t = 0; t < nproducers; t++)
+    pthread_create(&tid[t], 0, stack_worker, 0);
+  for (t = 0; t < nproducers; t++)
+    pthread_join(tid[t], 0);
+  *sec = now() - *sec;
+
+  /* Every element must be there exactly once. */
+  for (i = 0; i < npool; i++)
+    items[i].producer = 0;
+  while ((lp = (method == M_MUTEX) ? edque_pop_back(&dque)
+          : estack_pop(&stack)) != 0) {
+    if (ELIST_ENTRY(lp, struct item, link)->producer++)
+      return -1;
+    n++;
+  }
+  return (n == npool) ? 0 : -1;
+}
+
+
+/* mpsc and spsc */
+static void *
+producer(void *arg)
+{
+  int id = (int)(long)arg;
+  struct item *it = items + (long)id * nitems;
+  long i;
+
+  for (i = 0; i < nitems; i++, it++) {
+    it->producer = id;
+    it->seq = i;
+    if (method == M_MUTEX) {
+      pthread_mutex_lock(&lock);
+      edque_push_back(&dque, &it->link);
+      pthread_mutex_unlock(&lock);
+    }
+    else if (nproducers > 1)
+      empscq_push(&mpscq, &it->link);
+    else {
+      while (espscq_push(&spscq, &it->link) < 0)
+        sched_yield();
+    }
+  }
+  return 0;
+}
+
+static int
+run_queue(double *sec)
+{
+  static struct elist *ring[1024];
+  pthread_t tid[64];
+  struct elist *lp;
+  struct item *it;
+  long *expect, total = nitems * nproducers, n = 0;
+  int t, ret = 0;
+
+  edque_init(&dque);
+  empscq_init(&mpscq);
+  espscq_init(&spscq, ring, 1024);
+  expect = calloc(nproducers, sizeof(*expect));
+
+  *sec = now();
+  for (t = 0; t < nproducers; t++)
+    pthread_create(&tid[t], 0, producer, (void *)(long)t);
+
+  while (n < total) {
+    if (method == M_MUTEX) {
+      pthread_mutex_lock(&lock);
+      lp = edque_pop_front(&dque);
+      pthread_mutex_unlock(&lock);
+    }
+    else if (nproducers > 1)
+      lp = empscq_pop(&mpscq);
+    else
+      lp = espscq_pop(&spscq);
+    if (!lp) {
+      sched_yield();
+      continue;
+    }
+    it = ELIST_ENTRY(lp, struct item, link);
+    if (it->seq != expect[it->producer]++)
+      ret = -1;
+    n++;
+  }
+  *sec = now() - *sec;
+
+  for (t = 0; t < nproducers; t++)
+    pthread_join(tid[t], 0);
+  free(expect);
+  return ret;
+}
+
+
+int
+main(int argc, char *argv[])
+{
+  static const char *names[] = { "mutex+edque", "lock-free" };
+  double sec;
+  int np;
+
+  nitems = (argc > 1) ? atol(argv[1]) : 1000000;
+  np = (argc > 2) ? atoi(argv[2]) : 4;
+  if (np < 1 || np > 64)
+    np = 4;
+
+  /* edque_push_back() to an empty deque expects a zeroed link. */
+  items = calloc(nitems * np, sizeof(*items));
+
+  for (method = M_MUTEX; method <= M_LOCKFREE; method++) {
+    nproducers = np;
+    if (run_stack(&sec) < 0) {
+      fprintf(stderr, "elfq-test: %s stack test failed\n", names[method]);
+      return 1;
+    }
+    printf("%-12s stack %2d threads: %8.2f Mops/s\n", names[method], np,
+           nitems * np * 2 / sec / 1e6);
+
+    if (run_queue(&sec) < 0) {
+      fprintf(stderr, "elfq-test: %s mpsc test failed\n", names[method]);
+      return 1;
+    }
+    printf("%-12s mpsc  %2d producers: %6.2f Mops/s\n", names[method], np,
+           nitems * np / sec / 1e6);
+
+    nproducers = 1;
+    if (run_queue(&sec) < 0) {
+      fprintf(stderr, "elfq-test: %s spsc test failed\n", names[method]);
+      return 1;
+    }
+    printf("%-12s spsc   1 producer:  %6.2f Mops/s\n", names[method],
+           nitems / sec / 1e6);
+  }
+
+  free(items);
+  return 0;
+}
@@ -0,0 +1,296 @@
+/* Embedded lock-free stack and queues
+ * Copyright (C) 2014  Seong-Kook Shin <cinsky@gmail.com>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Library General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Library General Public License for more details.
+ *
+ * You should have received a copy of the GNU Library General Public
+ * License along with this library; if not, write to the Free
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+#ifndef ELFQ_H_
+#define ELFQ_H_
+
+/*
+ * Lock-free counterparts of the edque functions in elist.h.  The
+ * elements embed the same struct elist (only its 'next' is used), and
+ * ELIST_ENTRY() gets the enclosing struct back, so an element can move
+ * between a mutex-protected elist and these without any allocation.
+ *
+ * estack  -- Treiber stack; any number of pushers and poppers.
+ * empscq  -- FIFO queue (Vyukov); any number of producers, one consumer.
+ * espscq  -- bounded FIFO ring; one producer, one consumer, wait-free.
+ *
+ *   struct job {
+ *     struct elist link;
+ *     ...
+ *   };
+ *
+ *   struct empscq jobs;
+ *
+ *   empscq_init(&jobs);
+ *   ...
+ *   empscq_push(&jobs, &job->link);             // any thread
+ *   ...
+ *   while ((lp = empscq_pop(&jobs)) != 0)       // the consumer thread
+ *     run(ELIST_ENTRY(lp, struct job, link));
+ *
+ * None of them blocks; use a condition variable or an eventfd to wait
+ * for elements.
+ *
+ * estack uses a double-width compare-and-swap; on x86-64, build with
+ * -mcx16 to inline it, or link with -latomic.
+ */
+
+#include "elist.h"
+
+BEGIN_C_DECLS
+
+#define ELFQ_CACHELINE  64
+
+
+/*
+ * estack -- A stack with a generation tag next to the top pointer, so
+ * that a pop does not succeed with a stale 'next' if the top was
+ * popped and pushed back meanwhile (the ABA problem).
+ *
+ * estack_pop() reads the 'next' of an element that another thread may
+ * have just popped, so the elements must stay readable memory while
+ * the stack is in use (e.g. a free list of a pool), not be free()d.
+ */
+struct estack {
+  struct elist *top;
+  unsigned long tag;
+} __attribute__((aligned(2 * sizeof(void *))));
+
+#define ESTACK_INITIALIZER      { 0, 0 }
+
+
+static __inline__ void
+estack_init(struct estack *s)
+{
+  s->top = 0;
+  s->tag = 0;
+}
+
+
+static __inline__ int
+estack_cas_(struct estack *s, struct estack *expected, struct estack desired)
+{
+#if defined(__x86_64__) && defined(__GCC_HAVE_SYNC_COMPARE_AND_SWAP_16)
+  union { struct estack s; unsigned __int128 w; } e, d, old;
+
+  e.s = *expected;
+  d.s = desired;
+  old.w = __sync_val_compare_and_swap((unsigned __int128 *)s, e.w, d.w);
+  if (old.w == e.w)
+    return 1;
+  *expected = old.s;
+  return 0;
+#else
+  return __atomic_compare_exchange(s, expected, &desired, 0,
+                                   __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE);
+#endif
+}
+
+
+static __inline__ void
+estack_snapshot_(struct estack *s, struct estack *snap)
+{
+  /* A torn read only fails the following CAS. */
+  snap->tag = __atomic_load_n(&s->tag, __ATOMIC_ACQUIRE);
+  snap->top = __atomic_load_n(&s->top, __ATOMIC_ACQUIRE);
+}
+
+
+static __inline__ void
+estack_push(struct estack *s, struct elist *node)
+{
+  struct estack old, new_;
+
+  estack_snapshot_(s, &old);
+  do {
+    __atomic_store_n(&node->next, old.top, __ATOMIC_RELAXED);
+    new_.top = node;
+    new_.tag = old.tag + 1;
+  } while (!estack_cas_(s, &old, new_));
+}
+
+
+static __inline__ struct elist *
+estack_pop(struct estack *s)
+{
+  struct estack old, new_;
+
+  estack_snapshot_(s, &old);
+  do {
+    if (!old.top)
+      return 0;
+    new_.top = __atomic_load_n(&old.top->next, __ATOMIC_RELAXED);
+    new_.tag = old.tag + 1;
+  } while (!estack_cas_(s, &old, new_));
+
+  /* Racy with the load above in other poppers; harmless, see above. */
+  __atomic_store_n(&old.top->next, 0, __ATOMIC_RELAXED);
+  return old.top;
+}
+
+
+/*
+ * empscq -- Dmitry Vyukov's intrusive MPSC queue.  A push is one
+ * atomic exchange, and never waits.  A pop may return NULL while a
+ * producer is between its two steps even though the queue is not
+ * empty; the element shows up on a later pop.
+ *
+ * The queue must not move in memory after empscq_init(), since it
+ * holds a pointer to its own 'stub'.
+ */
+struct empscq {
+  struct elist *head __attribute__((aligned(ELFQ_CACHELINE)));
+  struct elist *tail __attribute__((aligned(ELFQ_CACHELINE)));
+  struct elist stub;
+};
+
+
+static __inline__ void
+empscq_init(struct empscq *q)
+{
+  q->stub.next = q->stub.prev = 0;
+  q->head = q->tail = &q->stub;
+}
+
+
+static __inline__ void
+empscq_push(struct empscq *q, struct elist *node)
+{
+  struct elist *prev;
+
+  node->next = 0;
+  prev = __atomic_exchange_n(&q->head, node, __ATOMIC_ACQ_REL);
+  /* The queue is cut here until the next line; see empscq_pop(). */
+  __atomic_store_n(&prev->next, node, __ATOMIC_RELEASE);
+}
+
+
+static __inline__ struct elist *
+empscq_pop(struct empscq *q)
+{
+  struct elist *tail = q->tail, *next, *head;
+
+  next = __atomic_load_n(&tail->next, __ATOMIC_ACQUIRE);
+  if (tail == &q->stub) {
+    if (!next)
+      return 0;
+    q->tail = tail = next;
+    next = __atomic_load_n(&next->next, __ATOMIC_ACQUIRE);
+  }
+  if (next) {
+    q->tail = next;
+    tail->next = 0;
+    return tail;
+  }
+
+  head = __atomic_load_n(&q->head, __ATOMIC_ACQUIRE);
+  if (tail != head)
+    return 0;                   /* a producer is in the middle */
+
+  /* TAIL is the last one; put the stub behind it to take it out. */
+  empscq_push(q, &q->stub);
+  next = __atomic_load_n(&tail->next, __ATOMIC_ACQUIRE);
+  if (next) {
+    q->tail = next;
+    tail->next = 0;
+    return tail;
+  }
+  return 0;
+}
+
+
+static __inline__ int
+empscq_empty(struct empscq *q)
+{
+  return q->tail == &q->stub &&
+    !__atomic_load_n(&q->stub.next, __ATOMIC_ACQUIRE);
+}
+
+
+/*
+ * espscq -- A ring of element pointers for one producer and one
+ * consumer.  The ring is provided by the caller, and its size must be
+ * a power of two.  Each side caches the index of the other side, so a
+ * push or a pop touches the shared cache line only when the cached
+ * index says the ring is full or empty.
+ */
+struct espscq {
+  struct elist **ring;
+  unsigned long mask;
+
+  unsigned long head __attribute__((aligned(ELFQ_CACHELINE)));
+  unsigned long tail_cache;     /* the producer's copy of TAIL */
+
+  unsigned long tail __attribute__((aligned(ELFQ_CACHELINE)));
+  unsigned long head_cache;     /* the consumer's copy of HEAD */
+};
+
+
+/*
+ * Returns 0 on success, or -1 if SIZE is not a power of two.
+ */
+static __inline__ int
+espscq_init(struct espscq *q, struct elist **ring, unsigned long size)
+{
+  if (size == 0 || (size & (size - 1)))
+    return -1;
+  q->ring = ring;
+  q->mask = size - 1;
+  q->head = q->tail_cache = 0;
+  q->tail = q->head_cache = 0;
+  return 0;
+}
+
+
+/*
+ * Returns 0 on success, or -1 if the ring is full.
+ */
+static __inline__ int
+espscq_push(struct espscq *q, struct elist *node)
+{
+  unsigned long head = q->head;
+
+  if (head - q->tail_cache > q->mask) {
+    q->tail_cache = __atomic_load_n(&q->tail, __ATOMIC_ACQUIRE);
+    if (head - q->tail_cache > q->mask)
+      return -1;
+  }
+  q->ring[head & q->mask] = node;
+  __atomic_store_n(&q->head, head + 1, __ATOMIC_RELEASE);
+  return 0;
+}
+
+
+static __inline__ struct elist *
+espscq_pop(struct espscq *q)
+{
+  unsigned long tail = q->tail;
+  struct elist *node;
+
+  if (tail == q->head_cache) {
+    q->head_cache = __atomic_load_n(&q->head, __ATOMIC_ACQUIRE);
+    if (tail == q->head_cache)
+      return 0;
+  }
+  node = q->ring[tail & q->mask];
+  __atomic_store_n(&q->tail, tail + 1, __ATOMIC_RELEASE);
+  return node;
+}
+
+END_C_DECLS
+
+#endif /* ELFQ_H_ */
@@ -225,7 +225,7 @@ obstack_1grow_(struct obstack *stack, char data,
   void *p;
 
   if (!stack->grow) {
-    if (stack->current - 1 >= stack->num_ptrs) {
+    if (stack->current + 1 >= stack->num_ptrs) {
       if (grow_ptrs(stack, realloc_func) < 0)
         return;
     }
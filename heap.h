@@ -52,11 +52,12 @@
 #define HEAP_MAKE_ROOM_(heap, result)                           \
   do {                                                          \
     void *p;                                                    \
+    (result) = 1;                                               \
     if (!(heap)->body || (heap)->end >= (heap)->size) {         \
       p = realloc((heap)->body,                                 \
                   (heap)->size * 2  * sizeof((heap)->body[0])); \
       if (p) {                                                  \
-        (heap)->body = p;                                       \
+        (heap)->body = (__typeof__((heap)->body))p;             \
         (heap)->size = (heap)->size * 2;                        \
         (result) = 1;                                           \
       }                                                         \
@@ -138,9 +139,260 @@
 
 
 #define HEAP_POP(type, heap)                    \
-      ({ typeof((heap)->body[0]) result;        \
+      ({ __typeof__((heap)->body[0]) result;    \
          HEAP_POP_(type, heap, result);         \
          result; })
 #endif  /* __GNUC__ */
 
+
+/*
+ * D-ary heap with inline keys and stable handles.
+ *
+ * HEAP_* macros above keep pointers to the elements, so that every
+ * comparison dereferences two pointers, and there is no way to find
+ * an element to change its priority.  DHEAP_DEFINE() defines a heap
+ * type NAME that stores KEY_TYPE keys inline in one array, and a set
+ * of static functions on it:
+ *
+ *   void     NAME_init(NAME *h);
+ *   void     NAME_free(NAME *h);
+ *   int      NAME_reserve(NAME *h, unsigned n);     0 on success
+ *   unsigned NAME_push(NAME *h, KEY_TYPE key, VALUE_TYPE value);
+ *   unsigned NAME_append(NAME *h, KEY_TYPE key, VALUE_TYPE value);
+ *   void     NAME_heapify(NAME *h);
+ *   int      NAME_top(NAME *h, KEY_TYPE *key, VALUE_TYPE *value);
+ *   int      NAME_pop(NAME *h, KEY_TYPE *key, VALUE_TYPE *value);
+ *   void     NAME_decrease_key(NAME *h, unsigned handle, KEY_TYPE key);
+ *   void     NAME_update(NAME *h, unsigned handle, KEY_TYPE key);
+ *   void     NAME_erase(NAME *h, unsigned handle);
+ *
+ * NAME_push() returns a handle of the new element, or DHEAP_NOHANDLE
+ * if it failed to allocate memory.  The handle is valid until the
+ * element is popped or erased.  NAME_top() and NAME_pop() return zero
+ * if the heap is empty; KEY and VALUE may be NULL.
+ *
+ * LESS(a, b) compares two keys; the top of the heap is the smallest
+ * key, which is the opposite of HEAP_* macros.  For example, a timer
+ * queue:
+ *
+ *   #define DEADLINE_LESS(a, b)     ((a) < (b))
+ *   DHEAP_DEFINE(timerq, time_t, struct conn *, DEADLINE_LESS);
+ *
+ *   timerq q;
+ *   timerq_init(&q);
+ *   c->timer = timerq_push(&q, time(0) + 30, c);
+ *   ...
+ *   timerq_update(&q, c->timer, time(0) + 30);
+ *
+ * For bulk loading, call NAME_append() for each element, then
+ * NAME_heapify() once, which runs in O(n).
+ *
+ * The arity is DHEAP_ARITY (4 by default).  The C++ version is dheap
+ * in dheap.hh.
+ */
+#ifndef DHEAP_ARITY
+#define DHEAP_ARITY     4
+#endif
+
+#define DHEAP_NOHANDLE  ((unsigned)-1)
+
+#define DHEAP_DEFINE(name, key_type, value_type, less)                  \
+  typedef struct {                                                      \
+    key_type key;                                                       \
+    unsigned handle;                                                    \
+  } name##_entry_;                                                      \
+                                                                        \
+  typedef struct {                                                      \
+    name##_entry_ *body;                                                \
+    unsigned *pos;            /* handle -> index, or next free handle */ \
+    value_type *values;       /* handle -> value */                     \
+    unsigned end;                                                       \
+    unsigned size;                                                      \
+    unsigned free_handle;                                               \
+  } name;                                                               \
+                                                                        \
+  static __inline__ void                                                \
+  name##_init(name *h)                                                  \
+  {                                                                     \
+    h->body = 0;                                                        \
+    h->pos = 0;                                                         \
+    h->values = 0;                                                      \
+    h->end = h->size = 0;                                               \
+    h->free_handle = DHEAP_NOHANDLE;                                    \
+  }                                                                     \
+                                                                        \
+  static __inline__ void                                                \
+  name##_free(name *h)                                                  \
+  {                                                                     \
+    free(h->body);                                                      \
+    free(h->pos);                                                       \
+    free(h->values);                                                    \
+    name##_init(h);                                                     \
+  }                                                                     \
+                                                                        \
+  static __inline__ int                                                 \
+  name##_reserve(name *h, unsigned n)                                   \
+  {                                                                     \
+    void *p;                                                            \
+    if (n <= h->size)                                                   \
+      return 0;                                                         \
+    p = realloc(h->body, n * sizeof(h->body[0]));                       \
+    if (!p)                                                             \
+      return -1;                                                        \
+    h->body = (name##_entry_ *)p;                                       \
+    p = realloc(h->pos, n * sizeof(h->pos[0]));                         \
+    if (!p)                                                             \
+      return -1;                                                        \
+    h->pos = (unsigned *)p;                                             \
+    p = realloc(h->values, n * sizeof(h->values[0]));                   \
+    if (!p)                                                             \
+      return -1;                                                        \
+    h->values = (value_type *)p;                                        \
+    h->size = n;                                                        \
+    return 0;                                                           \
+  }                                                                     \
+                                                                        \
+  static __inline__ void                                                \
+  name##_sift_up_(name *h, unsigned i)                                  \
+  {                                                                     \
+    name##_entry_ e = h->body[i];                                       \
+    while (i > 0) {                                                     \
+      unsigned parent = (i - 1) / DHEAP_ARITY;                          \
+      if (!less(e.key, h->body[parent].key))                            \
+        break;                                                          \
+      h->body[i] = h->body[parent];                                     \
+      h->pos[h->body[i].handle] = i;                                    \
+      i = parent;                                                       \
+    }                                                                   \
+    h->body[i] = e;                                                     \
+    h->pos[e.handle] = i;                                               \
+  }                                                                     \
+                                                                        \
+  static __inline__ void                                                \
+  name##_sift_down_(name *h, unsigned i)                                \
+  {                                                                     \
+    name##_entry_ e = h->body[i];                                       \
+    while (1) {                                                         \
+      unsigned c, best, last, first = i * DHEAP_ARITY + 1;              \
+      if (first >= h->end)                                              \
+        break;                                                          \
+      last = (first + DHEAP_ARITY < h->end) ?                           \
+        first + DHEAP_ARITY : h->end;                                   \
+      best = first;                                                     \
+      for (c = first + 1; c < last; c++)                                \
+        if (less(h->body[c].key, h->body[best].key))                    \
+          best = c;                                                     \
+      if (!less(h->body[best].key, e.key))                              \
+        break;                                                          \
+      h->body[i] = h->body[best];                                       \
+      h->pos[h->body[i].handle] = i;                                    \
+      i = best;                                                         \
+    }                                                                   \
+    h->body[i] = e;                                                     \
+    h->pos[e.handle] = i;                                               \
+  }                                                                     \
+                                                                        \
+  static __inline__ unsigned                                            \
+  name##_append(name *h, key_type key, value_type value)                \
+  {                                                                     \
+    unsigned handle;                                                    \
+    if (h->end >= h->size &&                                            \
+        name##_reserve(h, (h->size) ? h->size * 2 : 64) < 0)            \
+      return DHEAP_NOHANDLE;                                            \
+    if (h->free_handle != DHEAP_NOHANDLE) {                             \
+      handle = h->free_handle;                                          \
+      h->free_handle = h->pos[handle];                                  \
+    }                                                                   \
+    else                                                                \
+      handle = h->end;                                                  \
+    h->values[handle] = value;                                          \
+    h->body[h->end].key = key;                                          \
+    h->body[h->end].handle = handle;                                    \
+    h->pos[handle] = h->end++;                                          \
+    return handle;                                                      \
+  }                                                                     \
+                                                                        \
+  static __inline__ void                                                \
+  name##_heapify(name *h)                                               \
+  {                                                                     \
+    unsigned i;                                                         \
+    if (h->end > 1)                                                     \
+      for (i = (h->end - 2) / DHEAP_ARITY + 1; i-- > 0;)                \
+        name##_sift_down_(h, i);                                        \
+  }                                                                     \
+                                                                        \
+  static __inline__ unsigned                                            \
+  name##_push(name *h, key_type key, value_type value)                  \
+  {                                                                     \
+    unsigned handle = name##_append(h, key, value);                     \
+    if (handle != DHEAP_NOHANDLE)                                       \
+      name##_sift_up_(h, h->end - 1);                                   \
+    return handle;                                                      \
+  }                                                                     \
+                                                                        \
+  static __inline__ int                                                 \
+  name##_top(name *h, key_type *key, value_type *value)                 \
+  {                                                                     \
+    if (h->end == 0)                                                    \
+      return 0;                                                         \
+    if (key)                                                            \
+      *key = h->body[0].key;                                            \
+    if (value)                                                          \
+      *value = h->values[h->body[0].handle];                            \
+    return 1;                                                           \
+  }                                                                     \
+                                                                        \
+  static __inline__ void                                                \
+  name##_remove_at_(name *h, unsigned i)                                \
+  {                                                                     \
+    unsigned handle = h->body[i].handle;                                \
+    if (i != --h->end) {                                                \
+      h->body[i] = h->body[h->end];                                     \
+      h->pos[h->body[i].handle] = i;                                    \
+      if (i > 0 &&                                                      \
+          less(h->body[i].key, h->body[(i - 1) / DHEAP_ARITY].key))     \
+        name##_sift_up_(h, i);                                          \
+      else                                                              \
+        name##_sift_down_(h, i);                                        \
+    }                                                                   \
+    h->pos[handle] = h->free_handle;                                    \
+    h->free_handle = handle;                                            \
+  }                                                                     \
+                                                                        \
+  static __inline__ int                                                 \
+  name##_pop(name *h, key_type *key, value_type *value)                 \
+  {                                                                     \
+    if (!name##_top(h, key, value))                                     \
+      return 0;                                                         \
+    name##_remove_at_(h, 0);                                            \
+    return 1;                                                           \
+  }                                                                     \
+                                                                        \
+  static __inline__ void                                                \
+  name##_decrease_key(name *h, unsigned handle, key_type key)           \
+  {                                                                     \
+    h->body[h->pos[handle]].key = key;                                  \
+    name##_sift_up_(h, h->pos[handle]);                                 \
+  }                                                                     \
+                                                                        \
+  static __inline__ void                                                \
+  name##_update(name *h, unsigned handle, key_type key)                 \
+  {                                                                     \
+    unsigned i = h->pos[handle];                                        \
+    int up = less(key, h->body[i].key);                                 \
+    h->body[i].key = key;                                               \
+    if (up)                                                             \
+      name##_sift_up_(h, i);                                            \
+    else                                                                \
+      name##_sift_down_(h, i);                                          \
+  }                                                                     \
+                                                                        \
+  static __inline__ void                                                \
+  name##_erase(name *h, unsigned handle)                                \
+  {                                                                     \
+    name##_remove_at_(h, h->pos[handle]);                               \
+  }                                                                     \
+                                                                        \
+  typedef int name##_dummy_
+
 #endif  /* HEAP_H__ */
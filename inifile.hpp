@@ -90,10 +90,15 @@ public:
   inifile();
   ~inifile();
 
-  // Load the INI file.
+  // Load the INI file, with iniview (see iniview.hpp).  If CACHE is
+  // true, the parameters are taken from the image PATHNAME.cache if
+  // the file did not change since it was written, and otherwise the
+  // image is written after parsing (see confcache.h).  CACHE has no
+  // effect if something was loaded before.  inifile.cc links with
+  // confcache.c for this, whether CACHE is used or not.
   //
   // Returns true if parsing was successful, otherwise returns false.
-  bool load(const char *pathname);
+  bool load(const char *pathname, bool cache = false);
 
   // Return the SECTION_NAME section if exists.
   const section_type *section(const std::string &section_name = "") const;
@@ -117,39 +122,13 @@ public:
   size_type size() const        { return config_.size(); }
 
 private:
-  typedef std::ifstream::char_type char_type;
-  typedef std::ifstream::int_type int_type;
-  typedef std::ifstream::traits_type traits_type;
-
   section_type *create_section(const std::string &name = "");
-  bool register_parameter(section_type *sect,
-                          const std::string &name, const std::string &value);
-
-  void incr_lineno(int amount = 1) { lineno_ += amount; }
-  void incr_lineno(std::istream &is, const std::string &s);
-
-  void eat_spaces(std::istream &is, char_type lookahead = 0);
-  void eat_comment(std::istream &is, char_type lookahead = 0);
-  bool get_section_name(std::string &name,
-                       std::istream &is, char_type lookahead = 0);
-
-  bool get_param_name(std::string &name,
-                      std::istream &is, char_type lookahead = 0);
-  bool get_param_value(std::string &name,
-                       std::istream &is, char_type lookahead = 0);
-
-  bool get_esc_hex(int_type &value, std::istream &is);
-  bool get_esc_oct(int_type &value, std::istream &is);
-
-
-  const std::string &filename() { return filename_; }
-  long lineno() { return lineno_; }
-  std::ostream *estream() { return es_; }
+  bool load_image(const char *pathname);
+  void save_image(const char *pathname, const struct stat *st);
 
   const std::locale locale_;
 
   std::string filename_;
-  long lineno_;
   std::ostream *es_;
   config_type config_;
 };
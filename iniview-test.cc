@@ -0,0 +1,516 @@
+/*
+ * Test and benchmark of iniview
+ *
+ *   $ g++ -O2 -std=c++17 -o iniview-test iniview-test.cc iniview.cc inifile.cc \
+ *       confcache.c
+ *   $ ./iniview-test [MEGABYTES [NFILES]]
+ *
+ * The benchmark writes a synthetic INI file of MEGABYTES (50 by default)
+ * to $TMPDIR, with 64 parameters per section, some of them quoted and
+ * some with escape sequences and comments, and loads it with iniview
+ * and with inifile, without and with its confcache image.
+ *
+ * Then it splits the same amount into a directory of NFILES (64 by
+ * default) fragments, like a conf.d directory, loads them with one
+ * thread and with one thread per CPU, and builds an iniindex of them.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "iniview.hpp"
+#include "inifile.hpp"
+#include "confcache.h"
+#include "difftime.h"
+
+static const char sample[] =
+  "; a comment\n"
+  "top = level   # comment\n"
+  "\n"
+  "[ server ]   \n"
+  "  host = example.com  \n"
+  "  port=8080;comment\n"
+  "  name with space = a value with space\r\n"
+  "  empty =\n"
+  "  quoted = \"a ; b # c\"  ; comment\n"
+  "  single = 'say \"hi\"'\n"
+  "  escaped = \"tab\\there\\n\\x41\\101\\\\\\\"\"\n"
+  "  multi = \"line 1\n"
+  "line 2\"\n"
+  "[client]\n"
+  "  host = first\n"
+  "[server]\n"
+  "  port = 9090\n"
+  "[client]\n"
+  "  host = second\n";
+
+static int
+test()
+{
+  std::ostringstream err;
+  iniview ini;
+
+  ini.error_stream(&err);
+  if (!ini.load(sample, sizeof(sample) - 1, "sample"))
+    return -1;
+  if (!err.str().empty())
+    return -1;
+  if (ini.size() != 3)
+    return -1;
+  if (ini.get("", "top") != "level")
+    return -1;
+  if (ini.get("server", "host") != "example.com")
+    return -1;
+  if (ini.get("server", "port") != "9090")
+    return -1;
+  if (ini.get("server", "name with space") != "a value with space")
+    return -1;
+  if (ini.get("server", "empty", "x") != "")
+    return -1;
+  if (ini.get("server", "quoted") != "a ; b # c")
+    return -1;
+  if (ini.get("server", "single") != "say \"hi\"")
+    return -1;
+  if (ini.get("server", "escaped") != "tab\there\nAA\\\"")
+    return -1;
+  if (ini.get("server", "multi") != "line 1\nline 2")
+    return -1;
+  if (ini.get("client", "host") != "second")
+    return -1;
+  if (ini.get("client", "port", "none") != "none")
+    return -1;
+  if (ini.section("nothing") != 0)
+    return -1;
+
+  // An unescaped value is a view into the buffer.
+  iniview::string_view v = ini.get("server", "host");
+  if (v.data() < sample || v.data() >= sample + sizeof(sample))
+    return -1;
+
+  // A later load() overrides, and a failed one changes nothing.
+  static const char more[] = "[server]\nport = 1\nnew = 2\n";
+  if (!ini.load(more, sizeof(more) - 1, "more"))
+    return -1;
+  if (ini.get("server", "port") != "1" || ini.get("server", "new") != "2")
+    return -1;
+  if (ini.get("server", "host") != "example.com")
+    return -1;
+
+  static const char *bad[] = {
+    "[server\nx = 1\n",
+    "[s]\nno equal sign\n",
+    "[s]\nx = \"unterminated\n",
+    "[s]\nx = \"\\x4g\"\n",
+    "[s]\nx = \"\\19\"\n",
+  };
+  for (size_t i = 0; i < sizeof(bad) / sizeof(bad[0]); i++) {
+    err.str("");
+    if (ini.load(bad[i], strlen(bad[i]), "bad"))
+      return -1;
+    if (err.str().compare(0, 6, "bad:2:") != 0 &&
+        err.str().compare(0, 6, "bad:1:") != 0 &&
+        err.str().compare(0, 6, "bad:3:") != 0)
+      return -1;
+  }
+  if (ini.get("s", "x", "none") != "none")
+    return -1;
+
+  err.str("");
+  static const char garbage[] = "x = 'a' b\n";
+  if (!ini.load(garbage, sizeof(garbage) - 1, "garbage"))
+    return -1;
+  if (err.str().find("garbage:1: warning:") != 0)
+    return -1;
+  return 0;
+}
+
+
+static int
+test_file(const char *path)
+{
+  FILE *fp = fopen(path, "w");
+  if (fp == NULL)
+    return -1;
+  fwrite(sample, 1, sizeof(sample) - 1, fp);
+  fclose(fp);
+
+  inifile conf;
+  if (!conf.load(path))
+    return -1;
+  if (conf.size() != 3)
+    return -1;
+  if ((*conf.section("server"))["port"] != "9090")
+    return -1;
+  if ((*conf.section("server"))["escaped"] != "tab\there\nAA\\\"")
+    return -1;
+  if ((*conf.section())["top"] != "level")
+    return -1;
+
+  iniview ini;
+  if (!ini.load(path))
+    return -1;
+  if (ini.get("client", "host") != "second")
+    return -1;
+
+  // The first load writes the image, the second one reads it.
+  std::string image = std::string(path) + ".cache";
+  for (int i = 0; i < 2; i++) {
+    inifile cached;
+    if (!cached.load(path, true))
+      return -1;
+    if (access(image.c_str(), F_OK) != 0)
+      return -1;
+    if (cached.size() != conf.size())
+      return -1;
+    for (inifile::iterator j = conf.begin(); j != conf.end(); ++j)
+      if (!cached.section(j->first) ||
+          *cached.section(j->first) != *j->second)
+        return -1;
+  }
+  confcache_t *cc = confcache_open(path, CONFCACHE_INIFILE);
+  if (cc == NULL || confcache_nsections(cc) != 3)
+    return -1;
+  confcache_close(cc);
+  unlink(image.c_str());
+
+  // Empty sections are in the image too.
+  fp = fopen(path, "w");
+  if (fp == NULL)
+    return -1;
+  fputs("[empty]\n[full]\na = 1\n", fp);
+  fclose(fp);
+  for (int i = 0; i < 2; i++) {
+    inifile cached;
+    if (!cached.load(path, true))
+      return -1;
+    if (cached.size() != 2)
+      return -1;
+    if (!cached.section("empty") || !cached.section("empty")->empty())
+      return -1;
+    if ((*cached.section("full"))["a"] != "1")
+      return -1;
+  }
+  unlink(image.c_str());
+  return 0;
+}
+
+
+static int
+write_file(const std::string &path, const char *contents)
+{
+  FILE *fp = fopen(path.c_str(), "w");
+  if (fp == NULL)
+    return -1;
+  fputs(contents, fp);
+  fclose(fp);
+  return 0;
+}
+
+
+static int
+test_dir(const std::string &dir)
+{
+  std::ostringstream err;
+  if (mkdir(dir.c_str(), 0700) != 0)
+    return -1;
+
+  // The last one in the sorted order wins; "b" is the largest, so that
+  // it is likely to finish last.
+  std::string big = "[db]\nhost = b\n";
+  for (int i = 0; i < 10000; i++)
+    big += "[big." + std::to_string(i) + "]\nx = \"\\x41\"\n";
+  if (write_file(dir + "/10-a.ini",
+                 "[db]\nhost = a\nport = 1\n[a]\nx = 1\n") < 0 ||
+      write_file(dir + "/20-b.ini", big.c_str()) < 0 ||
+      write_file(dir + "/30-c.ini",
+                 "[db]\nport = 3\nuser = \"c\\x41\"\n") < 0 ||
+      write_file(dir + "/README", "this is not an INI file\n") < 0)
+    return -1;
+
+  for (unsigned nthreads = 1; nthreads <= 4; nthreads++) {
+    iniview ini;
+    ini.error_stream(&err);
+    if (!ini.load_glob((dir + "/*.ini").c_str(), nthreads))
+      return -1;
+    if (!err.str().empty())
+      return -1;
+    if (ini.size() != 10002)
+      return -1;
+    if (ini.get("db", "host") != "b")
+      return -1;
+    if (ini.get("db", "port") != "3")
+      return -1;
+    if (ini.get("db", "user") != "cA")
+      return -1;
+    if (ini.get("a", "x") != "1")
+      return -1;
+    if (ini.get("big.9999", "x") != "A")
+      return -1;
+
+    iniindex index(ini);
+    if (index.nsections() != 10002)
+      return -1;
+    if (index.size() != 10004)
+      return -1;
+    if (index.get("db", "host") != "b")
+      return -1;
+    if (index.get("db", "user") != "cA")
+      return -1;
+    if (index.get("db", "user").data()[2] != '\0')
+      return -1;
+    if (index.get("big.42", "x") != "A")
+      return -1;
+    if (index.get("db", "x", "none") != "none")
+      return -1;
+    if (index.get("big.42", "host", "none") != "none")
+      return -1;
+    if (index.section_name(0) != "a")
+      return -1;
+    if (index.section_name(index.nsections() - 1) != "db")
+      return -1;
+    size_t k = index.nsections() - 1;
+    if (index.section_end(k) - index.section_begin(k) != 3)
+      return -1;
+    if (index.name(index.section_begin(k)[0]) != "host")
+      return -1;
+    if (index.name(index.section_begin(k)[2]) != "user")
+      return -1;
+
+    // A failed file fails them all, and changes nothing.
+    std::vector<std::string> paths;
+    paths.push_back(dir + "/30-c.ini");
+    paths.push_back(dir + "/README");
+    paths.push_back(dir + "/missing.ini");
+    err.str("");
+    if (ini.load(paths, nthreads))
+      return -1;
+    if (err.str().find("README:1: error:") == std::string::npos)
+      return -1;
+    if (err.str().find("README") >= err.str().find("missing.ini"))
+      return -1;
+    if (ini.get("db", "host") != "b")
+      return -1;
+    if (ini.size() != 10002)
+      return -1;
+    err.str("");
+  }
+
+  iniview ini;
+  if (!ini.load_glob((dir + "/*.nothing").c_str()))
+    return -1;
+  if (ini.size() != 0)
+    return -1;
+  iniindex empty(ini);
+  if (empty.nsections() != 0 || empty.get("", "x", "y") != "y")
+    return -1;
+
+  // Sections, but no parameters at all
+  static const char bare[] = "[x]\n[y]\n";
+  if (!ini.load(bare, sizeof(bare) - 1, "bare"))
+    return -1;
+  iniindex sections(ini);
+  if (sections.nsections() != 2 || sections.size() != 0)
+    return -1;
+  for (size_t i = 0; i < sections.nsections(); i++)
+    if (sections.section_begin(i) != sections.section_end(i))
+      return -1;
+
+  unlink((dir + "/10-a.ini").c_str());
+  unlink((dir + "/20-b.ini").c_str());
+  unlink((dir + "/30-c.ini").c_str());
+  unlink((dir + "/README").c_str());
+  rmdir(dir.c_str());
+  return 0;
+}
+
+
+/* Returns the bytes written to PATH, or 0 if it cannot be written. */
+static size_t
+generate(const char *path, size_t bytes, long first = 0)
+{
+  FILE *fp = fopen(path, "w");
+  size_t size = 0;
+  long s, i;
+
+  if (fp == NULL) {
+    fprintf(stderr, "iniview-test: cannot write %s\n", path);
+    return 0;
+  }
+  for (s = first; size < bytes; s++) {
+    size += fprintf(fp, "\n# section %ld\n[section.%ld]\n", s, s);
+    for (i = 0; i < 64; i++) {
+      switch (i % 8) {
+      case 0:
+        size += fprintf(fp, "  quoted.%ld = \"value %ld; with a comment char\"\n",
+                        i, s * i);
+        break;
+      case 1:
+        size += fprintf(fp, "  escaped.%ld = \"line\\tvalue\\n%ld\"  ; note\n",
+                        i, s + i);
+        break;
+      case 2:
+        size += fprintf(fp, "; a comment line for %ld\n", i);
+        /* fall through */
+      default:
+        size += fprintf(fp, "  key.%ld = plain value number %ld # comment\n",
+                        i, s * 64 + i);
+        break;
+      }
+    }
+  }
+  fclose(fp);
+  return size;
+}
+
+
+static int
+bench_dir(const std::string &dir, size_t megabytes, int nfiles)
+{
+  std::vector<std::string> paths;
+  size_t size = 0, per_file = megabytes * 1024 * 1024 / nfiles, n = 0;
+  bool ok1 = false, ok = false;
+  df_t df;
+
+  if (mkdir(dir.c_str(), 0700) != 0) {
+    fprintf(stderr, "iniview-test: cannot create %s\n", dir.c_str());
+    return -1;
+  }
+  for (int i = 0; i < nfiles; i++) {
+    char name[32];
+    snprintf(name, sizeof(name), "/%03d.ini", i);
+    paths.push_back(dir + name);
+    // The files have no section in common.
+    if ((n = generate(paths.back().c_str(), per_file, i * 100000)) == 0)
+      break;
+    size += n;
+  }
+
+  {
+    iniview ini;
+    DF(df) {
+      ok1 = ini.load_glob((dir + "/*.ini").c_str(), 1);
+    }
+    printf("iniview  %6.1f MB in %d files, %2u threads: %8.1f ms\n",
+           size / 1048576.0, nfiles, 1, df.value / 1e6);
+  }
+
+  iniview ini;
+  DF(df) {
+    ok = ini.load_glob((dir + "/*.ini").c_str());
+  }
+  printf("iniview  %6.1f MB in %d files, %2u threads: %8.1f ms\n",
+         size / 1048576.0, nfiles, std::thread::hardware_concurrency(),
+         df.value / 1e6);
+
+  for (size_t i = 0; i < paths.size(); i++)
+    unlink(paths[i].c_str());
+  rmdir(dir.c_str());
+  if (!ok1 || !ok || n == 0) {
+    fprintf(stderr, "iniview-test: cannot load %s\n", dir.c_str());
+    return -1;
+  }
+
+  iniindex *index = 0;
+  DF(df) {
+    index = new iniindex(ini);
+  }
+  printf("iniindex %zu sections, %zu parameters: %8.1f ms to build\n",
+         index->nsections(), index->size(), df.value / 1e6);
+
+  std::vector<std::string> sects;
+  for (size_t i = 0; i < index->nsections() && i < 1024; i++)
+    sects.push_back(std::string(index->section_name(i)));
+
+  size_t found = 0, nlookups = 1000000;
+  uint64_t t_index;
+  DF(df) {
+    for (size_t i = 0; i < nlookups; i++)
+      found += index->get(sects[i % sects.size()], "key.7").size();
+  }
+  t_index = df.value;
+  DF(df) {
+    for (size_t i = 0; i < nlookups; i++)
+      found += ini.get(sects[i % sects.size()], "key.7").size();
+  }
+  printf("lookups: iniindex %6.1f ns, iniview %6.1f ns\n",
+         (double)t_index / nlookups, (double)df.value / nlookups);
+  delete index;
+
+  if (found == 0) {
+    fprintf(stderr, "iniview-test: no lookup found anything\n");
+    return -1;
+  }
+  return 0;
+}
+
+int
+main(int argc, char *argv[])
+{
+  size_t megabytes = (argc > 1) ? atol(argv[1]) : 50;
+  int nfiles = (argc > 2) ? atoi(argv[2]) : 64;
+  const char *tmpdir = getenv("TMPDIR");
+  std::string path = std::string((tmpdir) ? tmpdir : "/tmp") +
+    "/iniview-test." + std::to_string(getpid());
+  size_t size, n;
+  bool ok = false;
+  df_t df;
+
+  if (nfiles < 1)
+    nfiles = 64;
+
+  if (test() < 0 || test_file(path.c_str()) < 0 ||
+      test_dir(path + ".d") < 0) {
+    fprintf(stderr, "iniview-test: test failed\n");
+    return 1;
+  }
+  printf("iniview-test: test passed\n");
+
+  size = generate(path.c_str(), megabytes * 1024 * 1024);
+  if (size == 0)
+    return 1;
+
+  {
+    iniview ini;
+    DF(df) {
+      ok = ini.load(path.c_str());
+    }
+    n = 0;
+    for (iniview::const_iterator i = ini.begin(); i != ini.end(); ++i)
+      n += i->second.size();
+    printf("iniview  %6.1f MB: %8.1f ms, %6.1f MB/s, %zu sections, "
+           "%zu parameters\n", size / 1048576.0, df.value / 1e6,
+           size / 1048576.0 / (df.value / 1e9), ini.size(), n);
+  }
+  {
+    inifile conf;
+    DF(df) {
+      ok = ok && conf.load(path.c_str());
+    }
+    printf("inifile  %6.1f MB: %8.1f ms, %6.1f MB/s, %zu sections\n",
+           size / 1048576.0, df.value / 1e6,
+           size / 1048576.0 / (df.value / 1e9), conf.size());
+  }
+  {
+    inifile first, conf;
+    ok = ok && first.load(path.c_str(), true);
+    DF(df) {
+      ok = ok && conf.load(path.c_str(), true);
+    }
+    printf("inifile, cached:   %8.1f ms, %zu sections\n",
+           df.value / 1e6, conf.size());
+  }
+  unlink((path + ".cache").c_str());
+  unlink(path.c_str());
+  if (!ok) {
+    fprintf(stderr, "iniview-test: cannot load %s\n", path.c_str());
+    return 1;
+  }
+
+  return (bench_dir(path + ".d", megabytes, nfiles) < 0) ? 1 : 0;
+}
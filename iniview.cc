@@ -0,0 +1,608 @@
+/*
+ * iniview: fast, read-only INI file loader
+ * Copyright (C) 2014  Seong-Kook Shin <cinsky@gmail.com>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Library General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Library General Public License for more details.
+ *
+ * You should have received a copy of the GNU Library General Public
+ * License along with this library; if not, write to the Free
+ * Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ */
+
+#include <iostream>
+#include <sstream>
+#include <algorithm>
+#include <atomic>
+#include <thread>
+#include <cstring>
+#include <cerrno>
+
+#include <fcntl.h>
+#include <glob.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "iniview.hpp"
+
+// The whitespace of the C locale, but the newline.
+static inline bool
+is_blank(char ch)
+{
+  return ch == ' ' || ch == '\t' || ch == '\r' || ch == '\v' || ch == '\f';
+}
+
+
+static inline const char *
+skip_blank(const char *p, const char *end)
+{
+  while (p < end && is_blank(*p))
+    ++p;
+  return p;
+}
+
+
+// Returns the end of [P, END) without the trailing whitespace.
+static inline const char *
+rstrip(const char *p, const char *end)
+{
+  while (end > p && is_blank(end[-1]))
+    --end;
+  return end;
+}
+
+
+static inline const char *
+find_eol(const char *p, const char *end)
+{
+  const char *eol = (const char *)memchr(p, '\n', end - p);
+  return (eol) ? eol : end;
+}
+
+
+static int
+xdigit_value(char ch)
+{
+  if (ch >= '0' && ch <= '9')
+    return ch - '0';
+  if (ch >= 'a' && ch <= 'f')
+    return ch - 'a' + 10;
+  if (ch >= 'A' && ch <= 'F')
+    return ch - 'A' + 10;
+  return -1;
+}
+
+
+iniview::source::~source()
+{
+  if (addr)
+    munmap(addr, size);
+}
+
+
+iniview::iniview()
+  : cur_(0), es_(&std::cerr), name_(""), buf_(0)
+{
+}
+
+
+iniview::~iniview()
+{
+  clear();
+}
+
+
+void
+iniview::clear()
+{
+  config_.clear();
+  sources_.clear();
+}
+
+
+void
+iniview::error(const char *type, const char *pos, const std::string &msg)
+{
+  if (!es_)
+    return;
+
+  (*es_) << name_ << ":";
+  if (pos)
+    (*es_) << std::count(buf_, pos, '\n') + 1 << ":";
+  (*es_) << " " << type << ": " << msg << std::endl;
+}
+
+
+const iniview::section_type *
+iniview::section(string_view section_name) const
+{
+  config_type::const_iterator i = config_.find(section_name);
+  if (i == config_.end())
+    return 0;
+  return &i->second;
+}
+
+
+iniview::string_view
+iniview::get(string_view section, string_view name, string_view def) const
+{
+  const section_type *sect = this->section(section);
+  if (!sect)
+    return def;
+
+  section_type::const_iterator i = sect->find(name);
+  if (i == sect->end())
+    return def;
+  return i->second;
+}
+
+
+//
+// Parse the quoted string after the opening QUOTE at P.  On success,
+// P is moved past the closing quote.
+//
+bool
+iniview::unquote(const char *&p, const char *end, char quote,
+                 string_view &value)
+{
+  const char *close = (const char *)memchr(p, quote, end - p);
+  const char *esc = (const char *)memchr(p, '\\', ((close) ? close : end) - p);
+  const char *q;
+  int ch, digit;
+
+  if (!esc) {
+    if (!close) {
+      error("error", end, "unexpected EOF encountered");
+      return false;
+    }
+    value = string_view(p, close - p);
+    p = close + 1;
+    return true;
+  }
+
+  // Decode it into a copy, one run of plain characters at a time.
+  std::string s(p, esc - p);
+  q = esc;
+  while (q < end) {
+    if (*q == quote) {
+      cur_->copies.push_back(std::string());
+      cur_->copies.back().swap(s);
+      value = cur_->copies.back();
+      p = q + 1;
+      return true;
+    }
+    if (*q != '\\') {
+      const char *run = q;
+      while (q < end && *q != quote && *q != '\\')
+        ++q;
+      s.append(run, q - run);
+      continue;
+    }
+
+    if (++q == end) {
+      error("error", q, "prematured escape sequence");
+      return false;
+    }
+    switch (ch = *q++) {
+    case 'a':   s.push_back('\a');      break;
+    case 'b':   s.push_back('\b');      break;
+    case 'f':   s.push_back('\f');      break;
+    case 'n':   s.push_back('\n');      break;
+    case 'r':   s.push_back('\r');      break;
+    case 't':   s.push_back('\t');      break;
+    case 'v':   s.push_back('\v');      break;
+    case 'x':
+    case 'X':
+      ch = 0;
+      for (int i = 0; i < 2; i++) {
+        if (q == end) {
+          error("error", q, "prematured escape sequence");
+          return false;
+        }
+        if ((digit = xdigit_value(*q++)) < 0) {
+          error("error", q, "invalid hexadecimal escape sequence");
+          return false;
+        }
+        ch = ch * 16 + digit;
+      }
+      s.push_back((char)ch);
+      break;
+    case '0': case '1': case '2': case '3':
+    case '4': case '5': case '6': case '7':
+      ch -= '0';
+      for (int i = 0; i < 2; i++) {
+        if (q == end) {
+          error("error", q, "prematured escape sequence");
+          return false;
+        }
+        if (*q < '0' || *q > '7') {
+          error("error", q, "invalid octal escape sequence");
+          return false;
+        }
+        ch = ch * 8 + (*q++ - '0');
+      }
+      s.push_back((char)ch);
+      break;
+    default:
+      // \\, \', \", and the unknown ones stand for the character itself
+      s.push_back((char)ch);
+      break;
+    }
+  }
+
+  error("error", end, "unexpected EOF encountered");
+  return false;
+}
+
+
+bool
+iniview::parse(const char *buf, std::size_t size, const char *name,
+               config_type &config)
+{
+  const char *p = buf, *end = buf + size, *eol, *q;
+  section_type *sect = 0;
+
+  name_ = name;
+  buf_ = buf;
+
+  while (p < end) {
+    // Skip blank lines and the indentation.
+    while (p < end && (is_blank(*p) || *p == '\n'))
+      ++p;
+    if (p == end)
+      break;
+
+    eol = find_eol(p, end);
+
+    if (*p == '#' || *p == ';') {
+      p = eol;
+      continue;
+    }
+
+    if (*p == '[') {
+      p = skip_blank(p + 1, eol);
+      q = (const char *)memchr(p, ']', eol - p);
+      if (!q) {
+        error("error", p, "missing ']' in the section declaration");
+        return false;
+      }
+      sect = &config[string_view(p, rstrip(p, q) - p)];
+      p = eol;
+      continue;
+    }
+
+    q = (const char *)memchr(p, '=', eol - p);
+    if (!q) {
+      error("error", p, "missing '=' in the parameter");
+      return false;
+    }
+    string_view key(p, rstrip(p, q) - p);
+    string_view value;
+
+    p = skip_blank(q + 1, eol);
+    if (p < eol && (*p == '"' || *p == '\'')) {
+      ++p;
+      if (!unquote(p, end, p[-1], value))
+        return false;
+
+      // Only a comment may follow the closing quote.
+      eol = find_eol(p, end);
+      p = skip_blank(p, eol);
+      if (p < eol && *p != ';' && *p != '#')
+        error("warning", p, "ignoring remaining characters '" +
+              std::string(p, rstrip(p, eol) - p) + "'");
+    }
+    else {
+      q = (const char *)memchr(p, ';', eol - p);
+      if (!q)
+        q = eol;
+      const char *hash = (const char *)memchr(p, '#', q - p);
+      if (hash)
+        q = hash;
+      value = string_view(p, rstrip(p, q) - p);
+    }
+
+    if (!sect)
+      sect = &config[string_view()];
+    (*sect)[key] = value;
+    p = eol;
+  }
+  return true;
+}
+
+
+//
+// Merge CONFIG into config_; a parameter in CONFIG wins.
+//
+void
+iniview::merge(config_type &config)
+{
+  if (config_.empty()) {
+    config_.swap(config);
+    return;
+  }
+  for (config_type::iterator i = config.begin(); i != config.end(); ++i) {
+    section_type &sect = config_[i->first];
+    if (sect.empty()) {
+      sect.swap(i->second);
+      continue;
+    }
+    for (section_type::iterator j = i->second.begin();
+         j != i->second.end(); ++j)
+      sect[j->first] = j->second;
+  }
+}
+
+
+//
+// Parse BUF into a new config, with the copies going to SRC, which is
+// owned by this iniview from then on.
+//
+bool
+iniview::load_source(source *src, const char *buf, std::size_t size,
+                     const char *name)
+{
+  std::unique_ptr<source> holder(src);
+  config_type config;
+
+  cur_ = src;
+  if (!parse(buf, size, name, config))
+    return false;
+
+  sources_.push_back(std::move(holder));
+  merge(config);
+  return true;
+}
+
+
+bool
+iniview::load(const char *buf, std::size_t size, const char *name)
+{
+  return load_source(new source, buf, size, name);
+}
+
+
+bool
+iniview::load(const char *pathname)
+{
+  struct stat sbuf;
+  int fd, saved_errno;
+  void *addr;
+
+  name_ = pathname;
+  fd = open(pathname, O_RDONLY);
+  if (fd < 0) {
+    error("error", 0, std::string("cannot open '") + pathname + "': " +
+          strerror(errno));
+    return false;
+  }
+  if (fstat(fd, &sbuf) < 0) {
+    saved_errno = errno;
+    close(fd);
+    error("error", 0, std::string("cannot stat: ") + strerror(saved_errno));
+    return false;
+  }
+  if (sbuf.st_size == 0) {
+    close(fd);
+    return true;
+  }
+
+  addr = mmap(0, sbuf.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  saved_errno = errno;
+  close(fd);
+  if (addr == MAP_FAILED) {
+    error("error", 0, std::string("cannot map: ") + strerror(saved_errno));
+    return false;
+  }
+  madvise(addr, sbuf.st_size, MADV_SEQUENTIAL);
+
+  source *src = new source;
+  src->addr = addr;
+  src->size = sbuf.st_size;
+  return load_source(src, (const char *)addr, src->size, pathname);
+}
+
+
+//
+// Each file is loaded into an iniview of its own by the next free
+// thread, and they are merged here afterwards, in the order of PATHS.
+// Since the views point into the sources, moving the sources keeps
+// them valid.
+//
+bool
+iniview::load(const std::vector<std::string> &paths, unsigned nthreads)
+{
+  std::size_t n = paths.size();
+  std::vector<std::unique_ptr<iniview> > parts(n);
+  std::vector<std::ostringstream> errs(n);
+  std::vector<char> ok(n);
+  std::atomic<std::size_t> next(0);
+  bool success = true;
+
+  auto worker = [&]() {
+    std::size_t i;
+    while ((i = next.fetch_add(1, std::memory_order_relaxed)) < n) {
+      parts[i].reset(new iniview);
+      parts[i]->error_stream((es_) ? &errs[i] : 0);
+      ok[i] = parts[i]->load(paths[i].c_str());
+    }
+  };
+
+  if (nthreads == 0)
+    nthreads = std::max(1u, std::thread::hardware_concurrency());
+  if (nthreads > n)
+    nthreads = n;
+
+  std::vector<std::thread> threads;
+  for (unsigned t = 1; t < nthreads; t++)
+    threads.emplace_back(worker);
+  worker();
+  for (std::size_t t = 0; t < threads.size(); t++)
+    threads[t].join();
+
+  for (std::size_t i = 0; i < n; i++) {
+    if (es_)
+      (*es_) << errs[i].str();
+    if (!ok[i])
+      success = false;
+  }
+  if (!success)
+    return false;
+
+  for (std::size_t i = 0; i < n; i++) {
+    merge(parts[i]->config_);
+    for (std::size_t j = 0; j < parts[i]->sources_.size(); j++)
+      sources_.push_back(std::move(parts[i]->sources_[j]));
+    parts[i]->sources_.clear();
+  }
+  return true;
+}
+
+
+bool
+iniview::load_glob(const char *pattern, unsigned nthreads)
+{
+  glob_t g;
+  int ret;
+
+  ret = glob(pattern, 0, 0, &g);
+  if (ret == GLOB_NOMATCH)
+    return true;
+  if (ret != 0) {
+    name_ = pattern;
+    error("error", 0, (ret == GLOB_NOSPACE) ? "out of memory" :
+          "cannot read the directory");
+    return false;
+  }
+
+  std::vector<std::string> paths(g.gl_pathv, g.gl_pathv + g.gl_pathc);
+  globfree(&g);
+  return load(paths, nthreads);
+}
+
+
+//
+// iniindex
+//
+
+// The hash of (SECTION, NAME), from the hash of SECTION
+std::size_t
+iniindex::hash(std::size_t section, string_view name)
+{
+  return (section ^ (section >> 7)) * 31 + std::hash<string_view>()(name);
+}
+
+
+std::uint32_t
+iniindex::add_string(string_view s)
+{
+  std::uint32_t off = buf_.size();
+
+  buf_.insert(buf_.end(), s.begin(), s.end());
+  buf_.push_back('\0');
+  return off;
+}
+
+
+iniindex::iniindex(const iniview &view)
+{
+  typedef const iniview::config_type::value_type *sect_ptr;
+  typedef const iniview::section_type::value_type *param_ptr;
+  std::vector<sect_ptr> sects;
+  std::vector<param_ptr> ps;
+  std::vector<std::size_t> hashes;
+  std::size_t bytes = 0, nparams = 0, nslots = 16;
+
+  for (iniview::const_iterator i = view.begin(); i != view.end(); ++i) {
+    sects.push_back(&*i);
+    bytes += i->first.size() + 1;
+    nparams += i->second.size();
+    for (iniview::section_type::const_iterator j = i->second.begin();
+         j != i->second.end(); ++j)
+      bytes += j->first.size() + j->second.size() + 2;
+  }
+  std::sort(sects.begin(), sects.end(),
+            [](sect_ptr a, sect_ptr b) { return a->first < b->first; });
+
+  buf_.reserve(bytes + 1);
+  buf_.push_back('\0');                 // so that &buf_[0] is valid
+  sections_.reserve(sects.size());
+  params_.reserve(nparams);
+  params_section_.reserve(nparams);
+  hashes.reserve(nparams);
+
+  for (std::size_t s = 0; s < sects.size(); s++) {
+    std::size_t sh = std::hash<string_view>()(sects[s]->first);
+    section sect;
+
+    sect.name = add_string(sects[s]->first);
+    sect.name_len = sects[s]->first.size();
+    sect.first = params_.size();
+
+    ps.clear();
+    for (iniview::section_type::const_iterator j = sects[s]->second.begin();
+         j != sects[s]->second.end(); ++j)
+      ps.push_back(&*j);
+    std::sort(ps.begin(), ps.end(),
+              [](param_ptr a, param_ptr b) { return a->first < b->first; });
+
+    for (std::size_t k = 0; k < ps.size(); k++) {
+      param p;
+      p.name = add_string(ps[k]->first);
+      p.name_len = ps[k]->first.size();
+      p.value = add_string(ps[k]->second);
+      p.value_len = ps[k]->second.size();
+      params_.push_back(p);
+      params_section_.push_back(s);
+      hashes.push_back(hash(sh, ps[k]->first));
+    }
+    sect.last = params_.size();
+    sections_.push_back(sect);
+  }
+
+  // At most half full, with linear probing.
+  while (nslots < params_.size() * 2)
+    nslots *= 2;
+  slots_.assign(nslots, 0);
+  for (std::size_t k = 0; k < params_.size(); k++) {
+    std::size_t h = hashes[k];
+    while (slots_[h & (nslots - 1)])
+      h++;
+    slots_[h & (nslots - 1)] = k + 1;
+  }
+}
+
+
+const iniindex::param *
+iniindex::find(string_view section, string_view name) const
+{
+  std::size_t mask = slots_.size() - 1;
+  std::size_t h = hash(std::hash<string_view>()(section), name);
+  std::uint32_t k;
+
+  while ((k = slots_[h & mask]) != 0) {
+    const param &p = params_[k - 1];
+    if (this->name(p) == name &&
+        section_name(params_section_[k - 1]) == section)
+      return &p;
+    h++;
+  }
+  return 0;
+}
+
+
+iniindex::string_view
+iniindex::get(string_view section, string_view name, string_view def) const
+{
+  const param *p = find(section, name);
+  return (p) ? value(*p) : def;
+}
@@ -0,0 +1,235 @@
+/*
+ * iniview: fast, read-only INI file loader
+ * Copyright (C) 2014  Seong-Kook Shin <cinsky@gmail.com>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Library General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Library General Public License for more details.
+ *
+ * You should have received a copy of the GNU Library General Public
+ * License along with this library; if not, write to the Free
+ * Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ */
+#ifndef INIVIEW_HPP__
+#define INIVIEW_HPP__
+
+#ifndef __cplusplus
+#error This is a C++ header file
+#endif
+
+#include <cstddef>
+#include <cstdint>
+#include <deque>
+#include <iosfwd>
+#include <memory>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
+
+//
+// iniview loads an INI file in the format that inifile.hpp describes,
+// for programs that only read their configuration.  It needs C++17.
+//
+// The file is mapped with mmap(2), and the lines and delimiters are
+// found with memchr(3).  Section names, parameter names and values are
+// std::string_view into the mapping; only a quoted value with escape
+// sequences is copied, to decode it.  So the views are valid as long
+// as the iniview is, and not after another load() or clear().
+//
+// The sections, and the parameters in each section, are kept in hash
+// tables:
+//
+//   iniview ini;
+//   if (!ini.load("/etc/foo.ini"))
+//     ...;
+//   std::string_view host = ini.get("db", "host", "localhost");
+//
+//   for (auto &s : ini)                  // in no particular order
+//     for (auto &p : s.second)
+//       use(s.first, p.first, p.second);
+//
+// Unlike the character-by-character parser that inifile::load() had
+// before it used iniview, a value never continues on the next line
+// unless it is quoted, "\\" is a backslash, and "\xhh" and "\ooo" are
+// decoded as in C.
+//
+class iniview {
+public:
+  typedef std::string_view string_view;
+  typedef std::unordered_map<string_view, string_view> section_type;
+  typedef std::unordered_map<string_view, section_type> config_type;
+  typedef config_type::size_type size_type;
+
+  typedef config_type::iterator iterator;
+  typedef config_type::const_iterator const_iterator;
+
+  iniview();
+  ~iniview();
+
+  // Load the INI file PATHNAME.  The sections and parameters of the
+  // file are merged into the ones that were loaded before.
+  //
+  // Returns true if parsing was successful, otherwise returns false
+  // with the error written to the error stream, and the sections that
+  // were loaded before are left as they were.
+  bool load(const char *pathname);
+
+  // Load from the memory BUF of SIZE bytes, which must stay valid as
+  // long as the views.  NAME is used in the error messages.
+  bool load(const char *buf, std::size_t size, const char *name = "");
+
+  // Load the files of PATHS, with up to NTHREADS threads (0 for one
+  // per CPU), each file parsed on its own.  They are merged in the
+  // order of PATHS, whichever finishes first, so that a parameter in a
+  // later file overrides the same one in an earlier file.  If any of
+  // them fails, nothing is merged, and the errors are written in the
+  // order of PATHS.
+  bool load(const std::vector<std::string> &paths, unsigned nthreads = 0);
+
+  // Load the files that match the glob(3) PATTERN, as above, in the
+  // sorted order of their names (e.g. "/etc/foo.d/*.ini").  No match
+  // is not an error.
+  bool load_glob(const char *pattern, unsigned nthreads = 0);
+
+  // Return the SECTION_NAME section if it exists, or NULL.
+  const section_type *section(string_view section_name = "") const;
+
+  // Return the value of NAME in SECTION, or DEF if there is none.
+  string_view get(string_view section, string_view name,
+                  string_view def = string_view()) const;
+
+  iterator begin()              { return config_.begin(); }
+  const_iterator begin() const  { return config_.begin(); }
+  iterator end()                { return config_.end(); }
+  const_iterator end() const    { return config_.end(); }
+
+  // Remove all sections, and unmap the files.
+  void clear();
+
+  // Returns the number of the sections
+  size_type size() const        { return config_.size(); }
+
+  // The errors go to ES, std::cerr by default, or nowhere if it is NULL.
+  void error_stream(std::ostream *es) { es_ = es; }
+
+private:
+  iniview(const iniview &);
+  iniview &operator=(const iniview &);
+
+  // The memory that the views of a load() point to
+  struct source {
+    void *addr;                         // the mapping, or NULL
+    std::size_t size;
+    std::deque<std::string> copies;     // the decoded values
+
+    source() : addr(0), size(0) { }
+    ~source();
+  };
+
+  bool load_source(source *src, const char *buf, std::size_t size,
+                   const char *name);
+  bool parse(const char *buf, std::size_t size, const char *name,
+             config_type &config);
+  bool unquote(const char *&p, const char *end, char quote, string_view &value);
+  void error(const char *type, const char *pos, const std::string &msg);
+  void merge(config_type &config);
+
+  config_type config_;
+  std::vector<std::unique_ptr<source> > sources_;
+  source *cur_;                          // of the load() in progress
+
+  std::ostream *es_;
+  const char *name_;                     // of the buffer being parsed
+  const char *buf_;
+};
+
+
+//
+// iniindex is a compact, read-only copy of an iniview, for a
+// configuration that is loaded once at startup and read from then on.
+// All names and values are copied, null-terminated, into one buffer,
+// so the iniview can go away.  The sections, and the parameters of
+// each section, are in arrays sorted by name, and a lookup goes
+// through one open addressing hash table over (section, name).
+//
+//   iniview ini;
+//   if (!ini.load_glob("/etc/foo.d/*.ini"))
+//     ...;
+//   iniindex conf(ini);
+//
+//   const char *host = conf.get("db", "host", "localhost").data();
+//
+//   for (size_t i = 0; i < conf.nsections(); i++)
+//     for (const iniindex::param *p = conf.section_begin(i);
+//          p != conf.section_end(i); ++p)
+//       use(conf.section_name(i), conf.name(*p), conf.value(*p));
+//
+class iniindex {
+public:
+  typedef std::string_view string_view;
+
+  struct param {
+    std::uint32_t name;                 // offsets into the buffer
+    std::uint32_t value;
+    std::uint32_t name_len;
+    std::uint32_t value_len;
+  };
+
+  explicit iniindex(const iniview &view);
+
+  // Return the value of NAME in SECTION, or DEF if there is none.
+  string_view get(string_view section, string_view name,
+                  string_view def = string_view()) const;
+
+  // Return the parameter NAME in SECTION, or NULL.
+  const param *find(string_view section, string_view name) const;
+
+  std::size_t nsections() const { return sections_.size(); }
+  string_view section_name(std::size_t i) const {
+    return str(sections_[i].name, sections_[i].name_len);
+  }
+  const param *section_begin(std::size_t i) const {
+    return params_.data() + sections_[i].first;
+  }
+  const param *section_end(std::size_t i) const {
+    return params_.data() + sections_[i].last;
+  }
+
+  string_view name(const param &p) const { return str(p.name, p.name_len); }
+  string_view value(const param &p) const {
+    return str(p.value, p.value_len);
+  }
+
+  // The number of parameters
+  std::size_t size() const { return params_.size(); }
+
+private:
+  struct section {
+    std::uint32_t name;
+    std::uint32_t name_len;
+    std::uint32_t first;                // of the parameters
+    std::uint32_t last;
+  };
+
+  string_view str(std::uint32_t off, std::uint32_t len) const {
+    return string_view(&buf_[0] + off, len);
+  }
+  std::uint32_t add_string(string_view s);
+  static std::size_t hash(std::size_t section, string_view name);
+
+  std::vector<char> buf_;
+  std::vector<section> sections_;
+  std::vector<param> params_;
+  std::vector<std::uint32_t> params_section_;   // of each parameter
+  std::vector<std::uint32_t> slots_;            // parameter + 1, or 0
+};
+
+#endif  // INIVIEW_HPP__
@@ -0,0 +1,318 @@
+/*
+ * Interval tree on top of the augmented rbtree
+ * Copyright (C) 2014  Seong-Kook Shin <cinsky@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ */
+#include <stddef.h>
+#include "itree.h"
+
+#define ITREE(n)        rb_entry((n), struct itree_node, rb)
+
+
+static void
+itree_augment(struct rb_node *rb, void *data)
+{
+  struct itree_node *node = ITREE(rb);
+  unsigned long max = node->last;
+
+  (void)data;
+  if (rb->rb_left && ITREE(rb->rb_left)->max_last > max)
+    max = ITREE(rb->rb_left)->max_last;
+  if (rb->rb_right && ITREE(rb->rb_right)->max_last > max)
+    max = ITREE(rb->rb_right)->max_last;
+  node->max_last = max;
+}
+
+
+void
+itree_insert(struct rb_root *root, struct itree_node *node)
+{
+  struct rb_node **link = &root->rb_node, *parent = NULL;
+
+  while (*link) {
+    parent = *link;
+    if (node->start < ITREE(parent)->start)
+      link = &parent->rb_left;
+    else
+      link = &parent->rb_right;
+  }
+
+  node->max_last = node->last;
+  rb_link_node(&node->rb, parent, link);
+  rb_insert_color(&node->rb, root);
+  rb_augment_insert(&node->rb, itree_augment, NULL);
+
+  root->size++;
+  root->nmodified++;
+}
+
+
+void
+itree_remove(struct rb_root *root, struct itree_node *node)
+{
+  struct rb_node *deepest;
+
+  deepest = rb_augment_erase_begin(&node->rb);
+  rb_erase(&node->rb, root);
+  rb_augment_erase_end(deepest, itree_augment, NULL);
+
+  root->size--;
+  root->nmodified++;
+}
+
+
+/*
+ * Return the leftmost node in the subtree of NODE that overlaps
+ * [START, LAST], or NULL.  NODE->max_last must be >= START.
+ */
+static struct itree_node *
+subtree_search(struct itree_node *node, unsigned long start,
+               unsigned long last)
+{
+  struct itree_node *left;
+
+  while (1) {
+    /* Any overlapping node in the left subtree comes first. */
+    if (node->rb.rb_left) {
+      left = ITREE(node->rb.rb_left);
+      if (start <= left->max_last) {
+        node = left;
+        continue;
+      }
+    }
+    if (node->start > last)     /* so are all nodes on the right */
+      return NULL;
+    if (start <= node->last)
+      return node;
+    if (!node->rb.rb_right)
+      return NULL;
+    node = ITREE(node->rb.rb_right);
+    if (start > node->max_last)
+      return NULL;
+  }
+}
+
+
+struct itree_node *
+itree_first(struct rb_root *root, unsigned long start, unsigned long last)
+{
+  struct itree_node *node;
+
+  if (!root->rb_node)
+    return NULL;
+  node = ITREE(root->rb_node);
+  if (start > node->max_last)
+    return NULL;
+  return subtree_search(node, start, last);
+}
+
+
+struct itree_node *
+itree_next(struct itree_node *node, unsigned long start, unsigned long last)
+{
+  struct rb_node *rb = node->rb.rb_right, *prev;
+
+  while (1) {
+    /* The left subtree of NODE was already visited; try the right
+     * one.  Its nodes start at or after NODE->start. */
+    if (rb) {
+      node = ITREE(rb);
+      if (start <= node->max_last)
+        return subtree_search(node, start, last);
+    }
+
+    /* Move up until we come from a left child. */
+    do {
+      prev = &node->rb;
+      rb = rb_parent(prev);
+      if (!rb)
+        return NULL;
+      node = ITREE(rb);
+    } while (prev == rb->rb_right);
+
+    if (node->start > last)
+      return NULL;
+    if (start <= node->last)
+      return node;
+    rb = node->rb.rb_right;
+  }
+}
+
+
+#ifdef TEST_ITREE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/time.h>
+
+/*
+ * Random inserts, removes and overlap queries checked against a naive
+ * scan of an array, then a benchmark of stabbing queries (a point, as
+ * in IP-range lookups) and short range queries against the scan.
+ *
+ *   $ cc -O2 -DTEST_ITREE itree.c rbtree.c
+ *   $ ./a.out [NINTERVALS] [NQUERIES]
+ */
+struct range {
+  struct itree_node node;
+  int live;
+};
+
+static double
+now(void)
+{
+  struct timeval tv;
+
+  gettimeofday(&tv, 0);
+  return tv.tv_sec + tv.tv_usec / 1e6;
+}
+
+/* Check the red-black properties and MAX_LAST; returns the black height. */
+static int
+check(struct rb_node *rb, unsigned long *max)
+{
+  unsigned long lmax = 0, rmax = 0, m;
+  int lh, rh;
+
+  if (!rb) {
+    *max = 0;
+    return 1;
+  }
+  if (rb_is_red(rb) &&
+      ((rb->rb_left && rb_is_red(rb->rb_left)) ||
+       (rb->rb_right && rb_is_red(rb->rb_right))))
+    return -1;
+  if ((rb->rb_left && rb_parent(rb->rb_left) != rb) ||
+      (rb->rb_right && rb_parent(rb->rb_right) != rb))
+    return -1;
+  lh = check(rb->rb_left, &lmax);
+  rh = check(rb->rb_right, &rmax);
+  if (lh < 0 || lh != rh)
+    return -1;
+
+  m = ITREE(rb)->last;
+  if (rb->rb_left && lmax > m)
+    m = lmax;
+  if (rb->rb_right && rmax > m)
+    m = rmax;
+  if (ITREE(rb)->max_last != m)
+    return -1;
+  *max = m;
+  return lh + rb_is_black(rb);
+}
+
+static int
+test(unsigned nranges, unsigned nops)
+{
+  struct rb_root root = RB_ROOT;
+  struct range *ranges = calloc(nranges, sizeof(*ranges));
+  struct itree_node *n;
+  unsigned long start, last, max;
+  unsigned i, j, k, expect, found, nlive = 0;
+
+  for (i = 0; i < nops; i++) {
+    j = rand() % nranges;
+    if (!ranges[j].live) {
+      ranges[j].node.start = rand() % 10000;
+      ranges[j].node.last = ranges[j].node.start + rand() % 300;
+      itree_insert(&root, &ranges[j].node);
+      ranges[j].live = 1;
+      nlive++;
+    }
+    else if (rand() % 3 == 0) {
+      itree_remove(&root, &ranges[j].node);
+      ranges[j].live = 0;
+      nlive--;
+    }
+
+    if (root.size != nlive || check(root.rb_node, &max) < 0)
+      return -1;
+
+    start = rand() % 10500;
+    last = start + rand() % 200;
+    expect = 0;
+    for (k = 0; k < nranges; k++)
+      if (ranges[k].live && ranges[k].node.start <= last &&
+          start <= ranges[k].node.last)
+        expect++;
+
+    found = 0;
+    max = 0;
+    for (n = itree_first(&root, start, last); n;
+         n = itree_next(n, start, last)) {
+      if (n->start > last || start > n->last || n->start < max)
+        return -1;
+      max = n->start;
+      found++;
+    }
+    if (found != expect)
+      return -1;
+  }
+  free(ranges);
+  return 0;
+}
+
+int
+main(int argc, char *argv[])
+{
+  unsigned n = (argc > 1) ? atoi(argv[1]) : 100000;
+  unsigned nq = (argc > 2) ? atoi(argv[2]) : 10000;
+  struct rb_root root = RB_ROOT;
+  struct range *ranges;
+  struct itree_node *node;
+  static const unsigned widths[] = { 0, 100, 1000 };
+  unsigned long start, last, span = n * 16UL, sum;
+  unsigned i, k, w;
+  double beg;
+
+  srand(1);
+  if (test(500, 20000) < 0) {
+    fprintf(stderr, "itree: test failed\n");
+    return 1;
+  }
+  printf("itree: test passed\n");
+
+  ranges = calloc(n, sizeof(*ranges));
+  for (i = 0; i < n; i++) {
+    ranges[i].node.start = rand() % span;
+    ranges[i].node.last = ranges[i].node.start + rand() % 64;
+  }
+  beg = now();
+  for (i = 0; i < n; i++)
+    itree_insert(&root, &ranges[i].node);
+  printf("%u intervals inserted in %.3f sec\n", n, now() - beg);
+
+  for (w = 0; w < sizeof(widths) / sizeof(widths[0]); w++) {
+    srand(2);
+    sum = 0;
+    beg = now();
+    for (k = 0; k < nq; k++) {
+      start = rand() % span;
+      last = start + widths[w];
+      for (node = itree_first(&root, start, last); node;
+           node = itree_next(node, start, last))
+        sum += node->start;
+    }
+    printf("width %4u: itree %10.0f queries/s", widths[w], nq / (now() - beg));
+
+    srand(2);
+    beg = now();
+    for (k = 0; k < nq; k++) {
+      start = rand() % span;
+      last = start + widths[w];
+      for (i = 0; i < n; i++)
+        if (ranges[i].node.start <= last && start <= ranges[i].node.last)
+          sum -= ranges[i].node.start;
+    }
+    printf(", scan %10.0f queries/s%s\n", nq / (now() - beg),
+           (sum) ? " (MISMATCH)" : "");
+  }
+
+  free(ranges);
+  return 0;
+}
+#endif  /* TEST_ITREE */
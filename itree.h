@@ -0,0 +1,70 @@
+/*
+ * Interval tree on top of the augmented rbtree
+ * Copyright (C) 2014  Seong-Kook Shin <cinsky@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ */
+#ifndef ITREE_H__
+#define ITREE_H__
+
+#include "rbtree.h"
+
+/*
+ * An interval tree holds closed intervals [start, last], and finds
+ * every interval that overlaps a given range in O(log n + k).
+ *
+ * Like rb_node, itree_node is embedded in your own struct.  The tree
+ * is ordered by START, and each node keeps the maximum LAST of its
+ * subtree (maintained via rb_augment_insert() and
+ * rb_augment_erase_begin()/rb_augment_erase_end()).  Duplicated or
+ * overlapping intervals are allowed.
+ *
+ *   struct route {
+ *     struct itree_node range;
+ *     ...
+ *   };
+ *
+ *   struct rb_root routes = RB_ROOT;
+ *
+ *   r->range.start = ip_lo;
+ *   r->range.last = ip_hi;
+ *   itree_insert(&routes, &r->range);
+ *
+ *   for (n = itree_first(&routes, ip, ip); n; n = itree_next(n, ip, ip)) {
+ *     struct route *r = container_of(n, struct route, range);
+ *     ...
+ *   }
+ *
+ * The overlapping intervals are visited in the order of START.
+ */
+
+struct itree_node {
+  struct rb_node rb;
+  unsigned long start;
+  unsigned long last;
+  unsigned long max_last;       /* maximum LAST in this subtree */
+};
+
+extern void itree_insert(struct rb_root *root, struct itree_node *node);
+extern void itree_remove(struct rb_root *root, struct itree_node *node);
+
+/*
+ * Return the first interval that overlaps [START, LAST], or NULL.
+ */
+extern struct itree_node *itree_first(struct rb_root *root,
+                                      unsigned long start,
+                                      unsigned long last);
+
+/*
+ * Return the next interval after NODE that overlaps [START, LAST], or
+ * NULL.  NODE must be returned by itree_first() or itree_next() with
+ * the same range.
+ */
+extern struct itree_node *itree_next(struct itree_node *node,
+                                     unsigned long start,
+                                     unsigned long last);
+
+#endif  /* ITREE_H__ */
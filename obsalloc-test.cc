@@ -0,0 +1,203 @@
+/*
+ * Test and benchmark of obsalloc.hh
+ *
+ *   $ cc -O2 -c obsutil.c
+ *   $ g++ -std=c++17 -O2 -o obsalloc-test obsalloc-test.cc obsutil.o
+ *   $ ./obsalloc-test [NREQUESTS] [NHEADERS]
+ *
+ * The benchmark builds a map of NHEADERS (name, value) strings per
+ * request, looks every name up, and throws the map away, with
+ *
+ * - "heap": std::map<std::string, std::string>,
+ * - "pmr": std::pmr::map<std::pmr::string, std::pmr::string> over an
+ *   obs_arena, with an obs_checkpoint per request, and
+ * - "classic": std::map and std::basic_string with obs_allocator.
+ *
+ * It counts the calls to operator new and the obstack chunks that are
+ * malloc()ed.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <map>
+#include <string>
+#include <vector>
+
+static unsigned long nheap;
+
+extern "C" void *
+counted_malloc(size_t size)
+{
+  nheap++;
+  return malloc(size);
+}
+
+#define obstack_chunk_alloc     counted_malloc
+#define obstack_chunk_free      free
+#include "obsalloc.hh"
+#include "difftime.h"
+
+void *
+operator new(size_t size)
+{
+  void *p = counted_malloc(size);
+  if (!p)
+    throw std::bad_alloc();
+  return p;
+}
+
+void
+operator delete(void *p) noexcept
+{
+  free(p);
+}
+
+void
+operator delete(void *p, size_t) noexcept
+{
+  free(p);
+}
+
+typedef std::basic_string<char, std::char_traits<char>,
+                          obs_allocator<char> > ostring;
+typedef std::pair<const ostring, ostring> opair;
+typedef std::map<ostring, ostring, std::less<ostring>,
+                 obs_allocator<opair> > omap;
+
+struct alignas(64) line {
+  char data[64];
+};
+
+static int
+test()
+{
+  obs_arena arena;
+  void *base = arena.mark();
+
+  {
+    obs_checkpoint cp(arena);
+    std::pmr::map<std::pmr::string, std::pmr::string> m(&arena);
+    for (int i = 0; i < 1000; i++)
+      m.emplace(std::pmr::string("a rather long key, number ", &arena)
+                + std::to_string(i).c_str(), "value");
+    if (m.size() != 1000)
+      return -1;
+    if (m.find("a rather long key, number 999") == m.end())
+      return -1;
+
+    {
+      obs_checkpoint inner(arena);
+      void *mark = arena.mark();
+      std::pmr::vector<line> v(&arena);
+      v.resize(100);
+      if (((size_t)v.data() & 63) != 0)
+        return -1;
+      inner.rollback();
+      if (arena.mark() != mark)
+        return -1;
+    }
+    if (m.find("a rather long key, number 0") == m.end())
+      return -1;
+  }
+  if (arena.mark() != base)
+    return -1;
+
+  {
+    obs_checkpoint cp(arena);
+    obs_allocator<opair> alloc(arena);
+    omap m(std::less<ostring>(), alloc);
+    obs_allocator<char> calloc_(arena);
+    for (int i = 0; i < 1000; i++)
+      m.insert(opair(ostring("another rather long key ", calloc_)
+                     + std::to_string(i).c_str(),
+                     ostring("value", calloc_)));
+    if (m.size() != 1000)
+      return -1;
+    cp.commit();
+  }
+  if (arena.mark() == base)
+    return -1;
+  arena.release(base);
+  if (arena.mark() != base)
+    return -1;
+  return 0;
+}
+
+
+static char names[1024][48];
+static char values[1024][48];
+
+static int
+bench(const char *name, long nrequests, int nheaders, int which)
+{
+  obs_arena arena(65536);       // a request fits in one chunk
+  unsigned long n0 = nheap, found = 0;
+  double sec;
+  df_t df;
+
+  DF(df) {
+    for (long r = 0; r < nrequests; r++) {
+      if (which == 0) {
+        std::map<std::string, std::string> m;
+        for (int i = 0; i < nheaders; i++)
+          m.emplace(names[i], values[i]);
+        for (int i = 0; i < nheaders; i++)
+          found += m.find(names[i])->second.size();
+      }
+      else if (which == 1) {
+        obs_checkpoint cp(arena);
+        std::pmr::map<std::pmr::string, std::pmr::string> m(&arena);
+        for (int i = 0; i < nheaders; i++)
+          m.emplace(names[i], values[i]);
+        for (int i = 0; i < nheaders; i++)
+          found += m.find(names[i])->second.size();
+      }
+      else {
+        obs_checkpoint cp(arena);
+        obs_allocator<char> ca(arena);
+        obs_allocator<opair> pa(arena);
+        omap m(std::less<ostring>(), pa);
+        for (int i = 0; i < nheaders; i++)
+          m.insert(opair(ostring(names[i], ca), ostring(values[i], ca)));
+        for (int i = 0; i < nheaders; i++)
+          found += m.find(ostring(names[i], ca))->second.size();
+      }
+    }
+  }
+  sec = df.value / 1e9;
+
+  if (found != (unsigned long)nrequests * nheaders * 40) {
+    fprintf(stderr, "obsalloc-test: %s: found %lu of %lu\n", name, found,
+            (unsigned long)nrequests * nheaders * 40);
+    return -1;
+  }
+  printf("%-8s %8.3f us/request, %8.2f heap allocations/request\n",
+         name, sec * 1e6 / nrequests, (double)(nheap - n0) / nrequests);
+  return 0;
+}
+
+int
+main(int argc, char *argv[])
+{
+  long nrequests = (argc > 1) ? atol(argv[1]) : 100000;
+  int nheaders = (argc > 2) ? atoi(argv[2]) : 32;
+
+  if (nheaders < 1 || nheaders > 1024)
+    nheaders = 32;
+
+  obsutil_init();
+  if (test() < 0) {
+    fprintf(stderr, "obsalloc-test: test failed\n");
+    return 1;
+  }
+  printf("obsalloc-test: test passed\n");
+
+  for (int i = 0; i < nheaders; i++) {
+    snprintf(names[i], sizeof(names[i]), "x-request-header-%04d", i * 7919);
+    snprintf(values[i], sizeof(values[i]), "%040d", i);
+  }
+  if (bench("heap", nrequests, nheaders, 0) < 0 ||
+      bench("pmr", nrequests, nheaders, 1) < 0 ||
+      bench("classic", nrequests, nheaders, 2) < 0)
+    return 1;
+  return 0;
+}
@@ -0,0 +1,212 @@
+/* -*-c++-*- */
+#ifndef OBSALLOC_HH__
+#define OBSALLOC_HH__
+
+/*
+ * Copyright (C) 2014  Seong-Kook Shin <cinsky@gmail.com>
+ * DO WHAT THE FUCK YOU WANT TO PUBLIC LICENSE
+ * Version 2, December 2004
+ */
+
+#include <cstddef>
+#include <new>
+#if __cplusplus >= 201703L
+#include <memory_resource>
+#endif
+
+#include "obsutil.h"
+
+//
+// C++ allocators over an obstack (obsutil.h), for containers that live
+// no longer than a unit of work, such as a request.  Their nodes and
+// strings are bumped out of the obstack's chunks instead of going to
+// the global heap one by one, and are freed all together:
+//
+//   obs_arena arena;                     // one per thread, say
+//
+//   void handle(request *req) {
+//     obs_checkpoint cp(arena);
+//     std::pmr::map<std::pmr::string, std::pmr::string> hdrs(&arena);
+//     ...
+//   }                                    // hdrs, then cp, go away here
+//
+// deallocate() does nothing; the memory comes back only when an
+// obs_checkpoint goes out of scope, or when the arena is destroyed.
+// So the containers must be gone by then, and a container that keeps
+// erasing and inserting grows the arena without bound.
+//
+// obs_arena is a std::pmr::memory_resource (C++17), and also works with
+// obs_allocator<T>, a classic allocator for C++98 code:
+//
+//   typedef std::basic_string<char, std::char_traits<char>,
+//                             obs_allocator<char> > ostring;
+//   obs_allocator<ostring> alloc(arena);
+//   std::vector<ostring, obs_allocator<ostring> > v(alloc);
+//
+// An arena may be used by one thread at a time.  It throws
+// std::bad_alloc when the obstack runs out of memory.
+//
+
+class obs_arena
+#if __cplusplus >= 201703L
+  : public std::pmr::memory_resource
+#endif
+{
+  struct obstack stack_;
+  unsigned long nalloc_;
+
+  obs_arena(const obs_arena &);
+  obs_arena &operator=(const obs_arena &);
+
+public:
+  // CHUNK_SIZE 0 uses the default chunk size of the obstack.
+  explicit obs_arena(int chunk_size = 0) : nalloc_(0) {
+    int ret = (chunk_size > 0) ? obs_begin(&stack_, chunk_size)
+                               : obs_init(&stack_);
+    if (ret < 0)
+      throw std::bad_alloc();
+  }
+
+  ~obs_arena() {
+    obs_free(&stack_, 0);
+  }
+
+  struct obstack *obstack() { return &stack_; }
+
+  // The number of allocate() calls so far.
+  unsigned long nalloc() const { return nalloc_; }
+
+  void *allocate_bytes(std::size_t bytes, std::size_t align) {
+    std::size_t mask = obs_alignment_mask(&stack_);
+    char *p;
+
+    if (bytes > (std::size_t)INT_MAX - align)
+      throw std::bad_alloc();
+    ++nalloc_;
+    if (align <= mask + 1)
+      p = (char *)obs_alloc(&stack_, bytes);
+    else {
+      p = (char *)obs_alloc(&stack_, bytes + align - 1);
+      if (p)
+        p = (char *)(((std::size_t)p + align - 1) & ~(align - 1));
+    }
+    if (!p)
+      throw std::bad_alloc();
+    return p;
+  }
+
+  // A position in the arena, for release().
+  void *mark() {
+    void *p = obs_alloc(&stack_, 0);
+    if (!p)
+      throw std::bad_alloc();
+    return p;
+  }
+
+  // Free everything allocated since MARK was taken.
+  void release(void *mark) {
+    obs_free(&stack_, mark);
+  }
+
+#if __cplusplus >= 201703L
+protected:
+  void *do_allocate(std::size_t bytes, std::size_t align) override {
+    return allocate_bytes(bytes, align);
+  }
+
+  void do_deallocate(void *, std::size_t, std::size_t) override {
+  }
+
+  bool do_is_equal(const std::pmr::memory_resource &other) const
+    noexcept override {
+    return this == &other;
+  }
+#endif
+};
+
+
+//
+// Frees what was allocated from ARENA in its scope, when it goes out
+// of scope, unless commit() was called.  Checkpoints nest.
+//
+class obs_checkpoint {
+  obs_arena &arena_;
+  void *mark_;
+
+  obs_checkpoint(const obs_checkpoint &);
+  obs_checkpoint &operator=(const obs_checkpoint &);
+
+public:
+  explicit obs_checkpoint(obs_arena &arena)
+    : arena_(arena), mark_(arena.mark()) {
+  }
+
+  ~obs_checkpoint() {
+    if (mark_)
+      arena_.release(mark_);
+  }
+
+  // Free what was allocated since the checkpoint, and go on with it.
+  void rollback() {
+    if (mark_) {
+      arena_.release(mark_);
+      mark_ = arena_.mark();
+    }
+  }
+
+  // Keep what was allocated since the checkpoint.
+  void commit() {
+    mark_ = 0;
+  }
+};
+
+
+template <class T>
+class obs_allocator {
+  template <class U> friend class obs_allocator;
+  obs_arena *arena_;
+
+public:
+  typedef T value_type;
+  typedef T *pointer;
+  typedef const T *const_pointer;
+  typedef T &reference;
+  typedef const T &const_reference;
+  typedef std::size_t size_type;
+  typedef std::ptrdiff_t difference_type;
+
+  template <class U> struct rebind { typedef obs_allocator<U> other; };
+
+  obs_allocator(obs_arena &arena) : arena_(&arena) { }
+
+  template <class U>
+  obs_allocator(const obs_allocator<U> &other) : arena_(other.arena_) { }
+
+  obs_arena *arena() const { return arena_; }
+
+  T *allocate(size_type n, const void * = 0) {
+    if (n > max_size())
+      throw std::bad_alloc();
+    return (T *)arena_->allocate_bytes(n * sizeof(T), __alignof__(T));
+  }
+
+  void deallocate(T *, size_type) { }
+
+  size_type max_size() const { return (size_type)INT_MAX / sizeof(T); }
+
+  // For C++98 containers; later ones use allocator_traits.
+  void construct(T *p, const T &v) { new ((void *)p) T(v); }
+  void destroy(T *p) { p->~T(); }
+
+  template <class U>
+  bool operator==(const obs_allocator<U> &other) const {
+    return arena_ == other.arena_;
+  }
+
+  template <class U>
+  bool operator!=(const obs_allocator<U> &other) const {
+    return arena_ != other.arena_;
+  }
+};
+
+#endif  /* OBSALLOC_HH__ */
@@ -192,6 +192,493 @@ obs_grow_format(struct obstack *stack, const char *format, ...)
 }
 
 
+#ifdef OBS_STATS
+#include <stddef.h>
+#include <stdlib.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <time.h>
+#include <pthread.h>
+
+/*
+ * Each chunk is allocated with this header in front of it, which
+ * remembers what the chunk added to the statistics.
+ */
+struct stats_hdr {
+  size_t size;
+  size_t waste;
+} __attribute__((aligned(16)));
+
+struct stats_site {
+  struct stats_site *next;
+  const char *file;
+  int line;
+  const char *func;
+
+  unsigned long created;
+  struct obs_stats *live;       /* the registered obstacks */
+  unsigned long nlive;
+
+  /* the counters of the obstacks that were unregistered */
+  unsigned long long alloc;
+  unsigned long long nalloc;
+
+  /* updated with atomics, from any thread */
+  unsigned long chunks;
+  size_t size;
+  size_t waste;
+  size_t peak;
+};
+
+struct obs_stats {
+  struct obs_stats_counter_ count;      /* must be the first */
+
+  struct obs_stats *next, *prev;
+  struct stats_site *site;
+  struct obstack *stack;        /* only its own thread looks at it */
+  void *fresh;                  /* the chunk allocated last */
+
+  /* written only by the thread that owns STACK */
+  unsigned long chunks;
+  size_t size;
+  size_t waste;
+  size_t peak;
+};
+
+static pthread_mutex_t stats_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct stats_site *stats_sites;
+static struct stats_site stats_total;
+
+#define STATS_SET(v, x) __atomic_store_n(&(v), (x), __ATOMIC_RELAXED)
+#define STATS_GET(v)    __atomic_load_n(&(v), __ATOMIC_RELAXED)
+
+
+static void
+stats_max(size_t *peak, size_t value)
+{
+  size_t old = __atomic_load_n(peak, __ATOMIC_RELAXED);
+
+  while (old < value &&
+         !__atomic_compare_exchange_n(peak, &old, value, 1,
+                                      __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+    ;
+}
+
+
+/* Add SIZE bytes and CHUNKS chunks of WASTE to the site and the total. */
+static void
+stats_site_add(struct stats_site *site, long chunks, long size, long waste)
+{
+  struct stats_site *sp[2] = { site, &stats_total };
+  size_t now;
+  int i;
+
+  for (i = 0; i < 2; i++) {
+    __atomic_add_fetch(&sp[i]->chunks, chunks, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&sp[i]->waste, waste, __ATOMIC_RELAXED);
+    now = __atomic_add_fetch(&sp[i]->size, size, __ATOMIC_RELAXED);
+    if (size > 0)
+      stats_max(&sp[i]->peak, now);
+  }
+}
+
+
+static void
+stats_add(struct obs_stats *st, long chunks, long size, long waste)
+{
+  STATS_SET(st->chunks, st->chunks + chunks);
+  STATS_SET(st->size, st->size + size);
+  STATS_SET(st->waste, st->waste + waste);
+  if (st->size > st->peak)
+    STATS_SET(st->peak, st->size);
+  stats_site_add(st->site, chunks, size, waste);
+}
+
+
+static void
+stats_unregister(struct obs_stats *st)
+{
+  struct stats_site *site = st->site;
+
+  pthread_mutex_lock(&stats_lock);
+  if (st->prev)
+    st->prev->next = st->next;
+  else
+    site->live = st->next;
+  if (st->next)
+    st->next->prev = st->prev;
+  site->nlive--;
+  site->alloc += st->count.alloc;
+  site->nalloc += st->count.nalloc;
+  pthread_mutex_unlock(&stats_lock);
+
+  /* for obs_stats_get() and obs_stats_count_() */
+  obstack_chunkfun(st->stack, NULL);
+  free(st);
+}
+
+
+void *
+obs_stats_chunk_alloc_(void *arg, long size)
+{
+  struct obs_stats *st = arg;
+  struct obstack *stack = st->stack;
+  struct stats_hdr *hdr, *old;
+  size_t waste = 0, need = st->count.want;
+
+  hdr = malloc(sizeof(*hdr) + size);
+  if (!hdr)
+    return NULL;
+  hdr->size = size;
+  hdr->waste = 0;
+
+  /* _obstack_newchunk() calls us before it moves the growing object,
+   * so the rest of the current chunk is about to be abandoned. */
+  if (st->chunks > 0) {
+    old = (struct stats_hdr *)stack->chunk - 1;
+    waste = stack->chunk_limit - stack->object_base;
+    old->waste = waste;
+    need += stack->next_free - stack->object_base;
+  }
+  need += offsetof(struct _obstack_chunk, contents);
+  STATS_SET(st->count.room, ((size_t)size > need) ? size - need : 0);
+  st->count.want = 0;
+  stats_add(st, 1, size, waste);
+  st->fresh = hdr + 1;
+  return hdr + 1;
+}
+
+
+static void
+obs_stats_chunk_free_(void *arg, void *chunk)
+{
+  struct obs_stats *st = arg;
+  struct _obstack_chunk *c = chunk, *below = c->prev;
+  struct stats_hdr *hdr = (struct stats_hdr *)chunk - 1, *bh;
+  long waste = hdr->waste;
+
+  /*
+   * Unless _obstack_newchunk() is dropping the chunk that it just
+   * copied an object out of, obstack_free() is freeing the chunks down
+   * from the top, and BELOW may become the current chunk again, with
+   * its tail in use.
+   */
+  if (!(chunk != st->stack->chunk && st->stack->chunk == st->fresh) &&
+      below) {
+    bh = (struct stats_hdr *)below - 1;
+    waste += bh->waste;
+    bh->waste = 0;
+  }
+  st->fresh = NULL;
+
+  stats_add(st, -1, -(long)hdr->size, -waste);
+  free(hdr);
+
+  if (st->chunks == 0)
+    stats_unregister(st);
+}
+
+
+int
+obs_stats_begin_(struct obstack *stack, int size,
+                 const char *file, int line, const char *func)
+{
+  struct stats_site *site;
+  struct obs_stats *st;
+
+  OBS_ERROR_CLEAR;
+  st = calloc(1, sizeof(*st));
+  if (!st) {
+    OBS_ERROR_SET;
+    return -1;
+  }
+  st->stack = stack;
+
+  pthread_mutex_lock(&stats_lock);
+  for (site = stats_sites; site != NULL; site = site->next)
+    if (site->line == line && strcmp(site->file, file) == 0)
+      break;
+  if (!site) {
+    site = calloc(1, sizeof(*site));
+    if (!site) {
+      pthread_mutex_unlock(&stats_lock);
+      free(st);
+      OBS_ERROR_SET;
+      return -1;
+    }
+    site->file = file;
+    site->line = line;
+    site->func = func;
+    site->next = stats_sites;
+    stats_sites = site;
+  }
+  st->site = site;
+  st->next = site->live;
+  if (site->live)
+    site->live->prev = st;
+  site->live = st;
+  site->created++;
+  site->nlive++;
+  pthread_mutex_unlock(&stats_lock);
+
+  obstack_specify_allocation_with_arg(stack, size, 0,
+                                      obs_stats_chunk_alloc_,
+                                      obs_stats_chunk_free_, st);
+  if (OBS_ERROR) {
+    if (st->chunks == 0)
+      stats_unregister(st);
+    return -1;
+  }
+  return 0;
+}
+
+
+/*
+ * Fill INFO from what the thread that owns ST noted.  ST->stack is not
+ * looked at: it may be freed, or on the stack of a thread that is gone.
+ */
+static void
+stats_info(struct obs_stats *st, struct obs_stats_info *info)
+{
+  size_t room = STATS_GET(st->count.room);
+
+  info->chunks = STATS_GET(st->chunks);
+  info->size = STATS_GET(st->size);
+  info->waste = STATS_GET(st->waste);
+  info->peak = STATS_GET(st->peak);
+  info->alloc = STATS_GET(st->count.alloc);
+  info->nalloc = STATS_GET(st->count.nalloc);
+  info->used = (info->size > info->waste + room) ?
+    info->size - info->waste - room : 0;
+}
+
+
+int
+obs_stats_get(struct obstack *stack, struct obs_stats_info *info)
+{
+  if ((void *)stack->chunkfun != (void *)obs_stats_chunk_alloc_)
+    return -1;
+  stats_info((struct obs_stats *)stack->extra_arg, info);
+  return 0;
+}
+
+
+/* Write S to FP as a JSON string. */
+static void
+stats_json_string(FILE *fp, const char *s)
+{
+  unsigned char c;
+
+  putc('"', fp);
+  for (; (c = *s) != '\0'; s++) {
+    if (c == '"' || c == '\\')
+      fprintf(fp, "\\%c", c);
+    else if (c < 0x20)
+      fprintf(fp, "\\u%04x", c);
+    else
+      putc(c, fp);
+  }
+  putc('"', fp);
+}
+
+
+int
+obs_stats_report(FILE *fp, unsigned flags)
+{
+  struct stats_site *site;
+  struct obs_stats *st;
+  struct obs_stats_info info;
+  size_t used, total_used = 0;
+  unsigned long long alloc, nalloc;
+  unsigned long nlive = 0;
+  int first = 1;
+
+  pthread_mutex_lock(&stats_lock);
+  for (site = stats_sites; site != NULL; site = site->next) {
+    for (st = site->live; st != NULL; st = st->next) {
+      stats_info(st, &info);
+      total_used += info.used;
+    }
+    nlive += site->nlive;
+  }
+
+  fprintf(fp, "{\"time\":%ld,\"pid\":%ld,\"obstacks\":%lu,\"chunks\":%lu,"
+          "\"size\":%zu,\"used\":%zu,\"waste\":%zu,\"peak\":%zu,\"sites\":[",
+          (long)time(NULL), (long)getpid(), nlive,
+          STATS_GET(stats_total.chunks), STATS_GET(stats_total.size),
+          total_used, STATS_GET(stats_total.waste),
+          STATS_GET(stats_total.peak));
+
+  for (site = stats_sites; site != NULL; site = site->next) {
+    used = 0;
+    alloc = site->alloc;
+    nalloc = site->nalloc;
+    for (st = site->live; st != NULL; st = st->next) {
+      stats_info(st, &info);
+      used += info.used;
+      alloc += info.alloc;
+      nalloc += info.nalloc;
+    }
+
+    fprintf(fp, "%s{\"file\":", (first) ? "" : ",");
+    stats_json_string(fp, site->file);
+    fprintf(fp, ",\"line\":%d,\"func\":", site->line);
+    stats_json_string(fp, site->func);
+    fprintf(fp, ",\"created\":%lu,\"obstacks\":%lu,\"chunks\":%lu,"
+            "\"size\":%zu,\"used\":%zu,\"waste\":%zu,\"peak\":%zu,"
+            "\"alloc\":%llu,\"nalloc\":%llu",
+            site->created, site->nlive, STATS_GET(site->chunks),
+            STATS_GET(site->size), used, STATS_GET(site->waste),
+            STATS_GET(site->peak), alloc, nalloc);
+    first = 0;
+
+    if (flags & OBS_STATS_LIVE) {
+      fprintf(fp, ",\"live\":[");
+      for (st = site->live; st != NULL; st = st->next) {
+        stats_info(st, &info);
+        fprintf(fp, "%s{\"stack\":\"%p\",\"chunks\":%lu,\"size\":%zu,"
+                "\"used\":%zu,\"waste\":%zu,\"peak\":%zu,"
+                "\"alloc\":%llu,\"nalloc\":%llu}",
+                (st == site->live) ? "" : ",", (void *)st->stack,
+                info.chunks, info.size, info.used, info.waste, info.peak,
+                info.alloc, info.nalloc);
+      }
+      fprintf(fp, "]");
+    }
+    fprintf(fp, "}");
+  }
+  fprintf(fp, "]}\n");
+  pthread_mutex_unlock(&stats_lock);
+
+  return (ferror(fp)) ? -1 : 0;
+}
+
+
+static int stats_pipe[2] = { -1, -1 };
+static pthread_t stats_thread;
+static const char *stats_path;
+static int stats_interval;
+static int stats_signo;
+static int stats_quit;
+static struct sigaction stats_oldact;
+
+
+static void
+stats_signal(int signo)
+{
+  int saved_errno = errno;
+
+  if (write(stats_pipe[1], "r", 1) < 0) {
+    /* the pipe is full; a report is pending anyway */
+  }
+  errno = saved_errno;
+}
+
+
+static void *
+stats_main(void *arg)
+{
+  struct pollfd pfd;
+  char buf[64];
+  FILE *fp;
+  int n;
+
+  pfd.fd = stats_pipe[0];
+  pfd.events = POLLIN;
+
+  for (;;) {
+    n = poll(&pfd, 1, (stats_interval > 0) ? stats_interval * 1000 : -1);
+    if (__atomic_load_n(&stats_quit, __ATOMIC_ACQUIRE))
+      break;
+    if (n < 0)
+      continue;
+    if (n > 0) {
+      while (read(stats_pipe[0], buf, sizeof(buf)) > 0)
+        ;
+    }
+
+    fp = (stats_path) ? fopen(stats_path, "a") : stderr;
+    if (!fp)
+      continue;
+    obs_stats_report(fp, OBS_STATS_LIVE);
+    if (fp != stderr)
+      fclose(fp);
+    else
+      fflush(fp);
+  }
+  return NULL;
+}
+
+
+int
+obs_stats_start(const char *path, int interval, int signo)
+{
+  struct sigaction act;
+  int i, ret;
+
+  if (stats_pipe[0] >= 0) {
+    errno = EBUSY;
+    return -1;
+  }
+  if (pipe(stats_pipe) < 0)
+    return -1;
+  for (i = 0; i < 2; i++) {
+    fcntl(stats_pipe[i], F_SETFD, FD_CLOEXEC);
+    fcntl(stats_pipe[i], F_SETFL, fcntl(stats_pipe[i], F_GETFL) | O_NONBLOCK);
+  }
+  stats_path = path;
+  stats_quit = 0;
+  stats_interval = interval;
+  stats_signo = signo;
+
+  if (signo > 0) {
+    memset(&act, 0, sizeof(act));
+    act.sa_handler = stats_signal;
+    act.sa_flags = SA_RESTART;
+    sigemptyset(&act.sa_mask);
+    if (sigaction(signo, &act, &stats_oldact) < 0)
+      goto err;
+  }
+
+  ret = pthread_create(&stats_thread, NULL, stats_main, NULL);
+  if (ret) {
+    if (signo > 0)
+      sigaction(signo, &stats_oldact, NULL);
+    errno = ret;
+    goto err;
+  }
+  return 0;
+
+ err:
+  ret = errno;
+  close(stats_pipe[0]);
+  close(stats_pipe[1]);
+  stats_pipe[0] = stats_pipe[1] = -1;
+  errno = ret;
+  return -1;
+}
+
+
+void
+obs_stats_stop(void)
+{
+  if (stats_pipe[0] < 0)
+    return;
+  if (stats_signo > 0)
+    sigaction(stats_signo, &stats_oldact, NULL);
+  __atomic_store_n(&stats_quit, 1, __ATOMIC_RELEASE);
+  if (write(stats_pipe[1], "q", 1) < 0) {
+    /* the pipe is full, so the thread is awake anyway */
+  }
+  pthread_join(stats_thread, NULL);
+  close(stats_pipe[0]);
+  close(stats_pipe[1]);
+  stats_pipe[0] = stats_pipe[1] = -1;
+}
+#endif  /* OBS_STATS */
+
+
 #ifndef FAKEOBJS
 size_t
 obstack_capacity(struct obstack *stack)
@@ -235,9 +722,11 @@ obstack_dump(struct obstack *stack)
   printf("==   chunk_limit:    [0x%08lx]\n", (unsigned long)stack->chunk_limit);
   //printf("==   temp: %ld\n", (unsigned long)stack->temp);
   printf("==   alignment_mask: 0x%lx\n", (unsigned long)stack->alignment_mask);
+#ifndef TCOBJS
   printf("==   use_extra_arg:      %u\n", stack->use_extra_arg);
   printf("==   maybe_empty_object: %u\n", stack->maybe_empty_object);
   printf("==   alloc_failed:       %u\n", stack->alloc_failed);
+#endif
 
   chunk = stack->chunk;
   while (chunk) {
@@ -298,6 +787,67 @@ child_thread(void *arg)
   return NULL;
 }
 
+#ifdef OBS_STATS
+#include <signal.h>
+
+static void
+test_stats(void)
+{
+  struct obstack a, b;
+  struct obs_stats_info ia, ib;
+  char path[] = "/tmp/obsutil-test-XXXXXX";
+  void *mark;
+  int i, fd;
+
+  assert(OBSTACK_INIT(&a) == 0);
+  assert(OBSTACK_INIT(&b) == 0);
+
+  mark = OBSTACK_ALLOC(&a, 100);
+  OBSTACK_COPY0(&a, "hello", 5);
+  assert(obs_stats_get(&a, &ia) == 0);
+  assert(ia.chunks == 1 && ia.alloc == 106 && ia.nalloc == 2);
+  assert(ia.used >= 106 && ia.waste == 0);
+
+  /* An object that does not fit leaves the rest of the chunk unused. */
+  for (i = 0; i < 3; i++)
+    OBSTACK_ALLOC(&a, OBSTACK_CHUNK_SIZE(&a) - 200);
+  OBSTACK_GROW(&a, "x", 1);
+  OBSTACK_FINISH(&a);
+  assert(obs_stats_get(&a, &ia) == 0);
+  assert(ia.chunks == 3 && ia.waste > 0 && ia.size == ia.peak);
+  assert(ia.used + ia.waste <= ia.size);
+
+  OBSTACK_FREE(&a, mark);
+  assert(obs_stats_get(&a, &ia) == 0);
+  assert(ia.chunks == 1 && ia.waste == 0 && ia.peak > ia.size);
+
+  assert(obs_stats_get(&b, &ib) == 0 && ib.chunks == 1 && ib.alloc == 0);
+  obs_stats_report(stdout, OBS_STATS_LIVE);
+
+  /* The report on a signal. */
+  fd = mkstemp(path);
+  assert(fd >= 0);
+  close(fd);
+  assert(obs_stats_start(path, 0, SIGUSR2) == 0);
+  raise(SIGUSR2);
+  usleep(100000);
+  obs_stats_stop();
+  {
+    FILE *fp = fopen(path, "r");
+    char line[256];
+    assert(fp && fgets(line, sizeof(line), fp) &&
+           strncmp(line, "{\"time\":", 8) == 0);
+    fclose(fp);
+  }
+  unlink(path);
+
+  OBSTACK_FREE(&a, NULL);
+  OBSTACK_FREE(&b, NULL);
+  assert(obs_stats_get(&a, &ia) < 0);
+  obs_stats_report(stdout, 0);
+}
+#endif  /* OBS_STATS */
+
 int
 main(int argc, char *argv[])
 {
@@ -336,6 +886,9 @@ main(int argc, char *argv[])
   OBSTACK_FREE(stack, r);
   OBSTACK_FREE(stack, p);
 
+#ifdef OBS_STATS
+  test_stats();
+#endif
   return 0;
 }
 
@@ -37,8 +37,10 @@
 #include <stdint.h>
 #endif  /* __APPLE__ */
 
-#ifdef FAKEOBJS
+#if defined(FAKEOBJS)
 #include "fakeobs.h"
+#elif defined(TCOBJS)
+#include "tcobs.h"
 #else
 #include "obstack.h"
 #endif
@@ -125,7 +127,7 @@ extern void obsutil_alloc_failed_handler(void);
 #define OBSTACK_1GROW_FAST(s,v) obstack_1grow_fast((s), (v))
 #define OBSTACK_INT_GROW(s,v)   obstack_int_grow((s), (v))
 #define OBSTACK_INT_GROW_FAST(s,v) obstack_int_grow_fast((s), (v))
-#define OBSTACK_FREE(s, o)      obstack_free((s), (o))
+#define OBSTACK_FREE(s, o)      obs_free((s), (o))
 #define OBSTACK_COPY(s, a, z)   obs_copy((s), (a), (z))
 #define OBSTACK_COPY0(s, a, z)  obs_copy0((s), (a), (z))
 #define OBSTACK_BLANK(s, z)     obs_blank((s), (z))
@@ -139,21 +141,22 @@ extern void obsutil_alloc_failed_handler(void);
 #define OBSTACK_ALIGNMENT_MASK(s)       obstack_alignment_mask(s)
 #define OBSTACK_CHUNK_SIZE(s)   obstack_chunk_size(s)
 #define OBSTACK_CAPACITY(s)         obstack_capacity(s)
-#else
+#define OBSTACK_STR_COPY(s, str)        obs_copy0((s), (str), strlen(str))
+#endif  /* LEGACY */
+
+/* The inline functions below use these, with or without LEGACY. */
 #define obs_object_size(x)      obstack_object_size(x)
 #define obs_finish(x)           obstack_finish(x)
 #define obs_room(x)             obstack_room(x)
 #define obs_1grow_fast(s,c)     obstack_1grow_fast((s), (c))
 #define obs_int_grow(s,v)       obstack_int_grow((s), (v))
 #define obs_int_grow_fast(s,v)  obstack_int_grow_fast((s), (v))
-#define obs_free(s, o)          obstack_free((s), (o))
 #define obs_base(s)             obstack_base(s)
 #define obs_blank_fast(s, z)    obstack_blank_fast((s), (z))
 #define obs_next_free(s)        obstack_next_free(s)
 #define obs_alignment_mask(s)   obstack_alignment_mask(s)
 #define obs_chunk_size(s)       obstack_chunk_size(s)
 #define obs_capacity(s)         obstack_capacity(s)
-#endif  /* LEGACY */
 
 /*
  * You should call obsutil_init() before calling any function or using
@@ -183,6 +186,139 @@ obs_has_error(void)
 }
 
 
+#ifdef OBS_STATS
+#if defined(FAKEOBJS) || defined(TCOBJS)
+#error "OBS_STATS needs GNU obstack"
+#endif
+#include <stdio.h>
+
+/*
+ * Arena usage statistics, built with -DOBS_STATS (GNU obstack only):
+ *
+ *   $ cc -DOBS_STATS ... obsutil.c -lpthread
+ *
+ * Every obstack initialized with obs_init() or obs_begin() (or their
+ * LEGACY names) is registered under the file and line of that call.
+ * Its chunks are allocated through obsutil, which keeps, per obstack
+ * and per call site:
+ *
+ *   chunks, size   the chunks and their bytes, and the high-water
+ *                  mark of the size (peak),
+ *   waste          the bytes left unused at the end of the chunks
+ *                  below the current one, when an object did not fit,
+ *   used           size - waste - the room left in the current chunk,
+ *   alloc, nalloc  the bytes that obs_alloc(), obs_copy(), obs_grow()
+ *                  and friends asked for, and the number of objects of
+ *                  obs_alloc(), obs_copy() and obs_copy0().
+ *
+ * An obstack is unregistered when obs_free(S, NULL) releases its last
+ * chunk, so the live obstacks of a site that keep growing in number
+ * are the leaks.  The obstacks made with obstack_init() itself are not
+ * counted.
+ */
+struct obs_stats_counter_ {
+  unsigned long long alloc;
+  unsigned long long nalloc;
+  size_t room;                  /* left in the current chunk */
+  size_t want;                  /* the last request, for a new chunk */
+};
+
+struct obs_stats_info {
+  unsigned long chunks;
+  size_t size;
+  size_t used;
+  size_t waste;
+  size_t peak;
+  unsigned long long alloc;
+  unsigned long long nalloc;
+};
+
+/* For obs_stats_report(): list every live obstack, not just the sites. */
+#define OBS_STATS_LIVE  0x0001
+
+extern int obs_stats_begin_(struct obstack *stack, int size,
+                            const char *file, int line, const char *func);
+extern void *obs_stats_chunk_alloc_(void *arg, long size);
+
+/*
+ * Fill INFO with the statistics of STACK.  Returns -1 if STACK is not
+ * registered.
+ */
+extern int obs_stats_get(struct obstack *stack, struct obs_stats_info *info);
+
+/*
+ * Write the statistics of all call sites to FP as one line of JSON:
+ *
+ *   {"time":1414141414,"pid":123,"obstacks":2,"chunks":3,"size":12264,
+ *    "used":9000,"waste":1200,"peak":16352,"sites":[{"file":"conf.c",
+ *    "line":42,"func":"conf_new","created":5,"obstacks":2,...},...]}
+ *
+ * where "created" counts every obstack that was initialized at the
+ * site.  With OBS_STATS_LIVE, each site has a "live" array of its
+ * obstacks.  The room in the current chunk of an obstack is the one
+ * that its own thread noted at its last obs_*() call, so the report
+ * never touches the obstacks themselves, which may be gone for the
+ * leaked ones; "used" is approximate.
+ */
+extern int obs_stats_report(FILE *fp, unsigned flags);
+
+/*
+ * Start a thread that appends obs_stats_report(OBS_STATS_LIVE) to
+ * PATH (stderr if NULL) every INTERVAL seconds, if INTERVAL > 0, and
+ * whenever the process gets the signal SIGNO, if SIGNO > 0:
+ *
+ *   obs_stats_start("/var/tmp/mydaemon.obs", 0, SIGUSR2);
+ *
+ * Returns 0 on success, or -1 with errno set.
+ */
+extern int obs_stats_start(const char *path, int interval, int signo);
+extern void obs_stats_stop(void);
+
+static __inline__ void
+obs_stats_count_(struct obstack *stack, int size, int nobj)
+{
+  struct obs_stats_counter_ *c;
+  size_t room;
+
+  if ((void *)stack->chunkfun != (void *)obs_stats_chunk_alloc_ || size < 0)
+    return;
+  /* Only the thread that owns STACK writes these. */
+  c = (struct obs_stats_counter_ *)stack->extra_arg;
+  __atomic_store_n(&c->alloc, c->alloc + size, __ATOMIC_RELAXED);
+  __atomic_store_n(&c->nalloc, c->nalloc + nobj, __ATOMIC_RELAXED);
+
+  /* If SIZE does not fit, obs_stats_chunk_alloc_() sets the room. */
+  room = stack->chunk_limit - stack->next_free;
+  c->want = size;
+  __atomic_store_n(&c->room, (room > (size_t)size) ? room - size : 0,
+                   __ATOMIC_RELAXED);
+}
+
+
+static __inline__ void
+obs_stats_free_(struct obstack *stack, void *obj)
+{
+  struct obs_stats_counter_ *c;
+
+  obstack_free(stack, obj);
+  /* Unless that was the last chunk, and STACK is unregistered */
+  if ((void *)stack->chunkfun != (void *)obs_stats_chunk_alloc_)
+    return;
+  c = (struct obs_stats_counter_ *)stack->extra_arg;
+  __atomic_store_n(&c->room, stack->chunk_limit - stack->next_free,
+                   __ATOMIC_RELAXED);
+}
+
+#define obs_init(s)     obs_stats_begin_((s), 0, __FILE__, __LINE__, __func__)
+#define obs_begin(s, z) obs_stats_begin_((s), (z), \
+                                         __FILE__, __LINE__, __func__)
+#define obs_free(s, o)  obs_stats_free_((s), (o))
+#define OBS_STATS_COUNT(s, z, n)        obs_stats_count_((s), (z), (n))
+
+#else  /* OBS_STATS */
+#define obs_free(s, o)  obstack_free((s), (o))
+#define OBS_STATS_COUNT(s, z, n)        ((void)0)
+
 static __inline__ int
 obs_init(struct obstack *stack)
 {
@@ -204,6 +340,7 @@ obs_begin(struct obstack *stack, int size)
     return -1;
   return 0;
 }
+#endif  /* OBS_STATS */
 
 
 static __inline__ void *
@@ -211,6 +348,7 @@ obs_alloc(struct obstack *stack, int size)
 {
   void *ptr;
   OBS_ERROR_CLEAR;
+  OBS_STATS_COUNT(stack, size, 1);
   ptr = obstack_alloc(stack, size);
   if (OBS_ERROR)
     return 0;
@@ -223,6 +361,7 @@ obs_copy(struct obstack *stack, const void *address, int size)
 {
   void *ptr;
   OBS_ERROR_CLEAR;
+  OBS_STATS_COUNT(stack, size, 1);
   ptr = obstack_copy(stack, address, size);
   if (obs_errno)
     return 0;
@@ -235,6 +374,7 @@ obs_copy0(struct obstack *stack, const void *address, int size)
 {
   void *ptr;
   OBS_ERROR_CLEAR;
+  OBS_STATS_COUNT(stack, size + 1, 1);
   ptr = obstack_copy0(stack, address, size);
   if (obs_errno)
     return 0;
@@ -246,6 +386,7 @@ static __inline__ int
 obs_blank(struct obstack *stack, int size)
 {
   OBS_ERROR_CLEAR;
+  OBS_STATS_COUNT(stack, size, 0);
   obstack_blank(stack, size);
   if (obs_errno)
     return -1;
@@ -257,6 +398,7 @@ static __inline__ int
 obs_grow(struct obstack *stack, const void *data, int size)
 {
   OBS_ERROR_CLEAR;
+  OBS_STATS_COUNT(stack, size, 0);
   obstack_grow(stack, data, size);
   if (obs_errno)
     return -1;
@@ -268,6 +410,7 @@ static __inline__ int
 obs_grow0(struct obstack *stack, const void *data, int size)
 {
   OBS_ERROR_CLEAR;
+  OBS_STATS_COUNT(stack, size + 1, 0);
   obstack_grow0(stack, data, size);
   if (obs_errno)
     return -1;
@@ -279,6 +422,7 @@ static __inline__ int
 obs_1grow(struct obstack *stack, char c)
 {
   OBS_ERROR_CLEAR;
+  OBS_STATS_COUNT(stack, 1, 0);
   obstack_1grow(stack, c);
   if (obs_errno)
     return -1;
@@ -290,6 +434,7 @@ static __inline__ int
 obs_ptr_grow(struct obstack *stack, const void *data)
 {
   OBS_ERROR_CLEAR;
+  OBS_STATS_COUNT(stack, sizeof(void *), 0);
   obstack_ptr_grow(stack, (void *)data);
   if (obs_errno)
     return -1;
@@ -0,0 +1,280 @@
+/*
+ * Order-statistics tree on top of the augmented rbtree
+ * Copyright (C) 2014  Seong-Kook Shin <cinsky@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ */
+#include <stddef.h>
+#include "ostree.h"
+
+#define OSTREE(n)       rb_entry((n), struct ostree_node, rb)
+#define COUNT(n)        ((n) ? OSTREE(n)->count : 0)
+
+
+static void
+ostree_augment(struct rb_node *rb, void *data)
+{
+  (void)data;
+  OSTREE(rb)->count = 1 + COUNT(rb->rb_left) + COUNT(rb->rb_right);
+}
+
+
+void
+ostree_insert_color(struct rb_root *root, struct ostree_node *node)
+{
+  node->count = 1;
+  rb_insert_color(&node->rb, root);
+  rb_augment_insert(&node->rb, ostree_augment, NULL);
+
+  root->size++;
+  root->nmodified++;
+}
+
+
+void
+ostree_remove(struct rb_root *root, struct ostree_node *node)
+{
+  struct rb_node *deepest;
+
+  deepest = rb_augment_erase_begin(&node->rb);
+  rb_erase(&node->rb, root);
+  rb_augment_erase_end(deepest, ostree_augment, NULL);
+
+  root->size--;
+  root->nmodified++;
+}
+
+
+struct ostree_node *
+ostree_select(struct rb_root *root, size_t k)
+{
+  struct rb_node *rb = root->rb_node;
+  size_t left;
+
+  while (rb) {
+    left = COUNT(rb->rb_left);
+    if (k < left)
+      rb = rb->rb_left;
+    else if (k == left)
+      return OSTREE(rb);
+    else {
+      k -= left + 1;
+      rb = rb->rb_right;
+    }
+  }
+  return NULL;
+}
+
+
+size_t
+ostree_rank(const struct ostree_node *node)
+{
+  const struct rb_node *rb = &node->rb, *parent;
+  size_t rank = COUNT(rb->rb_left);
+
+  while ((parent = rb_parent(rb)) != NULL) {
+    if (rb == parent->rb_right)
+      rank += COUNT(parent->rb_left) + 1;
+    rb = parent;
+  }
+  return rank;
+}
+
+
+#ifdef TEST_OSTREE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/time.h>
+
+/*
+ * Random inserts and removes checked against a sorted array, then a
+ * benchmark of percentile queries over a sliding window of latency
+ * samples: ostree_select() against copying the window and running
+ * quickselect, which is what we do without the tree.
+ *
+ *   $ cc -O2 -DTEST_OSTREE ostree.c rbtree.c
+ *   $ ./a.out [WINDOW] [NSAMPLES]
+ */
+struct sample {
+  struct ostree_node node;
+  long latency;
+};
+
+#define LATENCY_CMP(a, b)       (((a) > (b)) - ((a) < (b)))
+
+static double
+now(void)
+{
+  struct timeval tv;
+
+  gettimeofday(&tv, 0);
+  return tv.tv_sec + tv.tv_usec / 1e6;
+}
+
+static size_t
+check(struct rb_node *rb)
+{
+  size_t n;
+
+  if (!rb)
+    return 0;
+  n = 1 + check(rb->rb_left) + check(rb->rb_right);
+  if (OSTREE(rb)->count != n)
+    abort();
+  return n;
+}
+
+static int
+cmp_long(const void *a, const void *b)
+{
+  return LATENCY_CMP(*(const long *)a, *(const long *)b);
+}
+
+static int
+test(unsigned nsamples, unsigned nops)
+{
+  struct rb_root root = RB_ROOT;
+  struct sample *samples = calloc(nsamples, sizeof(*samples));
+  char *live = calloc(nsamples, 1);
+  long *sorted = malloc(sizeof(*sorted) * nsamples);
+  struct ostree_node *node;
+  unsigned i, j, k, nlive = 0;
+
+  for (i = 0; i < nops; i++) {
+    j = rand() % nsamples;
+    if (!live[j]) {
+      samples[j].latency = rand() % 1000;
+      OSTREE_INSERT(&root, struct sample, latency, node, LATENCY_CMP,
+                    &samples[j]);
+      live[j] = 1;
+      nlive++;
+    }
+    else {
+      ostree_remove(&root, &samples[j].node);
+      live[j] = 0;
+      nlive--;
+    }
+    if (root.size != nlive || check(root.rb_node) != nlive)
+      return -1;
+
+    for (j = k = 0; j < nsamples; j++)
+      if (live[j])
+        sorted[k++] = samples[j].latency;
+    qsort(sorted, k, sizeof(*sorted), cmp_long);
+
+    for (k = 0; k < nlive; k++) {
+      node = ostree_select(&root, k);
+      if (!node || container_of(node, struct sample, node)->latency !=
+          sorted[k] || ostree_rank(node) != k)
+        return -1;
+    }
+    if (ostree_select(&root, nlive))
+      return -1;
+  }
+  free(sorted);
+  free(live);
+  free(samples);
+  return 0;
+}
+
+/* Hoare's quickselect */
+static long
+quickselect(long *a, size_t n, size_t k)
+{
+  size_t lo = 0, hi = n - 1, i, j;
+  long pivot, t;
+
+  while (lo < hi) {
+    pivot = a[lo + (hi - lo) / 2];
+    i = lo;
+    j = hi;
+    while (i <= j) {
+      while (a[i] < pivot)
+        i++;
+      while (a[j] > pivot)
+        j--;
+      if (i <= j) {
+        t = a[i]; a[i] = a[j]; a[j] = t;
+        i++;
+        if (j == 0)
+          break;
+        j--;
+      }
+    }
+    if (k <= j)
+      hi = j;
+    else if (k >= i)
+      lo = i;
+    else
+      break;
+  }
+  return a[k];
+}
+
+int
+main(int argc, char *argv[])
+{
+  size_t window = (argc > 1) ? atol(argv[1]) : 10000;
+  size_t n = (argc > 2) ? atol(argv[2]) : 1000000;
+  struct rb_root root = RB_ROOT;
+  struct sample *ring;
+  long *copy, *latency, sum;
+  size_t i, pos, every;
+  double beg;
+
+  srand(1);
+  if (test(300, 5000) < 0) {
+    fprintf(stderr, "ostree: test failed\n");
+    return 1;
+  }
+  printf("ostree: test passed\n");
+
+  ring = calloc(window, sizeof(*ring));
+  copy = malloc(sizeof(*copy) * window);
+  latency = malloc(sizeof(*latency) * n);
+  for (i = 0; i < n; i++)
+    latency[i] = rand() % 100000;
+
+  /* Every sample replaces the oldest one in the window; the p99 is
+   * queried every EVERY samples. */
+  for (every = 10; every <= 10000; every *= 10) {
+    memset(ring, 0, sizeof(*ring) * window);
+    root = (struct rb_root)RB_ROOT;
+    sum = 0;
+    beg = now();
+    for (i = 0; i < n; i++) {
+      pos = i % window;
+      if (i >= window)
+        ostree_remove(&root, &ring[pos].node);
+      ring[pos].latency = latency[i];
+      OSTREE_INSERT(&root, struct sample, latency, node, LATENCY_CMP,
+                    &ring[pos]);
+      if (i >= window && i % every == 0)
+        sum += container_of(ostree_select(&root, (window - 1) * 99 / 100),
+                            struct sample, node)->latency;
+    }
+    printf("p99 every %5zu samples: ostree %8.3f sec", every, now() - beg);
+
+    beg = now();
+    for (i = 0; i < n; i++) {
+      ring[i % window].latency = latency[i];
+      if (i >= window && i % every == 0) {
+        for (pos = 0; pos < window; pos++)
+          copy[pos] = ring[pos].latency;
+        sum -= quickselect(copy, window, (window - 1) * 99 / 100);
+      }
+    }
+    printf(", copy+quickselect %8.3f sec%s\n", now() - beg,
+           (sum) ? " (MISMATCH)" : "");
+  }
+
+  free(latency);
+  free(copy);
+  free(ring);
+  return 0;
+}
+#endif  /* TEST_OSTREE */
@@ -0,0 +1,75 @@
+/*
+ * Order-statistics tree on top of the augmented rbtree
+ * Copyright (C) 2014  Seong-Kook Shin <cinsky@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ */
+#ifndef OSTREE_H__
+#define OSTREE_H__
+
+#include "rbtree.h"
+
+/*
+ * An order-statistics tree keeps the size of every subtree, so that
+ * it can find the k-th smallest node (ostree_select()) and the rank
+ * of a node (ostree_rank()) in O(log n).  For example, the 99th
+ * percentile of live latency samples is
+ *
+ *   ostree_select(&root, (root.size - 1) * 99 / 100)
+ *
+ * Like rb_node, ostree_node is embedded in your own struct, and you
+ * provide the ordering.  OSTREE_INSERT() works like RB_INSERT(), but
+ * it allows duplicated keys (they go after the existing ones):
+ *
+ *   struct sample {
+ *     struct ostree_node node;
+ *     long latency;
+ *   };
+ *
+ *   #define LATENCY_CMP(a, b)   (((a) > (b)) - ((a) < (b)))
+ *
+ *   OSTREE_INSERT(&root, struct sample, latency, node, LATENCY_CMP, s);
+ *   ...
+ *   ostree_remove(&root, &s->node);
+ *
+ * If you link a node by yourself (rb_link_node()), call
+ * ostree_insert_color() instead of rb_insert_color().
+ */
+
+struct ostree_node {
+  struct rb_node rb;
+  size_t count;                 /* # of nodes in this subtree */
+};
+
+extern void ostree_insert_color(struct rb_root *root, struct ostree_node *node);
+extern void ostree_remove(struct rb_root *root, struct ostree_node *node);
+
+/*
+ * Return the K-th (0-based) smallest node, or NULL if K >= the number
+ * of nodes.
+ */
+extern struct ostree_node *ostree_select(struct rb_root *root, size_t k);
+
+/*
+ * Return the number of nodes that precede NODE.
+ */
+extern size_t ostree_rank(const struct ostree_node *node);
+
+#define OSTREE_INSERT(root, usertype, userkey, handle, compare, data) do { \
+      struct rb_node **new_ = &((root)->rb_node), *parent_ = 0;         \
+      while (*new_) {                                                   \
+        usertype *this_ = container_of(*new_, usertype, handle.rb);     \
+        parent_ = *new_;                                                \
+        if (compare((data)->userkey, this_->userkey) < 0)               \
+          new_ = &((*new_)->rb_left);                                   \
+        else                                                            \
+          new_ = &((*new_)->rb_right);                                  \
+      }                                                                 \
+      rb_link_node(&(data)->handle.rb, parent_, new_);                  \
+      ostree_insert_color((root), &(data)->handle);                     \
+    } while (0)
+
+#endif  /* OSTREE_H__ */
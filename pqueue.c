@@ -0,0 +1,371 @@
+/*
+ * Concurrent priority queue
+ * Copyright (C) 2014  Seong-Kook Shin <cinsky@gmail.com>
+ * DO WHAT THE FUCK YOU WANT TO PUBLIC LICENSE
+ * Version 2, December 2004
+ */
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+#include <pthread.h>
+
+#include "heap.h"
+#include "pqueue.h"
+
+#define PQ_CACHELINE    64
+
+#define PQ_LESS(a, b)   ((a) < (b))
+DHEAP_DEFINE(pq_heap, unsigned long, void *, PQ_LESS);
+
+struct subqueue {
+  pthread_mutex_t lock;
+  pq_heap heap;
+
+  /* Written under LOCK, read without it by pqueue_pop() to choose a
+   * heap.  TOP is meaningless if SIZE is zero. */
+  unsigned long top;
+  size_t size;
+} __attribute__((aligned(PQ_CACHELINE)));
+
+struct pqueue {
+  int nqueues;
+  struct subqueue *sq;
+};
+
+static __thread unsigned long pq_seed;
+
+
+/*
+ * xorshift64; seeded per thread on the first call.
+ */
+static __inline__ unsigned
+pq_random(void)
+{
+  unsigned long x = pq_seed;
+
+  if (!x)
+    x = ((unsigned long)&x ^ (unsigned long)pthread_self()) | 1;
+  x ^= x << 13;
+  x ^= x >> 7;
+  x ^= x << 17;
+  pq_seed = x;
+  return (unsigned)(x >> 16);
+}
+
+
+static __inline__ void
+sq_publish(struct subqueue *sq)
+{
+  unsigned long key = 0;
+
+  pq_heap_top(&sq->heap, &key, 0);
+  __atomic_store_n(&sq->top, key, __ATOMIC_RELAXED);
+  __atomic_store_n(&sq->size, sq->heap.end, __ATOMIC_RELAXED);
+}
+
+
+pqueue_t *
+pqueue_new(int nqueues)
+{
+  pqueue_t *q;
+  int i;
+
+  if (nqueues < 1)
+    nqueues = 1;
+
+  q = malloc(sizeof(*q));
+  if (!q)
+    return NULL;
+
+  if (posix_memalign((void **)&q->sq, PQ_CACHELINE,
+                     sizeof(*q->sq) * nqueues) != 0) {
+    free(q);
+    return NULL;
+  }
+  memset(q->sq, 0, sizeof(*q->sq) * nqueues);
+
+  q->nqueues = nqueues;
+  for (i = 0; i < nqueues; i++) {
+    pthread_mutex_init(&q->sq[i].lock, NULL);
+    pq_heap_init(&q->sq[i].heap);
+  }
+  return q;
+}
+
+
+void
+pqueue_delete(pqueue_t *q)
+{
+  int i;
+
+  for (i = 0; i < q->nqueues; i++) {
+    pq_heap_free(&q->sq[i].heap);
+    pthread_mutex_destroy(&q->sq[i].lock);
+  }
+  free(q->sq);
+  free(q);
+}
+
+
+int
+pqueue_push(pqueue_t *q, unsigned long key, void *data)
+{
+  struct subqueue *sq;
+  unsigned handle;
+  int i;
+
+  if (q->nqueues == 1) {
+    sq = q->sq;
+    pthread_mutex_lock(&sq->lock);
+  }
+  else {
+    /* Try a few random heaps before blocking on one. */
+    for (i = 0; ; i++) {
+      sq = q->sq + pq_random() % q->nqueues;
+      if (i >= q->nqueues) {
+        pthread_mutex_lock(&sq->lock);
+        break;
+      }
+      if (pthread_mutex_trylock(&sq->lock) == 0)
+        break;
+    }
+  }
+
+  handle = pq_heap_push(&sq->heap, key, data);
+  if (handle != DHEAP_NOHANDLE)
+    sq_publish(sq);
+  pthread_mutex_unlock(&sq->lock);
+
+  return (handle != DHEAP_NOHANDLE) ? 0 : -1;
+}
+
+
+/*
+ * Pop from SQ if it is not empty.  If BLOCK is zero and SQ is locked
+ * by other thread, returns -1 immediately.
+ */
+static __inline__ int
+sq_pop(struct subqueue *sq, int block, unsigned long *key, void **data)
+{
+  int ret;
+
+  if (block)
+    pthread_mutex_lock(&sq->lock);
+  else if (pthread_mutex_trylock(&sq->lock) != 0)
+    return -1;
+
+  ret = pq_heap_pop(&sq->heap, key, data);
+  if (ret)
+    sq_publish(sq);
+  pthread_mutex_unlock(&sq->lock);
+  return ret;
+}
+
+
+/*
+ * Choose the heap with the smaller top key among I and J, using the
+ * published tops.  Returns -1 if both look empty.
+ */
+static __inline__ int
+choose(pqueue_t *q, int i, int j)
+{
+  size_t si = __atomic_load_n(&q->sq[i].size, __ATOMIC_RELAXED);
+  size_t sj = __atomic_load_n(&q->sq[j].size, __ATOMIC_RELAXED);
+
+  if (!si)
+    return (sj) ? j : -1;
+  if (!sj)
+    return i;
+  return (__atomic_load_n(&q->sq[j].top, __ATOMIC_RELAXED) <
+          __atomic_load_n(&q->sq[i].top, __ATOMIC_RELAXED)) ? j : i;
+}
+
+
+int
+pqueue_pop(pqueue_t *q, unsigned long *key, void **data)
+{
+  int c, i, ret;
+
+  if (q->nqueues == 1)
+    return sq_pop(q->sq, 1, key, data);
+
+  while (1) {
+    c = choose(q, pq_random() % q->nqueues, pq_random() % q->nqueues);
+
+    if (c < 0) {
+      /* Both samples are empty; the queue may be nearly empty, so
+       * look for any non-empty heap before giving up. */
+      for (i = 0; i < q->nqueues; i++)
+        if (__atomic_load_n(&q->sq[i].size, __ATOMIC_RELAXED))
+          break;
+      if (i == q->nqueues)
+        return 0;
+      ret = sq_pop(q->sq + i, 1, key, data);
+    }
+    else
+      ret = sq_pop(q->sq + c, 0, key, data);
+
+    if (ret > 0)
+      return 1;
+  }
+}
+
+
+size_t
+pqueue_size(pqueue_t *q)
+{
+  size_t size = 0;
+  int i;
+
+  for (i = 0; i < q->nqueues; i++)
+    size += __atomic_load_n(&q->sq[i].size, __ATOMIC_RELAXED);
+  return size;
+}
+
+
+#ifdef TEST_PQUEUE
+#include <stdio.h>
+#include <sys/time.h>
+
+/*
+ * Throughput of mutex + HEAP_INSERT/HEAP_POP, the exact pqueue, and
+ * the relaxed pqueue (2 heaps per thread) at 1 to 64 threads.  Each
+ * thread repeats popping an element and pushing it back with a later
+ * key, which is what a scheduler thread does.
+ *
+ *   $ ./pqueue [OPS-PER-THREAD] [PREFILL]
+ */
+struct elem {
+  unsigned long key;
+};
+
+#define elemheap_t_cmp(x, y)    (((x)->key < (y)->key) - ((x)->key > (y)->key))
+HEAP_DECL_TYPE(struct elem, elemheap_t);
+
+enum { M_HEAP, M_EXACT, M_RELAXED };
+
+static int method;
+static long nops;
+static pqueue_t *pq;
+static elemheap_t heap;
+static pthread_mutex_t heap_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static void *
+worker(void *arg)
+{
+  unsigned long key;
+  struct elem *e;
+  void *data;
+  long i;
+
+  for (i = 0; i < nops; i++) {
+    if (method == M_HEAP) {
+      pthread_mutex_lock(&heap_lock);
+      e = HEAP_POP(elemheap_t, &heap);
+      pthread_mutex_unlock(&heap_lock);
+
+      e->key += 1 + pq_random() % 1000;
+
+      pthread_mutex_lock(&heap_lock);
+      HEAP_INSERT(elemheap_t, &heap, e);
+      pthread_mutex_unlock(&heap_lock);
+    }
+    else {
+      if (!pqueue_pop(pq, &key, &data))
+        abort();
+      pqueue_push(pq, key + 1 + pq_random() % 1000, data);
+    }
+  }
+  return 0;
+}
+
+static double
+run(int m, int nthreads, struct elem *elems, long prefill)
+{
+  pthread_t tid[64];
+  struct timeval beg, end;
+  unsigned long key;
+  long i;
+  int t;
+
+  method = m;
+  if (m == M_HEAP) {
+    heap = (elemheap_t)HEAP_INITIALIZER(prefill * 2);
+    for (i = 0; i < prefill; i++) {
+      elems[i].key = i * 7 % prefill;
+      HEAP_INSERT(elemheap_t, &heap, &elems[i]);
+    }
+  }
+  else {
+    pq = pqueue_new((m == M_EXACT) ? 1 : nthreads * 2);
+    for (i = 0; i < prefill; i++)
+      pqueue_push(pq, i * 7 % prefill, &elems[i]);
+  }
+
+  gettimeofday(&beg, 0);
+  for (t = 0; t < nthreads; t++)
+    pthread_create(&tid[t], 0, worker, 0);
+  for (t = 0; t < nthreads; t++)
+    pthread_join(tid[t], 0);
+  gettimeofday(&end, 0);
+
+  if (m == M_HEAP)
+    HEAP_FREE(&heap);
+  else {
+    for (i = 0; pqueue_pop(pq, &key, 0); i++)
+      ;
+    if (i != prefill)
+      fprintf(stderr, "error: %ld elements lost\n", prefill - i);
+    pqueue_delete(pq);
+  }
+
+  return nops * nthreads / ((end.tv_sec - beg.tv_sec) +
+                            (end.tv_usec - beg.tv_usec) / 1e6) / 1e6;
+}
+
+static int
+test_exact(void)
+{
+  unsigned long key, prev = 0;
+  int i;
+
+  pq = pqueue_new(1);
+  for (i = 0; i < 10000; i++)
+    pqueue_push(pq, pq_random() % 5000, 0);
+  for (i = 0; pqueue_pop(pq, &key, 0); i++) {
+    if (key < prev)
+      return -1;
+    prev = key;
+  }
+  pqueue_delete(pq);
+  return (i == 10000) ? 0 : -1;
+}
+
+int
+main(int argc, char *argv[])
+{
+  long prefill;
+  struct elem *elems;
+  int nthreads;
+
+  nops = (argc > 1) ? atol(argv[1]) : 1000000;
+  prefill = (argc > 2) ? atol(argv[2]) : 100000;
+
+  if (test_exact() < 0) {
+    fprintf(stderr, "pqueue: exact mode test failed\n");
+    return 1;
+  }
+
+  elems = malloc(sizeof(*elems) * prefill);
+  printf("%8s %14s %14s %14s  (Mops/s)\n",
+         "threads", "mutex+HEAP", "exact", "relaxed");
+  for (nthreads = 1; nthreads <= 64; nthreads *= 2) {
+    printf("%8d", nthreads);
+    printf(" %14.2f", run(M_HEAP, nthreads, elems, prefill));
+    printf(" %14.2f", run(M_EXACT, nthreads, elems, prefill));
+    printf(" %14.2f\n", run(M_RELAXED, nthreads, elems, prefill));
+  }
+  free(elems);
+  return 0;
+}
+#endif  /* TEST_PQUEUE */
@@ -0,0 +1,85 @@
+#ifndef PQUEUE_H__
+#define PQUEUE_H__
+
+/*
+ * Concurrent priority queue
+ * Copyright (C) 2014  Seong-Kook Shin <cinsky@gmail.com>
+ * DO WHAT THE FUCK YOU WANT TO PUBLIC LICENSE
+ * Version 2, December 2004
+ */
+
+/*
+ * 'pqueue' is a priority queue for many producer and many consumer
+ * threads, built on DHEAP_DEFINE() in heap.h.  The smallest key comes
+ * out first.
+ *
+ * It is a MultiQueue: NQUEUES heaps, each with its own lock.  push()
+ * inserts into a random heap; pop() looks at the tops of two random
+ * heaps and removes from the one with the smaller key.  Threads rarely
+ * contend on the same lock, but pop() is relaxed: it returns one of
+ * the smallest keys, not always the smallest.  With NQUEUES of about
+ * twice the number of threads, the returned key is typically within
+ * the smallest few NQUEUES keys, which is fine for scheduling
+ * timers or tasks.
+ *
+ * If NQUEUES is 1, pqueue is exact: pop() always returns the smallest
+ * key, and every operation takes the one lock.
+ *
+ *   $ cc -D_GNU_SOURCE your-source.c pqueue.c -lpthread
+ *
+ * The test/benchmark program can be built with:
+ *
+ *   $ cc -D_GNU_SOURCE -DTEST_PQUEUE -O2 pqueue.c -lpthread
+ */
+
+/* This indirect using of extern "C" { ... } makes Emacs happy */
+#ifndef BEGIN_C_DECLS
+# ifdef __cplusplus
+#  define BEGIN_C_DECLS extern "C" {
+#  define END_C_DECLS   }
+# else
+#  define BEGIN_C_DECLS
+#  define END_C_DECLS
+# endif
+#endif /* BEGIN_C_DECLS */
+
+#include <stddef.h>
+
+BEGIN_C_DECLS
+
+struct pqueue;
+typedef struct pqueue pqueue_t;
+
+/*
+ * Create a new priority queue with NQUEUES internal heaps.  Use 1 for
+ * the exact mode.  Returns NULL on failure.
+ */
+extern pqueue_t *pqueue_new(int nqueues);
+
+/*
+ * Release Q.  No thread may use Q at the same time.
+ */
+extern void pqueue_delete(pqueue_t *q);
+
+/*
+ * Insert DATA with the priority KEY.  Returns 0 on success, -1 if it
+ * failed to allocate memory.
+ */
+extern int pqueue_push(pqueue_t *q, unsigned long key, void *data);
+
+/*
+ * Remove an element with the smallest (in the exact mode) or a small
+ * (in the relaxed mode) key, and store it in *KEY and *DATA.  KEY and
+ * DATA may be NULL.  Returns 1 on success, 0 if Q was empty.
+ */
+extern int pqueue_pop(pqueue_t *q, unsigned long *key, void **data);
+
+/*
+ * Return the number of elements in Q.  The result is not exact if
+ * other threads are modifying Q.
+ */
+extern size_t pqueue_size(pqueue_t *q);
+
+END_C_DECLS
+
+#endif  /* PQUEUE_H__ */
@@ -41,19 +41,13 @@
 
 #include <fnmatch.h>
 
-#ifdef HAVE_UNISTRING
-#include <unistr.h>
-#endif
-
 #include "xerror.h"
 #ifdef USE_XOBS
 #include "xobstack.h"
-#else
-struct xobs {};
 #endif
-#include "uthash.h"
 
 #include "properties.h"
+#include "confcache.h"
 
 #ifdef TEST_PROPERTIES
 #define xobs_chunk_alloc malloc
@@ -65,18 +59,46 @@ struct xobs {};
 #define TRUE    (!FALSE)
 #endif
 
-#ifndef HAVE_UNISTRING
-#include <wchar.h>
-
-typedef wchar_t ucs4_t;
-#endif
-
 
 struct property {
   char *key;
   char *value;
 
-  UT_hash_handle hh;
+  struct property *link;        /* in the order of insertion */
+};
+
+/*
+ * The hash table is open addressed, with linear probing, and keeps
+ * the hashes of the keys, so that a probe reads the property only if
+ * the hash matches.
+ */
+struct slot {
+  unsigned long hash;
+  struct property *prop;        /* NULL if empty */
+};
+
+/*
+ * The properties are allocated PROPS_BLOCK at a time, or as many as
+ * the file seems to have, from the pool if USE_XOBS, or from the
+ * blocks below.
+ */
+#define PROPS_BLOCK     256
+
+#ifndef USE_XOBS
+struct propblock {
+  struct propblock *next;
+  struct property props[1];
+};
+#endif
+
+/*
+ * The loaded files, and the strings of properties_put() if not
+ * USE_XOBS.  The keys and values of a loaded file point into its
+ * text, where they were unescaped in place.
+ */
+struct text {
+  struct text *next;
+  char data[1];
 };
 
 struct ifs {
@@ -85,6 +107,9 @@ struct ifs {
   char *begin;
   char *end;
 
+  char *spill;                  /* holds a line that straddles a refill */
+  size_t spillcap;
+
   int fd;
   int blksize;
   int eof;
@@ -92,107 +117,45 @@ struct ifs {
 };
 
 
-struct lexer {
-  struct ifs *is;
-
-  int bol;                      /* TRUE on beginning of the line */
-
-  int parsekey;
-  char *filename;
-  unsigned lineno;
-
-  char escseq[5];
-  char mb[MB_LEN_MAX];
-
-#ifdef USE_XOBS
-  struct xobs *pool;
-#else
-  char *token;
-  size_t token_size;
-  int token_idx;
-#endif
-};
+struct properties {
+  struct slot *table;
+  size_t table_size;            /* a power of two */
+  size_t count;                 /* at most the half of TABLE_SIZE */
 
+  struct property *first;       /* in the order of insertion */
+  struct property **last;
 
-struct properties {
-  struct property *root;
+  struct property *spare;       /* not used yet */
+  size_t nspare;
+  size_t hint;                  /* the size of the next block, if larger */
 
-  struct lexer *lex;
+  struct text *texts;
 
-  const char *filename;
+  /*
+   * The image of properties_load_cached(), read in place until the
+   * first properties_put().  The properties then point into it.
+   */
+  confcache_t *image;
 
 #ifdef USE_XOBS
   struct xobs pool_;
+#else
+  struct propblock *blocks;
 #endif
 };
 
 
-
-enum {
-  TK_EOF = -1,
-  TK_SEP = 1,
-  TK_NAME,
-};
-
-static __inline__ void properties_put_(PROPERTIES *props,
-                                       const char *key, const char *value,
-                                       int copy);
-
 struct ifs *ifs_open(const char *filename);
 void ifs_close(struct ifs *p);
 ssize_t ifs_getline(char **line, size_t *linecap, struct ifs *s);
+ssize_t ifs_getline_ref(const char **line, struct ifs *s);
 
 static __inline__ int ifs_fill(struct ifs *s);
 
-static int init_lexer(struct xobs *pool, struct lexer *lex,
-                      const char *filename);
-static void free_lexer(struct lexer *lex);
+static __inline__ unsigned long key_hash(const char *key, size_t len);
+static int properties_put_(PROPERTIES *props, char *key, size_t keylen,
+                           unsigned long hash, char *value);
 
-static char *token_string(struct lexer *lex);
-static int get_token(struct lexer *lex);
-
-
-#ifndef USE_XOBS
-static __inline__ void
-token_clear(struct lexer *lex)
-{
-  free(lex->token);
-  lex->token_idx = 0;
-}
-
-
-static __inline__ char *
-token_finish(struct lexer *lex)
-{
-  char *p;
-
-  p = malloc(lex->token_idx + 1);
-  memcpy(p, lex->token, lex->token_idx);
-  p[lex->token_idx] = '\0';
-
-  lex->token_idx = 0;
-  return p;
-}
-
-static __inline__ int
-token_grow(struct lexer *lex, int c)
-{
-  size_t newsize;
-  char *p;
-
-  if (lex->token_idx >= lex->token_size) {
-    newsize = lex->token_size + 4096;
-    p = realloc(lex->token, newsize);
-    if (!p)
-      return 0;
-    lex->token = p;
-    lex->token_size = newsize;
-  }
-
-  lex->token[lex->token_idx++] = (unsigned char)c;
-  return 1;
-}
-#endif  /* USE_XOBS */
 
 struct ifs *
 ifs_open(const char *filename)
@@ -236,6 +199,8 @@ ifs_open(const char *filename)
 
   p->begin = p->end = p->buffer + p->blksize;
   p->eof = FALSE;
+  p->spill = NULL;
+  p->spillcap = 0;
 
   return p;
 
@@ -254,6 +219,7 @@ ifs_close(struct ifs *p)
   close(p->fd);
 
   free(p->filename);
+  free(p->spill);
   free(p->buffer);
   free(p);
 }
@@ -304,13 +270,40 @@ ifs_getc(struct ifs *s)
 }
 
 
+/*
+ * Grow *LINE so that it can hold at least NEED bytes.
+ */
+static __inline__ int
+ifs_reserve(char **line, size_t *linecap, size_t need)
+{
+  size_t newsize;
+  char *q;
+
+  if (need <= *linecap)
+    return 0;
+
+  newsize = *linecap ? *linecap : LINE_MAX;
+  while (newsize < need)
+    newsize *= 2;
+
+  q = realloc(*line, newsize);
+  if (!q)
+    return -1;
+  *line = q;
+  *linecap = newsize;
+  return 0;
+}
+
+
+/*
+ * Read a line from S like getline(3).  Returns the number of bytes
+ * stored in *LINE (including the newline), or -1 on EOF or on error.
+ */
 ssize_t
 ifs_getline(char **line, size_t *linecap, struct ifs *s)
 {
-  int ch;
-  char *p, *q, *end;
-  size_t newsize;
-  ssize_t readch = EOF;
+  char *q;
+  size_t n, len = 0;
 
   assert(linecap != NULL);
   assert(s != NULL);
@@ -322,31 +315,75 @@ ifs_getline(char **line, size_t *linecap, struct ifs *s)
     *linecap = LINE_MAX;
   }
 
-  p = *line;
-  end = *line + *linecap;
+  while (1) {
+    if (ifs_fill(s) < 0)
+      break;
+    if (s->begin >= s->end)
+      break;
 
-  while ((ch = ifs_getc(s)) != EOF) {
-    readch++;
-    if (p >= end - 1) {
-      newsize = *linecap * 2;
-      q = realloc(*line, newsize);
-      if (!q) {
-        *p = '\0';
-        return -1;
-      }
-      p = q + (p - *line);
-      end = q + newsize;
-      *line = q;
-      *linecap = newsize;
+    q = memchr(s->begin, '\n', s->end - s->begin);
+    n = (q) ? (size_t)(q + 1 - s->begin) : (size_t)(s->end - s->begin);
+
+    if (ifs_reserve(line, linecap, len + n + 1) < 0) {
+      (*line)[len] = '\0';
+      return -1;
     }
-    *p++ = ch;
+    memcpy(*line + len, s->begin, n);
+    len += n;
+    s->begin += n;
 
-    if (ch == '\n')
+    if (q)
       break;
   }
 
-  *p = '\0';
-  return readch;
+  (*line)[len] = '\0';
+  return (len) ? (ssize_t)len : -1;
+}
+
+
+/*
+ * Read a line from S without copying.
+ *
+ * On success, *LINE points the line (including the newline, not
+ * NUL-terminated) and returns its length.  If the line lies in the
+ * internal buffer, *LINE points into it; otherwise the line is
+ * collected in a separate buffer owned by S.  Either way, *LINE is
+ * valid until the next read from S.  Returns -1 on EOF or on error.
+ */
+ssize_t
+ifs_getline_ref(const char **line, struct ifs *s)
+{
+  char *q;
+  size_t n, len = 0;
+
+  assert(s != NULL);
+
+  if (ifs_fill(s) < 0 || s->begin >= s->end)
+    return -1;
+
+  q = memchr(s->begin, '\n', s->end - s->begin);
+  if (q) {
+    n = q + 1 - s->begin;
+    *line = s->begin;
+    s->begin += n;
+    return n;
+  }
+
+  do {
+    n = (q) ? (size_t)(q + 1 - s->begin) : (size_t)(s->end - s->begin);
+    if (ifs_reserve(&s->spill, &s->spillcap, len + n) < 0)
+      return -1;
+    memcpy(s->spill + len, s->begin, n);
+    len += n;
+    s->begin += n;
+
+    if (q || ifs_fill(s) < 0)
+      break;
+    q = memchr(s->begin, '\n', s->end - s->begin);
+  } while (s->begin < s->end);
+
+  *line = s->spill;
+  return len;
 }
 
 
@@ -365,253 +402,517 @@ ifs_ungetc(struct ifs *s, char ch)
 }
 
 
-static int
-init_lexer(struct xobs *pool, struct lexer *lex, const char *filename)
+/*
+ * The loader reads the whole file into one text, and takes the
+ * natural lines out of it with memchr(3).  A logical line without a
+ * backslash, which is most of them, is split into its key and value
+ * in place, by putting NULs after them.  Otherwise its natural lines
+ * are joined, and its escapes decoded, in place too, since neither
+ * makes it longer.  So nothing is copied but the file itself.
+ */
+
+static __inline__ int
+is_blank(int c)
 {
-  lex->is = ifs_open(filename);
-#ifdef USE_XOBS
-  lex->pool = pool;
-  lex->filename = xobs_copy0(lex->pool, filename, strlen(filename));
-#else
-  lex->filename = strdup(filename);
-  lex->token = 0;
-  lex->token_size = 0;
-  lex->token_idx = 0;
-#endif
-  lex->lineno = 1;
-  return 0;
+  return c == ' ' || c == '\t' || c == '\f';
 }
 
 
-static void
-free_lexer(struct lexer *lex)
+static __inline__ char *
+skip_blank(char *p, char *end)
 {
-  if (!lex)
-    return;
-#ifndef USE_XOBS
-  token_clear(lex);
-  free(lex->filename);
-#endif
-  ifs_close(lex->is);
-  //xobs_free(lex->pool, NULL);
+  while (p < end && is_blank(*p))
+    p++;
+  return p;
 }
 
 
-char *
-token_string(struct lexer *lex)
+/* Return TRUE if the character at P follows an odd number of '\\'. */
+static __inline__ int
+escaped(const char *begin, const char *p)
 {
-  char *p, *end, *q, *r;
+  const char *q = p;
 
-#ifdef USE_XOBS
-  p = xobs_base(lex->pool);
-  end = p + xobs_object_size(lex->pool);
-#else
-  p = lex->token;
-  end = lex->token + lex->token_idx;
-#endif
+  while (q > begin && q[-1] == '\\')
+    q--;
+  return (p - q) % 2;
+}
 
-  for (q = end - 1; q >= p; q--) {
-    if (isspace(*q))
-      *q = '\0';
-    else
-      break;
-  }
 
-#ifdef USE_XOBS
-  r = xobs_finish(lex->pool);
-#else
-  r = token_finish(lex);
-#endif
+/* Return the end of the natural line at P, and set *NEXT past it. */
+static __inline__ char *
+line_end(char *p, char *end, char **next)
+{
+  char *eol = memchr(p, '\n', end - p);
 
-  return r;
+  if (!eol) {
+    *next = end;
+    return end;
+  }
+  *next = eol + 1;
+  if (eol > p && eol[-1] == '\r')
+    eol--;
+  return eol;
 }
 
 
-static int
-parse(PROPERTIES *props)
+/*
+ * Join the natural lines of the logical line at P, whose first
+ * natural line ends at EOL, in place.  The backslashes that continue
+ * the lines and the blanks that begin the continued ones are dropped.
+ * Returns the end of the logical line, and sets *NEXT past it.
+ */
+static char *
+join_lines(char *p, char *eol, char **next, char *end)
 {
-  int token;
-  char *key, *value;
-  struct lexer *lex = props->lex;
+  char *w = eol, *q, *qe;
+
+  while (escaped(p, w) && *next < end) {
+    w--;
+    q = *next;
+    qe = line_end(q, end, next);
+    q = skip_blank(q, qe);
+    memmove(w, q, qe - q);
+    w += qe - q;
+  }
+  if (escaped(p, w))            /* at the end of the file */
+    w--;
+  return w;
+}
 
-  while (1) {
-    key = value = NULL;
 
-    token = get_token(lex);
-    if (token != TK_NAME)
-      return -1;
-    else
-      key = token_string(lex);
+static __inline__ int
+hex4(const char *p, const char *end, unsigned long *uc)
+{
+  int i, d;
 
-    token = get_token(lex);
-    if (token != TK_SEP)
+  if (end - p < 4)
+    return -1;
+  *uc = 0;
+  for (i = 0; i < 4; i++) {
+    if (p[i] >= '0' && p[i] <= '9')
+      d = p[i] - '0';
+    else if (p[i] >= 'a' && p[i] <= 'f')
+      d = p[i] - 'a' + 10;
+    else if (p[i] >= 'A' && p[i] <= 'F')
+      d = p[i] - 'A' + 10;
+    else
       return -1;
+    *uc = (*uc << 4) | d;
+  }
+  return 0;
+}
 
-    token = get_token(lex);
-    if (token != TK_NAME)
-      return -1;
-    else
-      value = token_string(lex);
 
-    printf("[%s] = [%s]\n", key, value);
+static __inline__ char *
+put_utf8(char *w, unsigned long uc)
+{
+  if (uc < 0x80)
+    *w++ = uc;
+  else if (uc < 0x800) {
+    *w++ = 0xc0 | (uc >> 6);
+    *w++ = 0x80 | (uc & 0x3f);
+  }
+  else if (uc < 0x10000) {
+    *w++ = 0xe0 | (uc >> 12);
+    *w++ = 0x80 | ((uc >> 6) & 0x3f);
+    *w++ = 0x80 | (uc & 0x3f);
+  }
+  else {
+    *w++ = 0xf0 | (uc >> 18);
+    *w++ = 0x80 | ((uc >> 12) & 0x3f);
+    *w++ = 0x80 | ((uc >> 6) & 0x3f);
+    *w++ = 0x80 | (uc & 0x3f);
+  }
+  return w;
+}
+
+
+/*
+ * Decode the escapes of [*RP, END) into W, which is not after *RP.
+ * For a key, stop at the first unescaped separator or blank.  Sets
+ * *RP where it stopped, and returns the end of W.
+ */
+static char *
+unescape(char **rp, char *end, char *w, int key)
+{
+  char *r = *rp;
+  unsigned long uc, lo;
+  int c;
+
+  while (r < end) {
+    c = *r;
+    if (c != '\\') {
+      if (key && (c == '=' || c == ':' || is_blank(c)))
+        break;
+      *w++ = c;
+      r++;
+      continue;
+    }
 
-    properties_put_(props, key, value, 0);
+    if (++r == end)
+      break;
+    c = *r++;
+    switch (c) {
+    case 't':
+      *w++ = '\t';
+      break;
+    case 'n':
+      *w++ = '\n';
+      break;
+    case 'r':
+      *w++ = '\r';
+      break;
+    case 'f':
+      *w++ = '\f';
+      break;
+    case 'u':
+      if (hex4(r, end, &uc) < 0) {
+        *w++ = c;
+        break;
+      }
+      r += 4;
+      /* A surrogate pair is one character. */
+      if (uc >= 0xd800 && uc < 0xdc00 && end - r >= 6 &&
+          r[0] == '\\' && r[1] == 'u' && hex4(r + 2, end, &lo) == 0 &&
+          lo >= 0xdc00 && lo < 0xe000) {
+        uc = 0x10000 + ((uc - 0xd800) << 10) + (lo - 0xdc00);
+        r += 6;
+      }
+      w = put_utf8(w, uc);
+      break;
+    default:
+      *w++ = c;
+      break;
+    }
   }
-  return 0;
+  *rp = r;
+  return w;
 }
 
 
+/*
+ * The parser hands the properties to the table PARSE_BATCH at a time,
+ * and prefetches their slots as they come, so that the cache misses
+ * on a large table overlap instead of following one another.
+ */
+#define PARSE_BATCH     16
+
+struct pending {
+  char *key;
+  size_t keylen;
+  unsigned long hash;
+  char *value;
+};
+
+
 static int
-get_token(struct lexer *lex)
+flush_pending(PROPERTIES *props, struct pending *batch, int n)
 {
-  int ch;
   int i;
 
- begin:
-  while ((ch = ifs_getc(lex->is)) != EOF) {
-    if (!isblank(ch)) {
-      break;
+  for (i = 0; i < n; i++)
+    if (properties_put_(props, batch[i].key, batch[i].keylen,
+                        batch[i].hash, batch[i].value) < 0)
+      return -1;
+  return 0;
+}
+
+
+/*
+ * Parse TEXT of SIZE bytes, which is followed by one more byte that
+ * may be overwritten.
+ */
+static int
+parse(PROPERTIES *props, char *text, size_t size)
+{
+  char *p = text, *end = text + size, *eol, *next;
+  char *key, *kend, *value, *vend, *r;
+  struct pending batch[PARSE_BATCH], *pe;
+  int nbatch = 0;
+
+  /* A lone CR ends a line too. */
+  for (r = memchr(text, '\r', size); r != NULL;
+       r = memchr(r + 1, '\r', end - r - 1))
+    if (r + 1 == end || r[1] != '\n')
+      *r = '\n';
+
+  for (; p < end; p = next) {
+    eol = line_end(p, end, &next);
+    key = skip_blank(p, eol);
+    if (key == eol || *key == '#' || *key == '!')
+      continue;
+
+    if (!memchr(key, '\\', eol - key)) {
+      *eol = '\0';
+      kend = key + strcspn(key, "=: \t\f");
+      value = skip_blank(kend, eol);
+      if (value < eol && (*value == '=' || *value == ':'))
+        value = skip_blank(value + 1, eol);
+      vend = eol;             /* trailing blanks are kept, as in Java */
+    }
+    else {
+      eol = join_lines(key, eol, &next, end);
+      r = key;
+      kend = unescape(&r, eol, key, TRUE);
+      r = skip_blank(r, eol);
+      if (r < eol && (*r == '=' || *r == ':'))
+        r = skip_blank(r + 1, eol);
+      if (r == eol)
+        value = vend = kend;
+      else {
+        /* R passed at least one separator or blank after KEND. */
+        value = kend + 1;
+        vend = unescape(&r, eol, value, FALSE);
+      }
+    }
+    *vend = '\0';
+    *kend = '\0';
+
+    pe = &batch[nbatch++];
+    pe->key = key;
+    pe->keylen = kend - key;
+    pe->hash = key_hash(key, kend - key);
+    pe->value = value;
+    if (props->table)
+      __builtin_prefetch(&props->table[pe->hash & (props->table_size - 1)]);
+
+    if (nbatch == PARSE_BATCH) {
+      if (flush_pending(props, batch, nbatch) < 0)
+        return -1;
+      nbatch = 0;
     }
   }
-  if (ch == EOF)
-    return TK_EOF;
+  return flush_pending(props, batch, nbatch);
+}
+
 
-  switch (ch) {
-  case '#':
-  case '!':                     /* ignore comments */
-    while ((ch = ifs_getc(lex->is)) != EOF) {
-      if (ch == '\n') {
-        lex->lineno++;
+/* Read the file at PATHNAME into a new text of PROPS. */
+static char *
+read_text(PROPERTIES *props, const char *pathname, size_t *size)
+{
+  struct text *t;
+  struct stat sbuf;
+  size_t cap, len = 0;
+  ssize_t n;
+  int fd, saved_errno;
+  void *q;
+  char c;
+
+  fd = open(pathname, O_RDONLY);
+  if (fd == -1)
+    return NULL;
+  if (fstat(fd, &sbuf) == -1)
+    goto err;
+
+  /* Not regular files have no size; a pipe, for example */
+  cap = (S_ISREG(sbuf.st_mode)) ? (size_t)sbuf.st_size + 1 : 65536;
+  t = malloc(offsetof(struct text, data) + cap);
+  if (!t)
+    goto err;
+
+  for (;;) {
+    if (len + 1 >= cap) {
+      /*
+       * Full, which is where a regular file ends; grow only if there
+       * is more, instead of doubling the text to read the EOF.
+       */
+      n = read(fd, &c, 1);
+      if (n == 0)
         break;
+      if (n < 0) {
+        if (errno == EINTR)
+          continue;
+        free(t);
+        goto err;
       }
+      q = realloc(t, offsetof(struct text, data) + cap * 2);
+      if (!q) {
+        free(t);
+        goto err;
+      }
+      t = q;
+      cap *= 2;
+      t->data[len++] = c;
+      continue;
     }
-    goto begin;
-
-  case '\r':
-  case '\n':
-    lex->lineno++;
-    goto begin;
-
-  case '=':
-  case ':':
-    return TK_SEP;
-
-  case EOF:
-    return TK_EOF;
-
-  default:                      /* get NAME  */
-    ifs_ungetc(lex->is, ch);
-
-    while (1) {
-      ch = ifs_getc(lex->is);
-
-      if (ch == '\\') {
-        ch = ifs_getc(lex->is);
-        switch (ch) {
-        case 'u':
-        case 'U':
-          /* TODO: get unicode character */
-          {
-            char *endptr;
-            ucs4_t uc;
-#ifdef HAVE_UNISTRING
-            int len;
-#endif
+    n = read(fd, t->data + len, cap - len - 1);
+    if (n == 0)
+      break;
+    if (n < 0) {
+      if (errno == EINTR)
+        continue;
+      free(t);
+      goto err;
+    }
+    len += n;
+  }
+  close(fd);
 
-            memset(lex->escseq, 0, sizeof(lex->escseq));
-            for (i = 0; i < 4; i++) {
-              lex->escseq[i] = ifs_getc(lex->is);
-              if (lex->escseq[i] == -1) {
-                lex->escseq[i] = '\0';
-                break;
-              }
-            }
-            uc = strtoul(lex->escseq, &endptr, 16);
-            while (*endptr != '\0')
-              ifs_ungetc(lex->is, *endptr++);
-
-#ifdef HAVE_UNISTRING
-            len = u8_uctomb((uint8_t *)lex->mb, uc, MB_LEN_MAX);
-            if (len >= 0) {
-              for (i = 0; i < len; i++) {
-#ifdef USE_XOBS
-                xobs_1grow(lex->pool, lex->mb[i]);
-#else
-                token_grow(lex, lex->mb[i]);
-#endif
-              }
-            }
-            else {
-              /* TODO: len == -1 illegal unicode escape sequence */
-            }
-#else
-            xerror(0, 0, "%s:%d: unicode escape sequence is not supported",
-                   lex->filename, lex->lineno);
-#ifdef USE_XOBS
-            xobs_1grow(lex->pool, '?');
-#else
-            token_grow(lex, '?');
-#endif
+  t->data[len] = '\0';
+  t->next = props->texts;
+  props->texts = t;
+  *size = len;
+  return t->data;
 
-#endif  /* HAVE_UNISTRING */
-          }
-          break;
-        case '\n':
-          lex->lineno++;
-          break;                  /* escaping line terminator */
+ err:
+  saved_errno = errno;
+  close(fd);
+  errno = saved_errno;
+  return NULL;
+}
 
-        case ':':
-        case '=':
-#ifdef USE_XOBS
-          xobs_1grow(lex->pool, ch);
-#else
-          token_grow(lex, ch);
-#endif
-          break;
 
-        default:
-          /* TODO: handle other escape sequences */
-          break;
-        }
-      }
-      else {                    /* non-escape sequence */
-        switch (ch) {
-        case '=':
-#if 0
-        case ':':
-          /* TODO: if the value part contains ':' where the delimiter was '=',
-           * gettoken() can't handle this. -- cinsk */
-#endif
-        case '\n':
-#ifdef USE_XOBS
-          xobs_1grow(lex->pool, '\0');
-#else
-          token_grow(lex, '\0');
-#endif
-          /* NAME part is ready */
-          /* TODO: rtrim NAME part */
-          ifs_ungetc(lex->is, ch);
-          return TK_NAME;
+/*
+ * Guess the number of lines in TEXT from the first 64 KiB, to size
+ * the hash table and the first block of properties at once.
+ */
+static size_t
+guess_lines(const char *text, size_t size)
+{
+  size_t sample = (size < 65536) ? size : 65536, lines = 0;
+  const char *p = text, *end = text + sample;
 
-        case EOF:
-#ifdef USE_XOBS
-          xobs_1grow(lex->pool, '\0');
-#else
-          token_grow(lex, '\0');
+  while (p < end && (p = memchr(p, '\n', end - p)) != NULL) {
+    lines++;
+    p++;
+  }
+  if (sample == 0)
+    return 0;
+  return (lines + 1) * (size / sample);
+}
+
+
+static __inline__ unsigned long
+key_hash(const char *key, size_t len)
+{
+  /* FNV-1a */
+  unsigned long h = 2166136261UL;
+
+  while (len--) {
+    h ^= (unsigned char)*key++;
+    h *= 16777619UL;
+  }
+  return h;
+}
+
+
+/* Make the hash table big enough for SIZE properties. */
+static int
+resize_table(PROPERTIES *props, size_t size)
+{
+  struct slot *table, *sl;
+  struct property *p;
+  size_t n = 16, i;
+
+  while (n < size * 2)
+    n *= 2;
+  if (n <= props->table_size)
+    return 0;
+
+  table = calloc(n, sizeof(*table));
+  if (!table)
+    return -1;
+  for (i = 0; i < props->table_size; i++) {
+    if ((p = props->table[i].prop) == NULL)
+      continue;
+    for (sl = &table[props->table[i].hash & (n - 1)]; sl->prop;
+         sl = (sl == table + n - 1) ? table : sl + 1)
+      ;
+    *sl = props->table[i];
+  }
+  free(props->table);
+  props->table = table;
+  props->table_size = n;
+  return 0;
+}
+
+
+static struct property *
+new_property(PROPERTIES *props)
+{
+  size_t n;
+#ifndef USE_XOBS
+  struct propblock *b;
 #endif
-          return TK_NAME;
 
-        default:
+  if (props->nspare == 0) {
+    n = (props->hint > PROPS_BLOCK) ? props->hint : PROPS_BLOCK;
+    props->hint = 0;
 #ifdef USE_XOBS
-          xobs_1grow(lex->pool, ch);
+    props->spare = xobs_alloc(&props->pool_, sizeof(struct property) * n);
+    if (!props->spare)
+      return NULL;
 #else
-          token_grow(lex, ch);
+    b = malloc(offsetof(struct propblock, props) +
+               sizeof(struct property) * n);
+    if (!b)
+      return NULL;
+    b->next = props->blocks;
+    props->blocks = b;
+    props->spare = b->props;
 #endif
-          break;
-        }
-      }
-    } /* while */
-  }   /* switch */
+    props->nspare = n;
+  }
+  props->nspare--;
+  return props->spare++;
+}
+
+
+/*
+ * Return the slot of KEY of KEYLEN bytes, or the empty slot where it
+ * would go.  The table must not be empty.
+ */
+static struct slot *
+find_slot(PROPERTIES *props, const char *key, size_t keylen,
+          unsigned long hash)
+{
+  struct slot *sl, *last = props->table + props->table_size - 1;
+  struct property *p;
+
+  for (sl = &props->table[hash & (props->table_size - 1)];
+       (p = sl->prop) != NULL; sl = (sl == last) ? props->table : sl + 1)
+    if (sl->hash == hash && strncmp(p->key, key, keylen) == 0 &&
+        p->key[keylen] == '\0')
+      break;
+  return sl;
+}
+
+
+/*
+ * Add KEY of KEYLEN bytes and of HASH, or replace its value, without
+ * copying KEY or VALUE.
+ */
+static int
+properties_put_(PROPERTIES *props, char *key, size_t keylen,
+                unsigned long hash, char *value)
+{
+  struct slot *sl;
+  struct property *p;
+
+  if ((props->count + 1) * 2 > props->table_size &&
+      resize_table(props, props->count + 1) < 0)
+    return -1;
+
+  sl = find_slot(props, key, keylen, hash);
+  if (sl->prop) {
+    sl->prop->value = value;
+    return 0;
+  }
+
+  p = new_property(props);
+  if (!p)
+    return -1;
+
+  p->key = key;
+  p->value = value;
+  p->link = NULL;
+  sl->hash = hash;
+  sl->prop = p;
+  *props->last = p;
+  props->last = &p->link;
+  props->count++;
+  return 0;
 }
 
 
@@ -619,8 +920,10 @@ PROPERTIES *
 properties_load(const char *pathname, PROPERTIES *reuse)
 {
   PROPERTIES *p;
+  char *text;
+  size_t size, lines;
 
-  /* REUSE is not fully implemented yet, read the comment in parse(). */
+  /* REUSE is not fully implemented yet; the filename is the last one. */
   assert(reuse == NULL);
 
   if (!reuse) {
@@ -629,125 +932,189 @@ properties_load(const char *pathname, PROPERTIES *reuse)
       return NULL;
 #ifdef USE_XOBS
     xobs_init(&p->pool_);
+#else
+    p->blocks = NULL;
 #endif
 
-    p->root = NULL;
-    p->filename = NULL;
-    p->lex = NULL;
+    p->table = NULL;
+    p->table_size = 0;
+    p->count = 0;
+    p->first = NULL;
+    p->last = &p->first;
+    p->spare = NULL;
+    p->nspare = 0;
+    p->hint = 0;
+    p->texts = NULL;
+    p->image = NULL;
   }
   else
     p = reuse;
 
   if (pathname) {
-#ifdef USE_XOBS
-    p->filename = xobs_copy0(&p->pool_, pathname, strlen(pathname));
-#else
-    p->filename = strdup(pathname);
-#endif
-
-    if (p->lex)
-      free_lexer(p->lex);
-
-#ifdef USE_XOBS
-    p->lex = xobs_alloc(&p->pool_, sizeof(*p->lex));
-#else
-    p->lex = malloc(sizeof(*p->lex));
-#endif
-
-#ifdef USE_XOBS
-    init_lexer(&p->pool_, p->lex, pathname);
-#else
-    init_lexer(0, p->lex, pathname);
-#endif
-
-    parse(p);
+    text = read_text(p, pathname, &size);
+    if (!text)
+      goto err;
+    lines = guess_lines(text, size);
+    if (resize_table(p, p->count + lines) < 0)
+      goto err;
+    p->hint = lines;
+
+    if (parse(p, text, size) < 0)
+      goto err;
   }
 
   return p;
+
+ err:
+  if (!reuse)
+    properties_close(p);
+  return NULL;
 }
 
 
 void
 properties_close(PROPERTIES *props)
 {
-  struct property *p, *tmp;
-
-  HASH_ITER(hh, props->root, p, tmp) {
-    HASH_DEL(props->root, p);
+  struct text *t;
 #ifndef USE_XOBS
-    free(p->key);
-    free(p->value);
-    free(p);
+  struct propblock *b;
 #endif
-  }
 
-  free_lexer(props->lex);
+  while ((t = props->texts) != NULL) {
+    props->texts = t->next;
+    free(t);
+  }
+  free(props->table);
+  confcache_close(props->image);
 #ifdef USE_XOBS
   xobs_free(&props->pool_, NULL);
 #else
-  free((void *)props->filename);
-  free(props->lex);
+  while ((b = props->blocks) != NULL) {
+    props->blocks = b->next;
+    free(b);
+  }
 #endif
 
   free(props);
 }
 
 
-static __inline__ void
-properties_put_(PROPERTIES *props, const char *key, const char *value, int copy)
+/*
+ * Add the properties of the image to the table.  The image stays
+ * mapped, and the strings are never written.
+ */
+static int
+materialize(PROPERTIES *props)
 {
-  struct property *p;
+  size_t i, n, keylen;
+  const char *key, *value;
 
-  HASH_FIND_STR(props->root, key, p);
-  if (p) {
-    HASH_DEL(props->root, p);
-#ifndef USE_XOBS
-    free(p->key);
-    free(p->value);
-    free(p);
-#endif
+  if (!props->image || props->table)
+    return 0;
+
+  n = confcache_count(props->image);
+  if (resize_table(props, n + 1) < 0)
+    return -1;
+  props->hint = n;
+  for (i = 0; i < n; i++) {
+    confcache_entry(props->image, i, NULL, NULL, &key, &keylen, &value, NULL);
+    if (properties_put_(props, (char *)key, keylen, key_hash(key, keylen),
+                        (char *)value) < 0)
+      return -1;
   }
+  return 0;
+}
 
-#ifdef USE_XOBS
-  p = xobs_alloc(&props->pool_, sizeof(*p));
-  /* TODO: it seems okay to use KEY or VALUE directly, not copying */
-  p->key = xobs_copy0(&props->pool_, key, strlen(key));
-  p->value = xobs_copy0(&props->pool_, value, strlen(value));
-#else
-  p = malloc(sizeof(*p));
-  if (p) {
-    if (copy) {
-      p->key = strdup(key);
-      p->value = strdup(value);
-    }
-    else {
-      p->key = (char *)key;
-      p->value = (char *)value;
-    }
+
+PROPERTIES *
+properties_load_cached(const char *pathname)
+{
+  PROPERTIES *p;
+  confcache_builder_t *b;
+  struct property *q;
+  struct stat sbuf;
+  confcache_t *cc;
+  int cache;
+
+  cc = confcache_open(pathname, CONFCACHE_PROPERTIES);
+  if (cc) {
+    p = properties_load(NULL, NULL);
+    if (!p)
+      confcache_close(cc);
+    else
+      p->image = cc;
+    return p;
   }
-#endif
 
-  HASH_ADD_KEYPTR(hh, props->root, p->key, strlen(p->key), p);
+  cache = (stat(pathname, &sbuf) == 0);
+  p = properties_load(pathname, NULL);
+  if (!p || !cache)
+    return p;
+
+  b = confcache_builder_new(CONFCACHE_PROPERTIES);
+  if (!b)
+    return p;
+  for (q = p->first; q != NULL; q = q->link)
+    if (confcache_add(b, NULL, 0, q->key, strlen(q->key),
+                      q->value, strlen(q->value)) < 0)
+      break;
+  if (!q)
+    confcache_write(b, pathname, &sbuf);
+  confcache_builder_free(b);
+  return p;
 }
 
 
 void
 properties_put(PROPERTIES *props, const char *key, const char *value)
 {
-  properties_put_(props, key, value, 1);
-}
+  size_t keylen = strlen(key), valuelen = strlen(value);
+  char *k, *v;
+
+  if (materialize(props) < 0)
+    return;
+#ifdef USE_XOBS
+  k = xobs_copy0(&props->pool_, key, keylen);
+  v = xobs_copy0(&props->pool_, value, valuelen);
+#else
+  struct text *t;
 
+  t = malloc(offsetof(struct text, data) + keylen + valuelen + 2);
+  if (!t)
+    return;
+  t->next = props->texts;
+  props->texts = t;
+  k = t->data;
+  v = t->data + keylen + 1;
+  memcpy(k, key, keylen + 1);
+  memcpy(v, value, valuelen + 1);
+#endif
+
+  properties_put_(props, k, keylen, key_hash(k, keylen), v);
+}
 
 
 const char *
 properties_get(PROPERTIES *props, const char *key)
 {
-  struct property *p;
-
-  HASH_FIND_STR(props->root, key, p);
+  size_t keylen = strlen(key);
+  struct slot *sl;
+  const char *value;
+  long i;
+
+  if (props->image && !props->table) {
+    i = confcache_find(props->image, NULL, 0, key, keylen);
+    if (i < 0)
+      return NULL;
+    confcache_entry(props->image, i, NULL, NULL, NULL, NULL, &value, NULL);
+    return value;
+  }
+  if (!props->table)
+    return NULL;
+  sl = find_slot(props, key, keylen, key_hash(key, keylen));
 
-  if (p)
-    return p->value;
+  if (sl->prop)
+    return sl->prop->value;
   else
     return NULL;
 }
@@ -759,10 +1126,25 @@ properties_enum(PROPERTIES *props,
                 const char *pattern,
                 void *data)
 {
-  struct property *p, *tmp;
+  struct property *p;
+  const char *key, *value;
+  size_t i, n;
   int count = 0;
 
-  HASH_ITER(hh, props->root, p, tmp) {
+  if (props->image && !props->table) {
+    n = confcache_count(props->image);
+    for (i = 0; i < n; i++) {
+      confcache_entry(props->image, i, NULL, NULL, &key, NULL, &value, NULL);
+      if (!pattern || fnmatch(pattern, key, 0) == 0) {
+        if (iter(key, value, data) == -1)
+          break;
+        count++;
+      }
+    }
+    return count;
+  }
+
+  for (p = props->first; p != NULL; p = p->link) {
     if (!pattern || (pattern && fnmatch(pattern, p->key, 0) == 0)) {
       if (iter(p->key, p->value, data) == -1)
         break;
@@ -776,6 +1158,219 @@ properties_enum(PROPERTIES *props,
 
 
 #ifdef TEST_PROPERTIES
+/*
+ *   $ cc -D_GNU_SOURCE -DTEST_PROPERTIES -o properties properties.c \
+ *       confcache.c xerror.c
+ */
+#include <stdio.h>
+#include <sys/time.h>
+
+static int
+count_iter(const char *key, const char *value, void *data)
+{
+  (void)key; (void)value; (void)data;
+  return 0;
+}
+
+/*
+ * Line scanning throughput of the ifs reader.
+ *
+ *   $ ./properties -l FILE
+ */
+static int
+bench_lines(const char *pathname)
+{
+  static const char *names[] = { "ifs_getc", "ifs_getline",
+                                 "ifs_getline_ref" };
+  struct timeval beg, end;
+  unsigned long nbytes, nlines;
+  struct ifs *is;
+  char *line = NULL;
+  const char *lp;
+  size_t linecap = 0;
+  ssize_t len;
+  double sec;
+  int method, ch;
+
+  for (method = 0; method < 3; method++) {
+    is = ifs_open(pathname);
+    if (!is) {
+      xerror(0, errno, "cannot open %s", pathname);
+      return 1;
+    }
+    nbytes = nlines = 0;
+    gettimeofday(&beg, 0);
+    switch (method) {
+    case 0:
+      while ((ch = ifs_getc(is)) != EOF) {
+        nbytes++;
+        if (ch == '\n')
+          nlines++;
+      }
+      break;
+    case 1:
+      while ((len = ifs_getline(&line, &linecap, is)) >= 0) {
+        nbytes += len;
+        nlines++;
+      }
+      break;
+    default:
+      while ((len = ifs_getline_ref(&lp, is)) >= 0) {
+        nbytes += len;
+        nlines++;
+      }
+      break;
+    }
+    gettimeofday(&end, 0);
+    ifs_close(is);
+
+    sec = (end.tv_sec - beg.tv_sec) + (end.tv_usec - beg.tv_usec) / 1e6;
+    printf("%-16s %10lu bytes %8lu lines %7.2f GB/s\n",
+           names[method], nbytes, nlines,
+           nbytes / sec / (1024 * 1024 * 1024));
+  }
+  free(line);
+  return 0;
+}
+
+
+/*
+ * Load time of a file with NENTRIES generated properties.
+ *
+ *   $ ./properties -b NENTRIES
+ */
+static int
+bench_load(int nentries)
+{
+  char path[] = "/tmp/properties.XXXXXX";
+  struct timeval beg, end;
+  PROPERTIES *props;
+  FILE *fp;
+  double sec;
+  int i, fd;
+
+  fd = mkstemp(path);
+  if (fd < 0 || !(fp = fdopen(fd, "w"))) {
+    xerror(0, errno, "cannot create %s", path);
+    return 1;
+  }
+  fprintf(fp, "# %d generated properties\n", nentries);
+  for (i = 0; i < nentries; i++) {
+    fprintf(fp, "com.example.service%d.endpoint.url = "
+            "https://host%d.example.com:8443/api/v1\n", i, i % 1000);
+    if (i % 100 == 0)
+      fprintf(fp, "message%d = Hello\\u0020World\\\n    continued %d\n",
+              i, i);
+  }
+  fclose(fp);
+
+  gettimeofday(&beg, 0);
+  props = properties_load(path, NULL);
+  gettimeofday(&end, 0);
+  unlink(path);
+  if (!props) {
+    xerror(0, errno, "cannot load %s", path);
+    return 1;
+  }
+
+  sec = (end.tv_sec - beg.tv_sec) + (end.tv_usec - beg.tv_usec) / 1e6;
+  printf("properties_load: %d lines, %d properties, %.1f ms\n",
+         nentries + (nentries + 99) / 100,
+         properties_enum(props, count_iter, NULL, NULL), sec * 1e3);
+  properties_close(props);
+  return 0;
+}
+
+
+/*
+ * Check the syntax of .properties files.
+ *
+ *   $ ./properties -t
+ */
+static int
+check_syntax(void)
+{
+  static const char sample[] =
+    "# comment\n"
+    "! another comment \\\n"
+    "plain=value\n"
+    "  spaced   :   value with  blanks   \n"
+    "esctail = a\\tb  \n"
+    "colon:value\r\n"
+    "blank value\n"
+    "empty\n"
+    "=nokey\n"
+    "esc\\ key\\:x = a\\=b\\tc\\nd\\\\\n"
+    "cont = first \\\n"
+    "    second\\\n"
+    "\tthird\n"
+    "unicode=\\u00e9\\u4e2d\\uD83D\\uDE00\\u12\n"
+    "trail = x\\ \n"
+    "lone\rcr = yes\n"
+    "plain = overridden\n"
+    "last = no newline\\";
+  static const char *expected[][2] = {
+    { "plain", "overridden" },
+    { "spaced", "value with  blanks   " },
+    { "esctail", "a\tb  " },
+    { "colon", "value" },
+    { "blank", "value" },
+    { "empty", "" },
+    { "", "nokey" },
+    { "esc key:x", "a=b\tc\nd\\" },
+    { "cont", "first secondthird" },
+    { "unicode", "\xc3\xa9\xe4\xb8\xad\xf0\x9f\x98\x80u12" },
+    { "trail", "x " },
+    { "lone", "" },
+    { "cr", "yes" },
+    { "last", "no newline" },
+  };
+  char path[] = "/tmp/properties.XXXXXX";
+  PROPERTIES *props;
+  const char *v;
+  size_t i;
+  int fd, failed = 0;
+
+  fd = mkstemp(path);
+  if (fd < 0 || write(fd, sample, sizeof(sample) - 1) < 0) {
+    xerror(0, errno, "cannot write %s", path);
+    return 1;
+  }
+  close(fd);
+  props = properties_load(path, NULL);
+  unlink(path);
+  if (!props) {
+    xerror(0, errno, "cannot load %s", path);
+    return 1;
+  }
+
+  for (i = 0; i < sizeof(expected) / sizeof(expected[0]); i++) {
+    v = properties_get(props, expected[i][0]);
+    if (!v || strcmp(v, expected[i][1]) != 0) {
+      printf("[%s] = |%s|, expected |%s|\n", expected[i][0],
+             (v) ? v : "(null)", expected[i][1]);
+      failed = 1;
+    }
+  }
+  i = properties_enum(props, count_iter, NULL, NULL);
+  if (i != sizeof(expected) / sizeof(expected[0])) {
+    printf("%zu properties, expected %zu\n", i,
+           sizeof(expected) / sizeof(expected[0]));
+    failed = 1;
+  }
+
+  properties_put(props, "plain", "put");
+  properties_put(props, "new", "one");
+  if (strcmp(properties_get(props, "plain"), "put") != 0 ||
+      strcmp(properties_get(props, "new"), "one") != 0)
+    failed = 1;
+  properties_close(props);
+
+  printf("%s\n", (failed) ? "FAILED" : "passed");
+  return failed;
+}
+
+
 int
 myiter(const char *key, const char *value, void *data)
 {
@@ -789,7 +1384,18 @@ main(int argc, char *argv[])
   PROPERTIES *props;
   int i;
 
+  if (argc > 2 && strcmp(argv[1], "-l") == 0)
+    return bench_lines(argv[2]);
+  if (argc > 2 && strcmp(argv[1], "-b") == 0)
+    return bench_load(atoi(argv[2]));
+  if (argc > 1 && strcmp(argv[1], "-t") == 0)
+    return check_syntax();
+
   props = properties_load(argv[1], NULL);
+  if (!props) {
+    xerror(0, errno, "cannot load %s", argv[1]);
+    return 1;
+  }
 
   printf("--\n");
 
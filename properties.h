@@ -50,7 +50,10 @@ typedef struct properties PROPERTIES;
  * Load properties file from PATHNAME.
  *
  * This function will parse the properties file and returns the structure
- * that containing parsing result.
+ * that containing parsing result, or NULL with errno set if the file
+ * cannot be read.  The syntax is that of java.util.Properties: comment
+ * lines, line continuations, and the escapes including "\uXXXX", which
+ * is stored in UTF-8.
  *
  * Currently non-null REUSE is not permitted.
  *
@@ -62,6 +65,21 @@ typedef struct properties PROPERTIES;
  */
 extern PROPERTIES *properties_load(const char *pathname, PROPERTIES *reuse);
 
+/*
+ * Load the properties file PATHNAME, like properties_load(), from its
+ * image PATHNAME.cache if the file did not change since the image was
+ * written, or parse it and write the image.  See confcache.h.
+ *
+ * The properties are read from the image in place until the first
+ * properties_put().
+ *
+ * properties.c links with confcache.c for this, whether it is called
+ * or not:
+ *
+ *   $ cc -D_GNU_SOURCE ... properties.c confcache.c xerror.c
+ */
+extern PROPERTIES *properties_load_cached(const char *pathname);
+
 /*
  * Release the structure returned by properties_load().
  */
@@ -0,0 +1,407 @@
+/*
+ * Lock-free readers for rbtree
+ * Copyright (C) 2014  Seong-Kook Shin <cinsky@gmail.com>
+ * DO WHAT THE FUCK YOU WANT TO PUBLIC LICENSE
+ * Version 2, December 2004
+ */
+#include <stdlib.h>
+#include <sched.h>
+
+#include "rbsync.h"
+
+/* Reclaim when this many objects are retired */
+#define RETIRE_BATCH    64
+
+/*
+ * Epoch-based reclamation.  A reader publishes the global epoch it saw
+ * when it entered a section, and zero when it left.  An object retired
+ * in epoch E is unreachable for every reader that entered in a later
+ * epoch, so it can be freed once no reader is in E or earlier.
+ */
+struct reader {
+  unsigned long epoch;          /* 0 if not in a read-side section */
+  unsigned depth;               /* nesting level; only the owner uses it */
+  int used;                     /* owned by a thread */
+  struct reader *next;
+} __attribute__((aligned(64)));
+
+struct retired {
+  void *ptr;
+  void (*freefn)(void *);
+  unsigned long epoch;
+};
+
+static unsigned long global_epoch = 1;
+static struct reader *readers;  /* never shrinks; records are reused */
+
+static pthread_mutex_t retire_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct retired *retired;
+static size_t nretired, retired_cap;
+
+static pthread_once_t key_once = PTHREAD_ONCE_INIT;
+static pthread_key_t reader_key;
+static __thread struct reader *self;
+
+
+static void
+release_reader(void *arg)
+{
+  struct reader *r = arg;
+
+  __atomic_store_n(&r->epoch, 0, __ATOMIC_RELEASE);
+  __atomic_store_n(&r->used, 0, __ATOMIC_RELEASE);
+}
+
+
+static void
+make_key(void)
+{
+  pthread_key_create(&reader_key, release_reader);
+}
+
+
+/*
+ * Get a reader record for this thread, reusing the one of an exited
+ * thread if any.
+ */
+static struct reader *
+register_reader(void)
+{
+  struct reader *r;
+  int unused = 0;
+
+  for (r = __atomic_load_n(&readers, __ATOMIC_ACQUIRE); r; r = r->next) {
+    if (!__atomic_load_n(&r->used, __ATOMIC_RELAXED) &&
+        __atomic_compare_exchange_n(&r->used, &unused, 1, 0,
+                                    __ATOMIC_ACQ_REL, __ATOMIC_RELAXED))
+      break;
+    unused = 0;
+  }
+
+  if (!r) {
+    if (posix_memalign((void **)&r, 64, sizeof(*r)) != 0)
+      abort();
+    r->epoch = 0;
+    r->used = 1;
+    r->next = __atomic_load_n(&readers, __ATOMIC_RELAXED);
+    while (!__atomic_compare_exchange_n(&readers, &r->next, r, 1,
+                                        __ATOMIC_RELEASE, __ATOMIC_RELAXED))
+      ;
+  }
+  r->depth = 0;
+
+  pthread_once(&key_once, make_key);
+  pthread_setspecific(reader_key, r);
+  self = r;
+  return r;
+}
+
+
+void
+rbs_read_lock(void)
+{
+  struct reader *r = self;
+
+  if (!r)
+    r = register_reader();
+  if (r->depth++ > 0)
+    return;
+
+  __atomic_store_n(&r->epoch, __atomic_load_n(&global_epoch, __ATOMIC_RELAXED),
+                   __ATOMIC_RELAXED);
+  /* The epoch must be visible before we read any node. */
+  __atomic_thread_fence(__ATOMIC_SEQ_CST);
+}
+
+
+void
+rbs_read_unlock(void)
+{
+  struct reader *r = self;
+
+  if (--r->depth > 0)
+    return;
+  __atomic_store_n(&r->epoch, 0, __ATOMIC_RELEASE);
+}
+
+
+/*
+ * Start a new epoch, and return the oldest epoch that a reader may
+ * still be in.  Objects retired before it can be freed.
+ */
+static unsigned long
+advance_epoch(void)
+{
+  unsigned long now, e, oldest;
+  struct reader *r;
+
+  now = __atomic_add_fetch(&global_epoch, 1, __ATOMIC_SEQ_CST);
+  oldest = now;
+  for (r = __atomic_load_n(&readers, __ATOMIC_ACQUIRE); r; r = r->next) {
+    e = __atomic_load_n(&r->epoch, __ATOMIC_SEQ_CST);
+    if (e && e < oldest)
+      oldest = e;
+  }
+  return oldest;
+}
+
+
+/*
+ * Free the retired objects that no reader can see.  Called with
+ * RETIRE_LOCK held.
+ */
+static void
+reclaim(void)
+{
+  unsigned long oldest = advance_epoch();
+  size_t i, j;
+
+  for (i = j = 0; i < nretired; i++) {
+    if (retired[i].epoch < oldest)
+      retired[i].freefn(retired[i].ptr);
+    else
+      retired[j++] = retired[i];
+  }
+  nretired = j;
+}
+
+
+int
+rbs_retire(void *ptr, void (*freefn)(void *))
+{
+  struct retired *p;
+  size_t cap;
+
+  pthread_mutex_lock(&retire_lock);
+  if (nretired == retired_cap) {
+    cap = (retired_cap) ? retired_cap * 2 : RETIRE_BATCH * 2;
+    p = realloc(retired, sizeof(*p) * cap);
+    if (!p) {
+      pthread_mutex_unlock(&retire_lock);
+      rbs_synchronize();
+      freefn(ptr);
+      return -1;
+    }
+    retired = p;
+    retired_cap = cap;
+  }
+
+  retired[nretired].ptr = ptr;
+  retired[nretired].freefn = freefn;
+  retired[nretired].epoch = __atomic_load_n(&global_epoch, __ATOMIC_SEQ_CST);
+  nretired++;
+
+  if (nretired >= RETIRE_BATCH && nretired % RETIRE_BATCH == 0)
+    reclaim();
+  pthread_mutex_unlock(&retire_lock);
+  return 0;
+}
+
+
+void
+rbs_synchronize(void)
+{
+  unsigned long target, e;
+  struct reader *r;
+
+  target = __atomic_add_fetch(&global_epoch, 1, __ATOMIC_SEQ_CST);
+  for (r = __atomic_load_n(&readers, __ATOMIC_ACQUIRE); r; r = r->next) {
+    while ((e = __atomic_load_n(&r->epoch, __ATOMIC_SEQ_CST)) != 0 &&
+           e < target)
+      sched_yield();
+  }
+
+  pthread_mutex_lock(&retire_lock);
+  reclaim();
+  pthread_mutex_unlock(&retire_lock);
+}
+
+
+#ifdef TEST_RBSYNC
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/time.h>
+
+/*
+ * A routing table of NKEYS entries.  Reader threads look up random
+ * keys; one writer thread replaces a random entry BURST times every
+ * 100 microseconds.  The even keys are never removed, so readers must
+ * always find them.  Compared with the same table behind a pthread
+ * rwlock.
+ *
+ *   $ cc -D_GNU_SOURCE -DTEST_RBSYNC -O2 rbsync.c rbtree.c -lpthread
+ *   $ ./a.out [NKEYS] [SECONDS] [BURST]
+ */
+struct route {
+  struct rb_node node;
+  unsigned long key;
+  unsigned long value;          /* always KEY * 3 */
+};
+
+#define ROUTE_CMP(a, b)         (((a) > (b)) - ((a) < (b)))
+
+static struct rb_seqroot table = RB_SEQROOT_INIT;
+static pthread_rwlock_t rwlock = PTHREAD_RWLOCK_INITIALIZER;
+static struct route **slots;    /* the odd keys in the table */
+static unsigned long nkeys, burst;
+static int use_rwlock;
+static volatile int stop;
+
+static unsigned long
+xorshift(unsigned long *x)
+{
+  *x ^= *x << 13;
+  *x ^= *x >> 7;
+  *x ^= *x << 17;
+  return *x;
+}
+
+static void
+free_route(void *p)
+{
+  /* Poison it, so that a reader that sees a freed node fails. */
+  memset(p, 0xff, sizeof(struct route));
+  free(p);
+}
+
+static struct route *
+new_route(unsigned long key)
+{
+  struct route *r = malloc(sizeof(*r));
+
+  r->key = key;
+  r->value = key * 3;
+  return r;
+}
+
+static void *
+reader(void *arg)
+{
+  unsigned long x = (unsigned long)arg * 2654435761UL + 1, key, n = 0;
+  struct route *r;
+
+  while (!stop) {
+    key = xorshift(&x) % (nkeys * 2);
+    if (use_rwlock) {
+      pthread_rwlock_rdlock(&rwlock);
+      r = RB_SEARCH(&table.root, struct route, node, key, ROUTE_CMP, key);
+      if ((r && r->value != key * 3) || (!r && key % 2 == 0))
+        abort();
+      pthread_rwlock_unlock(&rwlock);
+    }
+    else {
+      rbs_read_lock();
+      r = RBS_SEARCH(&table, struct route, node, key, ROUTE_CMP, key);
+      if ((r && r->value != key * 3) || (!r && key % 2 == 0))
+        abort();
+      rbs_read_unlock();
+    }
+    n++;
+  }
+  return (void *)n;
+}
+
+static void *
+writer(void *arg)
+{
+  struct rb_root *root = &table.root;
+  unsigned long x = 88172645463325252UL, i, n = 0;
+  struct route *r, *old;
+
+  (void)arg;
+  while (!stop) {
+    /* Replace the odd key in a random slot with another odd key. */
+    i = xorshift(&x) % nkeys;
+    r = new_route((xorshift(&x) % nkeys) * 2 + 1);
+
+    if (use_rwlock)
+      pthread_rwlock_wrlock(&rwlock);
+    else
+      rbs_write_lock(&table);
+    old = slots[i];
+    if (old)
+      rb_erase(&old->node, root);
+    slots[i] = (RB_INSERT(root, struct route, key, node, ROUTE_CMP, r)) ?
+      NULL : r;
+    if (use_rwlock)
+      pthread_rwlock_unlock(&rwlock);
+    else
+      rbs_write_unlock(&table);
+
+    if (!slots[i])
+      free(r);
+    if (old) {
+      if (use_rwlock)
+        free_route(old);
+      else
+        rbs_retire(old, free_route);
+    }
+    if (++n % burst == 0)
+      usleep(100);
+  }
+  return (void *)n;
+}
+
+static void
+run(int nreaders, int seconds)
+{
+  pthread_t tid[65];
+  unsigned long reads = 0, writes;
+  void *ret;
+  int i;
+
+  stop = 0;
+  for (i = 0; i < nreaders; i++)
+    pthread_create(&tid[i], 0, reader, (void *)(long)(i + 1));
+  pthread_create(&tid[nreaders], 0, writer, 0);
+  sleep(seconds);
+  stop = 1;
+  for (i = 0; i < nreaders; i++) {
+    pthread_join(tid[i], &ret);
+    reads += (unsigned long)ret;
+  }
+  pthread_join(tid[nreaders], &ret);
+  writes = (unsigned long)ret;
+
+  printf("%-8s %3d readers: %8.2f M lookups/s, %8.2f K updates/s\n",
+         (use_rwlock) ? "rwlock" : "rbsync", nreaders,
+         reads / 1e6 / seconds, writes / 1e3 / seconds);
+}
+
+int
+main(int argc, char *argv[])
+{
+  struct rb_root *root = &table.root;
+  int seconds, nreaders;
+  unsigned long i;
+  struct route *r;
+
+  nkeys = (argc > 1) ? atol(argv[1]) : 100000;
+  seconds = (argc > 2) ? atoi(argv[2]) : 1;
+  burst = (argc > 3) ? atol(argv[3]) : 10;
+
+  slots = calloc(nkeys, sizeof(*slots));
+  for (i = 0; i < nkeys * 2; i++) {
+    r = new_route(i);
+    RB_INSERT(root, struct route, key, node, ROUTE_CMP, r);
+    if (i % 2)
+      slots[i / 2] = r;
+  }
+
+  for (nreaders = 1; nreaders <= 16; nreaders *= 2) {
+    use_rwlock = 1;
+    run(nreaders, seconds);
+    use_rwlock = 0;
+    run(nreaders, seconds);
+  }
+
+  rbs_synchronize();
+  RB_ERASE_LOOP(root) {
+    r = RB_ERASE(root, struct route, node);
+    free(r);
+  }
+  free(slots);
+  return 0;
+}
+#endif  /* TEST_RBSYNC */
@@ -0,0 +1,207 @@
+#ifndef RBSYNC_H__
+#define RBSYNC_H__
+
+/*
+ * Lock-free readers for rbtree
+ * Copyright (C) 2014  Seong-Kook Shin <cinsky@gmail.com>
+ * DO WHAT THE FUCK YOU WANT TO PUBLIC LICENSE
+ * Version 2, December 2004
+ */
+
+/*
+ * 'rbsync' lets many threads search an rbtree (rbtree.h) while other
+ * threads modify it, without a rwlock:
+ *
+ * - Writers serialize on a mutex, and bump a sequence counter before
+ *   and after the modification (a seqlock).  They use the usual
+ *   RB_INSERT(), RB_DELETE(), rb_erase(), ...
+ *
+ * - Readers take no lock.  RBS_SEARCH() walks the tree and retries if
+ *   the sequence counter changed meanwhile.  After RBS_MAX_RETRIES
+ *   failures, it takes the writer lock, so readers do not starve.
+ *
+ * - A reader may be looking at a node that a writer is removing, so
+ *   removed nodes are not freed at once.  Pass them to rbs_retire();
+ *   they are freed after every reader that could see them has left
+ *   its read-side section (epoch-based reclamation).
+ *
+ *   struct rb_seqroot table = RB_SEQROOT_INIT;
+ *
+ *   // reader
+ *   rbs_read_lock();
+ *   r = RBS_SEARCH(&table, struct route, node, prefix, ROUTE_CMP, key);
+ *   if (r)
+ *     use(r);                  // R is valid until rbs_read_unlock()
+ *   rbs_read_unlock();
+ *
+ *   // writer
+ *   struct rb_root *root = &table.root;
+ *
+ *   rbs_write_lock(&table);
+ *   r = RB_DELETE(root, struct route, node, prefix, ROUTE_CMP, key);
+ *   rbs_write_unlock(&table);
+ *   if (r)
+ *     rbs_retire(r, free_route);
+ *
+ * A read-side section must not call rbs_synchronize(), nor wait for
+ * anything that waits for the readers.  It may take the writer lock,
+ * as RBS_SEARCH() does when it has retried too often, because a writer
+ * never waits for the readers while it holds the lock: call
+ * rbs_retire() and rbs_synchronize() only after rbs_write_unlock(), as
+ * above.  The user keys must not change while their nodes are in the
+ * tree.
+ *
+ *   $ cc -D_GNU_SOURCE your-source.c rbsync.c rbtree.c -lpthread
+ */
+
+#include <pthread.h>
+#include <sched.h>
+#include "rbtree.h"
+
+/* This indirect using of extern "C" { ... } makes Emacs happy */
+#ifndef BEGIN_C_DECLS
+# ifdef __cplusplus
+#  define BEGIN_C_DECLS extern "C" {
+#  define END_C_DECLS   }
+# else
+#  define BEGIN_C_DECLS
+#  define END_C_DECLS
+# endif
+#endif /* BEGIN_C_DECLS */
+
+BEGIN_C_DECLS
+
+struct rb_seqroot {
+  struct rb_root root;
+  pthread_mutex_t lock;         /* held by writers */
+  unsigned seq;                 /* odd while a writer is modifying ROOT */
+};
+
+#define RB_SEQROOT_INIT { RB_ROOT, PTHREAD_MUTEX_INITIALIZER, 0 }
+
+#define RBS_MAX_RETRIES 8
+
+/* No valid rbtree is this deep; a longer walk saw a torn update. */
+#define RBS_MAX_DEPTH   128
+
+#if defined(__i386__) || defined(__x86_64__)
+#define RBS_PAUSE_()    __builtin_ia32_pause()
+#else
+#define RBS_PAUSE_()    __asm__ __volatile__("" ::: "memory")
+#endif
+
+
+static __inline__ void
+rbs_write_lock(struct rb_seqroot *sr)
+{
+  pthread_mutex_lock(&sr->lock);
+  __atomic_store_n(&sr->seq, sr->seq + 1, __ATOMIC_RELAXED);
+  __atomic_thread_fence(__ATOMIC_RELEASE);
+}
+
+
+static __inline__ void
+rbs_write_unlock(struct rb_seqroot *sr)
+{
+  __atomic_store_n(&sr->seq, sr->seq + 1, __ATOMIC_RELEASE);
+  pthread_mutex_unlock(&sr->lock);
+}
+
+
+/*
+ * Begin an optimistic read of SR, and return the sequence to pass to
+ * rbs_read_retry().
+ */
+static __inline__ unsigned
+rbs_read_begin(struct rb_seqroot *sr)
+{
+  unsigned seq, spins = 0;
+
+  /* Let the writer run if it was preempted in the middle. */
+  while ((seq = __atomic_load_n(&sr->seq, __ATOMIC_ACQUIRE)) & 1) {
+    if (++spins < 100)
+      RBS_PAUSE_();
+    else
+      sched_yield();
+  }
+  return seq;
+}
+
+
+/*
+ * Return nonzero if a writer modified SR since rbs_read_begin()
+ * returned SEQ; what was read in between must be discarded.
+ */
+static __inline__ int
+rbs_read_retry(struct rb_seqroot *sr, unsigned seq)
+{
+  __atomic_thread_fence(__ATOMIC_ACQUIRE);
+  return __atomic_load_n(&sr->seq, __ATOMIC_RELAXED) != seq;
+}
+
+
+#define RBS_LOAD_(p)    __atomic_load_n(&(p), __ATOMIC_RELAXED)
+
+/*
+ * RB_SEARCH() for readers.  Must be called in a read-side section.
+ * After RBS_MAX_RETRIES, it searches under the writer lock, without
+ * leaving the section, so that the nodes found before in the section
+ * stay valid; see above why this cannot deadlock.
+ */
+#define RBS_SEARCH(sr, usertype, handle, userkey, compare, key) ({        \
+      usertype *rbs_ret_;                                               \
+      unsigned rbs_seq_, rbs_tries_ = 0;                                \
+      do {                                                              \
+        struct rb_node *rbs_n_;                                         \
+        int rbs_depth_ = 0;                                             \
+        rbs_seq_ = rbs_read_begin(sr);                                  \
+        rbs_ret_ = 0;                                                   \
+        rbs_n_ = RBS_LOAD_((sr)->root.rb_node);                         \
+        while (rbs_n_ && rbs_depth_++ < RBS_MAX_DEPTH) {                \
+          usertype *rbs_data_ = container_of(rbs_n_, usertype, handle); \
+          int rbs_result_ = compare((key), rbs_data_->userkey);         \
+          if (rbs_result_ < 0)                                          \
+            rbs_n_ = RBS_LOAD_(rbs_n_->rb_left);                        \
+          else if (rbs_result_ > 0)                                     \
+            rbs_n_ = RBS_LOAD_(rbs_n_->rb_right);                       \
+          else {                                                        \
+            rbs_ret_ = rbs_data_;                                       \
+            break;                                                      \
+          }                                                             \
+        }                                                               \
+      } while (rbs_read_retry((sr), rbs_seq_) &&                        \
+               ++rbs_tries_ < RBS_MAX_RETRIES);                         \
+      if (rbs_tries_ == RBS_MAX_RETRIES) {                              \
+        pthread_mutex_lock(&(sr)->lock);                                \
+        rbs_ret_ = RB_SEARCH(&(sr)->root, usertype, handle, userkey,    \
+                             compare, (key));                           \
+        pthread_mutex_unlock(&(sr)->lock);                              \
+      }                                                                 \
+      rbs_ret_; })
+
+
+/*
+ * Enter and leave a read-side section.  The nodes found in a section
+ * stay valid until the section ends.  Sections can nest.
+ */
+extern void rbs_read_lock(void);
+extern void rbs_read_unlock(void);
+
+/*
+ * Call FREEFN(PTR) after every read-side section that is active now
+ * has ended.  PTR must be already unreachable from the tree.  Do not
+ * call it with the writer lock held, since it may wait.  Returns
+ * 0 on success, or -1 if it failed to allocate memory (then it waits
+ * for the readers, and calls FREEFN(PTR) before returning).
+ */
+extern int rbs_retire(void *ptr, void (*freefn)(void *));
+
+/*
+ * Wait until the read-side sections that are active now have ended,
+ * and release every retired object.  Not with the writer lock held.
+ */
+extern void rbs_synchronize(void);
+
+END_C_DECLS
+
+#endif  /* RBSYNC_H__ */
@@ -0,0 +1,187 @@
+/*
+ * Test and benchmark of rb_build_sorted(), rb_join() and rb_split()
+ *
+ *   $ cc -O2 -o rbtree-build-test rbtree-build-test.c rbtree.c
+ *   $ ./rbtree-build-test [NELEM]
+ *
+ * The benchmark loads NELEM sorted keys with RB_INSERT() and with
+ * rb_build_sorted(), then splits the tree in half and joins it back,
+ * against moving the nodes one by one.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/time.h>
+#include "rbtree.h"
+
+struct mytype {
+  struct rb_node node_;
+  long key;
+};
+
+#define KEY_CMP(a, b)   (((a) > (b)) - ((a) < (b)))
+
+static double
+now(void)
+{
+  struct timeval tv;
+  gettimeofday(&tv, 0);
+  return tv.tv_sec + tv.tv_usec / 1e6;
+}
+
+/* Returns the black height of RB, or -1 if it is not a red-black tree. */
+static int
+check_node(struct rb_node *rb, struct rb_node *parent)
+{
+  int lh, rh;
+
+  if (!rb)
+    return 0;
+  if (rb_parent(rb) != parent)
+    return -1;
+  if (rb_is_red(rb) && ((rb->rb_left && rb_is_red(rb->rb_left)) ||
+                        (rb->rb_right && rb_is_red(rb->rb_right))))
+    return -1;
+  lh = check_node(rb->rb_left, rb);
+  rh = check_node(rb->rb_right, rb);
+  if (lh < 0 || lh != rh)
+    return -1;
+  return lh + rb_is_black(rb);
+}
+
+/* Check that ROOT is a red-black tree holding keys [FIRST, LAST). */
+static int
+check(struct rb_root *root, long first, long last)
+{
+  struct rb_node *rb;
+  long key = first;
+
+  if (root->rb_node && rb_is_red(root->rb_node))
+    return -1;
+  if (check_node(root->rb_node, NULL) < 0)
+    return -1;
+  for (rb = rb_first(root); rb; rb = rb_next(rb))
+    if (container_of(rb, struct mytype, node_)->key != key++)
+      return -1;
+  return (key == last && root->size == (size_t)(last - first)) ? 0 : -1;
+}
+
+static int
+test(void)
+{
+  struct rb_root a, b, c;
+  struct rb_node **nodes;
+  struct mytype *elems, *p;
+  long n, i, k, j;
+
+  elems = malloc(sizeof(*elems) * 2000);
+  nodes = malloc(sizeof(*nodes) * 2000);
+  for (i = 0; i < 2000; i++) {
+    elems[i].key = i;
+    nodes[i] = &elems[i].node_;
+  }
+
+  for (n = 0; n <= 300; n++) {
+    a = RB_ROOT;
+    rb_build_sorted(&a, nodes, n);
+    if (check(&a, 0, n) < 0)
+      return -1;
+
+    /* split at every position, and join back */
+    for (k = 0; k <= n; k += (n < 50) ? 1 : 7) {
+      b = RB_ROOT;
+      p = RB_SPLIT((&a), struct mytype, node_, key, KEY_CMP, k, &b);
+      if ((k < n) != (p != 0) || check(&a, 0, k) < 0 || check(&b, k, n) < 0)
+        return -1;
+      rb_join(&a, &b);
+      if (check(&a, 0, n) < 0 || b.rb_node || b.size)
+        return -1;
+    }
+  }
+
+  /* joining trees of very different heights, built by insertion */
+  for (n = 1; n < 2000; n = n * 3 + 1) {
+    for (k = 0; k <= n; k += (k < 10) ? 1 : n / 5 + 1) {
+      a = RB_ROOT;
+      b = RB_ROOT;
+      for (i = 0; i < n; i++) {
+        j = (i * 7919) % n;
+        RB_INSERT((j < k ? &a : &b), struct mytype, key, node_, KEY_CMP,
+                  (&elems[j]));
+      }
+      rb_join(&a, &b);
+      if (check(&a, 0, n) < 0)
+        return -1;
+      c = RB_ROOT;
+      RB_SPLIT((&a), struct mytype, node_, key, KEY_CMP, n - k, &c);
+      if (check(&a, 0, n - k) < 0 || check(&c, n - k, n) < 0)
+        return -1;
+    }
+  }
+
+  free(nodes);
+  free(elems);
+  return 0;
+}
+
+int
+main(int argc, char *argv[])
+{
+  long n = (argc > 1) ? atol(argv[1]) : 10000000;
+  struct rb_root root = RB_ROOT, right = RB_ROOT;
+  struct rb_node **nodes, *rb;
+  struct mytype *elems, *p;
+  double beg;
+  long i;
+
+  if (test() < 0) {
+    fprintf(stderr, "rbtree-build-test: test failed\n");
+    return 1;
+  }
+  printf("rbtree-build-test: test passed\n");
+
+  elems = malloc(sizeof(*elems) * n);
+  nodes = malloc(sizeof(*nodes) * n);
+  for (i = 0; i < n; i++) {
+    elems[i].key = i;
+    nodes[i] = &elems[i].node_;
+  }
+
+  beg = now();
+  for (i = 0; i < n; i++) {
+    p = &elems[i];
+    RB_INSERT((&root), struct mytype, key, node_, KEY_CMP, p);
+  }
+  printf("%ld sorted keys: RB_INSERT       %8.3f sec\n", n, now() - beg);
+
+  beg = now();
+  rb_build_sorted(&root, nodes, n);
+  printf("%ld sorted keys: rb_build_sorted %8.3f sec\n", n, now() - beg);
+
+  beg = now();
+  RB_SPLIT((&root), struct mytype, node_, key, KEY_CMP, n / 2, &right);
+  rb_join(&root, &right);
+  printf("split in half and join:         %8.3f sec\n", now() - beg);
+
+  beg = now();
+  while ((rb = rb_last(&root)) != 0 &&
+         container_of(rb, struct mytype, node_)->key >= n / 2) {
+    rb_erase(rb, &root);
+    root.size--;
+    p = container_of(rb, struct mytype, node_);
+    RB_INSERT((&right), struct mytype, key, node_, KEY_CMP, p);
+  }
+  while ((rb = rb_first(&right)) != 0) {
+    rb_erase(rb, &right);
+    right.size--;
+    p = container_of(rb, struct mytype, node_);
+    RB_INSERT((&root), struct mytype, key, node_, KEY_CMP, p);
+  }
+  printf("the same by reinsertion:        %8.3f sec\n", now() - beg);
+
+  if (check(&root, 0, n) < 0)
+    fprintf(stderr, "rbtree-build-test: broken tree\n");
+
+  free(nodes);
+  free(elems);
+  return 0;
+}
@@ -465,3 +465,193 @@ void rb_replace_node(struct rb_node *victim, struct rb_node *new,
         *new = *victim;
 }
 EXPORT_SYMBOL(rb_replace_node);
+
+/*
+ * Build a subtree from nodes[0..n), and return its root.  Leaves are
+ * at DEPTH and DEPTH + 1 only, and the nodes at RED_DEPTH are red.
+ */
+static struct rb_node *__rb_build(struct rb_node **nodes, size_t n,
+                                  struct rb_node *parent,
+                                  int depth, int red_depth)
+{
+        struct rb_node *node;
+        size_t mid;
+
+        if (!n)
+                return NULL;
+
+        mid = n / 2;
+        node = nodes[mid];
+        node->rb_parent_color = (unsigned long)parent;
+        if (depth != red_depth)
+                rb_set_black(node);
+        node->rb_left = __rb_build(nodes, mid, node, depth + 1, red_depth);
+        node->rb_right = __rb_build(nodes + mid + 1, n - mid - 1, node,
+                                    depth + 1, red_depth);
+        return node;
+}
+
+/*
+ * Build a balanced tree in O(n) from N nodes sorted in the tree order.
+ * Any nodes in @root are discarded.
+ */
+void rb_build_sorted(struct rb_root *root, struct rb_node **nodes, size_t n)
+{
+        int depth = 0;
+
+        /* The tree is perfect down to floor(log2(n + 1)) levels; the
+         * nodes below, if any, are red. */
+        while (((size_t)2 << depth) <= n + 1)
+                depth++;
+
+        root->rb_node = __rb_build(nodes, n, NULL, 0, depth);
+        root->size = n;
+        root->nmodified++;
+}
+EXPORT_SYMBOL(rb_build_sorted);
+
+/*
+ * Make the root of @node black, and return its black height.
+ */
+static int __rb_black_root(struct rb_node *node)
+{
+        int height = 0;
+
+        if (!node)
+                return 0;
+        rb_set_parent(node, NULL);
+        rb_set_black(node);
+        for (; node; node = node->rb_left)
+                if (rb_is_black(node))
+                        height++;
+        return height;
+}
+
+/*
+ * Join @left, @node and @right, where every node of @left precedes
+ * @node and every node of @right follows it.  Returns the new root.
+ * Takes O(|difference of the heights| + 1) besides measuring them.
+ */
+static struct rb_node *__rb_join(struct rb_node *left, struct rb_node *node,
+                                 struct rb_node *right)
+{
+        int lh = __rb_black_root(left), rh = __rb_black_root(right), h;
+        struct rb_node *parent = NULL, *y;
+        struct rb_root tmp;
+
+        if (lh == rh) {
+                node->rb_parent_color = RB_BLACK;
+                node->rb_left = left;
+                node->rb_right = right;
+                if (left)
+                        rb_set_parent(left, node);
+                if (right)
+                        rb_set_parent(right, node);
+                return node;
+        }
+
+        /* Find a black node Y on the spine of the higher tree, with the
+         * black height of the lower one, and put NODE in its place as a
+         * red node with Y and the lower tree as the children. */
+        if (lh > rh) {
+                for (y = left, h = lh; h != rh || (y && rb_is_red(y));
+                     y = y->rb_right) {
+                        if (rb_is_black(y))
+                                h--;
+                        parent = y;
+                }
+                node->rb_left = y;
+                node->rb_right = right;
+                parent->rb_right = node;
+                tmp.rb_node = left;
+        } else {
+                for (y = right, h = rh; h != lh || (y && rb_is_red(y));
+                     y = y->rb_left) {
+                        if (rb_is_black(y))
+                                h--;
+                        parent = y;
+                }
+                node->rb_left = left;
+                node->rb_right = y;
+                parent->rb_left = node;
+                tmp.rb_node = right;
+        }
+        node->rb_parent_color = (unsigned long)parent;  /* red */
+        if (node->rb_left)
+                rb_set_parent(node->rb_left, node);
+        if (node->rb_right)
+                rb_set_parent(node->rb_right, node);
+
+        rb_insert_color(node, &tmp);
+        return tmp.rb_node;
+}
+
+/*
+ * Move every node of @right to the end of @left.  Every node of @left
+ * must precede every node of @right.  O(log n).
+ */
+void rb_join(struct rb_root *left, struct rb_root *right)
+{
+        struct rb_node *node;
+
+        if (!right->rb_node)
+                return;
+
+        node = rb_first(right);
+        rb_erase(node, right);
+        left->rb_node = __rb_join(left->rb_node, node, right->rb_node);
+        left->size += right->size;
+        left->nmodified++;
+
+        right->rb_node = NULL;
+        right->size = 0;
+        right->nmodified++;
+}
+EXPORT_SYMBOL(rb_join);
+
+/*
+ * Move @node and every node after it from @root to @right, which must
+ * be empty.  O(log^2 n), plus O(min(k, n - k)) to count the k nodes
+ * moved, for the sizes.
+ */
+void rb_split(struct rb_root *root, struct rb_node *node, struct rb_root *right)
+{
+        struct rb_node *left_tree, *right_tree, *child, *parent, *up;
+        const struct rb_node *fwd, *bwd;
+        size_t k = 0;
+        int from_right;
+
+        /* Count the smaller side. */
+        for (fwd = node, bwd = rb_prev(node); fwd && bwd;
+             fwd = rb_next(fwd), bwd = rb_prev(bwd))
+                k++;
+        if (fwd)                /* K is the number of nodes before NODE */
+                k = root->size - k;
+
+        parent = rb_parent(node);
+        left_tree = node->rb_left;
+        right_tree = __rb_join(NULL, node, node->rb_right);
+
+        /* Walk up, adding each ancestor and its other subtree to the
+         * side it belongs to. */
+        for (child = node; parent; child = parent, parent = up) {
+                up = rb_parent(parent);
+                from_right = (parent->rb_right == child);
+                if (from_right)
+                        left_tree = __rb_join(parent->rb_left, parent,
+                                              left_tree);
+                else
+                        right_tree = __rb_join(right_tree, parent,
+                                               parent->rb_right);
+        }
+
+        /* LEFT_TREE may still be a subtree with a parent and a red root. */
+        __rb_black_root(left_tree);
+        root->rb_node = left_tree;
+        root->size -= k;
+        root->nmodified++;
+        right->rb_node = right_tree;
+        right->size = k;
+        right->nmodified++;
+}
+EXPORT_SYMBOL(rb_split);
@@ -178,6 +178,13 @@ extern struct rb_node *rb_prev(const struct rb_node *);
 extern struct rb_node *rb_first(const struct rb_root *);
 extern struct rb_node *rb_last(const struct rb_root *);
 
+/* Bulk construction, join and split */
+extern void rb_build_sorted(struct rb_root *root, struct rb_node **nodes,
+                            size_t n);
+extern void rb_join(struct rb_root *left, struct rb_root *right);
+extern void rb_split(struct rb_root *root, struct rb_node *node,
+                     struct rb_root *right);
+
 /* Fast replacement of a single node without remove/rebalance/add/rebalance */
 extern void rb_replace_node(struct rb_node *victim, struct rb_node *new,
                             struct rb_root *root);
@@ -250,6 +257,27 @@ static inline void rb_link_node(struct rb_node * node, struct rb_node * parent,
   root->size--;                                                  \
   tmp; })
 
+/*
+ * Move the nodes whose keys are not less than KEY from ROOT to RIGHT,
+ * which must be empty.  Returns the first node moved, or NULL if no
+ * node was moved.
+ */
+#define RB_SPLIT(root, usertype, handle, userkey, compare, key, right) ({ \
+      usertype *ret = 0;                                                \
+      struct rb_node *node = (root)->rb_node;                           \
+      while (node) {                                                    \
+        usertype *data = container_of(node, usertype, handle);          \
+        if (compare((key), data->userkey) <= 0) {                       \
+          ret = data;                                                   \
+          node = node->rb_left;                                         \
+        }                                                               \
+        else                                                            \
+          node = node->rb_right;                                        \
+      }                                                                 \
+      if (ret)                                                          \
+        rb_split((root), &ret->handle, (right));                        \
+      ret; })
+
 #define RB_ITER(root, usertype, handle, ptr)    \
   for (ptr = rb_first(root); ptr != 0; ptr = rb_next(ptr))
 
@@ -2,13 +2,13 @@
  * Light file stream
  * Copyright (C) 2004  Seong-Kook Shin <cinsky@gmail.com>
  */
+#define _GNU_SOURCE     1
 #include <stream.h>
 #include <xassert.h>
 #include <stdlib.h>
 #include <string.h>
 #include <errno.h>
-
-#define STREAM_BUFSIZ 3
+#include <sys/socket.h>
 
 #ifndef STREAM_BUFSIZ
 # ifdef BUFSIZ
@@ -18,7 +18,28 @@
 # endif
 #endif /* STREAM_BUFSIZ */
 
+/*
+ * Limits for the adaptive buffer sizing.  The initial buffer size is
+ * derived from the underlying fd (see get_fd_bufsize()), and it is
+ * doubled after STREAM_GROW_AFTER consecutive full-buffer transfers,
+ * up to STREAM_BUFSIZ_MAX.
+ */
+#ifndef STREAM_BUFSIZ_MIN
+# define STREAM_BUFSIZ_MIN      512
+#endif
+#ifndef STREAM_BUFSIZ_MAX
+# define STREAM_BUFSIZ_MAX      (1024 * 1024)
+#endif
+#ifndef STREAM_FILE_BLOCKS
+# define STREAM_FILE_BLOCKS     16      /* initial buffer of a regular file,
+                                         * in the unit of st_blksize */
+#endif
+#ifndef STREAM_GROW_AFTER
+# define STREAM_GROW_AFTER      4
+#endif
+
 int stream_errno;
+size_t stream_bufsize;
 
 struct stream_ {
   struct stream_ops op;
@@ -40,8 +61,16 @@ struct stream_ {
   int fd;
   void *data;
 
+  char *lbuf;                   /* holds a line that straddles a refill */
+  size_t lsize;                 /* size of LBUF */
+
+  size_t align;                 /* alignment of BUF, 0 if not aligned */
+  unsigned seqfills;            /* # of consecutive full-buffer transfers */
+
   unsigned eof:   1;            /* nonzero if EOF is reached */
+  unsigned error: 1;            /* nonzero if a read failed */
   unsigned dirty: 1;            /* nonzero if BUF contains unwritten data */
+  unsigned adaptive: 1;         /* nonzero if BUF is owned and resizable */
 };
 
 static char stream_nbuf[1];
@@ -78,6 +107,10 @@ static int get_type_determined(const char *mode);
 static int get_flags_from_type(int type);
 static int flush_buf(stream_t *s);
 static int get_buf_prepared(stream_t *s);
+static size_t get_fd_bufsize(int fd, int type, size_t *align);
+static char *alloc_buf(size_t size, size_t align);
+static void grow_buf(stream_t *s);
+static int lbuf_append(stream_t *s, size_t len, const char *src, size_t n);
 
 
 stream_t *
@@ -85,10 +118,14 @@ s_open(const struct stream_ops *ops, const char *pathname, const char *mode,
        void *data)
 {
   stream_t *s;
+  size_t size, align;
+  char *buf;
 
   s = malloc(sizeof(*s));
   if (!s)
     return 0;
+  memset(s, 0, sizeof(*s));
+  s->buf = stream_nbuf;
 
   memcpy(&s->op, ops, sizeof(*ops));
   s->type = get_type_determined(mode);
@@ -102,7 +139,22 @@ s_open(const struct stream_ops *ops, const char *pathname, const char *mode,
   s->ungetc = -1;
 
   s->dirty = 0;
-  s_setvbuf(s, malloc(STREAM_BUFSIZ), STREAM_IOFBF, STREAM_BUFSIZ);
+
+  if (stream_bufsize) {
+    size = stream_bufsize;
+    align = 0;
+  }
+  else
+    size = get_fd_bufsize(s->fd, s->type, &align);
+  buf = alloc_buf(size, align);
+  if (!buf) {
+    stream_errno = errno;
+    s->op.close(s->fd, s->data);
+    goto err;
+  }
+  s_setvbuf(s, buf, STREAM_IOFBF, size);
+  s->align = align;
+  s->adaptive = !stream_bufsize;
 
   /* if (!(s->flags & O_TRUNC) && get_buf_prepared(s) < 0) { */
   if (get_buf_prepared(s) < 0) {
@@ -127,6 +179,7 @@ s_close(stream_t *s)
     stream_errno = errno;
     return -1;
   }
+  free(s->lbuf);
   free(s);
   return 0;
 }
@@ -138,6 +191,8 @@ s_close(stream_t *s)
  * - set stream_errno instead of errno(3).
  * - Whenver s_setvbuf() replaces the existing buffer, it calls free().
  *   This means new buffer should be allocated by calling malloc().
+ * - A buffer given by the caller is never resized; only the buffer
+ *   that s_open() allocated grows under sequential access.
  */
 int
 s_setvbuf(stream_t *s, char *buf, int mode, size_t size)
@@ -152,6 +207,7 @@ s_setvbuf(stream_t *s, char *buf, int mode, size_t size)
       free(s->buf);
 
     buf = stream_nbuf;
+    s->adaptive = 0;
     s->size = 1;
     s->end = buf + 1;
     s->cur = 0;
@@ -160,22 +216,53 @@ s_setvbuf(stream_t *s, char *buf, int mode, size_t size)
   }
 
   if (buf) {
+    size_t pending = 0;
+
     if (s->dirty)
       flush_buf(s);
+    else if (s->buf != stream_nbuf && s->cur && s->cur < s->end &&
+             (size_t)(s->end - s->cur) <= size) {
+      /* Keep the unread contents, since the fd may not be seekable. */
+      pending = s->end - s->cur;
+      memcpy(buf, s->cur, pending);
+    }
 
     if (s->buf != stream_nbuf)
       free(s->buf);
 
     s->buf = buf;
     s->size = size;
-    s->end = buf + 1;
-    s->cur = s->end;
+    s->align = 0;
+    s->adaptive = 0;
+    s->seqfills = 0;
+    if (pending) {
+      s->cur = buf;
+      s->end = buf + pending;
+    }
+    else {
+      s->end = buf + 1;
+      s->cur = s->end;
+    }
   }
   s->b_mode = mode;
   return 0;
 }
 
 
+int
+s_eof(stream_t *s)
+{
+  return s->eof && s->cur >= s->end;
+}
+
+
+int
+s_error(stream_t *s)
+{
+  return s->error;
+}
+
+
 off_t
 s_seek(stream_t *s, off_t offset, int whence)
 {
@@ -195,7 +282,114 @@ s_getc(stream_t *s)
       return EOF;
   }
   s->vpos++;
-  return *s->cur++;
+  return (unsigned char)*s->cur++;
+}
+
+
+/*
+ * Read a record terminated by DELIM from S.
+ *
+ * On success, *LINEP points the record (including DELIM, unless EOF
+ * is reached before DELIM), and returns the length of it.  The record
+ * is not NUL-terminated.  Returns -1 on EOF or on error.
+ *
+ * If the record lies in the internal buffer, *LINEP points directly
+ * into the buffer; otherwise the record is copied into a separate
+ * line buffer.  Either way, *LINEP is valid until the next operation
+ * on S.
+ *
+ * s_error() tells a failed read, with stream_errno set, from EOF.
+ */
+ssize_t
+s_getdelim(stream_t *s, const char **linep, int delim)
+{
+  char *p;
+  size_t n, len = 0;
+
+  xassert(s->type != ST_WRITE && s->type != ST_APPEND,
+          "attempt to read from write-only stream");
+
+  if (s->cur >= s->end) {
+    if (get_buf_prepared(s) < 0 || s->cur >= s->end)
+      return -1;
+  }
+
+  p = memchr(s->cur, delim, s->end - s->cur);
+  if (p) {
+    n = p + 1 - s->cur;
+    *linep = s->cur;
+    s->cur += n;
+    s->vpos += n;
+    return n;
+  }
+
+  /* The record straddles a refill; collect it in LBUF. */
+  while (1) {
+    n = (p) ? (size_t)(p + 1 - s->cur) : (size_t)(s->end - s->cur);
+    if (lbuf_append(s, len, s->cur, n) < 0)
+      return -1;
+    len += n;
+    s->cur += n;
+    s->vpos += n;
+
+    if (p)
+      break;
+    if (get_buf_prepared(s) < 0)
+      return -1;
+    if (s->cur >= s->end)
+      break;                    /* EOF */
+    p = memchr(s->cur, delim, s->end - s->cur);
+  }
+
+  *linep = s->lbuf;
+  return len;
+}
+
+
+ssize_t
+s_getline(stream_t *s, const char **linep)
+{
+  return s_getdelim(s, linep, '\n');
+}
+
+
+char *
+s_gets(stream_t *s, char *str, int size)
+{
+  char *p = str, *q;
+  size_t n;
+
+  xassert(s->type != ST_WRITE && s->type != ST_APPEND,
+          "attempt to read from write-only stream");
+
+  if (size <= 0)
+    return 0;
+
+  while (p < str + size - 1) {
+    if (s->cur >= s->end) {
+      if (get_buf_prepared(s) < 0 || s->cur >= s->end)
+        break;
+    }
+    n = s->end - s->cur;
+    if (n > (size_t)(str + size - 1 - p))
+      n = str + size - 1 - p;
+
+    q = memchr(s->cur, '\n', n);
+    if (q)
+      n = q + 1 - s->cur;
+
+    memcpy(p, s->cur, n);
+    p += n;
+    s->cur += n;
+    s->vpos += n;
+    if (q)
+      break;
+  }
+
+  if (p == str)
+    return 0;
+  *p = '\0';
+  return str;
 }
 
 
@@ -278,6 +472,10 @@ flush_buf(stream_t *s)
     /* TODO: support for async I/O? */
     xassert(0, "TODO: support for async I/O?");
   }
+  if ((size_t)written == s->size)
+    s->seqfills++;
+  else
+    s->seqfills = 0;
   s->ppos = s->vpos;
   s->dirty = 0;
   s->cur = s->end = s->buf;
@@ -306,13 +504,25 @@ get_buf_prepared(stream_t *s)
       return -1;
     }
     s->ppos = s->vpos;
+    s->seqfills = 0;
   }
+
+  if (s->adaptive && s->seqfills >= STREAM_GROW_AFTER)
+    grow_buf(s);
+
   if (!s->eof && s->type != ST_WRITE && s->type != ST_APPEND) {
     chread = s->op.read(s->fd, s->buf, s->size, s->data);
-    if (chread < 0)
+    if (chread < 0) {
+      stream_errno = errno;
+      s->error = 1;
       return -1;
+    }
     if (!chread)
       s->eof = 1;
+    if ((size_t)chread == s->size)
+      s->seqfills++;
+    else
+      s->seqfills = 0;
   }
   s->cur = s->buf;
   s->end = s->buf + chread;
@@ -321,7 +531,154 @@ get_buf_prepared(stream_t *s)
 }
 
 
+/*
+ * Get the preferred buffer size for FD, and store the preferred buffer
+ * alignment in *ALIGN (0 if the alignment does not matter).
+ *
+ * Sockets use SO_RCVBUF or SO_SNDBUF depending on TYPE, pipes use the
+ * pipe capacity, and regular files and block devices use a multiple of
+ * st_blksize aligned to st_blksize, so that the buffer can be used even
+ * if stream_ops::open() added O_DIRECT.  If FD is not a system file
+ * descriptor (i.e. stream_ops is not backed by the kernel), returns
+ * STREAM_BUFSIZ.
+ */
+static size_t
+get_fd_bufsize(int fd, int type, size_t *align)
+{
+  struct stat sbuf;
+  socklen_t len;
+  size_t size = STREAM_BUFSIZ;
+  int optval;
+
+  *align = 0;
+
+  if (fstat(fd, &sbuf) != 0)
+    return STREAM_BUFSIZ;
+
+  if (S_ISSOCK(sbuf.st_mode)) {
+    len = sizeof(optval);
+    if (getsockopt(fd, SOL_SOCKET,
+                   (type == ST_WRITE || type == ST_APPEND) ?
+                   SO_SNDBUF : SO_RCVBUF,
+                   &optval, &len) == 0 && optval > 0)
+      size = optval;
+  }
+  else if (S_ISFIFO(sbuf.st_mode)) {
+#ifdef F_GETPIPE_SZ
+    optval = fcntl(fd, F_GETPIPE_SZ);
+    if (optval > 0)
+      size = optval;
+    else
+#endif
+      size = sbuf.st_blksize;
+  }
+  else if (S_ISREG(sbuf.st_mode) || S_ISBLK(sbuf.st_mode)) {
+    if (sbuf.st_blksize > 0) {
+      *align = sbuf.st_blksize;
+      size = (size_t)sbuf.st_blksize * STREAM_FILE_BLOCKS;
+    }
+  }
+  else if (sbuf.st_blksize > 0)
+    size = sbuf.st_blksize;
+
+  if (size < STREAM_BUFSIZ_MIN)
+    size = STREAM_BUFSIZ_MIN;
+  if (size > STREAM_BUFSIZ_MAX)
+    size = STREAM_BUFSIZ_MAX;
+  if (*align && size % *align)
+    size += *align - size % *align;
+
+  return size;
+}
+
+
+/*
+ * Allocate SIZE bytes of buffer, aligned to ALIGN if ALIGN is nonzero.
+ * The returned buffer can be released by free().
+ */
+static char *
+alloc_buf(size_t size, size_t align)
+{
+  void *p;
+  int ret;
+
+  if (!align)
+    return malloc(size);
+
+  ret = posix_memalign(&p, align, size);
+  if (ret != 0) {
+    errno = ret;
+    return 0;
+  }
+  return p;
+}
+
+
+/*
+ * Double the internal buffer of S.  Should be called only when BUF
+ * holds no valid data (i.e. right after flush_buf(), or when
+ * s->cur == s->end).  If the allocation fails, S keeps the current
+ * buffer, and stops trying to grow.
+ */
+static void
+grow_buf(stream_t *s)
+{
+  char *nbuf;
+  size_t nsize;
+
+  xassert(!s->dirty, "attempt to grow a dirty buffer");
+
+  s->seqfills = 0;
+  if (s->size >= STREAM_BUFSIZ_MAX)
+    return;
+
+  nsize = s->size * 2;
+  if (nsize > STREAM_BUFSIZ_MAX)
+    nsize = STREAM_BUFSIZ_MAX;
+
+  nbuf = alloc_buf(nsize, s->align);
+  if (!nbuf) {
+    s->adaptive = 0;
+    return;
+  }
+  free(s->buf);
+  s->buf = s->cur = s->end = nbuf;
+  s->size = nsize;
+}
+
+
+/*
+ * Copy N bytes from SRC to the line buffer at the offset LEN, growing
+ * the line buffer if needed.
+ */
+static int
+lbuf_append(stream_t *s, size_t len, const char *src, size_t n)
+{
+  size_t nsize;
+  char *p;
+
+  if (len + n > s->lsize) {
+    nsize = s->lsize ? s->lsize : s->size;
+    while (nsize < len + n)
+      nsize *= 2;
+    p = realloc(s->lbuf, nsize);
+    if (!p) {
+      stream_errno = errno;
+      return -1;
+    }
+    s->lbuf = p;
+    s->lsize = nsize;
+  }
+  memcpy(s->lbuf + len, src, n);
+  return 0;
+}
+
+
 #ifdef TEST_STREAM
+#include <sys/time.h>
+#include <sys/wait.h>
+
+static unsigned long nreads;
 
 static int
 posix_open(const char *pathname, int flags, void *data)
@@ -338,6 +695,7 @@ posix_close(int fd, void *data)
 static ssize_t
 posix_read(int fd, void *buf, size_t count, void *data)
 {
+  nreads++;
   return read(fd, buf, count);
 }
 
@@ -362,12 +720,205 @@ struct stream_ops posix_ops = {
   posix_lseek
 };
 
+/*
+ * Benchmark of the buffer sizing: "fixed" uses STREAM_BUFSIZ as the
+ * previous s_open() did, "adaptive" uses the buffer chosen by s_open().
+ *
+ *   $ ./stream -b [MEGABYTES]
+ */
+static int
+fd_open(const char *pathname, int flags, void *data)
+{
+  return *(int *)data;
+}
+
+struct stream_ops fd_ops = {
+  fd_open,
+  0,
+  posix_close,
+  posix_read,
+  posix_write,
+  posix_lseek
+};
+
+static void
+fill_fd(int fd, size_t total)
+{
+  static char block[65536];
+  size_t n;
+
+  memset(block, 'x', sizeof(block));
+  while (total > 0) {
+    n = total < sizeof(block) ? total : sizeof(block);
+    if (write(fd, block, n) != (ssize_t)n)
+      break;
+    total -= n;
+  }
+}
+
+static void
+bench_read(const char *name, const char *pathname,
+           const struct stream_ops *ops, int fd, int fixed)
+{
+  struct timeval beg, end;
+  unsigned long nbytes = 0;
+  stream_t *s;
+  double sec;
+
+  nreads = 0;
+  stream_bufsize = fixed ? STREAM_BUFSIZ : 0;
+  gettimeofday(&beg, 0);
+  s = s_open(ops, pathname, "r", &fd);
+  if (!s) {
+    fprintf(stderr, "error: cannot open a stream for %s\n", name);
+    return;
+  }
+
+  while (s_getc(s) != EOF)
+    nbytes++;
+  gettimeofday(&end, 0);
+
+  sec = (end.tv_sec - beg.tv_sec) + (end.tv_usec - beg.tv_usec) / 1e6;
+  printf("%-8s %-8s %10lu bytes %8lu reads %9.1f MB/s\n",
+         name, fixed ? "fixed" : "adaptive", nbytes, nreads,
+         nbytes / sec / (1024 * 1024));
+  s_close(s);
+}
+
+static void
+bench_ipc(const char *name, int is_socket, size_t total, int fixed)
+{
+  int fd[2];
+  pid_t pid;
+
+  if (is_socket ? socketpair(AF_LOCAL, SOCK_STREAM, 0, fd) : pipe(fd)) {
+    fprintf(stderr, "error: cannot create %s\n", name);
+    return;
+  }
+  pid = fork();
+  if (pid == 0) {
+    close(fd[0]);
+    fill_fd(fd[1], total);
+    _exit(0);
+  }
+  close(fd[1]);
+  bench_read(name, 0, &fd_ops, fd[0], fixed);
+  waitpid(pid, 0, 0);
+}
+
+static void
+fill_lines(int fd, size_t total)
+{
+  static char block[65536];
+  size_t i, n;
+
+  for (i = 0; i < sizeof(block); i++)
+    block[i] = (i % 97 == 96) ? '\n' : 'a' + i % 26;
+  while (total > 0) {
+    n = total < sizeof(block) ? total : sizeof(block);
+    if (write(fd, block, n) != (ssize_t)n)
+      break;
+    total -= n;
+  }
+}
+
+/*
+ * Line scanning throughput; METHOD 0 uses s_getc(), 1 uses s_gets(),
+ * and 2 uses s_getline().
+ */
+static void
+bench_lines(const char *pathname, int method)
+{
+  static const char *names[] = { "s_getc", "s_gets", "s_getline" };
+  struct timeval beg, end;
+  unsigned long nbytes = 0, nlines = 0;
+  char line[1024];
+  const char *lp;
+  ssize_t len;
+  stream_t *s;
+  double sec;
+  int ch;
+
+  stream_bufsize = 0;
+  gettimeofday(&beg, 0);
+  s = s_open(&posix_ops, pathname, "r", 0);
+  if (!s) {
+    fprintf(stderr, "error: cannot open a stream for %s\n", pathname);
+    return;
+  }
+  switch (method) {
+  case 0:
+    while ((ch = s_getc(s)) != EOF) {
+      nbytes++;
+      if (ch == '\n')
+        nlines++;
+    }
+    break;
+  case 1:
+    while (s_gets(s, line, sizeof(line))) {
+      nbytes += strlen(line);
+      nlines++;
+    }
+    break;
+  default:
+    while ((len = s_getline(s, &lp)) >= 0) {
+      nbytes += len;
+      nlines++;
+    }
+    break;
+  }
+  gettimeofday(&end, 0);
+
+  sec = (end.tv_sec - beg.tv_sec) + (end.tv_usec - beg.tv_usec) / 1e6;
+  printf("%-10s %10lu bytes %8lu lines %7.2f GB/s\n",
+         names[method], nbytes, nlines,
+         nbytes / sec / (1024 * 1024 * 1024));
+  s_close(s);
+}
+
+static int
+bench(int argc, char *argv[])
+{
+  char tmpfile[] = "/tmp/streamXXXXXX";
+  size_t total = 64;
+  int fd, fixed;
+
+  if (argc > 0)
+    total = atoi(argv[0]);
+  total *= 1024 * 1024;
+
+  fd = mkstemp(tmpfile);
+  if (fd == -1) {
+    fprintf(stderr, "error: mkstemp failed: %s\n", strerror(errno));
+    return 1;
+  }
+  fill_fd(fd, total);
+  close(fd);
+
+  for (fixed = 1; fixed >= 0; fixed--) {
+    bench_read("file", tmpfile, &posix_ops, -1, fixed);
+    bench_ipc("pipe", 0, total, fixed);
+    bench_ipc("socket", 1, total, fixed);
+  }
+
+  fd = open(tmpfile, O_WRONLY | O_TRUNC);
+  fill_lines(fd, total);
+  close(fd);
+  for (fixed = 0; fixed < 3; fixed++)
+    bench_lines(tmpfile, fixed);
+
+  unlink(tmpfile);
+  return 0;
+}
+
 int
 main(int argc, char *argv[])
 {
   stream_t *s_r, *s_w;
   int ch;
 
+  if (argc > 1 && strcmp(argv[1], "-b") == 0)
+    return bench(argc - 2, argv + 2);
 
   s_r = s_open(&posix_ops, argv[1], "r", 0);
   if (!s_r) {
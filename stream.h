@@ -105,6 +105,14 @@ typedef struct stream_ stream_t;
 
 extern int stream_errno;
 
+/*
+ * If nonzero, s_open() allocates a buffer of this size, instead of
+ * deriving the size from the underlying file descriptor.  The buffer
+ * chosen by s_open() grows under sustained sequential access only
+ * if this is zero.
+ */
+extern size_t stream_bufsize;
+
 extern stream_t *s_open(const struct stream_ops *ops,
                         const char *pathname, const char *mode,
                         void *data);
@@ -112,10 +120,20 @@ extern int s_close(stream_t *s);
 
 extern int s_setvbuf(stream_t *s, char *buf, int mode, size_t size);
 
+/*
+ * Like feof(3) and ferror(3): nonzero if all of S was read, or if a
+ * read from S failed.  A function that returns EOF or -1 may have
+ * failed for either; check these to tell which.
+ */
+extern int s_eof(stream_t *s);
+extern int s_error(stream_t *s);
+
 extern off_t s_seek(stream_t *s, off_t offset, int whence);
 extern int s_getc(stream_t *s);
 extern int s_ungetc(stream_t *s, int c);
 extern char *s_gets(stream_t *s, char *str, int size);
+extern ssize_t s_getdelim(stream_t *s, const char **linep, int delim);
+extern ssize_t s_getline(stream_t *s, const char **linep);
 extern int s_putc(stream_t *s, int ch);
 extern int s_puts(stream_t *s, const char *str);
 extern size_t s_read(stream_t *s, void *ptr, size_t size, size_t nmemb);
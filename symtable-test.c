@@ -0,0 +1,645 @@
+/*
+ * Test and benchmark of the symtable engines
+ *
+ *   $ cc -O2 -I. -DLEGACY -D_GNU_SOURCE -o symtable-test symtable-test.c \
+ *       symtable.c rbsync.c obsutil.c -lpthread
+ *   $ ./symtable-test [NSYMS...]
+ *
+ * The test runs the same random register/unregister/enter/leave/lookup
+ * sequence on a chained table, on an open addressing table
+ * (SYMTABLE_OPT_OPENADDR), and on a plain array model, and compares
+ * every lookup.  The values of the outer frames are checked after the
+ * inner frames were left, which catches a value that was released
+ * with the wrong frame.  Both tables are published every 61 steps.
+ * Every 20th snapshot is compared with its table on every name, and
+ * again 20 publishes later, when it must not have changed.
+ *
+ * The snapshot test runs reader threads that sum 1000 accounts in a
+ * snapshot while a writer moves money between them, and publishes
+ * every few transfers.  A reader that sees a half-published state
+ * gets a wrong sum.  The same is measured with a rwlock around the
+ * table.
+ *
+ * The benchmark registers NSYMS symbols (10k, 1M and 10M by default),
+ * then looks up every one of them in random order, and as many names
+ * that are not there.  The chained table is measured with 65536
+ * buckets, and with as many buckets as symbols, which is the best it
+ * can do, since it never grows.
+ *
+ * Before that, it measures a frame of 1000 symbols with 40-byte values
+ * that is entered, filled, updated and left over and over, and
+ * compares symtable_string_substitute() with a compiled template.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <sys/time.h>
+#include "symtable.h"
+
+static double
+now(void)
+{
+  struct timeval tv;
+  gettimeofday(&tv, 0);
+  return tv.tv_sec + tv.tv_usec / 1e6;
+}
+
+static unsigned long
+xorshift(unsigned long *x)
+{
+  *x ^= *x << 13;
+  *x ^= *x >> 7;
+  *x ^= *x << 17;
+  return *x;
+}
+
+static int
+same(const char *v1, size_t s1, const char *v2, size_t s2)
+{
+  if (!v1 || !v2)
+    return v1 == v2;
+  return s1 == s2 && memcmp(v1, v2, s1) == 0;
+}
+
+#define NNAMES          500
+#define NFRAMES         16
+
+/* model[frame][name]; -1 if not defined, else the length of the value */
+static int model_len[NFRAMES][NNAMES];
+static char model_val[NFRAMES][NNAMES][48];
+
+static const char *
+model_lookup(int depth, int name, unsigned flags, size_t *size)
+{
+  int f;
+
+  for (f = depth; f >= 0; f--) {
+    if (model_len[f][name] < 0)
+      continue;
+    if ((flags & SYMTABLE_OPT_CFRAME) && f != depth)
+      return NULL;
+    if ((flags & SYMTABLE_OPT_FRAME) &&
+        f != (int)(flags & SYMTABLE_OPT_FRAME_MASK))
+      continue;
+    *size = model_len[f][name];
+    return (model_len[f][name] > 0) ? model_val[f][name] : NULL;
+  }
+  return NULL;
+}
+
+static int
+model_register(int depth, int frame, int name, const char *value, int len)
+{
+  if (frame < 0)
+    frame = depth;
+  if (frame > depth || (frame != depth && model_len[frame][name] < 0))
+    return -1;
+  model_len[frame][name] = len;
+  memcpy(model_val[frame][name], value, len);
+  return 0;
+}
+
+/* what the snapshot of each table had when it was pinned */
+static int snap_len[2][NNAMES];
+static char snap_val[2][NNAMES][48];
+
+/* Check that SP still has what it had when it was pinned. */
+static int
+check_snapshot_values(symtable_snapshot_t *sp, int t)
+{
+  const char *v;
+  size_t size = 0;
+  char name[32];
+  int id;
+
+  for (id = 0; sp && id < NNAMES; id++) {
+    snprintf(name, sizeof(name), "v%d", id);
+    v = symtable_snapshot_lookup(sp, name, &size);
+    if (!same(v, size, (snap_len[t][id] > 0) ? snap_val[t][id] : NULL,
+              snap_len[t][id]))
+      return -1;
+  }
+  return 0;
+}
+
+/*
+ * Check *PINNED, then publish ST, pin the new snapshot, and compare it
+ * with ST.
+ */
+static int
+check_snapshot(symtable_t *st, symtable_snapshot_t **pinned, int t)
+{
+  symtable_snapshot_t *sp = *pinned;
+  const char *v, *vs;
+  size_t size = 0, ssize = 0;
+  char name[32];
+  int id;
+
+  if (check_snapshot_values(sp, t) < 0)
+    return -1;
+  if (symtable_publish(st) < 0)
+    return -1;
+  sp = symtable_snapshot_refresh(st, sp);
+  if (!sp)
+    return -1;
+  *pinned = sp;
+
+  for (id = 0; id < NNAMES; id++) {
+    snprintf(name, sizeof(name), "v%d", id);
+    v = symtable_lookup(st, name, &size, 0);
+    vs = symtable_snapshot_lookup(sp, name, &ssize);
+    if (!same(v, size, vs, ssize))
+      return -1;
+    snap_len[t][id] = (v) ? (int)size : -1;
+    if (v)
+      memcpy(snap_val[t][id], v, size);
+  }
+  return 0;
+}
+
+static int
+test(void)
+{
+  symtable_t *a, *b;
+  unsigned long x = 42, r;
+  char name[32], value[64];
+  const char *va, *vb, *vm;
+  size_t sa = 0, sb = 0, sm = 0;
+  symtable_snapshot_t *spa = NULL, *spb = NULL;
+  unsigned flags;
+  int i, ra, rb, rm, len, depth = 0, id, frame;
+
+  a = symtable_new(7, NFRAMES, 0);
+  b = symtable_new(0, NFRAMES, SYMTABLE_OPT_OPENADDR);
+  memset(model_len, -1, sizeof(model_len));
+
+  for (i = 0; i < 2000000; i++) {
+    r = xorshift(&x);
+    id = (r >> 8) % NNAMES;
+    snprintf(name, sizeof(name), "v%d", id);
+
+    switch (r % 16) {
+    case 0:
+      if (depth < NFRAMES - 2) {
+        ra = symtable_enter(a, NULL);
+        rb = symtable_enter(b, NULL);
+        if (ra != ++depth || rb != depth)
+          return -1;
+      }
+      break;
+    case 1:
+      if (depth > 0) {
+        memset(model_len[depth], -1, sizeof(model_len[depth]));
+        ra = symtable_leave(a);
+        rb = symtable_leave(b);
+        if (ra != --depth || rb != depth)
+          return -1;
+      }
+      break;
+    case 2:
+    case 3:
+      rm = (model_len[depth][id] >= 0) ? 0 : -1;
+      model_len[depth][id] = -1;
+      ra = symtable_unregister(a, name);
+      rb = symtable_unregister(b, name);
+      if (ra != rm || rb != rm)
+        return -1;
+      break;
+    case 4:
+    case 5:
+    case 6:
+    case 7:
+      /* short and long values, and an empty one */
+      len = (r >> 24) % 48;
+      memset(value, 'a' + i % 26, len);
+      value[len] = '\0';
+      frame = (r & (1UL << 40)) ? (int)((r >> 32) % 4) : -1;
+      if (len == 47) {
+        rm = model_register(depth, frame, id, value, 0);
+        ra = symtable_register_frame(a, frame, name, 0, 0);
+        rb = symtable_register_frame(b, frame, name, 0, 0);
+      }
+      else {
+        rm = model_register(depth, frame, id, value, len + 1);
+        ra = symtable_register_frame(a, frame, name, value, -1);
+        rb = symtable_register_frame(b, frame, name, value, -1);
+      }
+      if (ra != rm || rb != rm)
+        return -1;
+      break;
+    default:
+      if (r & (1UL << 40))
+        flags = 0;
+      else if (r & (1UL << 41))
+        flags = SYMTABLE_OPT_CFRAME;
+      else
+        flags = SYMTABLE_OPT_FRAME + (r >> 32) % 4;
+      vm = model_lookup(depth, id, flags, &sm);
+      va = symtable_lookup(a, name, &sa, flags);
+      vb = symtable_lookup(b, name, &sb, flags);
+      if (!same(va, sa, vm, sm) || !same(vb, sb, vm, sm))
+        return -1;
+      break;
+    }
+
+    if (i % 61 == 0 && (symtable_publish(a) < 0 || symtable_publish(b) < 0))
+      return -1;
+    if (i % 1220 == 0 &&
+        (check_snapshot(a, &spa, 0) < 0 || check_snapshot(b, &spb, 1) < 0))
+      return -1;
+  }
+
+  symtable_delete(a);
+  symtable_delete(b);
+  /* The snapshots outlive their tables. */
+  if (check_snapshot_values(spa, 0) < 0 || check_snapshot_values(spb, 1) < 0)
+    return -1;
+  symtable_snapshot_unpin(spa);
+  symtable_snapshot_unpin(spb);
+  return 0;
+}
+
+/*
+ * Render random templates compiled up front while the symbols change,
+ * and compare them with symtable_string_substitute().  The values of
+ * vN only refer to vM with M > N, since symtable_string_substitute()
+ * does not stop on a cycle.
+ */
+static int
+test_template(unsigned flags)
+{
+  static const char *pieces[] = {
+    "ab", "\\", "$", "}", "x y", "${v0}", "${v3}", "${v7}", "${v12}",
+    "${v19}", "${nope}", "\\${v2}",
+  };
+  static char text[64][256];
+  symtable_template_t *tp[64];
+  char value[64], name[16], buf[512], small[8];
+  unsigned long x = 99, r;
+  symtable_t *st;
+  size_t n;
+  char *s;
+  int i, j, k;
+
+  st = symtable_new(16, 8, flags);
+
+  for (i = 0; i < 64; i++) {
+    text[i][0] = '\0';
+    for (j = xorshift(&x) % 8; j >= 0; j--)
+      strcat(text[i], pieces[xorshift(&x) % (sizeof(pieces) /
+                                             sizeof(pieces[0]))]);
+    tp[i] = symtable_template_compile(st, text[i]);
+    if (!tp[i])
+      return -1;
+  }
+  if (symtable_template_compile(st, "a${b") ||
+      symtable_template_compile(st, "a${b${c}}"))
+    return -1;
+
+  for (i = 0; i < 200000; i++) {
+    r = xorshift(&x);
+    k = r % 20;
+    snprintf(name, sizeof(name), "v%d", k);
+    switch ((r >> 8) % 8) {
+    case 0:
+      if (symtable_current_frame(st) < 6)
+        symtable_enter(st, NULL);
+      break;
+    case 1:
+      if (symtable_current_frame(st) > 0)
+        symtable_leave(st);
+      break;
+    case 2:
+      symtable_unregister(st, name);
+      break;
+    default:
+      if (k < 19 && (r & (1UL << 20)))
+        snprintf(value, sizeof(value), "<%d ${v%lu} %lu>", k,
+                 k + 1 + (r >> 24) % (19 - k), r % 1000);
+      else
+        snprintf(value, sizeof(value), "[%d %lu]", k, (r >> 24) % 1000);
+      symtable_register(st, name, value, -1);
+      break;
+    }
+
+    j = (r >> 32) % 64;
+    s = symtable_string_substitute(st, text[j]);
+    n = symtable_template_render(tp[j], buf, sizeof(buf));
+    if (!s || n != strlen(s) || strcmp(s, buf) != 0)
+      return -1;
+    symtable_template_render(tp[j], small, sizeof(small));
+    if (strncmp(s, small, sizeof(small) - 1) != 0 ||
+        strlen(small) != ((n < sizeof(small)) ? n : sizeof(small) - 1))
+      return -1;
+    free(s);
+  }
+
+  for (i = 0; i < 64; i++)
+    symtable_template_free(tp[i]);
+  symtable_delete(st);
+  return 0;
+}
+
+static void
+bench(const char *label, char **names, long n, size_t table_size,
+      unsigned flags)
+{
+  symtable_t *st;
+  unsigned long x = 7;
+  char miss[64], value[32];
+  double t0, t1, t2, t3;
+  long i, found = 0;
+
+  st = symtable_new(table_size, 4, flags);
+
+  t0 = now();
+  for (i = 0; i < n; i++) {
+    snprintf(value, sizeof(value), "%ld", i);
+    symtable_register(st, names[i], value, -1);
+  }
+  t1 = now();
+  for (i = 0; i < n; i++)
+    found += symtable_lookup(st, names[xorshift(&x) % n], NULL, 0) != NULL;
+  t2 = now();
+  for (i = 0; i < n; i++) {
+    snprintf(miss, sizeof(miss), "%s.x", names[xorshift(&x) % n]);
+    found += symtable_lookup(st, miss, NULL, 0) != NULL;
+  }
+  t3 = now();
+
+  if (found != n)
+    fprintf(stderr, "symtable-test: %s: found %ld of %ld\n", label, found, n);
+
+  printf("%9ld  %-16s register %7.1f ns  hit %7.1f ns  miss %7.1f ns\n",
+         n, label, (t1 - t0) * 1e9 / n, (t2 - t1) * 1e9 / n,
+         (t3 - t2) * 1e9 / n);
+  symtable_delete(st);
+}
+
+static void
+bench_frames(unsigned flags)
+{
+  symtable_t *st;
+  char name[32], value[41];
+  double t0, t1, leave = 0;
+  int i, j, n = 20000;
+
+  st = symtable_new(4096, 4, flags);
+  memset(value, 'v', 40);
+  value[40] = '\0';
+
+  t0 = now();
+  for (i = 0; i < n; i++) {
+    symtable_enter(st, NULL);
+    for (j = 0; j < 1000; j++) {
+      snprintf(name, sizeof(name), "local%d", j);
+      symtable_register(st, name, value, -1);
+      if (j % 4 == 0)
+        symtable_register(st, name, value, -1);
+    }
+    t1 = now();
+    symtable_leave(st);
+    leave += now() - t1;
+  }
+  printf("frame of 1000 symbols (%-8s): %6.1f us, leave %6.1f us\n",
+         (flags & SYMTABLE_OPT_OPENADDR) ? "openaddr" : "chained",
+         (now() - t0) * 1e6 / n, leave * 1e6 / n);
+  symtable_delete(st);
+}
+
+static void
+bench_template(unsigned flags)
+{
+  static const char *text =
+    "https://${host}:${port}/${prefix}/users/${user}?session=${session}"
+    "&lang=${lang}";
+  symtable_template_t *tp;
+  symtable_t *st;
+  char name[32], buf[256], *s;
+  double t0, t1, t2;
+  long i, n = 1000000;
+
+  st = symtable_new(65536, 4, flags);
+  for (i = 0; i < 100000; i++) {
+    snprintf(name, sizeof(name), "other%ld", i);
+    symtable_register(st, name, "x", -1);
+  }
+  symtable_register(st, "host", "example.com", -1);
+  symtable_register(st, "port", "8443", -1);
+  symtable_register(st, "prefix", "api/v2", -1);
+  symtable_register(st, "user", "cinsk", -1);
+  symtable_register(st, "lang", "ko", -1);
+  tp = symtable_template_compile(st, text);
+
+  /* Every round changes ${session}; the time of that is subtracted. */
+  t0 = now();
+  for (i = 0; i < n; i++) {
+    snprintf(name, sizeof(name), "%ld", i);
+    symtable_register(st, "session", name, -1);
+  }
+  t1 = now();
+  for (i = 0; i < n; i++) {
+    snprintf(name, sizeof(name), "%ld", i);
+    symtable_register(st, "session", name, -1);
+    s = symtable_string_substitute(st, text);
+    free(s);
+  }
+  t2 = now();
+  for (i = 0; i < n; i++) {
+    snprintf(name, sizeof(name), "%ld", i);
+    symtable_register(st, "session", name, -1);
+    symtable_template_render(tp, buf, sizeof(buf));
+  }
+  printf("template (%-8s): substitute %6.1f ns, render %6.1f ns\n",
+         (flags & SYMTABLE_OPT_OPENADDR) ? "openaddr" : "chained",
+         ((t2 - t1) - (t1 - t0)) * 1e9 / n,
+         ((now() - t2) - (t1 - t0)) * 1e9 / n);
+
+  symtable_template_free(tp);
+  symtable_delete(st);
+}
+
+#define NACCOUNTS       1000
+
+static symtable_t *bank;
+static pthread_rwlock_t bank_lock;
+static char accounts[NACCOUNTS][16];
+static int use_rwlock;
+static volatile int stop, broken;
+
+static void *
+bank_reader(void *arg)
+{
+  symtable_snapshot_t *sp = NULL;
+  const char *v;
+  long sum, n = 0;
+  int i;
+
+  (void)arg;
+  while (!stop) {
+    if (use_rwlock)
+      pthread_rwlock_rdlock(&bank_lock);
+    else
+      sp = symtable_snapshot_refresh(bank, sp);
+
+    for (sum = 0, i = 0; i < NACCOUNTS; i++) {
+      v = (use_rwlock) ? symtable_lookup(bank, accounts[i], NULL, 0)
+        : symtable_snapshot_lookup(sp, accounts[i], NULL);
+      sum += atol(v);
+    }
+    if (sum != NACCOUNTS * 100L)
+      broken = 1;
+
+    if (use_rwlock)
+      pthread_rwlock_unlock(&bank_lock);
+    n += NACCOUNTS;
+  }
+  symtable_snapshot_unpin(sp);
+  return (void *)n;
+}
+
+/* Move random amounts between the accounts, in nested frames. */
+static long
+bank_writer(double seconds)
+{
+  unsigned long x = 1234567, r;
+  char value[32];
+  long a, b, n = 0;
+  double end = now() + seconds;
+  int i, depth = 0;
+
+  while (now() < end) {
+    if (use_rwlock)
+      pthread_rwlock_wrlock(&bank_lock);
+    for (i = 0; i < 10; i++) {
+      r = xorshift(&x);
+      if (r % 64 == 0 && depth < 4)
+        depth = symtable_enter(bank, NULL);
+      else if (r % 64 == 1 && depth > 0)
+        depth = symtable_leave(bank);
+
+      a = atol(symtable_lookup(bank, accounts[(r >> 8) % NACCOUNTS], 0, 0));
+      b = atol(symtable_lookup(bank, accounts[(r >> 24) % NACCOUNTS], 0, 0));
+      if ((r >> 8) % NACCOUNTS == (r >> 24) % NACCOUNTS)
+        continue;
+      snprintf(value, sizeof(value), "%ld", a - 7);
+      symtable_register(bank, accounts[(r >> 8) % NACCOUNTS], value, -1);
+      snprintf(value, sizeof(value), "%ld", b + 7);
+      symtable_register(bank, accounts[(r >> 24) % NACCOUNTS], value, -1);
+    }
+    if (use_rwlock)
+      pthread_rwlock_unlock(&bank_lock);
+    else
+      symtable_publish(bank);
+    n++;
+    /* Let the readers run on a single CPU. */
+    usleep(100);
+  }
+  return n;
+}
+
+static int
+test_snapshot(unsigned flags, int nreaders)
+{
+  pthread_rwlockattr_t attr;
+  pthread_t tid[16];
+  long reads = 0, writes;
+  double seconds = 0.5;
+  void *ret;
+  int i;
+
+  /* glibc prefers the readers by default, which starves the writer. */
+  pthread_rwlockattr_init(&attr);
+  pthread_rwlockattr_setkind_np(&attr,
+                                PTHREAD_RWLOCK_PREFER_WRITER_NONRECURSIVE_NP);
+  pthread_rwlock_init(&bank_lock, &attr);
+
+  bank = symtable_new(4096, 8, flags);
+  for (i = 0; i < NACCOUNTS; i++) {
+    snprintf(accounts[i], sizeof(accounts[i]), "account%d", i);
+    symtable_register(bank, accounts[i], "100", -1);
+  }
+  symtable_publish(bank);
+
+  stop = broken = 0;
+  for (i = 0; i < nreaders; i++)
+    pthread_create(&tid[i], 0, bank_reader, 0);
+  writes = bank_writer(seconds);
+  stop = 1;
+  for (i = 0; i < nreaders; i++) {
+    pthread_join(tid[i], &ret);
+    reads += (long)ret;
+  }
+
+  printf("%-8s (%-8s) %2d readers: %7.2f M lookups/s, %6.0f publishes/s\n",
+         (use_rwlock) ? "rwlock" : "snapshot",
+         (flags & SYMTABLE_OPT_OPENADDR) ? "openaddr" : "chained", nreaders,
+         reads / seconds / 1e6, writes / seconds);
+  symtable_delete(bank);
+  pthread_rwlock_destroy(&bank_lock);
+  return (broken) ? -1 : 0;
+}
+
+int
+main(int argc, char *argv[])
+{
+  static const long defaults[] = { 10000, 1000000, 10000000 };
+  long sizes[16], n, i;
+  int nsizes, k;
+  char **names, buf[64];
+
+  if (test() < 0) {
+    fprintf(stderr, "symtable-test: test failed\n");
+    return 1;
+  }
+  printf("symtable-test: test passed\n");
+
+  if (test_template(0) < 0 || test_template(SYMTABLE_OPT_OPENADDR) < 0) {
+    fprintf(stderr, "symtable-test: template test failed\n");
+    return 1;
+  }
+  printf("symtable-test: template test passed\n");
+
+  for (k = 1; k <= 4; k *= 2) {
+    for (use_rwlock = 1; use_rwlock >= 0; use_rwlock--) {
+      if (test_snapshot(0, k) < 0 ||
+          test_snapshot(SYMTABLE_OPT_OPENADDR, k) < 0) {
+        fprintf(stderr, "symtable-test: snapshot test failed\n");
+        return 1;
+      }
+    }
+  }
+
+  bench_frames(0);
+  bench_frames(SYMTABLE_OPT_OPENADDR);
+  bench_template(0);
+  bench_template(SYMTABLE_OPT_OPENADDR);
+
+  for (nsizes = 0; nsizes + 1 < argc && nsizes < 16; nsizes++)
+    sizes[nsizes] = atol(argv[nsizes + 1]);
+  if (nsizes == 0) {
+    memcpy(sizes, defaults, sizeof(defaults));
+    nsizes = 3;
+  }
+
+  for (k = 0; k < nsizes; k++) {
+    n = sizes[k];
+    names = malloc(sizeof(*names) * n);
+    for (i = 0; i < n; i++) {
+      snprintf(buf, sizeof(buf), "server.section%ld.key%ld", i % 1000, i);
+      names[i] = strdup(buf);
+    }
+
+    if (n <= 1000000)
+      bench("chained/65536", names, n, 65536, 0);
+    bench("chained/NSYMS", names, n, n, 0);
+    bench("openaddr", names, n, 0, SYMTABLE_OPT_OPENADDR);
+
+    for (i = 0; i < n; i++)
+      free(names[i]);
+    free(names);
+  }
+  return 0;
+}
@@ -1,10 +1,17 @@
 
 #include <assert.h>
+#include <errno.h>
 #include <stddef.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
 #include "symtable.h"
+#include "rbsync.h"
 
 struct symtable_ {
   unsigned flags;               /* options */
@@ -17,20 +24,53 @@ struct symtable_ {
   struct snode **table;         /* bucket table */
   size_t size_table;            /* size of TABLE */
 
+  /* The open addressing table, if SYMTABLE_OPT_OPENADDR.  Each slot
+   * holds the innermost node of a name; the nodes of the same name in
+   * the outer frames follow it through their NEXT. */
+  struct snode **slots;         /* struct snode *array[capacity] */
+  signed char *ctrl;            /* control byte of each slot */
+  size_t capacity;              /* number of slots; a power of two */
+  size_t nnames;                /* number of full slots */
+  size_t growth_left;           /* empty slots to fill before rehashing */
+
   symtable_free_t free_func;    /* user-provided free function */
 
   struct obstack _pool;
-  struct obstack *pool;
+  struct obstack *pool;         /* FRAME, TABLE, and scratch space for
+                                   the substitution */
+  int npools;                   /* FRAME[0..NPOOLS-1].pool are initialized */
+  void *chunks;                 /* chunks released by the frame pools */
+
+  unsigned long generation;     /* changed whenever a name may resolve to
+                                   another node; see symtable_template_t */
+
+  /* Snapshots for the reader threads; see symtable_publish(). */
+  struct symtable_snapshot_ *snap; /* the last published snapshot */
+  unsigned long version;        /* version of SNAP */
+  struct obstack _snaplog;
+  struct obstack *snaplog;      /* names changed since SNAP, or NULL
+                                   before the first symtable_publish() */
+  void *snaplog_base;           /* first object in SNAPLOG */
+  struct snaplog *dirty;        /* list of the changed names */
+  size_t ndirty;                /* length of DIRTY */
+  int snap_full;                /* if nonzero, DIRTY is incomplete */
 };
 
 struct sframe {
-  void *base;                   /* dummy for recording the current
-                                   point in the symtable_t::pool */
+  struct obstack pool;          /* nodes, names and values of this frame */
+  void *base;                   /* dummy for recording the first
+                                   object in POOL */
   const char *name;             /* name of the current frame (optional?) */
   struct snode *link;           /* list of all (key, value) pair for
                                    the current frame */
 };
 
+/* Size of the chunks of the frame pools */
+#define FRAME_CHUNK_SIZE        (16384 - 32)
+
+/* Values up to this size are stored in the node itself. */
+#define SNODE_INLINE_MAX        16
+
 struct snode {
   const char *name;             /* name of the key */
 
@@ -45,7 +85,21 @@ struct snode {
   size_t size_val;              /* size of the VAL */
 
   void *val;                    /* value of (key, value) pair.
-                                 * This points the malloc-ed memory area */
+                                 * This points BLK, or INL for small
+                                 * values */
+
+  void *blk;                    /* last value block in the FRAME pool */
+  size_t size_blk;              /* size of BLK */
+
+  size_t len_str;               /* strnlen(VAL, SIZE_VAL) */
+  int has_ref;                  /* nonzero if VAL may have "${" */
+
+  unsigned long hash;           /* hash of NAME; open addressing only */
+
+  union {
+    char buf[SNODE_INLINE_MAX];
+    void *align_;
+  } inl;
 };
 
 /*
@@ -60,8 +114,19 @@ struct snode {
  * member of struct snode is not allcated in symtable_t::pool.
  * Instead it is dynamically allocated using malloc() and realloc().
  *
- * Note that this bug fix may cause symtable module little bit slower.
- * I'll deal with it later -- cinsk
+ * Now each frame has its own obstack, and a node, its name and its
+ * value are allocated in the pool of the frame that the node belongs
+ * to, even if it is set while an inner frame is active.  So a value
+ * lives exactly as long as its frame, and symtable_leave() releases
+ * the whole frame at once instead of free()ing every value.
+ *
+ * symtable_register() in an inner frame never touches the node of an
+ * outer frame; it makes a new node that shadows the outer one.  A
+ * value that is replaced in the same frame reuses its block if the
+ * new value fits; otherwise the old block is abandoned until the
+ * frame is left.  The new block is twice as large as the old one, so
+ * a symbol that is set over and over wastes at most as much as its
+ * largest value.
  */
 #define symtable_hash(s)        symtable_hash_from_gcc(s)
 
@@ -69,12 +134,363 @@ static unsigned long symtable_hash_from_glib(const char *s);
 static unsigned int symtable_hash_from_gcc(const char *str);
 static struct snode *symtable_lookup_node(symtable_t *st,
                                           const char *key, unsigned flags);
+static unsigned long symtable_hash_mum(const char *s, size_t len);
+static void snap_touch(symtable_t *st, const char *name);
+static void snapshot_unref(void *arg);
+
+
+#if !defined(FAKEOBJS) && !defined(TCOBJS)
+/*
+ * A frame that is entered and left over and over would give its
+ * chunks back to malloc() and get them again every time, and glibc
+ * returns the top of the heap to the kernel in between.  So the
+ * chunks of the usual size are kept in the table for the next frame
+ * until symtable_delete().
+ */
+static void *
+frame_chunk_alloc(void *arg, long size)
+{
+  symtable_t *st = arg;
+  void *p = st->chunks;
+
+  if (size == FRAME_CHUNK_SIZE && p) {
+    st->chunks = *(void **)p;
+    return p;
+  }
+  return malloc(size);
+}
+
+
+static void
+frame_chunk_free(void *arg, void *chunk)
+{
+  symtable_t *st = arg;
+  struct _obstack_chunk *c = chunk;
+
+  if (c->limit - (char *)c == FRAME_CHUNK_SIZE) {
+    *(void **)c = st->chunks;
+    st->chunks = c;
+  }
+  else
+    free(c);
+}
+#endif  /* !FAKEOBJS && !TCOBJS */
+
+
+static int
+frame_pool_init(symtable_t *st, struct obstack *pool)
+{
+#if defined(FAKEOBJS) || defined(TCOBJS)
+  /* tcobs keeps the chunks in the thread by itself. */
+  return OBSTACK_INIT(pool);
+#else
+  OBS_ERROR_CLEAR;
+  obstack_specify_allocation_with_arg(pool, FRAME_CHUNK_SIZE, 0,
+                                      frame_chunk_alloc, frame_chunk_free,
+                                      st);
+  return (OBS_ERROR) ? -1 : 0;
+#endif
+}
+
+
+/*
+ * Small values are kept in the node itself, which saves a cache miss
+ * for the usual short strings and integers.
+ */
+static void
+snode_clear_value(struct snode *p)
+{
+  /* The block, if any, stays in the frame pool; see above. */
+  p->val = NULL;
+  p->size_val = 0;
+  p->len_str = 0;
+  p->has_ref = 0;
+}
+
+
+/*
+ * Replace the value of P with a copy of DATA.  On failure, P keeps the
+ * old value.
+ */
+static int
+snode_set_value(symtable_t *st, struct snode *p, const void *data,
+                size_t len)
+{
+  size_t cap;
+  void *v;
+
+  snap_touch(st, p->name);
+
+  if (len == 0) {
+    snode_clear_value(p);
+    return 0;
+  }
+
+  if (len <= SNODE_INLINE_MAX)
+    v = p->inl.buf;
+  else if (len <= p->size_blk)
+    v = p->blk;
+  else {
+    cap = (len > p->size_blk * 2) ? len : p->size_blk * 2;
+    v = OBSTACK_ALLOC(&st->frame[p->frame].pool, cap);
+    if (!v)
+      return -1;
+    p->blk = v;
+    p->size_blk = cap;
+  }
+  memmove(v, data, len);
+  p->val = v;
+  p->size_val = len;
+
+  /* for symtable_template_render() */
+  p->len_str = strnlen(v, len);
+  p->has_ref = memchr(v, '$', p->len_str) != NULL;
+  return 0;
+}
+
+
+/*
+ * The open addressing table (SYMTABLE_OPT_OPENADDR) in the manner of
+ * Google's "Swiss table".  Each slot has a control byte that is
+ * EMPTY, DELETED, or the low 7 bits of the hash of the full slot.
+ * The slots are probed a group at a time: one SSE2 compare finds the
+ * slots in a group whose control byte matches, so most failed probes
+ * never touch a node.  The groups are visited in triangular order,
+ * which covers every group since their number is a power of two.
+ *
+ * The table is rehashed when 7/8 of the slots are not EMPTY.
+ */
+#define CTRL_EMPTY      ((signed char)0x80)
+#define CTRL_DELETED    ((signed char)0xFE)
+
+#define H1(hash)        ((hash) >> 7)
+#define H2(hash)        ((signed char)((hash) & 0x7F))
+
+#ifdef __SSE2__
+#define GROUP_WIDTH     16
+#define GROUP_SHIFT     0       /* bit index to slot index */
+
+static __inline__ uint64_t
+group_match(const signed char *g, signed char c)
+{
+  __m128i v = _mm_loadu_si128((const __m128i *)g);
+  return _mm_movemask_epi8(_mm_cmpeq_epi8(v, _mm_set1_epi8(c)));
+}
+
+static __inline__ uint64_t
+group_match_empty(const signed char *g)
+{
+  return group_match(g, CTRL_EMPTY);
+}
+
+static __inline__ uint64_t
+group_match_free(const signed char *g)
+{
+  /* EMPTY or DELETED; only those have the sign bit. */
+  return _mm_movemask_epi8(_mm_loadu_si128((const __m128i *)g));
+}
+#else
+#define GROUP_WIDTH     8
+#define GROUP_SHIFT     3
+
+#define GROUP_LSB       0x0101010101010101ULL
+#define GROUP_MSB       0x8080808080808080ULL
+
+static __inline__ uint64_t
+group_load(const signed char *g)
+{
+  uint64_t v;
+  memcpy(&v, g, sizeof(v));
+  return v;
+}
+
+/* May have false positives, which the caller rejects by the hash. */
+static __inline__ uint64_t
+group_match(const signed char *g, signed char c)
+{
+  uint64_t x = group_load(g) ^ (GROUP_LSB * (unsigned char)c);
+  return (x - GROUP_LSB) & ~x & GROUP_MSB;
+}
+
+static __inline__ uint64_t
+group_match_empty(const signed char *g)
+{
+  /* 0x80 is the only control byte with bit 7 set and bit 6 clear. */
+  uint64_t v = group_load(g);
+  return v & ~(v << 1) & GROUP_MSB;
+}
+
+static __inline__ uint64_t
+group_match_free(const signed char *g)
+{
+  return group_load(g) & GROUP_MSB;
+}
+#endif  /* __SSE2__ */
+
+#define GROUP_FIRST(mask)       (__builtin_ctzll(mask) >> GROUP_SHIFT)
+
+
+/*
+ * Allocate a table of CAPACITY empty slots in ST, and move the names
+ * of the old table there.
+ */
+static int
+open_resize(symtable_t *st, size_t capacity)
+{
+  struct snode **old_slots = st->slots, **slots, *p;
+  signed char *old_ctrl = st->ctrl, *ctrl;
+  size_t old_capacity = st->capacity, mask, i, j, g, step;
+  uint64_t m;
+
+  slots = malloc(capacity * (sizeof(*slots) + 1));
+  if (!slots)
+    return -1;
+  ctrl = (signed char *)(slots + capacity);
+  memset(ctrl, CTRL_EMPTY, capacity);
+
+  mask = capacity / GROUP_WIDTH - 1;
+  for (i = 0; i < old_capacity; i++) {
+    if (old_ctrl[i] < 0)
+      continue;
+    p = old_slots[i];
+    g = H1(p->hash) & mask;
+    for (step = 0; !(m = group_match_free(ctrl + g * GROUP_WIDTH)); )
+      g = (g + ++step) & mask;
+    j = g * GROUP_WIDTH + GROUP_FIRST(m);
+    ctrl[j] = H2(p->hash);
+    slots[j] = p;
+  }
+
+  free(old_slots);
+  st->slots = slots;
+  st->ctrl = ctrl;
+  st->capacity = capacity;
+  st->growth_left = capacity - capacity / 8 - st->nnames;
+  return 0;
+}
+
+
+/*
+ * Return the slot index of KEY (whose hash is HASH) in ST, or -1 if
+ * not found.
+ */
+static __inline__ long
+open_find(symtable_t *st, const char *key, unsigned long hash)
+{
+  size_t mask = st->capacity / GROUP_WIDTH - 1;
+  size_t g = H1(hash) & mask, step = 0, i;
+  const signed char *grp;
+  struct snode *p;
+  uint64_t m;
+
+  for (;;) {
+    grp = st->ctrl + g * GROUP_WIDTH;
+    for (m = group_match(grp, H2(hash)); m; m &= m - 1) {
+      i = g * GROUP_WIDTH + GROUP_FIRST(m);
+      p = st->slots[i];
+      if (p->hash == hash && strcmp(p->name, key) == 0)
+        return i;
+    }
+    if (group_match_empty(grp))
+      return -1;
+    g = (g + ++step) & mask;
+  }
+}
+
+
+/* Return the slot index of the node P in ST. */
+static long
+open_find_node(symtable_t *st, struct snode *p)
+{
+  size_t mask = st->capacity / GROUP_WIDTH - 1;
+  size_t g = H1(p->hash) & mask, step = 0, i;
+  uint64_t m;
+
+  for (;;) {
+    for (m = group_match(st->ctrl + g * GROUP_WIDTH, H2(p->hash)); m;
+         m &= m - 1) {
+      i = g * GROUP_WIDTH + GROUP_FIRST(m);
+      if (st->slots[i] == p)
+        return i;
+    }
+    g = (g + ++step) & mask;
+  }
+}
+
+
+/*
+ * Make P the innermost node of its name.  P->hash must be set.
+ */
+static int
+open_insert(symtable_t *st, struct snode *p)
+{
+  size_t mask, g, step, i;
+  long found;
+  uint64_t m;
+
+  found = open_find(st, p->name, p->hash);
+  if (found >= 0) {
+    p->next = st->slots[found];
+    st->slots[found] = p;
+    return 0;
+  }
+
+ again:
+  mask = st->capacity / GROUP_WIDTH - 1;
+  g = H1(p->hash) & mask;
+  for (step = 0; !(m = group_match_free(st->ctrl + g * GROUP_WIDTH)); )
+    g = (g + ++step) & mask;
+  i = g * GROUP_WIDTH + GROUP_FIRST(m);
+
+  if (st->ctrl[i] == CTRL_EMPTY) {
+    if (st->growth_left == 0) {
+      /* Grow, or just drop the DELETED slots if they are many. */
+      if (open_resize(st, (st->nnames + 1 > st->capacity * 7 / 16) ?
+                      st->capacity * 2 : st->capacity) < 0)
+        return -1;
+      goto again;
+    }
+    st->growth_left--;
+  }
+  st->ctrl[i] = H2(p->hash);
+  st->slots[i] = p;
+  p->next = NULL;
+  st->nnames++;
+  return 0;
+}
+
+
+/*
+ * Remove P, the innermost node of its name, from ST.
+ */
+static void
+open_remove(symtable_t *st, struct snode *p)
+{
+  long i = open_find_node(st, p);
+  const signed char *grp;
+
+  if (p->next) {
+    st->slots[i] = p->next;
+    return;
+  }
+
+  /* If the group has an EMPTY slot, no probe has ever passed it. */
+  grp = st->ctrl + i / GROUP_WIDTH * GROUP_WIDTH;
+  if (group_match_empty(grp)) {
+    st->ctrl[i] = CTRL_EMPTY;
+    st->growth_left++;
+  }
+  else
+    st->ctrl[i] = CTRL_DELETED;
+  st->nnames--;
+}
 
 
 symtable_t *
 symtable_new(size_t table_size, size_t max_frame, unsigned flags)
 {
   symtable_t *p;
+  size_t capacity;
   int i;
 
   p = malloc(sizeof(*p));
@@ -94,24 +510,49 @@ symtable_new(size_t table_size, size_t max_frame, unsigned flags)
     p->frame[i].link = NULL;
   }
   p->size_frame = max_frame;
-
-  p->table = OBSTACK_ALLOC(p->pool, sizeof(*p->table) * table_size);
-  if (!p->table)
-    goto err;
-  for (i = 0; i < table_size; i++)
-    p->table[i] = NULL;
-  p->size_table = table_size;
+  p->npools = 0;
+  p->chunks = NULL;
+  p->generation = 0;
+  p->snap = NULL;
+  p->version = 0;
+  p->snaplog = NULL;
+  p->dirty = NULL;
+  p->ndirty = 0;
+  p->snap_full = 0;
+
+  p->table = NULL;
+  p->size_table = 0;
+  p->slots = NULL;
+  p->ctrl = NULL;
+  p->capacity = p->nnames = 0;
+
+  if (flags & SYMTABLE_OPT_OPENADDR) {
+    capacity = GROUP_WIDTH;
+    while (capacity - capacity / 8 < table_size)
+      capacity *= 2;
+    if (open_resize(p, capacity) < 0)
+      goto err;
+  }
+  else {
+    p->table = OBSTACK_ALLOC(p->pool, sizeof(*p->table) * table_size);
+    if (!p->table)
+      goto err;
+    for (i = 0; i < table_size; i++)
+      p->table[i] = NULL;
+    p->size_table = table_size;
+  }
 
   p->flags = flags;
   p->depth = -1;
-
-  symtable_enter(p, "*BASE*");
-
   p->free_func = NULL;
 
+  if (symtable_enter(p, "*BASE*") < 0)
+    goto err;
+
   return p;
 
  err:
+  free(p->slots);
   OBSTACK_FREE(p->pool, 0);
   free(p);
   return NULL;
@@ -121,10 +562,28 @@ symtable_new(size_t table_size, size_t max_frame, unsigned flags)
 void
 symtable_delete(symtable_t *st)
 {
+  void *chunk;
+  int i;
+
   while (symtable_leave(st) != -1)
     ;
 
+  for (i = 0; i < st->npools; i++)
+    OBSTACK_FREE(&st->frame[i].pool, NULL);
+  while ((chunk = st->chunks) != NULL) {
+    st->chunks = *(void **)chunk;
+    free(chunk);
+  }
   OBSTACK_FREE(st->pool, NULL);
+  free(st->slots);
+
+  if (st->snaplog)
+    OBSTACK_FREE(st->snaplog, NULL);
+  if (st->snap) {
+    /* The readers may be pinning it right now. */
+    rbs_synchronize();
+    snapshot_unref(st->snap);
+  }
   free(st);
 }
 
@@ -135,6 +594,7 @@ symtable_register_frame(symtable_t *st, int frame,
 {
   int index;
   struct snode *p, *q, *r;
+  struct obstack *pool;
 
   if (frame < 0) {
     frame = st->depth;
@@ -142,57 +602,52 @@ symtable_register_frame(symtable_t *st, int frame,
   }
   else
     p = symtable_lookup_node(st, name, SYMTABLE_OPT_FRAME + frame);
-  if (p) {
-    if (len < 0)
-      len = strlen(data) + 1;
+  if (len < 0)
+    len = strlen(data) + 1;
 
-    if (len > 0) {
-      p->val = realloc(p->val, len);
-      if (!p->val)
-        return -1;
-      memcpy(p->val, data, len);
-    }
-    else
-      p->val = NULL;
-    p->size_val = len;
-    return 0;
-  }
+  if (p)
+    return snode_set_value(st, p, data, len);
 
   if (frame != st->depth)
     return -1;
 
-  index = symtable_hash(name) % st->size_table;
-
-  p = OBSTACK_ALLOC(st->pool, sizeof(*p));
+  pool = &st->frame[frame].pool;
+  p = OBSTACK_ALLOC(pool, sizeof(*p));
   if (!p)
     return -1;
   p->valid = 0;
 
-  p->name = OBSTACK_STR_COPY(st->pool, name);
+  p->name = OBSTACK_STR_COPY(pool, name);
   if (!p->name) {
-    OBSTACK_FREE(st->pool, p);
+    OBSTACK_FREE(pool, p);
     return -1;
   }
 
-  if (len < 0)
-    len = strlen(data) + 1;
+  p->frame = frame;
+  p->val = p->blk = NULL;
+  p->size_blk = 0;
+  if (snode_set_value(st, p, data, len) < 0) {
+    OBSTACK_FREE(pool, p);
+    return -1;
+  }
 
-  if (len > 0) {
-    p->val = malloc(len);
-    if (!p->val) {
-      OBSTACK_FREE(st->pool, p);
+  if (st->slots) {
+    p->hash = symtable_hash_mum(name, strlen(name));
+    if (open_insert(st, p) < 0) {
+      OBSTACK_FREE(pool, p);
       return -1;
     }
-    memcpy(p->val, data, len);
+    p->flnk = st->frame[frame].link;
+    st->frame[frame].link = p;
+    p->valid = 1;
+    st->generation++;
+    return 0;
   }
-  else
-    p->val = NULL;
-  p->size_val = len;
 
   p->flnk = st->frame[frame].link;
   st->frame[frame].link = p;
-  p->frame = frame;
 
+  index = symtable_hash(name) % st->size_table;
   for (r = NULL, q = st->table[index]; q != NULL; q = q->next) {
     if (frame > q->frame)
       break;
@@ -211,6 +666,7 @@ symtable_register_frame(symtable_t *st, int frame,
     st->table[index] = p;
 
   p->valid = 1;
+  st->generation++;
 
   return 0;
 }
@@ -296,10 +752,9 @@ symtable_unregister_frame(symtable_t *st, int frame, const char *key)
     st->free_func(p->name, p->val, p->size_val);
 
   p->valid = 0;
-
-  free(p->val);
-  p->val = 0;
-  p->size_val = 0;
+  snap_touch(st, p->name);
+  snode_clear_value(p);
+  st->generation++;
 
   return 0;
 }
@@ -312,15 +767,34 @@ symtable_unregister(symtable_t *st, const char *key)
 }
 
 
+/* Return the hash of KEY that the engine of ST uses. */
+static __inline__ unsigned long
+symtable_key_hash(symtable_t *st, const char *key)
+{
+  if (st->slots)
+    return symtable_hash_mum(key, strlen(key));
+  return symtable_hash(key);
+}
+
+
 static struct snode *
-symtable_lookup_node(symtable_t *st, const char *key, unsigned flags)
+symtable_lookup_hashed(symtable_t *st, const char *key, unsigned long hash,
+                       unsigned flags)
 {
-  int index;
   struct snode *p;
+  long i;
 
-  index = symtable_hash(key) % st->size_table;
-  for (p = st->table[index]; p != NULL; p = p->next) {
-    if (p->valid && strcmp(key, p->name) == 0) {
+  if (st->slots) {
+    i = open_find(st, key, hash);
+    if (i < 0)
+      return NULL;
+    p = st->slots[i];
+  }
+  else
+    p = st->table[hash % st->size_table];
+
+  for (; p != NULL; p = p->next) {
+    if (p->valid && (st->slots || strcmp(key, p->name) == 0)) {
       if (flags & SYMTABLE_OPT_CFRAME) {
         if (p->frame == st->depth)
           return p;
@@ -343,6 +817,13 @@ symtable_lookup_node(symtable_t *st, const char *key, unsigned flags)
 }
 
 
+static struct snode *
+symtable_lookup_node(symtable_t *st, const char *key, unsigned flags)
+{
+  return symtable_lookup_hashed(st, key, symtable_key_hash(st, key), flags);
+}
+
+
 void *
 symtable_lookup(symtable_t *st, const char *key, size_t *size, unsigned flags)
 {
@@ -363,20 +844,35 @@ symtable_lookup(symtable_t *st, const char *key, size_t *size, unsigned flags)
 int
 symtable_enter(symtable_t *st, const char *name)
 {
-  if (st->depth > (int)st->size_frame)
+  struct sframe *f;
+
+  if (st->depth + 1 >= (int)st->size_frame)
     return -1;
 
-  st->depth++;
+  f = &st->frame[st->depth + 1];
+  if (st->depth + 1 == st->npools) {
+    /* The pool is kept after leaving, and reused by the next frame. */
+    if (frame_pool_init(st, &f->pool) < 0)
+      return -1;
+    st->npools++;
+  }
 
-  st->frame[st->depth].base = OBSTACK_ALLOC(st->pool, 1);
-  if (name)
-    st->frame[st->depth].name = OBSTACK_STR_COPY(st->pool, name);
+  f->base = OBSTACK_ALLOC(&f->pool, 1);
+  if (!f->base)
+    return -1;
+  if (name) {
+    f->name = OBSTACK_STR_COPY(&f->pool, name);
+    if (!f->name) {
+      OBSTACK_FREE(&f->pool, f->base);
+      return -1;
+    }
+  }
   else
-    st->frame[st->depth].name = NULL;
+    f->name = NULL;
 
-  st->frame[st->depth].link = NULL;
+  f->link = NULL;
 
-  return st->depth;
+  return ++st->depth;
 }
 
 
@@ -386,23 +882,20 @@ symtable_leave(symtable_t *st)
   struct snode *p;
   int index = -1;
 
-  if (st->depth < -1)
+  if (st->depth < 0)
     return -1;
 
   for (p = st->frame[st->depth].link; p != NULL; p = p->flnk) {
-    index = symtable_hash(p->name) % st->size_table;
-
-    if (p->valid) {
-      if (st->free_func)
-        st->free_func(p->name, p->val, p->size_val);
+    if (p->valid && st->free_func)
+      st->free_func(p->name, p->val, p->size_val);
+    snap_touch(st, p->name);
 
-      p->valid = 0;
-
-      free(p->val);
-      p->val = NULL;
-      p->size_val = 0;
+    if (st->slots) {
+      open_remove(st, p);
+      continue;
     }
 
+    index = symtable_hash(p->name) % st->size_table;
     if (p->prev != NULL)
       p->prev->next = p->next;
     else
@@ -412,8 +905,10 @@ symtable_leave(symtable_t *st)
       p->next->prev = p->prev;
   }
 
-  OBSTACK_FREE(st->pool, st->frame[st->depth].base);
+  /* Release the nodes and the values of the frame at once. */
+  OBSTACK_FREE(&st->frame[st->depth].pool, st->frame[st->depth].base);
 
+  st->generation++;
   st->depth--;
   return st->depth;
 }
@@ -436,14 +931,14 @@ symtable_get_frame_name(symtable_t *table, int frame_id)
 void *
 symtable_alloc(symtable_t *table, size_t size)
 {
-  return OBSTACK_ALLOC(table->pool, size);
+  return OBSTACK_ALLOC(&table->frame[table->depth].pool, size);
 }
 
 
 char *
 symtable_strdup(symtable_t *table, const char *s)
 {
-  return OBSTACK_STR_COPY(table->pool, s);
+  return OBSTACK_STR_COPY(&table->frame[table->depth].pool, s);
 }
 
 
@@ -473,9 +968,9 @@ symtable_var_substitute(symtable_t *st)
   int var_found = 0;
 
   s = OBSTACK_BASE(st->pool);
-  len = strlen(s);
 
  again:
+  len = strlen(s);
   for (i = len - 1; i >= 0; i--) {
     if (s[i] == '$') {
       if (i > 0 && s[i - 1] == '\\')
@@ -496,7 +991,7 @@ symtable_var_substitute(symtable_t *st)
         val = symtable_lookup(st, name, NULL, 0);
 
         if (!val)
-          strcpy(s + i, s + j + 1);
+          memmove(s + i, s + j + 1, strlen(s + j + 1) + 1);
         else {
           size_t val_len = strlen(val);
           size_t remained = strlen(s + j + 1);
@@ -580,7 +1075,7 @@ symtable_register_substitute_frame(symtable_t *st, int frame,
                                    const char *name, const char *data)
 {
   struct snode *snptr;
-  int size;
+  int size, ret;
   char *p;
 
   assert(OBSTACK_OBJECT_SIZE(st->pool) == 0);
@@ -598,6 +1093,7 @@ symtable_register_substitute_frame(symtable_t *st, int frame,
     return 0;
   }
   snptr->valid = 0;
+  st->generation++;
 
   size = strlen(data) + 1;
   OBSTACK_GROW(st->pool, data, size);
@@ -605,17 +1101,16 @@ symtable_register_substitute_frame(symtable_t *st, int frame,
     return -1;
   }
 
-  snptr->size_val = OBSTACK_OBJECT_SIZE(st->pool);
+  size = OBSTACK_OBJECT_SIZE(st->pool);
   p = OBSTACK_FINISH(st->pool);
 
-  snptr->val = realloc(snptr->val, snptr->size_val);
-  if (!snptr->val) {
-    OBSTACK_FREE(st->pool, p);
+  ret = snode_set_value(st, snptr, p, size);
+  OBSTACK_FREE(st->pool, p);
+  if (ret < 0)
     return -1;
-  }
-  memcpy(snptr->val, p, snptr->size_val);
 
   snptr->valid = 1;
+  st->generation++;
 
   return 0;
 }
@@ -650,6 +1145,759 @@ symtable_string_substitute(symtable_t *st, const char *data)
 }
 
 
+/*
+ * Compiled templates
+ *
+ * symtable_template_compile() splits a template into literal text and
+ * "${name}" references once.  A reference keeps the hash of its name,
+ * and the node that the name resolved to, with the generation of the
+ * table at that time.  The generation changes whenever a name may
+ * resolve to another node: a symbol is added or unregistered, or a
+ * frame is left.  Until then, symtable_template_render() just reads
+ * the current value of the cached node, and replacing a value keeps
+ * the node, so the new value shows up without a lookup.
+ */
+#define TPL_MAX_DEPTH   16      /* nesting limit of values in values */
+
+struct tpl_item {
+  const char *text;             /* literal text, or the name of a variable */
+  size_t len;                   /* length of TEXT */
+  int var;                      /* nonzero if TEXT is a variable name */
+  unsigned long hash;           /* symtable_key_hash() of the name */
+  unsigned long generation;     /* generation of the table when NODE
+                                   was looked up */
+  struct snode *node;           /* the node that the name resolved to */
+};
+
+struct symtable_template_ {
+  symtable_t *st;
+  size_t nitems;
+  struct tpl_item item[1];
+};
+
+
+/*
+ * Get the next piece of S[0..LEN) at *POS, and advance *POS past it.
+ * Returns 1 for a "${name}" with the name in *TEXT and *TLEN, 0 for a
+ * literal, -1 at the end, or -2 at a "${" without the closing '}' or
+ * with another "${" in the name.  A "$" right after a backslash does
+ * not start a reference, and the backslash is kept, as in
+ * symtable_string_substitute().
+ */
+static int
+tpl_next(const char *s, size_t len, size_t *pos,
+         const char **text, size_t *tlen)
+{
+  size_t i = *pos, j;
+  const char *q;
+
+  if (i >= len)
+    return -1;
+
+  if (s[i] == '$' && i + 1 < len && s[i + 1] == '{' &&
+      (i == 0 || s[i - 1] != '\\')) {
+    q = memchr(s + i + 2, '}', len - i - 2);
+    if (!q)
+      return -2;
+    for (j = i + 2; s + j + 1 < q; j++)
+      if (s[j] == '$' && s[j + 1] == '{')
+        return -2;
+    *text = s + i + 2;
+    *tlen = q - *text;
+    *pos = q - s + 1;
+    return 1;
+  }
+
+  for (j = i + 1; j + 1 < len; j++)
+    if (s[j] == '$' && s[j + 1] == '{' && s[j - 1] != '\\')
+      break;
+  if (j + 1 >= len)
+    j = len;
+  *text = s + i;
+  *tlen = j - i;
+  *pos = j;
+  return 0;
+}
+
+
+static __inline__ void
+tpl_emit(char *buf, size_t size, size_t *n, const char *s, size_t len)
+{
+  if (*n < size)
+    memcpy(buf + *n, s, (len < size - *n) ? len : size - *n);
+  *n += len;
+}
+
+
+/*
+ * Emit the value of the node P, expanding the references in it as
+ * symtable_string_substitute() does.
+ */
+static void
+tpl_emit_value(symtable_t *st, char *buf, size_t size, size_t *n,
+               struct snode *p, int depth)
+{
+  const char *s = p->val, *text;
+  size_t len = p->len_str, pos = 0, tlen;
+  char local[128], *name;
+  struct snode *q;
+  int r;
+
+  if (!p->has_ref) {
+    tpl_emit(buf, size, n, s, len);
+    return;
+  }
+
+  while ((r = tpl_next(s, len, &pos, &text, &tlen)) >= 0) {
+    if (r == 0 || depth >= TPL_MAX_DEPTH) {
+      /* a reference past the limit is kept as it is */
+      tpl_emit(buf, size, n, (r == 0) ? text : text - 2,
+               (r == 0) ? tlen : tlen + 3);
+      continue;
+    }
+
+    name = (tlen < sizeof(local)) ? local : malloc(tlen + 1);
+    if (!name)
+      continue;
+    memcpy(name, text, tlen);
+    name[tlen] = '\0';
+    q = symtable_lookup_node(st, name, 0);
+    if (name != local)
+      free(name);
+
+    if (q && q->val)
+      tpl_emit_value(st, buf, size, n, q, depth + 1);
+  }
+  if (r == -2)
+    tpl_emit(buf, size, n, s + pos, len - pos);
+}
+
+
+symtable_template_t *
+symtable_template_compile(symtable_t *st, const char *data)
+{
+  symtable_template_t *tp;
+  struct tpl_item *it;
+  size_t len = strlen(data), pos = 0, tlen, nitems = 0;
+  const char *text;
+  char *copy;
+  int r;
+
+  while ((r = tpl_next(data, len, &pos, &text, &tlen)) >= 0)
+    nitems++;
+  if (r == -2) {
+    errno = EINVAL;
+    return NULL;
+  }
+
+  /* The items, then the text with a '\0' after each name */
+  tp = malloc(offsetof(symtable_template_t, item) +
+              sizeof(*it) * nitems + len + nitems + 1);
+  if (!tp)
+    return NULL;
+  tp->st = st;
+  tp->nitems = nitems;
+  copy = (char *)(tp->item + nitems);
+
+  for (pos = 0, it = tp->item; it < tp->item + nitems; it++) {
+    r = tpl_next(data, len, &pos, &text, &tlen);
+    memcpy(copy, text, tlen);
+    copy[tlen] = '\0';
+    it->text = copy;
+    it->len = tlen;
+    it->var = r;
+    if (r) {
+      it->hash = symtable_key_hash(st, copy);
+      it->node = symtable_lookup_hashed(st, copy, it->hash, 0);
+      it->generation = st->generation;
+    }
+    copy += tlen + 1;
+  }
+  return tp;
+}
+
+
+void
+symtable_template_free(symtable_template_t *tp)
+{
+  free(tp);
+}
+
+
+size_t
+symtable_template_render(symtable_template_t *tp, char *buf, size_t size)
+{
+  symtable_t *st = tp->st;
+  struct tpl_item *it, *end = tp->item + tp->nitems;
+  struct snode *p;
+  size_t n = 0;
+
+  for (it = tp->item; it < end; it++) {
+    if (!it->var) {
+      tpl_emit(buf, size, &n, it->text, it->len);
+      continue;
+    }
+
+    if (it->generation != st->generation) {
+      it->node = symtable_lookup_hashed(st, it->text, it->hash, 0);
+      it->generation = st->generation;
+    }
+    p = it->node;
+    if (p && p->val)
+      tpl_emit_value(st, buf, size, &n, p, 0);
+  }
+
+  if (size > 0)
+    buf[(n < size) ? n : size - 1] = '\0';
+  return n;
+}
+
+
+/*
+ * Snapshots
+ *
+ * A snapshot is an immutable hash table of the names that are visible
+ * at the time of symtable_publish(), with copies of their values.
+ * Its buckets are grouped in pages of SNAP_PAGE_SIZE, and a bucket or
+ * a page that did not change since the previous snapshot is shared
+ * with it, so a publish costs the changed buckets, their pages, and
+ * the page directory:
+ *
+ *   snapshot v1:  page[0] page[1] page[2] ...
+ *                    |       |       |
+ *   snapshot v2:  page[0] page[1]'  page[2] ...   (one name changed)
+ *                            |
+ *                    bucket[5]'  (the other buckets of page[1]
+ *                                 are those of v1)
+ *
+ * Snapshots, pages and buckets are reference counted.  The table holds
+ * one reference to its last snapshot, and each pin holds another.
+ *
+ * The writer logs the name of every symbol whose value may have
+ * changed (DIRTY), so that symtable_publish() knows which buckets to
+ * rebuild.  The log is not kept before the first symtable_publish(),
+ * so the tables that are not shared pay nothing.
+ *
+ * symtable_snapshot_pin() loads the pointer to the last snapshot and
+ * increments its count.  The writer may publish a new one, and drop
+ * the reference of the table to the old one in between, so the pin is
+ * an rbsync read-side section, and symtable_publish() waits for the
+ * sections to end before dropping the reference.
+ */
+#define SNAP_PAGE_SHIFT 8
+#define SNAP_PAGE_SIZE  (1 << SNAP_PAGE_SHIFT)
+
+/* Objects in a snapshot bucket are aligned as OBSTACK_ALLOC() does. */
+#define SNAP_ALIGN(n)   (((n) + sizeof(void *) - 1) & ~(sizeof(void *) - 1))
+
+struct snaplog {
+  struct snaplog *next;
+  unsigned long hash;           /* symtable_hash_mum() of NAME */
+  char name[1];
+};
+
+struct snapent {
+  unsigned long hash;           /* symtable_hash_mum() of NAME */
+  const char *name;
+  const void *val;
+  size_t size;                  /* size of VAL */
+};
+
+struct snapbucket {
+  unsigned long refs;
+  size_t n;                     /* number of ENT */
+  struct snapent ent[1];        /* followed by the names and values */
+};
+
+struct snappage {
+  unsigned long refs;
+  struct snapbucket *bucket[SNAP_PAGE_SIZE];
+};
+
+struct symtable_snapshot_ {
+  unsigned long refs;
+  unsigned long version;
+  size_t nentries;              /* number of the names */
+  size_t mask;                  /* number of the buckets - 1 */
+  struct snappage *page[1];     /* (MASK + 1) / SNAP_PAGE_SIZE pages */
+};
+
+#define SNAP_BUCKET(sp, i)                                      \
+  ((sp)->page[(i) >> SNAP_PAGE_SHIFT]->bucket[(i) & (SNAP_PAGE_SIZE - 1)])
+
+
+static void
+snap_touch(symtable_t *st, const char *name)
+{
+  struct snaplog *l;
+  size_t len;
+
+  if (!st->snaplog || st->snap_full)
+    return;
+
+  len = strlen(name);
+  l = OBSTACK_ALLOC(st->snaplog, offsetof(struct snaplog, name) + len + 1);
+  if (!l) {
+    /* The next symtable_publish() will rebuild everything. */
+    st->snap_full = 1;
+    return;
+  }
+  memcpy(l->name, name, len + 1);
+  l->hash = symtable_hash_mum(name, len);
+  l->next = st->dirty;
+  st->dirty = l;
+  st->ndirty++;
+}
+
+
+static void
+snapbucket_unref(struct snapbucket *b)
+{
+  if (b && __atomic_sub_fetch(&b->refs, 1, __ATOMIC_ACQ_REL) == 0)
+    free(b);
+}
+
+
+static void
+snappage_unref(struct snappage *pg)
+{
+  int i;
+
+  if (__atomic_sub_fetch(&pg->refs, 1, __ATOMIC_ACQ_REL) != 0)
+    return;
+  for (i = 0; i < SNAP_PAGE_SIZE; i++)
+    snapbucket_unref(pg->bucket[i]);
+  free(pg);
+}
+
+
+static void
+snapshot_unref(void *arg)
+{
+  struct symtable_snapshot_ *sp = arg;
+  size_t i, npages = (sp->mask + 1) / SNAP_PAGE_SIZE;
+
+  if (__atomic_sub_fetch(&sp->refs, 1, __ATOMIC_ACQ_REL) != 0)
+    return;
+  for (i = 0; i < npages; i++)
+    snappage_unref(sp->page[i]);
+  free(sp);
+}
+
+
+static struct symtable_snapshot_ *
+snapshot_alloc(size_t nbuckets)
+{
+  struct symtable_snapshot_ *sp;
+  size_t npages = nbuckets / SNAP_PAGE_SIZE;
+
+  sp = malloc(offsetof(struct symtable_snapshot_, page) +
+              sizeof(sp->page[0]) * npages);
+  if (!sp)
+    return NULL;
+  sp->refs = 1;
+  sp->mask = nbuckets - 1;
+  sp->nentries = 0;
+  memset(sp->page, 0, sizeof(sp->page[0]) * npages);
+  return sp;
+}
+
+
+/*
+ * Make a bucket of the N entries in SRC, with copies of their names
+ * and values, into *BP.  *BP is NULL if N is zero.  Returns -1 if it
+ * runs out of memory.
+ */
+static int
+snapbucket_new(struct snapbucket **bp, const struct snapent *src, size_t n)
+{
+  struct snapbucket *b;
+  size_t i, size, len;
+  char *q;
+
+  *bp = NULL;
+  if (n == 0)
+    return 0;
+
+  size = SNAP_ALIGN(offsetof(struct snapbucket, ent) + sizeof(*src) * n);
+  for (i = 0; i < n; i++)
+    size += SNAP_ALIGN(src[i].size) + SNAP_ALIGN(strlen(src[i].name) + 1);
+
+  b = malloc(size);
+  if (!b)
+    return -1;
+  b->refs = 1;
+  b->n = n;
+
+  q = (char *)b +
+    SNAP_ALIGN(offsetof(struct snapbucket, ent) + sizeof(*src) * n);
+  for (i = 0; i < n; i++) {
+    b->ent[i].hash = src[i].hash;
+    b->ent[i].size = src[i].size;
+    memcpy(q, src[i].val, src[i].size);
+    b->ent[i].val = q;
+    q += SNAP_ALIGN(src[i].size);
+
+    len = strlen(src[i].name) + 1;
+    memcpy(q, src[i].name, len);
+    b->ent[i].name = q;
+    q += SNAP_ALIGN(len);
+  }
+  *bp = b;
+  return 0;
+}
+
+
+/* Free the pages of SP that are not in OLD, and SP itself. */
+static void
+snapshot_abort(struct symtable_snapshot_ *sp, struct symtable_snapshot_ *old)
+{
+  size_t i, npages = (sp->mask + 1) / SNAP_PAGE_SIZE;
+  int j;
+
+  for (i = 0; i < npages; i++) {
+    if (!sp->page[i] || (old && sp->page[i] == old->page[i]))
+      continue;
+    for (j = 0; j < SNAP_PAGE_SIZE; j++)
+      if (!old || sp->page[i]->bucket[j] != old->page[i]->bucket[j])
+        snapbucket_unref(sp->page[i]->bucket[j]);
+    free(sp->page[i]);
+  }
+  free(sp);
+}
+
+
+/* Fill E with the visible value of node P, if P has one. */
+static int
+snap_visible(symtable_t *st, struct snode *p, struct snapent *e)
+{
+  if (!p || !p->valid || !p->val)
+    return 0;
+  if (symtable_lookup_node(st, p->name, 0) != p)
+    return 0;                   /* shadowed by an inner frame */
+  e->hash = (st->slots) ? p->hash : symtable_hash_mum(p->name,
+                                                      strlen(p->name));
+  e->name = p->name;
+  e->val = p->val;
+  e->size = p->size_val;
+  return 1;
+}
+
+
+/* Build a snapshot of ST from scratch. */
+static struct symtable_snapshot_ *
+snapshot_build(symtable_t *st)
+{
+  struct symtable_snapshot_ *sp;
+  struct snapent *ents = NULL, *sorted = NULL, e;
+  size_t *start = NULL;
+  size_t n = 0, i, b, nbuckets, npages;
+  struct snode *p;
+  int f, j;
+
+  for (f = 0; f <= st->depth; f++)
+    for (p = st->frame[f].link; p != NULL; p = p->flnk)
+      n += snap_visible(st, p, &e);
+
+  for (nbuckets = SNAP_PAGE_SIZE; nbuckets < n; nbuckets *= 2)
+    ;
+  npages = nbuckets / SNAP_PAGE_SIZE;
+
+  sp = snapshot_alloc(nbuckets);
+  ents = malloc(sizeof(*ents) * (n + 1));
+  sorted = malloc(sizeof(*sorted) * (n + 1));
+  start = calloc(nbuckets + 1, sizeof(*start));
+  if (!sp || !ents || !sorted || !start)
+    goto err;
+
+  /* Sort the names by bucket, by counting. */
+  n = 0;
+  for (f = 0; f <= st->depth; f++)
+    for (p = st->frame[f].link; p != NULL; p = p->flnk)
+      if (snap_visible(st, p, &ents[n]))
+        start[(ents[n++].hash & sp->mask) + 1]++;
+  for (b = 0; b < nbuckets; b++)
+    start[b + 1] += start[b];
+  for (i = 0; i < n; i++)
+    sorted[start[ents[i].hash & sp->mask]++] = ents[i];
+  /* Now START[B] is where bucket B + 1 begins. */
+
+  for (i = 0; i < npages; i++) {
+    sp->page[i] = malloc(sizeof(*sp->page[i]));
+    if (!sp->page[i])
+      goto err;
+    sp->page[i]->refs = 1;
+    for (j = 0; j < SNAP_PAGE_SIZE; j++)
+      sp->page[i]->bucket[j] = NULL;
+    for (j = 0; j < SNAP_PAGE_SIZE; j++) {
+      b = i * SNAP_PAGE_SIZE + j;
+      if (snapbucket_new(&sp->page[i]->bucket[j],
+                         sorted + ((b > 0) ? start[b - 1] : 0),
+                         start[b] - ((b > 0) ? start[b - 1] : 0)) < 0)
+        goto err;
+    }
+  }
+  sp->nentries = n;
+
+  free(start);
+  free(sorted);
+  free(ents);
+  return sp;
+
+ err:
+  if (sp)
+    snapshot_abort(sp, NULL);
+  free(start);
+  free(sorted);
+  free(ents);
+  return NULL;
+}
+
+
+struct snapdirty {
+  size_t bucket;
+  struct snaplog *log;
+};
+
+
+static int
+snapdirty_cmp(const void *a, const void *b)
+{
+  const struct snapdirty *x = a, *y = b;
+
+  if (x->bucket != y->bucket)
+    return (x->bucket < y->bucket) ? -1 : 1;
+  if (x->log->hash != y->log->hash)
+    return (x->log->hash < y->log->hash) ? -1 : 1;
+  return strcmp(x->log->name, y->log->name);
+}
+
+
+/* Return nonzero if the name of E is one of the N in D. */
+static int
+snapdirty_find(const struct snapdirty *d, size_t n, const struct snapent *e)
+{
+  size_t i;
+
+  for (i = 0; i < n; i++)
+    if (d[i].log->hash == e->hash && strcmp(d[i].log->name, e->name) == 0)
+      return 1;
+  return 0;
+}
+
+
+/*
+ * Build a snapshot of ST from OLD, rebuilding only the buckets of the
+ * names in ST->DIRTY.
+ */
+static struct symtable_snapshot_ *
+snapshot_update(symtable_t *st, struct symtable_snapshot_ *old)
+{
+  struct symtable_snapshot_ *sp;
+  struct snapdirty *d;
+  struct snapbucket *ob;
+  struct snapent *ents = NULL, *tmp;
+  struct snaplog *l;
+  size_t nd = 0, cap = 0, i, j, k, m, n, pg, npages;
+
+  npages = (old->mask + 1) / SNAP_PAGE_SIZE;
+  sp = snapshot_alloc(old->mask + 1);
+  d = malloc(sizeof(*d) * st->ndirty);
+  if (!sp || !d) {
+    free(sp);
+    free(d);
+    return NULL;
+  }
+  memcpy(sp->page, old->page, sizeof(sp->page[0]) * npages);
+  sp->nentries = old->nentries;
+
+  for (l = st->dirty; l != NULL; l = l->next) {
+    d[nd].bucket = l->hash & old->mask;
+    d[nd++].log = l;
+  }
+  qsort(d, nd, sizeof(*d), snapdirty_cmp);
+
+  for (i = 0; i < nd; i = j) {
+    for (j = i + 1; j < nd && d[j].bucket == d[i].bucket; j++)
+      ;
+
+    pg = d[i].bucket >> SNAP_PAGE_SHIFT;
+    if (sp->page[pg] == old->page[pg]) {
+      sp->page[pg] = malloc(sizeof(*sp->page[pg]));
+      if (!sp->page[pg]) {
+        sp->page[pg] = old->page[pg];
+        goto err;
+      }
+      memcpy(sp->page[pg], old->page[pg], sizeof(*sp->page[pg]));
+      sp->page[pg]->refs = 1;
+    }
+
+    ob = SNAP_BUCKET(old, d[i].bucket);
+    m = (ob) ? ob->n : 0;
+    if (cap < m + j - i) {
+      cap = (m + j - i) * 2;
+      tmp = realloc(ents, sizeof(*ents) * cap);
+      if (!tmp)
+        goto err;
+      ents = tmp;
+    }
+
+    /* The names in the old bucket that did not change, ... */
+    n = 0;
+    for (k = 0; k < m; k++)
+      if (!snapdirty_find(d + i, j - i, &ob->ent[k]))
+        ents[n++] = ob->ent[k];
+    /* ... and the current values of the names that changed. */
+    for (k = i; k < j; k++) {
+      if (k > i && snapdirty_cmp(&d[k - 1], &d[k]) == 0)
+        continue;               /* changed more than once */
+      n += snap_visible(st, symtable_lookup_node(st, d[k].log->name, 0),
+                        &ents[n]);
+    }
+
+    if (snapbucket_new(&SNAP_BUCKET(sp, d[i].bucket), ents, n) < 0) {
+      SNAP_BUCKET(sp, d[i].bucket) = ob;
+      goto err;
+    }
+    sp->nentries += n - m;
+  }
+
+  /* SP shares the rest with OLD. */
+  for (pg = 0; pg < npages; pg++) {
+    if (sp->page[pg] == old->page[pg]) {
+      __atomic_add_fetch(&sp->page[pg]->refs, 1, __ATOMIC_RELAXED);
+      continue;
+    }
+    for (k = 0; k < SNAP_PAGE_SIZE; k++)
+      if (sp->page[pg]->bucket[k] &&
+          sp->page[pg]->bucket[k] == old->page[pg]->bucket[k])
+        __atomic_add_fetch(&sp->page[pg]->bucket[k]->refs, 1,
+                           __ATOMIC_RELAXED);
+  }
+
+  free(ents);
+  free(d);
+  return sp;
+
+ err:
+  snapshot_abort(sp, old);
+  free(ents);
+  free(d);
+  return NULL;
+}
+
+
+int
+symtable_publish(symtable_t *st)
+{
+  struct symtable_snapshot_ *old = st->snap, *sp;
+  size_t nbuckets;
+
+  if (!st->snaplog) {
+    if (OBSTACK_INIT(&st->_snaplog) < 0)
+      return -1;
+    st->snaplog_base = OBSTACK_ALLOC(&st->_snaplog, 1);
+    if (!st->snaplog_base) {
+      OBSTACK_FREE(&st->_snaplog, NULL);
+      return -1;
+    }
+    st->snaplog = &st->_snaplog;
+  }
+
+  if (old && !st->snap_full && st->ndirty == 0)
+    return 0;
+
+  /* Rebuild everything if the table needs to grow or shrink, or most
+   * of it changed anyway. */
+  nbuckets = (old) ? old->mask + 1 : 0;
+  if (!old || st->snap_full || st->ndirty >= nbuckets / 2 ||
+      old->nentries + st->ndirty > nbuckets * 2 ||
+      (nbuckets > SNAP_PAGE_SIZE && old->nentries < nbuckets / 8))
+    sp = snapshot_build(st);
+  else
+    sp = snapshot_update(st, old);
+  if (!sp)
+    return -1;
+
+  sp->version = ++st->version;
+  __atomic_store_n(&st->snap, sp, __ATOMIC_RELEASE);
+
+  OBSTACK_FREE(st->snaplog, st->snaplog_base);
+  st->snaplog_base = OBSTACK_ALLOC(st->snaplog, 1);
+  st->dirty = NULL;
+  st->ndirty = 0;
+  st->snap_full = (st->snaplog_base == NULL);
+
+  if (old) {
+    /* Wait for the threads that may be pinning OLD through ST. */
+    rbs_synchronize();
+    snapshot_unref(old);
+  }
+  return 0;
+}
+
+
+symtable_snapshot_t *
+symtable_snapshot_pin(symtable_t *st)
+{
+  struct symtable_snapshot_ *sp;
+
+  rbs_read_lock();
+  sp = __atomic_load_n(&st->snap, __ATOMIC_ACQUIRE);
+  if (sp)
+    __atomic_add_fetch(&sp->refs, 1, __ATOMIC_RELAXED);
+  rbs_read_unlock();
+  return sp;
+}
+
+
+void
+symtable_snapshot_unpin(symtable_snapshot_t *sp)
+{
+  if (sp)
+    snapshot_unref(sp);
+}
+
+
+symtable_snapshot_t *
+symtable_snapshot_refresh(symtable_t *st, symtable_snapshot_t *sp)
+{
+  /* SP is pinned, so its address is not reused by another one. */
+  if (sp && sp == __atomic_load_n(&st->snap, __ATOMIC_ACQUIRE))
+    return sp;
+  symtable_snapshot_unpin(sp);
+  return symtable_snapshot_pin(st);
+}
+
+
+unsigned long
+symtable_snapshot_version(const symtable_snapshot_t *sp)
+{
+  return sp->version;
+}
+
+
+const void *
+symtable_snapshot_lookup(const symtable_snapshot_t *sp, const char *key,
+                         size_t *size)
+{
+  unsigned long hash = symtable_hash_mum(key, strlen(key));
+  const struct snapbucket *b = SNAP_BUCKET(sp, hash & sp->mask);
+  const struct snapent *e, *end;
+
+  if (!b)
+    return NULL;
+  for (e = b->ent, end = e + b->n; e < end; e++) {
+    if (e->hash == hash && strcmp(e->name, key) == 0) {
+      if (size)
+        *size = e->size;
+      return e->val;
+    }
+  }
+  return NULL;
+}
+
+
 char *
 symtable_esc_substitute(symtable_t *st, const char *key)
 {
@@ -730,6 +1978,56 @@ symtable_hash_from_gcc(const char *str)
 }
 
 
+/*
+ * Multiply-and-fold string hash in the manner of wyhash; it eats 16
+ * bytes per round, and every bit of the input reaches every bit of the
+ * result.  The open addressing table needs that, since it uses the low
+ * 7 bits and the high bits separately.
+ */
+#define MUM_P0  0xa0761d6478bd642fULL
+#define MUM_P1  0xe7037ed1a0b428dbULL
+#define MUM_P2  0x8ebc6af09c88c6e3ULL
+
+static __inline__ uint64_t
+symtable_mum(uint64_t a, uint64_t b)
+{
+#ifdef __SIZEOF_INT128__
+  unsigned __int128 r = (unsigned __int128)a * b;
+  return (uint64_t)r ^ (uint64_t)(r >> 64);
+#else
+  uint64_t r = a * b;
+  return r ^ (r >> 32) ^ (a + (b >> 29));
+#endif
+}
+
+
+static unsigned long
+symtable_hash_mum(const char *s, size_t len)
+{
+  const unsigned char *p = (const unsigned char *)s;
+  uint64_t h = MUM_P0 ^ len, a, b;
+
+  while (len > 16) {
+    memcpy(&a, p, 8);
+    memcpy(&b, p + 8, 8);
+    h = symtable_mum(a ^ MUM_P1, b ^ h);
+    p += 16;
+    len -= 16;
+  }
+
+  a = b = 0;
+  if (len > 8) {
+    memcpy(&a, p, 8);
+    memcpy(&b, p + 8, len - 8);
+  }
+  else
+    memcpy(&a, p, len);
+
+  h = symtable_mum(a ^ MUM_P1, b ^ h);
+  return symtable_mum(h ^ MUM_P2, h);
+}
+
+
 static unsigned long
 symtable_hash_from_glib(const char *s)
 {
@@ -798,16 +2096,24 @@ symtable_dump(symtable_t *p)
   printf("symtable[%p]\n", p);
   printf("  flags: 0x%08X\n", p->flags);
   printf("  depth: %d\n", p->depth);
-  printf("  frame: size(%u)\n", p->size_frame);
+  printf("  frame: size(%zu)\n", p->size_frame);
 
   for (i = 0; i <= p->depth; i++)
     printf("    %2d: base(%p), link(%p) name(%s)\n", i,
            p->frame[i].base, p->frame[i].link, p->frame[i].name);
 
-  printf("  table: size(%u)\n", p->size_table);
-  for (i = 0; i < p->size_table; i++) {
+  if (p->slots)
+    printf("  slots: capacity(%lu) names(%lu) growth_left(%lu)\n",
+           (unsigned long)p->capacity, (unsigned long)p->nnames,
+           (unsigned long)p->growth_left);
+  else
+    printf("  table: size(%zu)\n", p->size_table);
+
+  for (i = 0; i < (p->slots ? p->capacity : p->size_table); i++) {
+    if (p->slots && p->ctrl[i] < 0)
+      continue;
     printf("    %2d: ", i);
-    node = p->table[i];
+    node = p->slots ? p->slots[i] : p->table[i];
     if (node) {
       printf("[%d:%c:%s]", node->frame, node->valid? 'V' : 'D', node->name);
       node = node->next;
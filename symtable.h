@@ -24,6 +24,10 @@
 
 #define SYMTABLE_OPT_CFRAME     0x8000
 
+/* For symtable_new(): use the open addressing table instead of the
+ * fixed-size chained one.  See symtable_new(). */
+#define SYMTABLE_OPT_OPENADDR   0x4000
+
 #define SYMTABLE_OPT_FRAME_MASK 0x00FF
 #define SYMTABLE_OPT_FRAME      0x0100
 
@@ -38,6 +42,12 @@ typedef struct symtable_ symtable_t;
  * Where TABLE_SIZE is the number of entries in the bucket table,
  * and MAX_DEPTH is the number of frames that this symbol table will support,
  * and FLAGS is options.
+ *
+ * If FLAGS has SYMTABLE_OPT_OPENADDR, the symbols are kept in an open
+ * addressing hash table that grows as needed, and TABLE_SIZE is just
+ * the number of symbols expected (0 is fine).  Use it for large
+ * tables; the default chained table never grows, so its lookups get
+ * slower as the symbols outnumber TABLE_SIZE.
  */
 extern symtable_t *symtable_new(size_t table_size,
                                 size_t max_depth, unsigned flags);
@@ -134,6 +144,92 @@ char *symtable_strdup(symtable_t *table, const char *s);
 
 extern char *symtable_string_substitute(symtable_t *st, const char *data);
 
+/*
+ * Compiled templates, for strings that are substituted over and over.
+ *
+ * symtable_template_compile() parses DATA once, in the syntax of
+ * symtable_string_substitute().  symtable_template_render() then
+ * writes the substituted string into BUF of SIZE bytes in one pass,
+ * with the values that the symbols have at the time of the call.
+ * Like snprintf(), it returns the length of the whole result; if it
+ * is not less than SIZE, the output was truncated.
+ *
+ * A template belongs to ST, and must be freed before ST is deleted.
+ * A reference in a value is expanded up to 16 levels deep; deeper
+ * ones, and an unterminated "${" in a value, are copied as they are.
+ *
+ * symtable_template_compile() returns NULL with errno set to EINVAL
+ * if a "${" has no closing '}' or contains another "${".  It returns
+ * NULL with errno set to ENOMEM if it runs out of memory.
+ */
+struct symtable_template_;
+typedef struct symtable_template_ symtable_template_t;
+
+extern symtable_template_t *symtable_template_compile(symtable_t *st,
+                                                      const char *data);
+extern size_t symtable_template_render(symtable_template_t *tp,
+                                       char *buf, size_t size);
+extern void symtable_template_free(symtable_template_t *tp);
+
+/*
+ * Snapshots, for sharing a table with other threads.
+ *
+ * symtable_t itself is not thread-safe.  Instead, the thread that owns
+ * ST (the writer) calls symtable_publish() after a batch of changes,
+ * which makes an immutable snapshot of the symbols that
+ * symtable_lookup(ST, NAME, NULL, 0) would find at that moment.  Any
+ * number of other threads (readers) pin the last published snapshot,
+ * and look up names in it without locks while the writer goes on:
+ *
+ *   // writer
+ *   symtable_register(st, "db.host", host, -1);
+ *   symtable_register(st, "db.port", port, -1);
+ *   symtable_publish(st);
+ *
+ *   // reader
+ *   snap = symtable_snapshot_refresh(st, snap);
+ *   host = symtable_snapshot_lookup(snap, "db.host", NULL);
+ *   port = symtable_snapshot_lookup(snap, "db.port", NULL);
+ *   ...
+ *   symtable_snapshot_unpin(snap);         // when the thread is done
+ *
+ * A snapshot holds copies of the names and values, so it stays valid
+ * after the writer changes or deletes ST, until it is unpinned.  The
+ * readers never see half of a publish.  A snapshot shares the buckets
+ * that did not change with the previous one, so a publish costs about
+ * the changed symbols, and all the readers share one copy.
+ *
+ * symtable_publish() returns 0 on success, or -1 if it runs out of
+ * memory; then the readers keep the previous snapshot.  It waits for
+ * the readers that are in the middle of symtable_snapshot_pin(), which
+ * takes a few instructions.  Before the first symtable_publish(),
+ * symtable_snapshot_pin() returns NULL.
+ *
+ * symtable_snapshot_refresh() returns SP if it is still the last
+ * snapshot, otherwise unpins SP (if not NULL) and pins the last one.
+ * Call it once per unit of work (e.g. per request); it is a single
+ * load if nothing was published.  No reader may call these with ST
+ * once symtable_delete(ST) was called.
+ *
+ *   $ cc -D_GNU_SOURCE ... symtable.c rbsync.c obsutil.c -lpthread
+ */
+struct symtable_snapshot_;
+typedef struct symtable_snapshot_ symtable_snapshot_t;
+
+extern int symtable_publish(symtable_t *st);
+
+extern symtable_snapshot_t *symtable_snapshot_pin(symtable_t *st);
+extern void symtable_snapshot_unpin(symtable_snapshot_t *sp);
+extern symtable_snapshot_t *symtable_snapshot_refresh(symtable_t *st,
+                                                      symtable_snapshot_t *sp);
+
+/* The version increases by one with each symtable_publish(). */
+extern unsigned long symtable_snapshot_version(const symtable_snapshot_t *sp);
+
+/* Like symtable_lookup(ST, KEY, SIZE, 0) at the time SP was published. */
+extern const void *symtable_snapshot_lookup(const symtable_snapshot_t *sp,
+                                            const char *key, size_t *size);
+
 extern int symtable_current_frame(symtable_t *table);
 extern const char *symtable_get_frame_name(symtable_t *table, int frame_id);
 
@@ -0,0 +1,252 @@
+/*
+ * Test and benchmark of tcobs.h against GNU obstack and fakeobs
+ *
+ * Build it once for each implementation behind obsutil.h:
+ *
+ *   $ cc -O2 -DTCOBJS -o tcobs-test tcobs-test.c obsutil.c tcobs.c -lpthread
+ *   $ cc -O2 -o tcobs-test-gnu tcobs-test.c obsutil.c -lpthread
+ *   $ cc -O2 -DFAKEOBJS -o tcobs-test-fake tcobs-test.c obsutil.c fakeobs.c \
+ *       -lpthread
+ *   $ ./tcobs-test [NREQUESTS] [NTHREADS]
+ *
+ * The test allocates, grows and frees random objects, some of them
+ * larger than a chunk, in an obstack per thread, and checks the
+ * contents of every live object against a model.  The obstacks are
+ * handed to another thread half way, so the chunks move between the
+ * thread caches.
+ *
+ * The benchmark runs NTHREADS threads that serve NREQUESTS requests
+ * each.  A request allocates 200 objects of 16 to 256 bytes and a
+ * string that grows a byte at a time, and then frees them all,
+ *
+ * - "reuse": back to the first object of the request, in an obstack
+ *   that the thread keeps, and
+ * - "fresh": with an obstack of its own, freed with obstack_free(S, 0).
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include "obsutil.h"
+#include "difftime.h"
+
+#if defined(TCOBJS)
+#define IMPL    "tcobs"
+#elif defined(FAKEOBJS)
+#define IMPL    "fakeobs"
+#else
+#define IMPL    "obstack"
+#endif
+
+static unsigned long
+xorshift(unsigned long *x)
+{
+  *x ^= *x << 13;
+  *x ^= *x >> 7;
+  *x ^= *x << 17;
+  return *x;
+}
+
+#define NOBJS   2000
+
+struct model {
+  struct obstack stack;
+  unsigned char *ptr[NOBJS];
+  int size[NOBJS];
+  int n;
+};
+
+static int
+check(struct model *m)
+{
+  int i, j;
+
+  for (i = 0; i < m->n; i++)
+    for (j = 0; j < m->size[i]; j++)
+      if (m->ptr[i][j] != (unsigned char)(i * 7 + j))
+        return -1;
+  return 0;
+}
+
+static int
+run_model(struct model *m, unsigned long *x, int steps)
+{
+  unsigned long r;
+  int i, j, size;
+  unsigned char *p;
+
+  for (i = 0; i < steps; i++) {
+    r = xorshift(x);
+    if (m->n == NOBJS || r % 8 == 0) {
+      /* free back to a random object */
+      j = (m->n > 0) ? (int)((r >> 8) % m->n) : 0;
+      if (m->n > 0)
+        obstack_free(&m->stack, m->ptr[j]);
+      m->n = j;
+      if (check(m) < 0)
+        return -1;
+      continue;
+    }
+
+    j = m->n;
+    if (r % 8 == 1) {
+      /* a growing object, sometimes longer than a chunk */
+      size = (r >> 8) % ((r & 0x10000) ? 40000 : 300);
+#ifdef FAKEOBJS
+      size += (size == 0);      /* fakeobs cannot finish an empty object */
+#endif
+      for (size_t k = 0; k < (size_t)size; k++)
+        obstack_1grow(&m->stack, (char)(j * 7 + k));
+      p = obstack_finish(&m->stack);
+    }
+    else {
+      size = (r >> 8) % ((r % 64 == 2) ? 100000 : 200);
+      p = obstack_alloc(&m->stack, size);
+      if (!p && size > 0)
+        return -1;
+      for (int k = 0; k < size; k++)
+        p[k] = (unsigned char)(j * 7 + k);
+    }
+    if (((unsigned long)p & (sizeof(void *) - 1)) != 0)
+      return -1;
+    m->ptr[j] = p;
+    m->size[j] = size;
+    m->n++;
+  }
+  return check(m);
+}
+
+static struct model models[8];
+
+static void *
+test_thread(void *arg)
+{
+  long id = (long)arg;
+  unsigned long x = id * 2654435761UL + 1;
+
+  /* The other half of the steps run on the obstack of another thread. */
+  return (void *)(long)run_model(&models[id], &x, 20000);
+}
+
+static int
+test(void)
+{
+  pthread_t tid[8];
+  void *ret;
+  int i, round, failed = 0;
+
+  for (i = 0; i < 8; i++) {
+    obstack_init(&models[i].stack);
+    models[i].n = 0;
+  }
+  for (round = 0; round < 2; round++) {
+    for (i = 0; i < 8; i++)
+      pthread_create(&tid[i], 0, test_thread, (void *)(long)i);
+    for (i = 0; i < 8; i++) {
+      pthread_join(tid[i], &ret);
+      failed |= (ret != 0);
+    }
+    /* Swap the obstacks of the threads. */
+    for (i = 0; i < 4; i++) {
+      struct model tmp = models[i];
+      models[i] = models[7 - i];
+      models[7 - i] = tmp;
+    }
+  }
+  for (i = 0; i < 8; i++)
+    obstack_free(&models[i].stack, 0);
+  return (failed) ? -1 : 0;
+}
+
+
+static long nrequests;
+static int fresh;
+
+static void
+request(struct obstack *s, unsigned long *x)
+{
+  unsigned long r;
+  char *p;
+  int i;
+
+  for (i = 0; i < 200; i++) {
+    r = xorshift(x);
+    p = obstack_alloc(s, 16 + r % 241);
+    p[0] = (char)r;
+  }
+  for (i = 0; i < 100; i++)
+    obstack_1grow(s, 'a' + i % 26);
+  obstack_1grow(s, '\0');
+  obstack_finish(s);
+}
+
+static void *
+bench_thread(void *arg)
+{
+  struct obstack s;
+  unsigned long x = (unsigned long)arg * 2654435761UL + 1;
+  void *mark;
+  long i;
+
+  if (!fresh)
+    obstack_init(&s);
+  for (i = 0; i < nrequests; i++) {
+    if (fresh) {
+      obstack_init(&s);
+      request(&s, &x);
+      obstack_free(&s, 0);
+    }
+    else {
+      mark = obstack_alloc(&s, 1);
+      request(&s, &x);
+      obstack_free(&s, mark);
+    }
+  }
+  if (!fresh)
+    obstack_free(&s, 0);
+  return 0;
+}
+
+static void
+bench(int nthreads)
+{
+  pthread_t tid[64];
+  double sec;
+  df_t df;
+  int i;
+
+  DF(df) {
+    for (i = 0; i < nthreads; i++)
+      pthread_create(&tid[i], 0, bench_thread, (void *)(long)(i + 1));
+    for (i = 0; i < nthreads; i++)
+      pthread_join(tid[i], 0);
+  }
+  sec = df.value / 1e9;
+
+  printf("%-8s %-6s %2d threads: %8.3f us/request, %7.2f M objects/s\n",
+         IMPL, (fresh) ? "fresh" : "reuse", nthreads,
+         sec * 1e6 / nrequests,
+         nrequests * nthreads * 302 / sec / 1e6);
+}
+
+int
+main(int argc, char *argv[])
+{
+  int nthreads, n;
+
+  nrequests = (argc > 1) ? atol(argv[1]) : 100000;
+  nthreads = (argc > 2) ? atoi(argv[2]) : 4;
+  if (nthreads < 1 || nthreads > 64)
+    nthreads = 4;
+
+  if (test() < 0) {
+    fprintf(stderr, "tcobs-test: %s test failed\n", IMPL);
+    return 1;
+  }
+  printf("tcobs-test: %s test passed\n", IMPL);
+
+  for (fresh = 0; fresh <= 1; fresh++)
+    for (n = 1; n <= nthreads; n *= 2)
+      bench(n);
+  return 0;
+}
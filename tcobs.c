@@ -0,0 +1,457 @@
+/*
+ * Thread-caching obstack
+ * Copyright (C) 2014  Seong-Kook Shin <cinsky@gmail.com>
+ */
+#include <assert.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <pthread.h>
+#include <sys/mman.h>
+
+#include "tcobs.h"
+
+#define CHUNK_LARGE     0x01    /* made for an object larger than a chunk */
+#define CHUNK_MMAP      0x02    /* mapped with mmap() */
+
+#define NCLASSES        (TCOBS_MAX_SHIFT - TCOBS_MIN_SHIFT + 1)
+
+/* The depot keeps this many times the cache of a thread. */
+#define DEPOT_FACTOR    16
+
+#define CONTENTS(c)     ((char *)(c) + sizeof(struct _obstack_chunk))
+
+void (*obstack_alloc_failed_handler)(void);
+
+static size_t default_chunk_size = 16384;
+static size_t huge_size = 2 * 1024 * 1024;
+static size_t cache_size = 4 * 1024 * 1024;
+
+/*
+ * Free chunks of one size.  The chunks are kept as they were released
+ * by obstack_free(): a list of segments, where each segment is the
+ * first chunk of SEG_COUNT chunks linked by PREV.  The link of the
+ * last chunk of a segment is stale.
+ */
+struct chunk_cache {
+  struct _obstack_chunk *top;   /* first chunk of the first segment */
+  struct _obstack_chunk *last;  /* first chunk of the last segment */
+  size_t count;                 /* number of chunks */
+};
+
+struct thread_cache {
+  struct chunk_cache cls[NCLASSES];
+  int registered;
+};
+
+static __thread struct thread_cache tcache;
+
+static pthread_mutex_t depot_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct chunk_cache depot[NCLASSES];
+
+static pthread_once_t key_once = PTHREAD_ONCE_INIT;
+static pthread_key_t cache_key;
+
+
+#define ERROR   do {                                \
+                  if (obstack_alloc_failed_handler) \
+                    obstack_alloc_failed_handler(); \
+                } while (0)
+
+
+static int
+size_class(size_t size)
+{
+  int shift = TCOBS_MIN_SHIFT;
+
+  while (((size_t)1 << shift) < size)
+    shift++;
+  return shift - TCOBS_MIN_SHIFT;
+}
+
+
+static void
+cache_push(struct chunk_cache *cc, struct _obstack_chunk *head, size_t n)
+{
+  head->seg_count = n;
+  head->seg_next = cc->top;
+  cc->top = head;
+  if (!cc->last)
+    cc->last = head;
+  cc->count += n;
+}
+
+
+static struct _obstack_chunk *
+cache_pop(struct chunk_cache *cc)
+{
+  struct _obstack_chunk *c = cc->top, *next;
+
+  if (!c)
+    return NULL;
+  if (c->seg_count > 1) {
+    next = c->prev;
+    next->seg_count = c->seg_count - 1;
+    next->seg_next = c->seg_next;
+    cc->top = next;
+    if (cc->last == c)
+      cc->last = next;
+  }
+  else {
+    cc->top = c->seg_next;
+    if (!cc->top)
+      cc->last = NULL;
+  }
+  cc->count--;
+  return c;
+}
+
+
+/* Move all chunks of FROM to the end of TO. */
+static void
+cache_move(struct chunk_cache *to, struct chunk_cache *from)
+{
+  if (!from->top)
+    return;
+  if (to->last)
+    to->last->seg_next = from->top;
+  else
+    to->top = from->top;
+  to->last = from->last;
+  to->count += from->count;
+  from->top = from->last = NULL;
+  from->count = 0;
+}
+
+
+static void
+chunk_release(struct _obstack_chunk *c)
+{
+  if (c->flags & CHUNK_MMAP)
+    munmap(c, c->size);
+  else
+    free(c);
+}
+
+
+static void
+thread_exit(void *arg)
+{
+  struct thread_cache *tc = arg;
+  int i;
+
+  pthread_mutex_lock(&depot_lock);
+  for (i = 0; i < NCLASSES; i++)
+    cache_move(&depot[i], &tc->cls[i]);
+  pthread_mutex_unlock(&depot_lock);
+}
+
+
+static void
+make_key(void)
+{
+  pthread_key_create(&cache_key, thread_exit);
+}
+
+
+/*
+ * Have thread_exit() hand the cache of this thread back to the depot.
+ * Call it before anything goes into tcache.
+ */
+static void
+register_thread(void)
+{
+  if (!tcache.registered) {
+    pthread_once(&key_once, make_key);
+    pthread_setspecific(cache_key, &tcache);
+    tcache.registered = 1;
+  }
+}
+
+
+/*
+ * Allocate SIZE bytes aligned to ALIGN, from mmap() if SIZE is large
+ * enough for huge pages.  Returns NULL on failure.
+ */
+static struct _obstack_chunk *
+chunk_map(size_t size, size_t align)
+{
+  struct _obstack_chunk *c;
+  char *p, *q;
+  void *m;
+
+  if (size < huge_size) {
+    if (posix_memalign(&m, align, size) != 0)
+      return NULL;
+    c = m;
+    c->flags = 0;
+    c->size = size;
+    c->limit = (char *)c + size;
+    return c;
+  }
+
+  size = (size + huge_size - 1) & ~(huge_size - 1);
+  if (align < huge_size)
+    align = huge_size;
+  p = mmap(NULL, size + align, PROT_READ | PROT_WRITE,
+           MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (p == MAP_FAILED)
+    return NULL;
+  q = (char *)(((uintptr_t)p + align - 1) & ~(uintptr_t)(align - 1));
+  if (q > p)
+    munmap(p, q - p);
+  if (q + size < p + size + align)
+    munmap(q + size, p + size + align - (q + size));
+#ifdef MADV_HUGEPAGE
+  madvise(q, size, MADV_HUGEPAGE);
+#endif
+
+  c = (struct _obstack_chunk *)q;
+  c->flags = CHUNK_MMAP;
+  c->size = size;
+  c->limit = q + size;
+  return c;
+}
+
+
+/* Get a chunk of the size of STACK. */
+static struct _obstack_chunk *
+chunk_get(struct obstack *stack)
+{
+  struct chunk_cache *cc, *dc;
+  struct _obstack_chunk *c, *seg;
+  int k = size_class(stack->chunk_size);
+
+  cc = &tcache.cls[k];
+  if (!cc->top) {
+    /* Take one segment from the depot. */
+    register_thread();
+    dc = &depot[k];
+    pthread_mutex_lock(&depot_lock);
+    seg = dc->top;
+    if (seg) {
+      dc->top = seg->seg_next;
+      if (!dc->top)
+        dc->last = NULL;
+      dc->count -= seg->seg_count;
+      cache_push(cc, seg, seg->seg_count);
+    }
+    pthread_mutex_unlock(&depot_lock);
+  }
+
+  c = cache_pop(cc);
+  if (!c) {
+    c = chunk_map(stack->chunk_size, stack->chunk_size);
+    if (!c)
+      return NULL;
+  }
+  c->flags &= CHUNK_MMAP;
+  /* The tail is left out, so that no object starts at the next chunk. */
+  c->limit = (char *)c + stack->chunk_size - TCOBS_ALIGNMENT;
+  return c;
+}
+
+
+/*
+ * Release the N chunks from TOP down (through PREV), which have the
+ * size of STACK, unless NLARGE of them are large ones.
+ */
+static void
+chunk_put(struct obstack *stack, struct _obstack_chunk *top, size_t n,
+          size_t nlarge)
+{
+  struct chunk_cache *cc, *dc, spill;
+  struct _obstack_chunk *c, *prev, *head = NULL, *tail = NULL;
+  size_t limit, m = 0;
+  int k = size_class(stack->chunk_size);
+
+  if (n == 0)
+    return;
+
+  register_thread();
+  cc = &tcache.cls[k];
+  if (nlarge == 0)
+    cache_push(cc, top, n);
+  else {
+    /* Pick out the large ones. */
+    for (c = top; n > 0; c = prev, n--) {
+      prev = c->prev;
+      if (c->flags & CHUNK_LARGE) {
+        chunk_release(c);
+        continue;
+      }
+      if (tail)
+        tail->prev = c;
+      else
+        head = c;
+      tail = c;
+      m++;
+    }
+    if (m > 0)
+      cache_push(cc, head, m);
+  }
+
+  limit = cache_size / stack->chunk_size;
+  if (limit < 2)
+    limit = 2;
+  if (cc->count <= limit)
+    return;
+
+  /* The thread has too many; let the others have them. */
+  dc = &depot[k];
+  spill.top = spill.last = NULL;
+  spill.count = 0;
+  pthread_mutex_lock(&depot_lock);
+  cache_move(dc, cc);
+  while (dc->count > limit * DEPOT_FACTOR) {
+    c = cache_pop(dc);
+    c->seg_count = 1;
+    c->seg_next = spill.top;
+    spill.top = c;
+  }
+  pthread_mutex_unlock(&depot_lock);
+
+  for (c = spill.top; c != NULL; c = prev) {
+    prev = c->seg_next;
+    chunk_release(c);
+  }
+}
+
+
+void
+_tcobs_begin(struct obstack *stack, long size)
+{
+  struct _obstack_chunk *c;
+
+  if (size <= 0)
+    size = default_chunk_size;
+  stack->chunk_size = (long)1 << (TCOBS_MIN_SHIFT + size_class(size));
+  if (stack->chunk_size > (long)1 << TCOBS_MAX_SHIFT)
+    stack->chunk_size = (long)1 << TCOBS_MAX_SHIFT;
+  stack->alignment_mask = TCOBS_ALIGNMENT - 1;
+
+  stack->chunk = NULL;
+  stack->object_base = stack->next_free = stack->chunk_limit = NULL;
+  stack->maybe_empty_object = 0;
+
+  c = chunk_get(stack);
+  if (!c) {
+    ERROR;
+    return;
+  }
+  c->prev = NULL;
+  c->seq = c->nlarge = 0;
+  stack->chunk = c;
+  stack->object_base = stack->next_free = CONTENTS(c);
+  stack->chunk_limit = c->limit;
+}
+
+
+/*
+ * Move the growing object to a new chunk with room for LENGTH more
+ * bytes.  Returns 0 on success, or -1 on failure.
+ */
+int
+_tcobs_newchunk(struct obstack *stack, long length)
+{
+  struct _obstack_chunk *old = stack->chunk, *c;
+  long obj_size = stack->next_free - stack->object_base;
+  size_t need = sizeof(*c) + obj_size + length + TCOBS_ALIGNMENT;
+
+  if (!old) {
+    ERROR;                      /* freed with obstack_free(STACK, NULL) */
+    return -1;
+  }
+
+  if (need <= (size_t)stack->chunk_size - TCOBS_ALIGNMENT)
+    c = chunk_get(stack);
+  else {
+    c = chunk_map(need, stack->chunk_size);
+    if (c)
+      c->flags |= CHUNK_LARGE;
+  }
+  if (!c) {
+    ERROR;
+    return -1;
+  }
+
+  memcpy(CONTENTS(c), stack->object_base, obj_size);
+
+  /* The object may have been the only one in OLD. */
+  if (stack->object_base == CONTENTS(old) && !stack->maybe_empty_object) {
+    stack->chunk = old->prev;
+    chunk_put(stack, old, 1, (old->flags & CHUNK_LARGE) ? 1 : 0);
+    old = stack->chunk;
+  }
+
+  c->prev = old;
+  c->seq = (old) ? old->seq + 1 : 0;
+  c->nlarge = ((old) ? old->nlarge : 0) + ((c->flags & CHUNK_LARGE) ? 1 : 0);
+
+  stack->chunk = c;
+  stack->object_base = CONTENTS(c);
+  stack->next_free = stack->object_base + obj_size;
+  stack->chunk_limit = c->limit;
+  stack->maybe_empty_object = 0;
+  return 0;
+}
+
+
+void
+_tcobs_free(struct obstack *stack, void *obj)
+{
+  struct _obstack_chunk *top = stack->chunk, *c;
+
+  if (!top)
+    return;
+
+  if (!obj) {
+    chunk_put(stack, top, top->seq + 1, top->nlarge);
+    stack->chunk = NULL;
+    stack->object_base = stack->next_free = stack->chunk_limit = NULL;
+    return;
+  }
+
+  if ((char *)obj < CONTENTS(top) || (char *)obj > top->limit) {
+    c = (struct _obstack_chunk *)((uintptr_t)obj &
+                                  ~(uintptr_t)(stack->chunk_size - 1));
+    assert(c->seq < top->seq && (char *)obj <= c->limit);
+    chunk_put(stack, top, top->seq - c->seq, top->nlarge - c->nlarge);
+    stack->chunk = top = c;
+  }
+  stack->object_base = stack->next_free = obj;
+  stack->chunk_limit = top->limit;
+  /* An empty object below OBJ may start at the same address. */
+  stack->maybe_empty_object = ((char *)obj == CONTENTS(top));
+}
+
+
+void
+tcobs_configure(size_t chunk, size_t huge, size_t cache)
+{
+  if (chunk)
+    default_chunk_size = chunk;
+  if (huge) {
+    /* chunk_map() needs a power of two */
+    for (huge_size = 4096; huge_size < huge; huge_size *= 2)
+      ;
+  }
+  if (cache)
+    cache_size = cache;
+}
+
+
+void
+tcobs_trim(void)
+{
+  struct _obstack_chunk *c;
+  int i;
+
+  pthread_mutex_lock(&depot_lock);
+  for (i = 0; i < NCLASSES; i++) {
+    cache_move(&depot[i], &tcache.cls[i]);
+    while ((c = cache_pop(&depot[i])) != NULL)
+      chunk_release(c);
+  }
+  pthread_mutex_unlock(&depot_lock);
+}
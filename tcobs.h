@@ -0,0 +1,286 @@
+/*
+ * Thread-caching obstack
+ * Copyright (C) 2014  Seong-Kook Shin <cinsky@gmail.com>
+ */
+#ifndef TCOBS_H_
+#define TCOBS_H_
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+/* This indirect using of extern "C" { ... } makes Emacs happy */
+#ifndef BEGIN_C_DECLS
+# ifdef __cplusplus
+#  define BEGIN_C_DECLS extern "C" {
+#  define END_C_DECLS   }
+# else
+#  define BEGIN_C_DECLS
+#  define END_C_DECLS
+# endif
+#endif /* BEGIN_C_DECLS */
+
+BEGIN_C_DECLS
+
+/*
+ * An obstack for multithreaded programs, with the same interface as
+ * GNU obstack (the part that obsutil.h uses).  Build with -DTCOBJS to
+ * use it through obsutil.h instead of GNU obstack or fakeobs:
+ *
+ *   $ cc -DTCOBJS -DLEGACY your-source.c obsutil.c tcobs.c -lpthread
+ *
+ * - The chunks are not given back to malloc() when an obstack frees
+ *   them, but kept in a cache of the thread, and reused by the next
+ *   obstack of the thread that needs a chunk of the same size.  The
+ *   caches of the threads overflow to a shared depot, which also
+ *   keeps the caches of the threads that exited.
+ *
+ * - Every chunk is aligned to the chunk size of its obstack, and no
+ *   object starts farther than that from its chunk, so
+ *   obstack_free() finds the chunk of an object by masking its
+ *   address.  The chunks above it go to the cache as one list, so
+ *   obstack_free() takes constant time however many chunks it
+ *   releases, unless some of them were made for objects larger than
+ *   a chunk.
+ *
+ * - Chunks of tcobs_configure()'s HUGE_SIZE (2 MiB by default) or
+ *   larger are mapped with mmap(), aligned, and marked for
+ *   transparent huge pages.
+ *
+ * The chunk size of obstack_begin(), or of tcobs_configure() for
+ * obstack_init(), is rounded up to a power of two between 4 KiB and
+ * 64 MiB.
+ *
+ * As in GNU obstack, the object passed to obstack_free() must be one
+ * that the obstack returned, or NULL to free everything.  An obstack
+ * may be used by one thread at a time, but it can move between
+ * threads.
+ */
+
+#define TCOBS_ALIGNMENT         16
+#define TCOBS_MIN_SHIFT         12
+#define TCOBS_MAX_SHIFT         26
+
+struct _obstack_chunk {
+  char *limit;                  /* end of the chunk */
+  struct _obstack_chunk *prev;  /* the chunk below this */
+  unsigned long seq;            /* number of the chunks below this */
+  unsigned long nlarge;         /* number of large chunks up to this */
+  size_t size;                  /* bytes allocated for the chunk */
+  unsigned flags;
+
+  /* A list of chunks in a cache is kept in its first chunk. */
+  struct _obstack_chunk *seg_next;
+  unsigned long seg_count;
+} __attribute__((aligned(TCOBS_ALIGNMENT)));
+
+struct obstack {
+  long chunk_size;              /* a power of two */
+  struct _obstack_chunk *chunk; /* the current chunk */
+  char *object_base;            /* the growing object */
+  char *next_free;              /* end of the growing object */
+  char *chunk_limit;            /* no object grows beyond this */
+  long alignment_mask;
+  int maybe_empty_object;       /* an empty object may start at
+                                   OBJECT_BASE */
+};
+
+extern void (*obstack_alloc_failed_handler)(void);
+
+extern void _tcobs_begin(struct obstack *stack, long size);
+extern int _tcobs_newchunk(struct obstack *stack, long length);
+extern void _tcobs_free(struct obstack *stack, void *obj);
+
+/*
+ * Set the chunk size of obstack_init(), the size from which chunks
+ * are mapped on huge pages, and the bytes of chunks of each size that
+ * a thread keeps.  0 leaves a setting as it is.  Affects the obstacks
+ * that are initialized later.
+ */
+extern void tcobs_configure(size_t chunk_size, size_t huge_size,
+                            size_t cache_size);
+
+/* Release the cached chunks of the calling thread and of the depot. */
+extern void tcobs_trim(void);
+
+#define obstack_init(s)         _tcobs_begin((s), 0)
+#define obstack_begin(s, z)     _tcobs_begin((s), (z))
+#define obstack_free(s, p)      _tcobs_free((s), (p))
+
+#define obstack_base(s)                 ((void *)(s)->object_base)
+#define obstack_next_free(s)            ((void *)(s)->next_free)
+#define obstack_alignment_mask(s)       ((s)->alignment_mask)
+#define obstack_chunk_size(s)           ((s)->chunk_size)
+
+
+static __inline__ int
+obstack_object_size(struct obstack *stack)
+{
+  return stack->next_free - stack->object_base;
+}
+
+
+static __inline__ int
+obstack_room(struct obstack *stack)
+{
+  return (stack->chunk_limit > stack->next_free) ?
+    stack->chunk_limit - stack->next_free : 0;
+}
+
+
+static __inline__ int
+tcobs_make_room_(struct obstack *stack, long length)
+{
+  if (stack->chunk_limit - stack->next_free < length)
+    return _tcobs_newchunk(stack, length);
+  return 0;
+}
+
+
+static __inline__ void
+obstack_blank_fast(struct obstack *stack, int size)
+{
+  stack->next_free += size;
+}
+
+
+static __inline__ void
+obstack_blank(struct obstack *stack, int size)
+{
+  if (size > 0 && tcobs_make_room_(stack, size) < 0)
+    return;
+  stack->next_free += size;
+}
+
+
+static __inline__ void
+obstack_grow(struct obstack *stack, const void *data, int size)
+{
+  if (tcobs_make_room_(stack, size) < 0)
+    return;
+  memcpy(stack->next_free, data, size);
+  stack->next_free += size;
+}
+
+
+static __inline__ void
+obstack_grow0(struct obstack *stack, const void *data, int size)
+{
+  if (tcobs_make_room_(stack, size + 1) < 0)
+    return;
+  memcpy(stack->next_free, data, size);
+  stack->next_free[size] = '\0';
+  stack->next_free += size + 1;
+}
+
+
+static __inline__ void
+obstack_1grow_fast(struct obstack *stack, char c)
+{
+  *stack->next_free++ = c;
+}
+
+
+static __inline__ void
+obstack_1grow(struct obstack *stack, char c)
+{
+  if (tcobs_make_room_(stack, 1) < 0)
+    return;
+  *stack->next_free++ = c;
+}
+
+
+static __inline__ void
+obstack_ptr_grow_fast(struct obstack *stack, void *data)
+{
+  memcpy(stack->next_free, &data, sizeof(data));
+  stack->next_free += sizeof(data);
+}
+
+
+static __inline__ void
+obstack_ptr_grow(struct obstack *stack, void *data)
+{
+  if (tcobs_make_room_(stack, sizeof(data)) < 0)
+    return;
+  obstack_ptr_grow_fast(stack, data);
+}
+
+
+static __inline__ void
+obstack_int_grow_fast(struct obstack *stack, int data)
+{
+  memcpy(stack->next_free, &data, sizeof(data));
+  stack->next_free += sizeof(data);
+}
+
+
+static __inline__ void
+obstack_int_grow(struct obstack *stack, int data)
+{
+  if (tcobs_make_room_(stack, sizeof(data)) < 0)
+    return;
+  obstack_int_grow_fast(stack, data);
+}
+
+
+static __inline__ void *
+obstack_finish(struct obstack *stack)
+{
+  char *value = stack->object_base;
+  uintptr_t p = (uintptr_t)stack->next_free;
+
+  if (stack->next_free == value)
+    stack->maybe_empty_object = 1;
+
+  p = (p + stack->alignment_mask) & ~(uintptr_t)stack->alignment_mask;
+  stack->next_free = ((char *)p > stack->chunk_limit) ?
+    stack->chunk_limit : (char *)p;
+
+  /* Close a large chunk when an object would start out of reach of
+   * the mask; see _tcobs_free().  CHUNK_LIMIT is put below NEXT_FREE,
+   * so that even an empty object goes to a new chunk. */
+  if (stack->next_free - (char *)stack->chunk >
+      stack->chunk_size - TCOBS_ALIGNMENT)
+    stack->chunk_limit = stack->next_free - 1;
+
+  stack->object_base = stack->next_free;
+  return value;
+}
+
+
+static __inline__ void *
+obstack_alloc(struct obstack *stack, int size)
+{
+  if (tcobs_make_room_(stack, size) < 0)
+    return 0;
+  stack->next_free += size;
+  return obstack_finish(stack);
+}
+
+
+static __inline__ void *
+obstack_copy(struct obstack *stack, const void *address, int size)
+{
+  if (tcobs_make_room_(stack, size) < 0)
+    return 0;
+  memcpy(stack->next_free, address, size);
+  stack->next_free += size;
+  return obstack_finish(stack);
+}
+
+
+static __inline__ void *
+obstack_copy0(struct obstack *stack, const void *address, int size)
+{
+  if (tcobs_make_room_(stack, size + 1) < 0)
+    return 0;
+  memcpy(stack->next_free, address, size);
+  stack->next_free[size] = '\0';
+  stack->next_free += size + 1;
+  return obstack_finish(stack);
+}
+
+END_C_DECLS
+
+#endif /* TCOBS_H_ */
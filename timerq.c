@@ -0,0 +1,428 @@
+/*
+ * Timer service for poll/epoll loops
+ * Copyright (C) 2014  Seong-Kook Shin <cinsky@gmail.com>
+ * DO WHAT THE FUCK YOU WANT TO PUBLIC LICENSE
+ * Version 2, December 2004
+ */
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/timerfd.h>
+
+#include "heap.h"
+#include "timerq.h"
+
+#define TQ_NOSLOT       ((unsigned)-1)
+
+#define TQ_LESS(a, b)   ((a) < (b))
+DHEAP_DEFINE(tq_heap, uint64_t, timerq_handle_t, TQ_LESS);
+
+/*
+ * A timer slot.  A handle is (GEN << 32 | slot index); cancelling or
+ * firing a timer bumps GEN, which invalidates the handle and the heap
+ * entry that carries it at once.
+ */
+struct tq_slot {
+  timerq_callback callback;     /* NULL if the slot is free */
+  void *arg;
+  unsigned gen;
+  unsigned next_free;
+};
+
+struct timerq {
+  tq_heap heap;                 /* deadline -> handle, with stale entries */
+
+  struct tq_slot *slots;
+  unsigned nslots;
+  unsigned free_slot;
+  unsigned active;              /* # of pending timers */
+
+  unsigned slack;
+
+  int tfd;
+  uint64_t armed;               /* deadline the timerfd is set to, or 0 */
+
+  timerq_handle_t *batch;       /* handles collected by timerq_expire() */
+  unsigned batch_size;
+};
+
+
+static uint64_t
+now_ms(void)
+{
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+
+static __inline__ struct tq_slot *
+handle_slot(timerq_t *tq, timerq_handle_t handle)
+{
+  unsigned idx = (unsigned)handle;
+
+  if (idx >= tq->nslots || tq->slots[idx].gen != (unsigned)(handle >> 32) ||
+      !tq->slots[idx].callback)
+    return NULL;
+  return tq->slots + idx;
+}
+
+
+static void
+release_slot(timerq_t *tq, struct tq_slot *slot)
+{
+  slot->callback = NULL;
+  slot->arg = NULL;
+  if (++slot->gen == 0)
+    slot->gen = 1;
+  slot->next_free = tq->free_slot;
+  tq->free_slot = slot - tq->slots;
+  tq->active--;
+}
+
+
+/*
+ * Drop stale entries at the top of the heap.
+ */
+static void
+prune_top(timerq_t *tq)
+{
+  timerq_handle_t handle;
+
+  while (tq_heap_top(&tq->heap, 0, &handle) && !handle_slot(tq, handle))
+    tq_heap_pop(&tq->heap, 0, 0);
+}
+
+
+/*
+ * Rebuild the heap without stale entries, if they outnumber the live
+ * ones.  Keeps the memory proportional to the pending timers when
+ * most timers are cancelled long before their deadlines.
+ */
+static void
+compact(timerq_t *tq)
+{
+  tq_heap live;
+  unsigned i;
+
+  if (tq->heap.end < 1024 || tq->heap.end < tq->active * 2)
+    return;
+
+  tq_heap_init(&live);
+  if (tq_heap_reserve(&live, tq->active + 1) < 0)
+    return;
+  for (i = 0; i < tq->heap.end; i++)
+    if (handle_slot(tq, tq->heap.values[tq->heap.body[i].handle]))
+      tq_heap_append(&live, tq->heap.body[i].key,
+                     tq->heap.values[tq->heap.body[i].handle]);
+  tq_heap_heapify(&live);
+
+  tq_heap_free(&tq->heap);
+  tq->heap = live;
+}
+
+
+/*
+ * Set the timerfd to the earliest pending deadline, if it changed.
+ */
+static void
+rearm(timerq_t *tq)
+{
+  struct itimerspec its;
+  uint64_t deadline = 0;
+
+  if (tq->tfd < 0)
+    return;
+
+  prune_top(tq);
+  tq_heap_top(&tq->heap, &deadline, 0);
+  if (deadline == tq->armed)
+    return;
+
+  memset(&its, 0, sizeof(its));
+  if (deadline) {
+    its.it_value.tv_sec = deadline / 1000;
+    its.it_value.tv_nsec = (deadline % 1000) * 1000000;
+  }
+  if (timerfd_settime(tq->tfd, TFD_TIMER_ABSTIME, &its, NULL) == 0)
+    tq->armed = deadline;
+}
+
+
+timerq_t *
+timerq_new(unsigned slack, int flags)
+{
+  timerq_t *tq;
+
+  tq = calloc(1, sizeof(*tq));
+  if (!tq)
+    return NULL;
+
+  tq_heap_init(&tq->heap);
+  tq->free_slot = TQ_NOSLOT;
+  tq->slack = slack;
+  tq->tfd = -1;
+
+  if (flags & TIMERQ_TIMERFD) {
+    tq->tfd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+    if (tq->tfd < 0) {
+      free(tq);
+      return NULL;
+    }
+  }
+  return tq;
+}
+
+
+void
+timerq_delete(timerq_t *tq)
+{
+  if (tq->tfd >= 0)
+    close(tq->tfd);
+  tq_heap_free(&tq->heap);
+  free(tq->slots);
+  free(tq->batch);
+  free(tq);
+}
+
+
+timerq_handle_t
+timerq_add(timerq_t *tq, unsigned timeout, timerq_callback callback,
+           void *arg)
+{
+  struct tq_slot *slot;
+  timerq_handle_t handle;
+  uint64_t deadline;
+  unsigned idx, n;
+  void *p;
+
+  if (!callback) {
+    errno = EINVAL;
+    return 0;
+  }
+
+  compact(tq);
+
+  if (tq->free_slot == TQ_NOSLOT) {
+    n = (tq->nslots) ? tq->nslots * 2 : 64;
+    p = realloc(tq->slots, sizeof(*tq->slots) * n);
+    if (!p)
+      return 0;
+    tq->slots = p;
+    for (idx = n; idx-- > tq->nslots;) {
+      tq->slots[idx].callback = NULL;
+      tq->slots[idx].gen = 1;
+      tq->slots[idx].next_free = tq->free_slot;
+      tq->free_slot = idx;
+    }
+    tq->nslots = n;
+  }
+
+  idx = tq->free_slot;
+  slot = tq->slots + idx;
+  handle = ((timerq_handle_t)slot->gen << 32) | idx;
+
+  deadline = now_ms() + timeout;
+  if (tq->slack > 1)
+    deadline = (deadline + tq->slack - 1) / tq->slack * tq->slack;
+
+  if (tq_heap_push(&tq->heap, deadline, handle) == DHEAP_NOHANDLE)
+    return 0;
+
+  tq->free_slot = slot->next_free;
+  slot->callback = callback;
+  slot->arg = arg;
+  tq->active++;
+
+  if (tq->tfd >= 0 && (!tq->armed || deadline < tq->armed))
+    rearm(tq);
+  return handle;
+}
+
+
+int
+timerq_cancel(timerq_t *tq, timerq_handle_t handle)
+{
+  struct tq_slot *slot = handle_slot(tq, handle);
+
+  if (!slot)
+    return -1;
+  release_slot(tq, slot);
+  return 0;
+}
+
+
+int
+timerq_expire(timerq_t *tq)
+{
+  timerq_handle_t handle;
+  timerq_callback callback;
+  struct tq_slot *slot;
+  uint64_t now, deadline, expirations;
+  unsigned i, n = 0;
+  void *arg, *p;
+  int fired = 0;
+
+  if (tq->tfd >= 0) {
+    /* Clear the readiness; EAGAIN means a spurious wakeup. */
+    if (read(tq->tfd, &expirations, sizeof(expirations)) < 0 &&
+        errno != EAGAIN)
+      return -1;
+    tq->armed = 0;
+  }
+
+  /* Collect the due timers first, so that timers added by the
+   * callbacks run in the next batch. */
+  now = now_ms();
+  while (tq_heap_top(&tq->heap, &deadline, &handle) && deadline <= now) {
+    tq_heap_pop(&tq->heap, 0, 0);
+    if (!handle_slot(tq, handle))
+      continue;
+    if (n >= tq->batch_size) {
+      i = (tq->batch_size) ? tq->batch_size * 2 : 64;
+      p = realloc(tq->batch, sizeof(*tq->batch) * i);
+      if (!p) {
+        tq_heap_push(&tq->heap, deadline, handle);
+        break;
+      }
+      tq->batch = p;
+      tq->batch_size = i;
+    }
+    tq->batch[n++] = handle;
+  }
+
+  for (i = 0; i < n; i++) {
+    /* An earlier callback may have cancelled this one. */
+    slot = handle_slot(tq, tq->batch[i]);
+    if (!slot)
+      continue;
+    callback = slot->callback;
+    arg = slot->arg;
+    release_slot(tq, slot);
+    callback(tq->batch[i], arg);
+    fired++;
+  }
+
+  compact(tq);
+  rearm(tq);
+  return fired;
+}
+
+
+int
+timerq_timeout(timerq_t *tq)
+{
+  uint64_t deadline, now;
+
+  prune_top(tq);
+  if (!tq_heap_top(&tq->heap, &deadline, 0))
+    return -1;
+
+  now = now_ms();
+  if (deadline <= now)
+    return 0;
+  if (deadline - now > (uint64_t)0x7fffffff)
+    return 0x7fffffff;
+  return (int)(deadline - now);
+}
+
+
+int
+timerq_fd(timerq_t *tq)
+{
+  return tq->tfd;
+}
+
+
+unsigned
+timerq_count(timerq_t *tq)
+{
+  return tq->active;
+}
+
+
+#ifdef TEST_TIMERQ
+#include <stdio.h>
+#include <poll.h>
+
+/*
+ * Connection-timeout workload: NTIMERS pending timers with timeouts
+ * up to 2 seconds.  Every step cancels a random timer and re-adds it,
+ * as a connection does on activity.  The event loop polls the timerfd
+ * for 3 seconds.
+ *
+ *   $ ./timerq [NTIMERS] [SLACK-MS] [STEPS-PER-LOOP]
+ */
+static unsigned long nfired;
+
+static void
+on_timeout(timerq_handle_t handle, void *arg)
+{
+  timerq_handle_t *slot = arg;
+
+  if (*slot != handle)
+    abort();
+  *slot = 0;
+  nfired++;
+}
+
+static double
+elapsed(struct timespec *beg)
+{
+  struct timespec end;
+
+  clock_gettime(CLOCK_MONOTONIC, &end);
+  return (end.tv_sec - beg->tv_sec) + (end.tv_nsec - beg->tv_nsec) / 1e9;
+}
+
+int
+main(int argc, char *argv[])
+{
+  unsigned ntimers = (argc > 1) ? atoi(argv[1]) : 100000;
+  unsigned slack = (argc > 2) ? atoi(argv[2]) : 10;
+  unsigned steps = (argc > 3) ? atoi(argv[3]) : 10000;
+  unsigned long ncancels = 0, nwakeups = 0, i, k;
+  timerq_handle_t *handles;
+  struct timespec beg;
+  struct pollfd pfd;
+  double sec;
+  timerq_t *tq;
+
+  tq = timerq_new(slack, TIMERQ_TIMERFD);
+  handles = calloc(ntimers, sizeof(*handles));
+
+  clock_gettime(CLOCK_MONOTONIC, &beg);
+  for (i = 0; i < ntimers; i++)
+    handles[i] = timerq_add(tq, rand() % 2000, on_timeout, &handles[i]);
+
+  pfd.fd = timerq_fd(tq);
+  pfd.events = POLLIN;
+  while (elapsed(&beg) < 3.0) {
+    if (poll(&pfd, 1, 1) > 0) {
+      nwakeups++;
+      timerq_expire(tq);
+    }
+    for (k = 0; k < steps; k++) {
+      i = rand() % ntimers;
+      if (handles[i] && timerq_cancel(tq, handles[i]) == 0)
+        ncancels++;
+      handles[i] = timerq_add(tq, 1000 + rand() % 1000, on_timeout,
+                              &handles[i]);
+    }
+  }
+  sec = elapsed(&beg);
+
+  printf("%u timers, slack %u ms: %.2f sec\n", ntimers, slack, sec);
+  printf("  %lu cancels (%.2f M/s incl. re-add), %lu fired, "
+         "%lu wakeups, %u pending, heap %u\n",
+         ncancels, ncancels / sec / 1e6, nfired, nwakeups,
+         timerq_count(tq), tq->heap.end);
+
+  timerq_delete(tq);
+  free(handles);
+  return 0;
+}
+#endif  /* TEST_TIMERQ */
@@ -0,0 +1,124 @@
+#ifndef TIMERQ_H__
+#define TIMERQ_H__
+
+/*
+ * Timer service for poll/epoll loops
+ * Copyright (C) 2014  Seong-Kook Shin <cinsky@gmail.com>
+ * DO WHAT THE FUCK YOU WANT TO PUBLIC LICENSE
+ * Version 2, December 2004
+ */
+
+/*
+ * 'timerq' is a one-shot timer facility built on DHEAP_DEFINE() in
+ * heap.h, for the daemons that keep a heap of deadlines and compute
+ * the poll(2) timeout from it by hand.
+ *
+ * - Cancelling a timer is O(1): it only invalidates the handle.  The
+ *   stale heap entry is dropped when it reaches the top, or when
+ *   stale entries outnumber the live ones and the heap is rebuilt.
+ *
+ * - Deadlines are rounded up to a multiple of SLACK milliseconds, so
+ *   timers that expire close together share one wakeup.  A timer
+ *   never fires early, and fires at most SLACK milliseconds late.
+ *
+ * - timerq_expire() runs every due timer in one batch.
+ *
+ * - If created with TIMERQ_TIMERFD, timerq owns a timerfd(2) that
+ *   becomes readable when the earliest timer is due.  Add it to your
+ *   poll set (pollxx, epoll, ...) and call timerq_expire() when it is
+ *   readable.  Otherwise, use timerq_timeout() as the poll timeout,
+ *   and call timerq_expire() after every poll.
+ *
+ *   timerq_t *tq = timerq_new(10, TIMERQ_TIMERFD);
+ *   ...
+ *   c->timer = timerq_add(tq, 30000, conn_timeout, c);
+ *   ...
+ *   timerq_cancel(tq, c->timer);        // on activity
+ *   c->timer = timerq_add(tq, 30000, conn_timeout, c);
+ *   ...
+ *   pfd.fd = timerq_fd(tq);
+ *   pfd.events = POLLIN;
+ *   ...
+ *   if (pfd.revents & POLLIN)
+ *     timerq_expire(tq);
+ *
+ * timerq is not thread-safe; use one per event loop.
+ *
+ *   $ cc -D_GNU_SOURCE your-source.c timerq.c
+ */
+
+/* This indirect using of extern "C" { ... } makes Emacs happy */
+#ifndef BEGIN_C_DECLS
+# ifdef __cplusplus
+#  define BEGIN_C_DECLS extern "C" {
+#  define END_C_DECLS   }
+# else
+#  define BEGIN_C_DECLS
+#  define END_C_DECLS
+# endif
+#endif /* BEGIN_C_DECLS */
+
+#include <stdint.h>
+
+BEGIN_C_DECLS
+
+struct timerq;
+typedef struct timerq timerq_t;
+
+/* A handle of a timer; zero is never a valid handle. */
+typedef uint64_t timerq_handle_t;
+
+typedef void (*timerq_callback)(timerq_handle_t handle, void *arg);
+
+#define TIMERQ_TIMERFD  0x01    /* create a timerfd */
+
+/*
+ * Create a timer queue that coalesces deadlines within SLACK
+ * milliseconds.  SLACK 0 disables the coalescing.  FLAGS is zero or
+ * TIMERQ_TIMERFD.  Returns NULL on failure.
+ */
+extern timerq_t *timerq_new(unsigned slack, int flags);
+
+extern void timerq_delete(timerq_t *tq);
+
+/*
+ * Register a timer that calls CALLBACK with ARG after TIMEOUT
+ * milliseconds.  Returns its handle, or zero on failure.
+ */
+extern timerq_handle_t timerq_add(timerq_t *tq, unsigned timeout,
+                                  timerq_callback callback, void *arg);
+
+/*
+ * Cancel the timer HANDLE.  Returns 0 on success, or -1 if HANDLE is
+ * not pending (already fired or cancelled).  It is safe to cancel
+ * any timer, including the running one, from a callback.
+ */
+extern int timerq_cancel(timerq_t *tq, timerq_handle_t handle);
+
+/*
+ * Run the callbacks of all due timers.  Returns the number of fired
+ * timers.
+ */
+extern int timerq_expire(timerq_t *tq);
+
+/*
+ * Return the milliseconds until the earliest pending deadline, 0 if
+ * some timer is already due, or -1 if there is no timer; suitable as
+ * the timeout of poll(2).
+ */
+extern int timerq_timeout(timerq_t *tq);
+
+/*
+ * Return the timerfd of TQ, or -1 if TQ was created without
+ * TIMERQ_TIMERFD.
+ */
+extern int timerq_fd(timerq_t *tq);
+
+/*
+ * Return the number of pending timers.
+ */
+extern unsigned timerq_count(timerq_t *tq);
+
+END_C_DECLS
+
+#endif  /* TIMERQ_H__ */
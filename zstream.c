@@ -0,0 +1,902 @@
+/*
+ * Compressed stream_ops backends for the light file stream
+ * Copyright (C) 2004  Seong-Kook Shin <cinsky@gmail.com>
+ */
+#include <zstream.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <pthread.h>
+#include <zlib.h>
+
+#ifdef HAVE_ZSTD
+# include <zstd.h>
+#endif
+
+#ifndef ZSTREAM_BUFSIZ
+# define ZSTREAM_BUFSIZ         (128 * 1024)    /* compressed I/O buffer */
+#endif
+
+#ifndef ZSTREAM_BLKSIZE
+# define ZSTREAM_BLKSIZE        (1024 * 1024)   /* default block per thread */
+#endif
+
+#define ZSTREAM_MAX_THREADS     64
+
+/*
+ * A block of the multi-threaded gzip writer.  Each block is compressed
+ * into a complete gzip member by its own thread.
+ */
+struct zblock {
+  unsigned char *in;
+  size_t inlen;
+
+  unsigned char *out;
+  size_t outlen;
+  size_t outcap;
+
+  int level;
+  int error;                    /* nonzero if the compression failed */
+};
+
+struct zfile {
+  int fd;
+  int writing;
+  int format;
+  int level;
+
+  off_t pos;                    /* uncompressed position */
+
+  unsigned char *buf;           /* compressed I/O buffer */
+  unsigned char *next;          /* unconsumed input in BUF (reading) */
+  size_t avail;                 /* # of bytes in NEXT */
+
+  unsigned eof:      1;         /* nonzero if FD reached EOF */
+  unsigned in_frame: 1;         /* nonzero in a gzip member or a zstd frame */
+  unsigned pending:  1;         /* nonzero if the decoder may have output */
+
+  z_stream zs;
+  int zs_ready;
+
+#ifdef HAVE_ZSTD
+  ZSTD_DStream *zds;
+  ZSTD_CCtx *zcc;
+#endif
+
+  struct zblock *blocks;        /* multi-threaded gzip writer */
+  int nblocks;
+  int curblk;
+  size_t blksize;
+};
+
+static struct zfile **zfiles;
+static int nzfiles;
+static pthread_mutex_t zfiles_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static int zs_open(const char *pathname, int flags, void *data);
+static int zs_creat(const char *pathname, mode_t mode, void *data);
+static int zs_close(int fd, void *data);
+static ssize_t zs_read(int fd, void *buf, size_t count, void *data);
+static ssize_t zs_write(int fd, const void *buf, size_t count, void *data);
+static off_t zs_lseek(int fd, off_t offset, int whence, void *data);
+
+struct stream_ops zstream_ops = {
+  zs_open,
+  zs_creat,
+  zs_close,
+  zs_read,
+  zs_write,
+  zs_lseek,
+};
+
+
+/*
+ * The state of each zstream is kept in ZFILES, indexed by the fd.
+ */
+static int
+zfile_register(struct zfile *zf)
+{
+  struct zfile **p;
+  int n;
+
+  pthread_mutex_lock(&zfiles_lock);
+  if (zf->fd >= nzfiles) {
+    n = (nzfiles) ? nzfiles : 16;
+    while (n <= zf->fd)
+      n *= 2;
+    p = realloc(zfiles, sizeof(*p) * n);
+    if (!p) {
+      pthread_mutex_unlock(&zfiles_lock);
+      return -1;
+    }
+    memset(p + nzfiles, 0, sizeof(*p) * (n - nzfiles));
+    zfiles = p;
+    nzfiles = n;
+  }
+  zfiles[zf->fd] = zf;
+  pthread_mutex_unlock(&zfiles_lock);
+  return 0;
+}
+
+
+static struct zfile *
+zfile_get(int fd, int remove)
+{
+  struct zfile *zf = 0;
+
+  pthread_mutex_lock(&zfiles_lock);
+  if (fd >= 0 && fd < nzfiles) {
+    zf = zfiles[fd];
+    if (remove)
+      zfiles[fd] = 0;
+  }
+  pthread_mutex_unlock(&zfiles_lock);
+
+  if (!zf)
+    errno = EBADF;
+  return zf;
+}
+
+
+static int
+write_all(int fd, const void *buf, size_t count)
+{
+  const char *p = buf;
+  ssize_t written;
+
+  while (count > 0) {
+    written = write(fd, p, count);
+    if (written < 0) {
+      if (errno == EINTR)
+        continue;
+      return -1;
+    }
+    p += written;
+    count -= written;
+  }
+  return 0;
+}
+
+
+/*
+ * Read more compressed input into zfile::buf if there is no
+ * unconsumed input.  Sets zfile::eof on EOF.
+ */
+static int
+fill_input(struct zfile *zf)
+{
+  ssize_t readch;
+
+  if (zf->avail > 0 || zf->eof)
+    return 0;
+
+  do {
+    readch = read(zf->fd, zf->buf, ZSTREAM_BUFSIZ);
+  } while (readch < 0 && errno == EINTR);
+
+  if (readch < 0)
+    return -1;
+  if (readch == 0)
+    zf->eof = 1;
+  zf->next = zf->buf;
+  zf->avail = readch;
+  return 0;
+}
+
+
+/*
+ * Detect the format from the magic number of the input.
+ */
+static int
+detect_format(struct zfile *zf)
+{
+  ssize_t readch;
+
+  zf->next = zf->buf;
+  zf->avail = 0;
+  while (zf->avail < 4) {
+    readch = read(zf->fd, zf->buf + zf->avail, ZSTREAM_BUFSIZ - zf->avail);
+    if (readch < 0) {
+      if (errno == EINTR)
+        continue;
+      return -1;
+    }
+    if (readch == 0) {
+      zf->eof = 1;
+      break;
+    }
+    zf->avail += readch;
+  }
+
+  if (zf->avail >= 2 && zf->buf[0] == 0x1f && zf->buf[1] == 0x8b)
+    return ZSTREAM_GZIP;
+  if (zf->avail >= 4 && zf->buf[0] == 0x28 && zf->buf[1] == 0xb5 &&
+      zf->buf[2] == 0x2f && zf->buf[3] == 0xfd)
+    return ZSTREAM_ZSTD;
+  return ZSTREAM_NONE;
+}
+
+
+static int
+init_reader(struct zfile *zf)
+{
+  zf->format = detect_format(zf);
+
+  switch (zf->format) {
+  case ZSTREAM_GZIP:
+    if (inflateInit2(&zf->zs, 15 + 16) != Z_OK)
+      goto nomem;
+    zf->zs_ready = 1;
+    break;
+
+  case ZSTREAM_ZSTD:
+#ifdef HAVE_ZSTD
+    zf->zds = ZSTD_createDStream();
+    if (!zf->zds)
+      goto nomem;
+    break;
+#else
+    errno = EPROTONOSUPPORT;
+    return -1;
+#endif
+
+  case ZSTREAM_NONE:
+    break;
+
+  default:
+    return -1;
+  }
+  return 0;
+
+ nomem:
+  errno = ENOMEM;
+  return -1;
+}
+
+
+static int
+init_writer(struct zfile *zf, const char *pathname,
+            const struct zstream_param *param)
+{
+  size_t len = strlen(pathname);
+  int i, threads = (param) ? param->threads : 1;
+
+  zf->format = (param) ? param->format : ZSTREAM_AUTO;
+  if (zf->format == ZSTREAM_AUTO) {
+    if (len > 4 && strcmp(pathname + len - 4, ".zst") == 0)
+      zf->format = ZSTREAM_ZSTD;
+    else
+      zf->format = ZSTREAM_GZIP;
+  }
+
+  zf->level = (param && param->level) ? param->level : -1;
+  if (threads > ZSTREAM_MAX_THREADS)
+    threads = ZSTREAM_MAX_THREADS;
+
+  switch (zf->format) {
+  case ZSTREAM_GZIP:
+    if (threads <= 1) {
+      if (deflateInit2(&zf->zs, zf->level, Z_DEFLATED, 15 + 16, 8,
+                       Z_DEFAULT_STRATEGY) != Z_OK)
+        goto nomem;
+      zf->zs_ready = 1;
+      break;
+    }
+
+    zf->blksize = (param && param->blksize) ? param->blksize : ZSTREAM_BLKSIZE;
+    zf->blocks = calloc(threads, sizeof(*zf->blocks));
+    if (!zf->blocks)
+      goto nomem;
+    zf->nblocks = threads;
+    for (i = 0; i < threads; i++) {
+      zf->blocks[i].in = malloc(zf->blksize);
+      if (!zf->blocks[i].in)
+        goto nomem;
+      zf->blocks[i].level = zf->level;
+    }
+    break;
+
+  case ZSTREAM_ZSTD:
+#ifdef HAVE_ZSTD
+    zf->zcc = ZSTD_createCCtx();
+    if (!zf->zcc)
+      goto nomem;
+    if (param && param->level)
+      ZSTD_CCtx_setParameter(zf->zcc, ZSTD_c_compressionLevel, param->level);
+    if (threads > 1) {
+      /* fails if libzstd is built without multi-threading; ignore it. */
+      ZSTD_CCtx_setParameter(zf->zcc, ZSTD_c_nbWorkers, threads);
+      if (param && param->blksize)
+        ZSTD_CCtx_setParameter(zf->zcc, ZSTD_c_jobSize, (int)param->blksize);
+    }
+    break;
+#else
+    errno = EPROTONOSUPPORT;
+    return -1;
+#endif
+
+  default:
+    errno = EINVAL;
+    return -1;
+  }
+  return 0;
+
+ nomem:
+  errno = ENOMEM;
+  return -1;
+}
+
+
+static void
+free_zfile(struct zfile *zf)
+{
+  int i;
+
+  if (zf->zs_ready) {
+    if (zf->writing)
+      deflateEnd(&zf->zs);
+    else
+      inflateEnd(&zf->zs);
+  }
+#ifdef HAVE_ZSTD
+  if (zf->zds)
+    ZSTD_freeDStream(zf->zds);
+  if (zf->zcc)
+    ZSTD_freeCCtx(zf->zcc);
+#endif
+  if (zf->blocks) {
+    for (i = 0; i < zf->nblocks; i++) {
+      free(zf->blocks[i].in);
+      free(zf->blocks[i].out);
+    }
+    free(zf->blocks);
+  }
+  free(zf->buf);
+  free(zf);
+}
+
+
+static int
+zs_open(const char *pathname, int flags, void *data)
+{
+  const struct zstream_param *param = data;
+  struct zfile *zf;
+  int saved_errno;
+
+  if ((flags & O_ACCMODE) == O_RDWR) {
+    errno = EINVAL;
+    return -1;
+  }
+
+  zf = calloc(1, sizeof(*zf));
+  if (!zf)
+    return -1;
+  zf->writing = ((flags & O_ACCMODE) == O_WRONLY);
+
+  /* Appending to a compressed file adds a new member (or frame). */
+  if (zf->writing && !(flags & O_TRUNC))
+    flags |= O_APPEND;
+
+  zf->buf = malloc(ZSTREAM_BUFSIZ);
+  if (!zf->buf) {
+    free(zf);
+    return -1;
+  }
+
+  zf->fd = open(pathname, flags, 0666);
+  if (zf->fd == -1)
+    goto err;
+
+  if ((zf->writing) ? init_writer(zf, pathname, param) < 0
+      : init_reader(zf) < 0)
+    goto err;
+
+  if (zfile_register(zf) < 0)
+    goto err;
+  return zf->fd;
+
+ err:
+  saved_errno = errno;
+  if (zf->fd != -1)
+    close(zf->fd);
+  free_zfile(zf);
+  errno = saved_errno;
+  return -1;
+}
+
+
+static int
+zs_creat(const char *pathname, mode_t mode, void *data)
+{
+  return zs_open(pathname, O_WRONLY | O_CREAT | O_TRUNC, data);
+}
+
+
+static ssize_t
+gzip_read(struct zfile *zf, void *buf, size_t count)
+{
+  int ret;
+
+  zf->zs.next_out = buf;
+  zf->zs.avail_out = count;
+
+  while (zf->zs.avail_out > 0) {
+    if (zf->avail == 0 && !zf->pending) {
+      if (zf->zs.avail_out < count)
+        break;                  /* do not block if we have something */
+      if (fill_input(zf) < 0)
+        return -1;
+      if (zf->avail == 0) {
+        if (zf->in_frame) {
+          errno = EIO;          /* truncated */
+          return -1;
+        }
+        break;
+      }
+    }
+
+    if (!zf->in_frame && zf->avail > 0) {
+      inflateReset(&zf->zs);
+      zf->in_frame = 1;
+    }
+
+    zf->zs.next_in = zf->next;
+    zf->zs.avail_in = zf->avail;
+    ret = inflate(&zf->zs, Z_NO_FLUSH);
+    zf->next = zf->zs.next_in;
+    zf->avail = zf->zs.avail_in;
+
+    if (ret == Z_STREAM_END)
+      zf->in_frame = 0;
+    else if (ret != Z_OK && ret != Z_BUF_ERROR) {
+      errno = EIO;
+      return -1;
+    }
+    zf->pending = (zf->zs.avail_out == 0);
+  }
+
+  return count - zf->zs.avail_out;
+}
+
+
+#ifdef HAVE_ZSTD
+static ssize_t
+zstd_read(struct zfile *zf, void *buf, size_t count)
+{
+  ZSTD_outBuffer out = { buf, count, 0 };
+  ZSTD_inBuffer in;
+  size_t ret;
+
+  while (out.pos < out.size) {
+    if (zf->avail == 0 && !zf->pending) {
+      if (out.pos > 0)
+        break;
+      if (fill_input(zf) < 0)
+        return -1;
+      if (zf->avail == 0) {
+        if (zf->in_frame) {
+          errno = EIO;
+          return -1;
+        }
+        break;
+      }
+    }
+
+    in.src = zf->next;
+    in.size = zf->avail;
+    in.pos = 0;
+    ret = ZSTD_decompressStream(zf->zds, &out, &in);
+    zf->next += in.pos;
+    zf->avail -= in.pos;
+
+    if (ZSTD_isError(ret)) {
+      errno = EIO;
+      return -1;
+    }
+    zf->in_frame = (ret != 0);
+    zf->pending = (out.pos == out.size);
+  }
+
+  return out.pos;
+}
+#endif  /* HAVE_ZSTD */
+
+
+static ssize_t
+plain_read(struct zfile *zf, void *buf, size_t count)
+{
+  size_t n;
+
+  if (zf->avail > 0) {
+    n = (count < zf->avail) ? count : zf->avail;
+    memcpy(buf, zf->next, n);
+    zf->next += n;
+    zf->avail -= n;
+    return n;
+  }
+  if (zf->eof)
+    return 0;
+  return read(zf->fd, buf, count);
+}
+
+
+static ssize_t
+zs_read(int fd, void *buf, size_t count, void *data)
+{
+  struct zfile *zf = zfile_get(fd, 0);
+  ssize_t readch;
+
+  if (!zf)
+    return -1;
+  if (zf->writing) {
+    errno = EBADF;
+    return -1;
+  }
+
+  switch (zf->format) {
+  case ZSTREAM_GZIP:
+    readch = gzip_read(zf, buf, count);
+    break;
+#ifdef HAVE_ZSTD
+  case ZSTREAM_ZSTD:
+    readch = zstd_read(zf, buf, count);
+    break;
+#endif
+  default:
+    readch = plain_read(zf, buf, count);
+    break;
+  }
+
+  if (readch > 0)
+    zf->pos += readch;
+  return readch;
+}
+
+
+/*
+ * Feed COUNT bytes to the single-threaded gzip encoder, and write the
+ * compressed output.  FLUSH is Z_NO_FLUSH or Z_FINISH.
+ */
+static int
+gzip_deflate(struct zfile *zf, const void *buf, size_t count, int flush)
+{
+  int ret;
+
+  zf->zs.next_in = (unsigned char *)buf;
+  zf->zs.avail_in = count;
+
+  do {
+    zf->zs.next_out = zf->buf;
+    zf->zs.avail_out = ZSTREAM_BUFSIZ;
+    ret = deflate(&zf->zs, flush);
+    if (ret == Z_STREAM_ERROR) {
+      errno = EIO;
+      return -1;
+    }
+    if (write_all(zf->fd, zf->buf, ZSTREAM_BUFSIZ - zf->zs.avail_out) < 0)
+      return -1;
+  } while (zf->zs.avail_out == 0 ||
+           (flush == Z_FINISH && ret != Z_STREAM_END));
+
+  return 0;
+}
+
+
+/*
+ * Compress a block into a complete gzip member.  Runs on a worker
+ * thread.
+ */
+static void *
+compress_block(void *arg)
+{
+  struct zblock *blk = arg;
+  z_stream zs;
+  size_t bound;
+  void *p;
+
+  memset(&zs, 0, sizeof(zs));
+  if (deflateInit2(&zs, blk->level, Z_DEFLATED, 15 + 16, 8,
+                   Z_DEFAULT_STRATEGY) != Z_OK) {
+    blk->error = ENOMEM;
+    return 0;
+  }
+
+  bound = deflateBound(&zs, blk->inlen);
+  if (bound > blk->outcap) {
+    p = realloc(blk->out, bound);
+    if (!p) {
+      deflateEnd(&zs);
+      blk->error = ENOMEM;
+      return 0;
+    }
+    blk->out = p;
+    blk->outcap = bound;
+  }
+
+  zs.next_in = blk->in;
+  zs.avail_in = blk->inlen;
+  zs.next_out = blk->out;
+  zs.avail_out = blk->outcap;
+  if (deflate(&zs, Z_FINISH) != Z_STREAM_END)
+    blk->error = EIO;
+  blk->outlen = blk->outcap - zs.avail_out;
+  deflateEnd(&zs);
+  return 0;
+}
+
+
+/*
+ * Compress the filled blocks in parallel, and write them in order.
+ * If FINAL, and nothing was written at all, write an empty member, so
+ * that the file is a valid gzip file as the single-threaded one is.
+ */
+static int
+flush_blocks(struct zfile *zf, int final)
+{
+  pthread_t tid[ZSTREAM_MAX_THREADS];
+  int started[ZSTREAM_MAX_THREADS];
+  int i, n = zf->curblk;
+
+  if (zf->curblk < zf->nblocks && zf->blocks[zf->curblk].inlen > 0)
+    n++;                        /* partially filled block */
+  if (n == 0 && final && zf->pos == 0)
+    n = 1;                      /* empty blocks[0] */
+  if (n == 0)
+    return 0;
+
+  for (i = 1; i < n; i++)
+    started[i] = (pthread_create(&tid[i], 0, compress_block,
+                                 &zf->blocks[i]) == 0);
+  compress_block(&zf->blocks[0]);
+  for (i = 1; i < n; i++) {
+    if (started[i])
+      pthread_join(tid[i], 0);
+    else
+      compress_block(&zf->blocks[i]);
+  }
+
+  for (i = 0; i < n; i++) {
+    if (zf->blocks[i].error) {
+      errno = zf->blocks[i].error;
+      return -1;
+    }
+    if (write_all(zf->fd, zf->blocks[i].out, zf->blocks[i].outlen) < 0)
+      return -1;
+    zf->blocks[i].inlen = 0;
+  }
+  zf->curblk = 0;
+  return 0;
+}
+
+
+static int
+gzip_mt_write(struct zfile *zf, const void *buf, size_t count)
+{
+  const char *p = buf;
+  struct zblock *blk;
+  size_t n;
+
+  while (count > 0) {
+    blk = &zf->blocks[zf->curblk];
+    n = zf->blksize - blk->inlen;
+    if (n > count)
+      n = count;
+    memcpy(blk->in + blk->inlen, p, n);
+    blk->inlen += n;
+    p += n;
+    count -= n;
+
+    if (blk->inlen == zf->blksize && ++zf->curblk == zf->nblocks) {
+      if (flush_blocks(zf, 0) < 0)
+        return -1;
+    }
+  }
+  return 0;
+}
+
+
+#ifdef HAVE_ZSTD
+static int
+zstd_compress(struct zfile *zf, const void *buf, size_t count,
+              ZSTD_EndDirective mode)
+{
+  ZSTD_inBuffer in = { buf, count, 0 };
+  ZSTD_outBuffer out;
+  size_t ret;
+  int finished;
+
+  do {
+    out.dst = zf->buf;
+    out.size = ZSTREAM_BUFSIZ;
+    out.pos = 0;
+    ret = ZSTD_compressStream2(zf->zcc, &out, &in, mode);
+    if (ZSTD_isError(ret)) {
+      errno = EIO;
+      return -1;
+    }
+    if (write_all(zf->fd, zf->buf, out.pos) < 0)
+      return -1;
+    finished = (mode == ZSTD_e_end) ? (ret == 0) : (in.pos == in.size);
+  } while (!finished);
+
+  return 0;
+}
+#endif  /* HAVE_ZSTD */
+
+
+static ssize_t
+zs_write(int fd, const void *buf, size_t count, void *data)
+{
+  struct zfile *zf = zfile_get(fd, 0);
+  int ret = 0;
+
+  if (!zf)
+    return -1;
+  if (!zf->writing) {
+    errno = EBADF;
+    return -1;
+  }
+
+  if (zf->format == ZSTREAM_GZIP) {
+    if (zf->blocks)
+      ret = gzip_mt_write(zf, buf, count);
+    else
+      ret = gzip_deflate(zf, buf, count, Z_NO_FLUSH);
+  }
+#ifdef HAVE_ZSTD
+  else
+    ret = zstd_compress(zf, buf, count, ZSTD_e_continue);
+#endif
+
+  if (ret < 0)
+    return -1;
+  zf->pos += count;
+  return count;
+}
+
+
+static off_t
+zs_lseek(int fd, off_t offset, int whence, void *data)
+{
+  struct zfile *zf = zfile_get(fd, 0);
+
+  if (!zf)
+    return (off_t)-1;
+
+  if ((whence == SEEK_CUR && offset == 0) ||
+      (whence == SEEK_SET && offset == zf->pos))
+    return zf->pos;
+
+  errno = ESPIPE;
+  return (off_t)-1;
+}
+
+
+static int
+zs_close(int fd, void *data)
+{
+  struct zfile *zf = zfile_get(fd, 1);
+  int ret = 0, saved_errno = 0;
+
+  if (!zf)
+    return -1;
+
+  if (zf->writing) {
+    if (zf->format == ZSTREAM_GZIP) {
+      if (zf->blocks)
+        ret = flush_blocks(zf, 1);
+      else
+        ret = gzip_deflate(zf, 0, 0, Z_FINISH);
+    }
+#ifdef HAVE_ZSTD
+    else
+      ret = zstd_compress(zf, 0, 0, ZSTD_e_end);
+#endif
+    if (ret < 0)
+      saved_errno = errno;
+  }
+
+  if (close(zf->fd) < 0 && !saved_errno) {
+    saved_errno = errno;
+    ret = -1;
+  }
+  free_zfile(zf);
+
+  if (saved_errno)
+    errno = saved_errno;
+  return ret;
+}
+
+
+#ifdef TEST_ZSTREAM
+#include <sys/time.h>
+
+/*
+ * Compress a plain file:
+ *
+ *   $ ./zstream -c [-t THREADS] [-l LEVEL] INPUT OUTPUT
+ *
+ * Decode a (possibly compressed) file, and print the number of lines
+ * and the decoding throughput:
+ *
+ *   $ ./zstream INPUT
+ */
+int
+main(int argc, char *argv[])
+{
+  struct zstream_param param = { ZSTREAM_AUTO, 0, 1, 0 };
+  struct timeval beg, end;
+  unsigned long nbytes = 0, nlines = 0;
+  stream_t *in, *out;
+  const char *line;
+  ssize_t len;
+  double sec;
+  int opt, compress = 0;
+
+  while ((opt = getopt(argc, argv, "ct:l:")) != -1) {
+    switch (opt) {
+    case 'c':
+      compress = 1;
+      break;
+    case 't':
+      param.threads = atoi(optarg);
+      break;
+    case 'l':
+      param.level = atoi(optarg);
+      break;
+    default:
+      return 1;
+    }
+  }
+  if (optind >= argc || (compress && optind + 1 >= argc)) {
+    fprintf(stderr, "usage: %s [-c [-t THREADS] [-l LEVEL]] INPUT [OUTPUT]\n",
+            argv[0]);
+    return 1;
+  }
+
+  gettimeofday(&beg, 0);
+  in = s_open(&zstream_ops, argv[optind], "r", 0);
+  if (!in) {
+    fprintf(stderr, "error: cannot open %s: %s\n", argv[optind],
+            strerror(stream_errno));
+    return 1;
+  }
+
+  if (compress) {
+    out = s_open(&zstream_ops, argv[optind + 1], "w", &param);
+    if (!out) {
+      fprintf(stderr, "error: cannot open %s: %s\n", argv[optind + 1],
+              strerror(stream_errno));
+      return 1;
+    }
+    while ((len = s_getline(in, &line)) >= 0) {
+      nbytes += len;
+      nlines++;
+      while (len-- > 0)
+        s_putc(out, *line++);
+    }
+    if (s_close(out) < 0) {
+      fprintf(stderr, "error: %s\n", strerror(stream_errno));
+      return 1;
+    }
+  }
+  else {
+    while ((len = s_getline(in, &line)) >= 0) {
+      nbytes += len;
+      nlines++;
+    }
+  }
+  if (s_error(in)) {
+    fprintf(stderr, "error: cannot read %s after %lu lines: %s\n",
+            argv[optind], nlines, strerror(stream_errno));
+    return 1;
+  }
+  s_close(in);
+  gettimeofday(&end, 0);
+
+  sec = (end.tv_sec - beg.tv_sec) + (end.tv_usec - beg.tv_usec) / 1e6;
+  printf("%lu bytes, %lu lines, %.2f sec, %.1f MB/s\n",
+         nbytes, nlines, sec, nbytes / sec / (1024 * 1024));
+  return 0;
+}
+#endif  /* TEST_ZSTREAM */
@@ -0,0 +1,78 @@
+/*
+ * Compressed stream_ops backends for the light file stream
+ * Copyright (C) 2004  Seong-Kook Shin <cinsky@gmail.com>
+ */
+#ifndef ZSTREAM_H_
+#define ZSTREAM_H_
+
+#include <stream.h>
+
+/*
+ * 'zstream' provides stream_ops that decode a compressed file while
+ * reading, and encode while writing, so that stream_t can consume
+ * compressed logs without a zcat(1) process in front of it.
+ *
+ * gzip is always supported (via zlib).  zstd is supported if this
+ * module is compiled with HAVE_ZSTD.
+ *
+ *   $ cc -DLINUX your-source.c zstream.c stream.c -lz -lpthread
+ *   $ cc -DLINUX -DHAVE_ZSTD your-source.c zstream.c stream.c \
+ *        -lz -lzstd -lpthread
+ *
+ * Pass the address of a zstream_param as the DATA argument of
+ * s_open(), or pass NULL to use the defaults:
+ *
+ *   struct zstream_param param = { ZSTREAM_AUTO, 6, 4, 0 };
+ *   stream_t *s = s_open(&zstream_ops, "access.log.gz", "w", &param);
+ *
+ * On reading, the format is detected from the contents.  Files that
+ * are not compressed are read as they are.  Concatenated gzip members
+ * and zstd frames are decoded as one stream.
+ *
+ * On writing with ZSTREAM_AUTO, the format is zstd if PATHNAME ends
+ * with ".zst" (and HAVE_ZSTD is defined), gzip otherwise.
+ *
+ * If zstream_param::threads is greater than 1, the written data is
+ * split into blocks of zstream_param::blksize bytes, and the blocks
+ * are compressed in parallel.  For gzip, each block becomes a separate
+ * gzip member (like pigz(1) in independent mode), which every gzip
+ * decoder accepts.  For zstd, the library's own worker threads are
+ * used.
+ *
+ * A zstream is either read-only or write-only; "r+", "w+", and "a+"
+ * fail with EINVAL.  Seeking is not supported, except to the current
+ * position.
+ */
+
+/* This indirect using of extern "C" { ... } makes Emacs happy */
+#ifndef BEGIN_C_DECLS
+# ifdef __cplusplus
+#  define BEGIN_C_DECLS extern "C" {
+#  define END_C_DECLS   }
+# else
+#  define BEGIN_C_DECLS
+#  define END_C_DECLS
+# endif
+#endif /* BEGIN_C_DECLS */
+
+BEGIN_C_DECLS
+
+enum {
+  ZSTREAM_AUTO,
+  ZSTREAM_NONE,                 /* not compressed; reading only */
+  ZSTREAM_GZIP,
+  ZSTREAM_ZSTD,
+};
+
+struct zstream_param {
+  int format;                   /* one of ZSTREAM_AUTO, ZSTREAM_GZIP, ... */
+  int level;                    /* compression level, 0 for the default */
+  int threads;                  /* # of compression threads on writing */
+  size_t blksize;               /* block size per thread, 0 for the default */
+};
+
+extern struct stream_ops zstream_ops;
+
+END_C_DECLS
+
+#endif /* ZSTREAM_H_ */